@@ -0,0 +1,234 @@
+// -*- mode: c++; c-file-style: "k&r"; c-basic-offset: 4 -*-
+
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+#ifndef DMTR_COROUTINE_HH_IS_INCLUDED
+#define DMTR_COROUTINE_HH_IS_INCLUDED
+
+// a C++20 coroutine front-end for the libOS. a function that returns
+// `dmtr::coroutine` runs as soon as it's called and may `co_await`
+// operations, e.g.
+//
+//     dmtr::coroutine echo(int qd) {
+//         while (1) {
+//             auto popped = co_await dmtr::pop(qd);
+//             if (0 != popped.error) break;
+//             co_await dmtr::push(qd, popped.qr.qr_value.sga);
+//             dmtr_sgafree(&popped.qr.qr_value.sga);
+//         }
+//         dmtr_close(qd);
+//     }
+//
+// suspended coroutines are resumed by `dmtr::scheduler::run()`, which
+// drives all of the thread's outstanding operations with a single
+// `dmtr_wait_many()` loop. every thread (core) has its own scheduler.
+
+#if __cplusplus < 202002L || !defined(__cpp_impl_coroutine)
+#error "dmtr/coroutine.hh needs a compiler with C++20 coroutines."
+#endif
+
+#include <algorithm>
+#include <coroutine>
+#include <cstdlib>
+#include <dmtr/libos.h>
+#include <dmtr/types.h>
+#include <dmtr/wait.h>
+#include <utility>
+#include <vector>
+
+namespace dmtr {
+
+// how an operation turned out. `error` is 0 on success; `qr` is only
+// meaningful if the operation got far enough to produce a result.
+struct result {
+    int error;
+    dmtr_qresult_t qr;
+};
+
+class scheduler
+{
+    // the most completions harvested by a single wait.
+    public: static constexpr int max_ready = 32;
+
+    private: struct waiter {
+        std::coroutine_handle<> handle;
+        result *result_out;
+    };
+
+    // `my_qts[i]` is what `my_waiters[i]` is suspended on.
+    private: std::vector<dmtr_qtoken_t> my_qts;
+    private: std::vector<waiter> my_waiters;
+
+    private: scheduler() = default;
+    private: scheduler(const scheduler &) = delete;
+
+    public: static scheduler &current() {
+        static thread_local scheduler s;
+        return s;
+    }
+
+    public: size_t pending() const {
+        return my_qts.size();
+    }
+
+    public: void suspend(dmtr_qtoken_t qt, std::coroutine_handle<> h, result *result_out) {
+        my_qts.push_back(qt);
+        my_waiters.push_back(waiter{h, result_out});
+    }
+
+    // resumes coroutines as their operations complete, until none are
+    // left waiting. fails only if waiting itself fails.
+    public: int run() {
+        while (!my_qts.empty()) {
+            int ret = run_once();
+            if (0 != ret) {
+                return ret;
+            }
+        }
+
+        return 0;
+    }
+
+    // waits for at least one operation to complete and resumes the
+    // coroutines that were waiting on the operations that did.
+    public: int run_once() {
+        dmtr_qresult_t qrs[max_ready];
+        int offsets[max_ready];
+        int n = 0;
+        int ret = dmtr_wait_many(qrs, offsets, &n, max_ready, my_qts.data(), static_cast<int>(my_qts.size()));
+        if (0 == n) {
+            return ret;
+        }
+
+        // the waiters have to be taken out before any of them is resumed,
+        // since a resumed coroutine may suspend again straight away.
+        std::coroutine_handle<> ready[max_ready];
+        for (int i = 0; i < n; ++i) {
+            waiter &w = my_waiters[offsets[i]];
+            // a failure is always reported on its own (and last).
+            w.result_out->error = i == n - 1 ? ret : 0;
+            w.result_out->qr = qrs[i];
+            ready[i] = w.handle;
+        }
+
+        std::sort(offsets, offsets + n);
+        for (int i = n - 1; i >= 0; --i) {
+            const size_t j = offsets[i];
+            my_qts[j] = my_qts.back();
+            my_qts.pop_back();
+            my_waiters[j] = my_waiters.back();
+            my_waiters.pop_back();
+        }
+
+        for (int i = 0; i < n; ++i) {
+            ready[i].resume();
+        }
+
+        return 0;
+    }
+};
+
+// an operation that has been started and can be awaited. if it isn't
+// awaited, its token is dropped.
+class operation
+{
+    private: int my_error;
+    private: dmtr_qtoken_t my_qt;
+    private: result my_result;
+
+    public: operation(int error, dmtr_qtoken_t qt) :
+        my_error(error),
+        my_qt(0 == error ? qt : 0),
+        my_result{}
+    {}
+
+    public: operation(operation &&other) :
+        my_error(other.my_error),
+        my_qt(std::exchange(other.my_qt, 0)),
+        my_result(other.my_result)
+    {}
+
+    private: operation(const operation &) = delete;
+
+    public: ~operation() {
+        if (0 != my_qt) {
+            (void)dmtr_drop(my_qt);
+        }
+    }
+
+    public: bool await_ready() const {
+        // an operation that couldn't be started has nothing to wait for.
+        return 0 != my_error;
+    }
+
+    public: void await_suspend(std::coroutine_handle<> h) {
+        scheduler::current().suspend(std::exchange(my_qt, 0), h, &my_result);
+    }
+
+    public: result await_resume() const {
+        if (0 != my_error) {
+            return result{my_error, {}};
+        }
+
+        return my_result;
+    }
+};
+
+inline operation wait(dmtr_qtoken_t qt) {
+    return operation(0 == qt ? EINVAL : 0, qt);
+}
+
+inline operation push(int qd, const dmtr_sgarray_t &sga) {
+    dmtr_qtoken_t qt = 0;
+    int ret = dmtr_push(&qt, qd, &sga);
+    return operation(ret, qt);
+}
+
+inline operation pop(int qd) {
+    dmtr_qtoken_t qt = 0;
+    int ret = dmtr_pop(&qt, qd);
+    return operation(ret, qt);
+}
+
+inline operation accept(int qd) {
+    dmtr_qtoken_t qt = 0;
+    int ret = dmtr_accept(&qt, qd);
+    return operation(ret, qt);
+}
+
+inline operation connect(int qd, const struct sockaddr *saddr, socklen_t size) {
+    dmtr_qtoken_t qt = 0;
+    int ret = dmtr_connect(&qt, qd, saddr, size);
+    return operation(ret, qt);
+}
+
+// the return type of a coroutine that runs detached: it starts as soon as
+// it's called and cleans up after itself once it returns.
+class coroutine
+{
+    public: struct promise_type {
+        coroutine get_return_object() {
+            return coroutine();
+        }
+
+        std::suspend_never initial_suspend() noexcept {
+            return {};
+        }
+
+        std::suspend_never final_suspend() noexcept {
+            return {};
+        }
+
+        void return_void() {}
+
+        // errors are reported through `result`, not exceptions.
+        void unhandled_exception() {
+            std::abort();
+        }
+    };
+};
+
+} // namespace dmtr
+
+#endif /* DMTR_COROUTINE_HH_IS_INCLUDED */
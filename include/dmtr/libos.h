@@ -15,8 +15,26 @@ extern "C" {
 
 #define DMTR_OPEN2
 DMTR_EXPORT int dmtr_init(int argc, char *argv[]);
+// thread-per-core mode: any thread other than the one that called
+// `dmtr_init()` has to call `dmtr_init_core()` before it uses the libOS.
+// each core gets its own queues, which only that thread may use; cores
+// exchange messages through channels. the n-th channel that core a opens
+// to core b is connected to the n-th channel that b opens to a.
+DMTR_EXPORT int dmtr_init_core(int *core_id_out);
 
 DMTR_EXPORT int dmtr_queue(int *qd_out);
+// a memory queue that threads can hand buffers through, backed by a
+// lock-free ring of `capacity` entries. with `DMTR_QUEUE_SPSC`, at most
+// one thread may push and one may pop; `DMTR_QUEUE_MPMC` allows any number
+// of either. `flags` of 0 creates an ordinary queue, as `dmtr_queue()`
+// does.
+#define DMTR_QUEUE_SPSC 0x1
+#define DMTR_QUEUE_MPMC 0x2
+DMTR_EXPORT int dmtr_queue2(int *qd_out, int flags, size_t capacity);
+// opens an end of the ring queue `ring_qd` on the calling core. `ring_qd`
+// may belong to any core.
+DMTR_EXPORT int dmtr_queue_attach(int *qd_out, int ring_qd);
+DMTR_EXPORT int dmtr_channel(int *qd_out, int peer_core_id);
 
 DMTR_EXPORT int dmtr_socket(int *qd_out, int domain, int type, int protocol);
 DMTR_EXPORT int dmtr_getsockname(int qd, struct sockaddr *saddr, socklen_t *size);
@@ -24,6 +42,11 @@ DMTR_EXPORT int dmtr_listen(int fd, int backlog);
 DMTR_EXPORT int dmtr_bind(int qd, const struct sockaddr *saddr, socklen_t size);
 DMTR_EXPORT int dmtr_accept(dmtr_qtoken_t *qtok_out, int sockqd);
 DMTR_EXPORT int dmtr_connect(dmtr_qtoken_t *qt_out, int qd, const struct sockaddr *saddr, socklen_t size);
+// a file opened with `O_SYNC` or `O_DSYNC` is committed in groups: the
+// pushes that are waiting when the queue is serviced are written together
+// and made durable with one flush, and all of them complete once it's done.
+// the flush doesn't hold up the libOS; the pushes that arrive while it's
+// under way make up the next group.
 DMTR_EXPORT int dmtr_open(int *qd_out, const char *pathname, int flags);
 
 #ifdef DMTR_OPEN2
@@ -37,8 +60,39 @@ DMTR_EXPORT int dmtr_is_qd_valid(int *flag_out, int qd);
 DMTR_EXPORT int dmtr_push(
     dmtr_qtoken_t *qtok_out, int qd, const dmtr_sgarray_t *sga);
 DMTR_EXPORT int dmtr_pop(dmtr_qtoken_t *qt_out, int qd);
+// pushes `sga` without handing out a token, for callers that don't need to
+// know when the push finishes. `done` is called once the libOS is done with
+// `sga`; if it's NULL, `sga` is released with `dmtr_sgafree()` instead. if
+// an error is returned, neither happens and `sga` still belongs to the
+// caller.
+DMTR_EXPORT int dmtr_push_detached(int qd, const dmtr_sgarray_t *sga, dmtr_push_done_fn done, void *arg);
+// start `count` operations on `qd` in one call. if an error is returned,
+// no tokens are handed out, although some of the pushes may still be sent.
+DMTR_EXPORT int dmtr_push_batch(
+    dmtr_qtoken_t qtoks_out[], int qd, const dmtr_sgarray_t sgas[], int count);
+DMTR_EXPORT int dmtr_pop_batch(dmtr_qtoken_t qtoks_out[], int qd, int count);
+// allocates a single segment of `size` bytes from the buffer pool of `qd`'s
+// libOS. release it with `dmtr_sgafree()`.
+DMTR_EXPORT int dmtr_sgaalloc(dmtr_sgarray_t *sga_out, int qd, size_t size);
+// reads up to `count` bytes from a file queue, starting at the queue's
+// cursor, and moves the cursor `count` bytes on. the result is a single
+// segment, which is shorter than `count` only at the end of the file; a pop
+// that starts past the end has no segments at all. `dmtr_pop()` on a file
+// queue reads up to 64 KiB.
 DMTR_EXPORT int dmtr_pop2(dmtr_qtoken_t *qt_out, int qd, size_t count);
+// moves the cursor of a file queue, as `lseek()` would. only pops that are
+// started afterwards see the new position; pushes aren't affected.
 DMTR_EXPORT int dmtr_lseek(int qd, off_t offset, int whence);
+// pushes `count` bytes of the file queue `file_qd`, starting at `offset`,
+// to the socket queue `qd` without copying them through the application.
+// the bytes go out as a single segment, in order with the other pushes on
+// `qd`, and the peer pops them like any other message. the range ends at
+// the end of the file, as it is when the push is started; a push that
+// starts past the end fails with `ENOMSG`. the file's cursor doesn't move,
+// and pushes on `file_qd` that haven't finished yet may not be seen. the
+// token completes once the last byte has been handed to the kernel, with
+// no sga.
+DMTR_EXPORT int dmtr_push_file(dmtr_qtoken_t *qt_out, int qd, int file_qd, off_t offset, size_t count);
 
 DMTR_EXPORT int dmtr_poll(dmtr_qresult_t *qr_out, dmtr_qtoken_t qt);
 DMTR_EXPORT int dmtr_drop(dmtr_qtoken_t qt);
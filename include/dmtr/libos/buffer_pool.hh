@@ -0,0 +1,52 @@
+// -*- mode: c++; c-file-style: "k&r"; c-basic-offset: 4 -*-
+
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+#ifndef DMTR_LIBOS_BUFFER_POOL_HH_IS_INCLUDED
+#define DMTR_LIBOS_BUFFER_POOL_HH_IS_INCLUDED
+
+#include <dmtr/types.h>
+#include <mutex>
+#include <vector>
+
+namespace dmtr {
+
+// recycles buffers in power-of-two size classes. a libOS that needs its
+// buffers to live in registered memory overrides `new_block()` and
+// `delete_block()`, so that blocks are registered once rather than on every
+// push. such a subclass has to call `release_free_blocks()` from its own
+// destructor.
+class buffer_pool : public dmtr_sgapool_t
+{
+    private: struct block_header {
+        buffer_pool *pool;
+        uint32_t size_class;
+        uint32_t magic;
+    };
+
+    private: std::vector<std::vector<void *>> my_free_blocks;
+    private: std::mutex my_lock;
+
+    public: buffer_pool();
+    public: virtual ~buffer_pool();
+
+    public: int alloc(void *&buf_out, size_t size);
+    public: int free(void *buf);
+    // fills in a single segment sga that `dmtr_sgafree()` returns to this
+    // pool.
+    public: int alloc_sga(dmtr_sgarray_t &sga_out, size_t size);
+
+    protected: virtual int new_block(void *&block_out, size_t size);
+    protected: virtual void delete_block(void *block);
+    protected: void release_free_blocks();
+
+    private: static int sp_free(dmtr_sgapool_t *pool, void *buf);
+    private: static int size_class(uint32_t &class_out, size_t size);
+    private: static size_t class_size(uint32_t size_class);
+    private: static size_t max_free_blocks(uint32_t size_class);
+};
+
+} // namespace dmtr
+
+#endif /* DMTR_LIBOS_BUFFER_POOL_HH_IS_INCLUDED */
@@ -0,0 +1,87 @@
+// -*- mode: c++; c-file-style: "k&r"; c-basic-offset: 4 -*-
+
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+#ifndef DMTR_LIBOS_CHANNEL_QUEUE_HH_IS_INCLUDED
+#define DMTR_LIBOS_CHANNEL_QUEUE_HH_IS_INCLUDED
+
+#include "io_queue.hh"
+
+#include <atomic>
+#include <deque>
+#include <dmtr/types.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <utility>
+
+namespace dmtr {
+
+// one end of a channel between two cores. each core drives its endpoint
+// from its own `io_queue_api`; a push on one end is popped from the other,
+// and the only state they share is the pair of message queues in between.
+class channel_queue : public io_queue
+{
+    // messages travelling in one direction. `event_fd` is signalled when
+    // the pipe stops being empty, and when the other end is closed, so
+    // that a core waiting on the pipe can sleep in its poller.
+    private: struct pipe {
+        std::mutex lock;
+        std::deque<dmtr_sgarray_t> messages;
+        int event_fd;
+
+        pipe() :
+            event_fd(-1)
+        {}
+    };
+
+    private: struct link {
+        // `pipes[0]` carries messages to the lower numbered core.
+        pipe pipes[2];
+        std::atomic<bool> closed_flag;
+        int creator_core_id;
+
+        link(int creator_core_id) :
+            closed_flag(false),
+            creator_core_id(creator_core_id)
+        {}
+        ~link();
+        int open_events();
+    };
+
+    // links that one side has opened and the other hasn't attached to yet,
+    // by pair of cores.
+    private: typedef std::map<std::pair<int, int>, std::deque<std::shared_ptr<link>>> pending_links_type;
+    private: static std::mutex our_pending_links_lock;
+    private: static pending_links_type our_pending_links;
+
+    private: std::shared_ptr<link> my_link;
+    private: pipe *my_inbox;
+    private: pipe *my_outbox;
+    private: std::queue<dmtr_qtoken_t> my_pops;
+    // whether the poller watches the inbox's `event_fd` for us.
+    private: bool my_watching_flag;
+    private: bool my_good_flag;
+
+    private: channel_queue(int qd);
+    public: ~channel_queue();
+    public: static int new_object(std::unique_ptr<io_queue> &q_out, int qd, int core_id, int peer_core_id);
+
+    public: virtual int push(dmtr_qtoken_t qt, const dmtr_sgarray_t &sga);
+    public: virtual int pop(dmtr_qtoken_t qt);
+    public: virtual int poll(dmtr_qresult_t &qr_out, dmtr_qtoken_t qt);
+    public: virtual int service();
+    public: virtual int close();
+
+    private: bool good() const {
+        return my_good_flag;
+    }
+
+    private: int attach(int core_id, int peer_core_id);
+};
+
+} // namespace dmtr
+
+#endif /* DMTR_LIBOS_CHANNEL_QUEUE_HH_IS_INCLUDED */
@@ -0,0 +1,20 @@
+// -*- mode: c++; c-file-style: "k&r"; c-basic-offset: 4 -*-
+
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+#ifndef DMTR_LIBOS_CONFIG_HH_IS_INCLUDED
+#define DMTR_LIBOS_CONFIG_HH_IS_INCLUDED
+
+#include <yaml-cpp/yaml.h>
+
+namespace dmtr {
+
+// loads the configuration file that `--config-path` (`-r`) names on the
+// command line, or `./config.yaml`. every setting has a default, so the
+// file is optional; without one, `config_out` is left null.
+int load_config(YAML::Node &config_out, int argc, char *argv[]);
+
+} // namespace dmtr
+
+#endif /* DMTR_LIBOS_CONFIG_HH_IS_INCLUDED */
@@ -9,14 +9,16 @@
 #include <boost/coroutine2/coroutine.hpp>
 #include <dmtr/annot.h>
 #include <dmtr/types.h>
+#include <dmtr/libos/buffer_pool.hh>
 #include <dmtr/libos/user_thread.hh>
 #include <memory>
 #include <sys/socket.h>
-#include <boost/unordered_map.hpp>
-#include <boost/atomic.hpp>
+#include <vector>
 
 namespace dmtr {
 
+class io_queue_api;
+
 class io_queue
 {
     // todo: fix case.
@@ -27,11 +29,27 @@ class io_queue
     };
     protected: class task {
         public: typedef user_thread<dmtr_qtoken_t> thread_type;
-        private: bool valid = false;
+        private: enum state_id {
+            FREE,
+            RESERVED,
+            VALID,
+        };
+        private: state_id my_state;
+        // set when the application drops the token before the operation
+        // completes; the slot is recycled by `complete()` instead.
+        private: bool my_dropped_flag;
+        // set for pushes started through the default `push_detached()`;
+        // `complete()` hands the sga back through `my_push_done`.
+        private: bool my_detached_flag;
+        private: dmtr_push_done_fn my_push_done;
+        private: void *my_push_done_arg;
+        private: uint32_t my_generation;
+        private: uint32_t my_next_free;
         private: dmtr_qresult_t my_qr;
         private: int my_error;
         private: dmtr_sgarray_t my_sga_arg;
         private: io_queue *my_queue_arg;
+        private: io_queue *my_owner;
 
         public: task();
         public: int initialize(io_queue &q, dmtr_qtoken_t qt, dmtr_opcode_t opcode);
@@ -50,26 +68,42 @@ class io_queue
             return my_error != EAGAIN;
         }
         public: bool is_valid() const {
-            return valid;
-        }
-        public: void clear() {
-            valid = false;
+            return VALID == my_state;
         }
         public: dmtr_opcode_t opcode() const {
             return my_qr.qr_opcode;
         }
+
+        friend class io_queue;
     };
-#define MAX_TASKS 1024
 
-#ifdef MAX_TASKS
-    private: task my_tasks[MAX_TASKS];
-#else
-    private: boost::unordered_map<dmtr_qtoken_t,task> my_tasks;
-#endif
+    // the lower 32 bits of a queue token identify a slot in the task slab
+    // (`QT_SLOT_BITS`) and the generation of that slot at the time the
+    // token was issued, so that stale tokens can be told apart from the
+    // slot's current occupant.
+#define QT_SLOT_BITS 20
+#define QT_SLOT_MASK ((1u << QT_SLOT_BITS) - 1)
+#define QT_GENERATION_MASK ((1u << (32 - QT_SLOT_BITS)) - 1)
+    // the task slab grows in chunks of doubling size, starting at
+    // `TASK_CHUNK_BASE` tasks. chunks are never moved or released before
+    // the queue is destroyed, so task pointers held by coroutines remain
+    // valid as the slab grows.
+#define TASK_CHUNK_BASE 2u
+#define TASK_SLAB_NIL UINT32_MAX
+
+    private: std::vector<std::unique_ptr<task[]>> my_task_chunks;
+    private: uint32_t my_task_capacity;
+    private: uint32_t my_free_task;
+    private: uint32_t my_token_epoch;
+    // the `io_queue_api` instance this queue is registered with; it
+    // collects completed tokens and decides when the queue is serviced.
+    private: io_queue_api *my_api;
+    private: bool my_scheduled_flag;
     protected: const category_id my_cid;
     protected: const int my_qd;
-    private: boost::atomic<uint32_t> my_qt_counter;
- 
+    // buffers handed out by the default `sgaalloc()`.
+    protected: static buffer_pool our_buffer_pool;
+
     protected: io_queue(enum category_id cid, int qd);
     public: virtual ~io_queue();
 
@@ -101,19 +135,62 @@ class io_queue
     // data plane functions
     public: virtual int push(dmtr_qtoken_t qt, const dmtr_sgarray_t &sga) = 0;
     public: virtual int pop(dmtr_qtoken_t qt) = 0;
+    // file queues: reads up to `count` bytes at the queue's cursor and
+    // moves the cursor past them. a plain `pop()` reads `FILE_POP_SIZE`
+    // bytes.
+    public: virtual int pop(dmtr_qtoken_t qt, size_t count);
+#define FILE_POP_SIZE (static_cast<size_t>(64) << 10)
+    public: virtual int lseek(off_t offset, int whence);
+    // network queues: pushes `count` bytes of `file_q` from `offset` as a
+    // single message (see `dmtr_push_file()`).
+    public: virtual int push_file(dmtr_qtoken_t qt, io_queue &file_q, off_t offset, size_t count);
+    // the default implementations start each operation separately.
+    public: virtual int push_batch(const dmtr_qtoken_t qts[], const dmtr_sgarray_t sgas[], int count);
+    public: virtual int pop_batch(const dmtr_qtoken_t qts[], int count);
+    // starts a push that has no token. the default implementation still
+    // occupies a task slot until the push completes.
+    public: virtual int push_detached(const dmtr_sgarray_t &sga, dmtr_push_done_fn done, void *arg);
     public: virtual int poll(dmtr_qresult_t &qr_out, dmtr_qtoken_t qt) = 0;
     public: virtual int drop(dmtr_qtoken_t qt);
+    // runs the queue's coroutines once without regard to any particular
+    // token. returns `EAGAIN` if the queue should be serviced again on the
+    // next pass even if nothing new happens to it; `0` if it can wait until
+    // a new operation is started on it or its event source fires.
+    // `ENOTSUP` means the queue can only make progress through `poll()`.
+    public: virtual int service();
+    // allocates a buffer that this queue's libOS can push without copying
+    // or registering it first.
+    public: virtual int sgaalloc(dmtr_sgarray_t &sga_out, size_t size);
 
     public: static int set_non_blocking(int fd);
+    // `fd` is an eventfd that another core signals when there's something
+    // for this queue; see `io_queue_api::watcher_type`. fails with
+    // `ENOTSUP` if the poller can't watch it, in which case a waiting queue
+    // has to stay runnable.
+    protected: int watch(int fd);
+    protected: int unwatch(int fd);
+    protected: static void signal_event(int fd);
+    protected: static void reset_event(int fd);
     protected: int new_task(dmtr_qtoken_t qt, dmtr_opcode_t opcode);
     protected: int new_task(dmtr_qtoken_t qt, dmtr_opcode_t opcode, const dmtr_sgarray_t &arg);
     protected: int new_task(dmtr_qtoken_t qt, dmtr_opcode_t opcode, io_queue *arg);
-    protected: void insert_task(dmtr_qtoken_t qt);
     protected: int get_task(task *&t_out, dmtr_qtoken_t qt);
     public: int new_qtoken(dmtr_qtoken_t &qt_out);
     public: bool has_task(dmtr_qtoken_t qt);
-    protected: task * get_task(dmtr_qtoken_t qt);
+    public: int set_token_epoch(uint32_t epoch);
+    public: int result(dmtr_qresult_t &qr_out, dmtr_qtoken_t qt);
+    protected: void schedule();
+    // hands the sga of a detached push back to the application.
+    protected: static void finish_detached_push(dmtr_sgarray_t &sga, int error, dmtr_push_done_fn done, void *arg);
+    private: void on_complete(dmtr_qtoken_t qt);
+    private: void discard_queue(io_queue &q);
+    private: int reserved_task(task *&t_out, dmtr_qtoken_t qt);
+    private: task * task_at(uint32_t slot);
+    private: int grow_task_slab();
+    private: void free_task(uint32_t slot);
     private: int drop_task(dmtr_qtoken_t qt);
+
+    friend class io_queue_api;
 };
 
 } // namespace dmtr
@@ -8,35 +8,116 @@
 
 #include "io_queue.hh"
 #include "io_queue_factory.hh"
-#include <boost/atomic.hpp>
+#include <atomic>
+#include <boost/chrono.hpp>
+#include <deque>
 #include <dmtr/annot.h>
 #include <memory>
 #include <unordered_map>
+#include <vector>
 
 namespace dmtr {
 
 class io_queue_api
 {
-    private: boost::atomic<uint32_t> my_qd_counter;
-    private: std::unique_ptr<io_queue> my_queues[256];
+    // a poller reports the descriptors of queues whose event source has
+    // fired since it was last called by appending them to `qds_out`. it
+    // blocks for up to `timeout_ms` milliseconds (forever if negative) if
+    // none has.
+    public: typedef int (*poller_type)(std::vector<int> &qds_out, int timeout_ms);
+    // a watcher has the poller report queue `qd` whenever `fd` becomes
+    // readable; a `qd` of zero stops watching `fd`. queues that are fed by
+    // other cores use this to sleep until they're signalled.
+    public: typedef int (*watcher_type)(int fd, int qd);
+
+    // each thread that drives the libOS has its own instance (a core);
+    // the core's id is kept in the upper bits of its queue descriptors so
+    // that a descriptor can't be used on the wrong core. the instance
+    // created by `init()` is core 0.
+#define QD_CORE_SHIFT 24
+#define MAX_CORES (1 << (31 - QD_CORE_SHIFT))
+    private: static std::atomic<int> our_core_count;
+    private: int my_core_id;
+    // the lower bits of a queue descriptor index into `my_queues`;
+    // descriptors of closed queues are recycled (most recently freed first)
+    // so the table only grows with the number of queues that are open at
+    // once.
+    private: std::vector<std::unique_ptr<io_queue>> my_queues;
+    // bumped every time a descriptor is recycled, so that tokens issued
+    // by a closed queue do not alias tokens of its successor.
+    private: std::vector<uint32_t> my_qd_epochs;
+    private: std::vector<int> my_free_qds;
     private: io_queue_factory my_queue_factory;
+    // tokens whose operations have completed, in completion order. entries
+    // are not removed when a token is dropped, so they have to be checked
+    // against the owning queue before they are used.
+#define MIN_COMPLETIONS_LIMIT static_cast<size_t>(1024)
+    private: std::deque<dmtr_qtoken_t> my_completions;
+    private: size_t my_completions_limit;
+    // the token array passed to the last wait and the offset of each token
+    // in it. applications tend to wait on the same array over and over,
+    // changing a few tokens between calls, so only the tokens that changed
+    // need to be looked at again.
+#define WAIT_SET_BLOCK static_cast<size_t>(64)
+    private: std::vector<dmtr_qtoken_t> my_wait_set;
+    private: std::unordered_map<dmtr_qtoken_t, int> my_wait_offsets;
+    // queues that have to be serviced on the next pass, either because an
+    // operation was started on them or because their event source fired.
+    private: std::vector<int> my_runnable_qds;
+    private: std::vector<int> my_servicing_qds;
+    private: poller_type my_poller;
+    private: watcher_type my_watcher;
+    // how long a wait spins before it blocks in the poller. configured
+    // through `wait: spin_budget_us` in the configuration file.
+#define DEFAULT_SPIN_BUDGET_US 50
+    private: boost::chrono::microseconds my_spin_budget;
 
-    private: io_queue_api();
+    private: io_queue_api(int core_id);
     public: ~io_queue_api();
+    private: int read_config(int argc, char *argv[]);
+    private: int qd_index(size_t &index_out, int qd) const;
     private: int get_queue(io_queue *&q_out, int qd) const;
-    private: int new_qd();
+    private: int new_qd(int &qd_out);
+    private: void free_qd(int qd);
     private: int new_queue(io_queue *&q_out, enum io_queue::category_id cid);
     private: int insert_queue(std::unique_ptr<io_queue> &q);
     private: int remove_queue(int qd);
+    // closes and removes a queue that nobody else knows the descriptor of.
+    private: void discard_queue(int qd);
+    private: static int new_qtokens(dmtr_qtoken_t qts_out[], io_queue &q, int count);
+    private: static void drop_qtokens(dmtr_qtoken_t qts[], io_queue &q, int count);
+    private: void schedule(io_queue &q);
+    private: int watch(int fd, int qd);
+    private: void on_complete(dmtr_qtoken_t qt);
+    private: bool is_complete(dmtr_qtoken_t qt) const;
+    private: void prune_completions();
+    private: void sync_wait_set(dmtr_qtoken_t qts[], int num_qts);
+    private: void update_wait_set(size_t i, dmtr_qtoken_t qt);
+    private: bool next_pass(int &block_ms_out, const boost::chrono::steady_clock::time_point &t0, int timeout_ms) const;
+    private: int advance(dmtr_qtoken_t qts[], int num_qts, int block_ms);
+    private: int reap(dmtr_qresult_t *qrs_out, int *ready_offsets, int &count_out, int max_qrs, bool all_flag);
+    private: int claim(dmtr_qresult_t &qr_out, dmtr_qtoken_t qt);
 
-    public: int qttoqd(dmtr_qtoken_t qtok) {
+    public: int qttoqd(dmtr_qtoken_t qtok) const {
         return static_cast<int>(QT2QD(qtok));
     }
 
     public: static int init(io_queue_api *&newobj_out, int argc, char *argv[]);
+    // creates the instance for another core, with the same settings as
+    // `main`.
+    public: static int init_core(io_queue_api *&newobj_out, const io_queue_api &main);
     public: int register_queue_ctor(enum io_queue::category_id cid, io_queue_factory::ctor_type ctor);
+    public: int register_poller(poller_type poller);
+    public: int register_watcher(watcher_type watcher);
+
+    public: int core_id() const {
+        return my_core_id;
+    }
 
     public: int queue(int &qd_out);
+    public: int queue(int &qd_out, int flags, size_t capacity);
+    public: int attach_queue(int &qd_out, int ring_qd);
+    public: int channel(int &qd_out, int peer_core_id);
 
     // ================================================
     // Generic interfaces to libOS syscalls
@@ -53,14 +134,25 @@ class io_queue_api
     public: int creat(int &qd_out, const char *pathname, mode_t mode);
     public: int close(int qd);
     public: int push(dmtr_qtoken_t &qtok_out, int qd, const dmtr_sgarray_t &sga);
+    public: int push_detached(int qd, const dmtr_sgarray_t &sga, dmtr_push_done_fn done, void *arg);
     public: int pop(dmtr_qtoken_t &qtok_out, int qd);
     public: int pop(dmtr_qtoken_t &qtok_out, int qd, size_t count);
+    public: int lseek(int qd, off_t offset, int whence);
+    public: int push_file(dmtr_qtoken_t &qtok_out, int qd, int file_qd, off_t offset, size_t count);
+    public: int push_batch(dmtr_qtoken_t qtoks_out[], int qd, const dmtr_sgarray_t sgas[], int count);
+    public: int pop_batch(dmtr_qtoken_t qtoks_out[], int qd, int count);
+    public: int sgaalloc(dmtr_sgarray_t &sga_out, int qd, size_t size);
     public: int poll(dmtr_qresult_t *qr_out, dmtr_qtoken_t qt);
     public: int drop(dmtr_qtoken_t qt);
+    public: int wait(dmtr_qresult_t *qr_out, dmtr_qtoken_t qt, int timeout_ms);
+    public: int wait_any(dmtr_qresult_t *qr_out, int *ready_offset, dmtr_qtoken_t qts[], int num_qts, int timeout_ms);
+    public: int wait_many(dmtr_qresult_t *qrs_out, int *ready_offsets, int &count_out, int max_qrs, dmtr_qtoken_t qts[], int num_qts, int timeout_ms);
     public: int is_qd_valid(bool &flag, int qd);
 
     private: static void on_poll_failure(dmtr_qresult_t * const qr_out, io_queue_api *self);
 
+    friend class io_queue;
+
 };
 
 } // namespace dmtr
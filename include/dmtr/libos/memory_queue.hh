@@ -32,6 +32,7 @@ class memory_queue : public io_queue
     public: virtual int pop(dmtr_qtoken_t qt);
     public: virtual int poll(dmtr_qresult_t &qr_out, dmtr_qtoken_t qt);
     public: virtual int drop(dmtr_qtoken_t qt);
+    public: virtual int service();
     public: virtual int close();
 
     private: bool good() const {
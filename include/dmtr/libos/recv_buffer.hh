@@ -0,0 +1,70 @@
+// -*- mode: c++; c-file-style: "k&r"; c-basic-offset: 4 -*-
+
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+#ifndef DMTR_LIBOS_RECV_BUFFER_HH_IS_INCLUDED
+#define DMTR_LIBOS_RECV_BUFFER_HH_IS_INCLUDED
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <dmtr/types.h>
+
+namespace dmtr {
+
+// the bytes received on a stream connection, read in as large pieces as the
+// socket will give us and cut up into framed messages (see
+// `dmtr_header_t`). messages aren't copied out: a popped sga points into
+// the chunk it was received in, and the chunk is freed once the
+// connection and every sga still pointing into it are done with it. a
+// chunk that nobody else refers to is rewound and reused.
+class recv_buffer
+{
+#define RECV_CHUNK_SIZE (static_cast<size_t>(16) << 10)
+    // reads smaller than this aren't worth a system call.
+#define RECV_MIN_READ static_cast<size_t>(1024)
+
+    private: struct chunk {
+        // the connection's reference plus one for every sga.
+        std::atomic<uint32_t> refs;
+        size_t capacity;
+
+        uint8_t *data() {
+            return reinterpret_cast<uint8_t *>(this + 1);
+        }
+    };
+
+    private: chunk *my_chunk;
+    // the bytes that haven't been popped yet.
+    private: size_t my_begin;
+    private: size_t my_end;
+    // how many bytes the message at `my_begin` takes up, as far as we know.
+    private: size_t my_needed;
+
+    public: recv_buffer();
+    public: ~recv_buffer();
+    private: recv_buffer(const recv_buffer &) = delete;
+
+    // takes the next message if all of it has been received. a message
+    // that isn't framed properly fails every pop from then on with
+    // `EILSEQ`.
+    public: int pop(bool &done_out, dmtr_sgarray_t &sga_out);
+    // where to read into next; there's room for at least the rest of the
+    // message that `pop()` is waiting for.
+    public: int reserve(void *&buf_out, size_t &len_out);
+    // accounts for `len` bytes read into the space from `reserve()`.
+    public: void commit(size_t len);
+    // lets go of the buffered bytes; sgas that were already popped stay
+    // valid.
+    public: void clear();
+
+    private: static int new_chunk(chunk *&chunk_out, size_t capacity);
+    private: static void release(chunk *c);
+    private: static int sp_free(dmtr_sgapool_t *pool, void *buf);
+    private: static dmtr_sgapool_t our_pool;
+};
+
+} // namespace dmtr
+
+#endif /* DMTR_LIBOS_RECV_BUFFER_HH_IS_INCLUDED */
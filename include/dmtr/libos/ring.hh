@@ -0,0 +1,216 @@
+// -*- mode: c++; c-file-style: "k&r"; c-basic-offset: 4 -*-
+
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+#ifndef DMTR_LIBOS_RING_HH_IS_INCLUDED
+#define DMTR_LIBOS_RING_HH_IS_INCLUDED
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+namespace dmtr {
+
+// bounded lock-free rings. `T` has to be trivially copyable. `push()` and
+// `pop()` move as many of the `n` items as they can and return how many
+// that was, so a batch costs the same synchronization as a single item.
+// the capacity is rounded up to a power of two.
+
+#define DMTR_CACHE_LINE_SIZE static_cast<size_t>(64)
+
+inline size_t ring_capacity(size_t capacity) {
+    size_t n = 2;
+    while (n < capacity) {
+        n <<= 1;
+    }
+
+    return n;
+}
+
+// one producer thread and one consumer thread. each side keeps its own
+// copy of the other side's index and only reloads it when that copy says
+// that the ring is full (or empty), so the two sides rarely touch each
+// other's cache lines.
+template <typename T>
+class spsc_ring
+{
+    private: std::unique_ptr<T[]> my_slots;
+    private: size_t my_mask;
+    private: char my_pad0[DMTR_CACHE_LINE_SIZE];
+    // owned by the consumer.
+    private: std::atomic<size_t> my_head;
+    private: size_t my_cached_tail;
+    private: char my_pad1[DMTR_CACHE_LINE_SIZE];
+    // owned by the producer.
+    private: std::atomic<size_t> my_tail;
+    private: size_t my_cached_head;
+    private: char my_pad2[DMTR_CACHE_LINE_SIZE];
+
+    public: spsc_ring(size_t capacity) :
+        my_mask(ring_capacity(capacity) - 1),
+        my_head(0),
+        my_cached_tail(0),
+        my_tail(0),
+        my_cached_head(0)
+    {
+        my_slots.reset(new T[my_mask + 1]);
+    }
+
+    private: spsc_ring(const spsc_ring &) = delete;
+
+    public: size_t capacity() const {
+        return my_mask + 1;
+    }
+
+    public: size_t push(const T items[], size_t n) {
+        const size_t tail = my_tail.load(std::memory_order_relaxed);
+        if (capacity() - (tail - my_cached_head) < n) {
+            my_cached_head = my_head.load(std::memory_order_acquire);
+        }
+
+        n = std::min(n, capacity() - (tail - my_cached_head));
+        for (size_t i = 0; i < n; ++i) {
+            my_slots[(tail + i) & my_mask] = items[i];
+        }
+
+        my_tail.store(tail + n, std::memory_order_release);
+        return n;
+    }
+
+    public: size_t pop(T items_out[], size_t n) {
+        const size_t head = my_head.load(std::memory_order_relaxed);
+        if (my_cached_tail - head < n) {
+            my_cached_tail = my_tail.load(std::memory_order_acquire);
+        }
+
+        n = std::min(n, my_cached_tail - head);
+        for (size_t i = 0; i < n; ++i) {
+            items_out[i] = my_slots[(head + i) & my_mask];
+        }
+
+        my_head.store(head + n, std::memory_order_release);
+        return n;
+    }
+};
+
+// any number of producer and consumer threads. every slot carries a
+// sequence number that says which lap of the ring it is ready for, so a
+// thread claims a run of slots with a single compare-and-swap on the shared
+// index and then fills (or drains) them without further synchronization.
+template <typename T>
+class mpmc_ring
+{
+    private: struct cell {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+
+    private: std::unique_ptr<cell[]> my_cells;
+    private: size_t my_mask;
+    private: char my_pad0[DMTR_CACHE_LINE_SIZE];
+    private: std::atomic<size_t> my_enqueue_pos;
+    private: char my_pad1[DMTR_CACHE_LINE_SIZE];
+    private: std::atomic<size_t> my_dequeue_pos;
+    private: char my_pad2[DMTR_CACHE_LINE_SIZE];
+
+    public: mpmc_ring(size_t capacity) :
+        my_mask(ring_capacity(capacity) - 1),
+        my_enqueue_pos(0),
+        my_dequeue_pos(0)
+    {
+        my_cells.reset(new cell[my_mask + 1]);
+        for (size_t i = 0; i <= my_mask; ++i) {
+            my_cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    private: mpmc_ring(const mpmc_ring &) = delete;
+
+    public: size_t capacity() const {
+        return my_mask + 1;
+    }
+
+    public: size_t push(const T items[], size_t n) {
+        size_t pos = my_enqueue_pos.load(std::memory_order_relaxed);
+        while (1) {
+            // a slot is free for position `pos` once its sequence number
+            // has caught up with `pos`.
+            size_t k = 0;
+            intptr_t diff = 0;
+            for (; k < n; ++k) {
+                const size_t seq = my_cells[(pos + k) & my_mask].sequence.load(std::memory_order_acquire);
+                diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + k);
+                if (0 != diff) {
+                    break;
+                }
+            }
+
+            if (0 == k) {
+                if (diff < 0) {
+                    // full.
+                    return 0;
+                }
+
+                // another producer got here first.
+                pos = my_enqueue_pos.load(std::memory_order_relaxed);
+                continue;
+            }
+
+            if (my_enqueue_pos.compare_exchange_weak(pos, pos + k, std::memory_order_relaxed)) {
+                for (size_t i = 0; i < k; ++i) {
+                    cell &c = my_cells[(pos + i) & my_mask];
+                    c.value = items[i];
+                    c.sequence.store(pos + i + 1, std::memory_order_release);
+                }
+
+                return k;
+            }
+        }
+    }
+
+    public: size_t pop(T items_out[], size_t n) {
+        size_t pos = my_dequeue_pos.load(std::memory_order_relaxed);
+        while (1) {
+            // a slot holds the item for position `pos` once its sequence
+            // number is one past `pos`.
+            size_t k = 0;
+            intptr_t diff = 0;
+            for (; k < n; ++k) {
+                const size_t seq = my_cells[(pos + k) & my_mask].sequence.load(std::memory_order_acquire);
+                diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + k + 1);
+                if (0 != diff) {
+                    break;
+                }
+            }
+
+            if (0 == k) {
+                if (diff < 0) {
+                    // empty.
+                    return 0;
+                }
+
+                // another consumer got here first.
+                pos = my_dequeue_pos.load(std::memory_order_relaxed);
+                continue;
+            }
+
+            if (my_dequeue_pos.compare_exchange_weak(pos, pos + k, std::memory_order_relaxed)) {
+                for (size_t i = 0; i < k; ++i) {
+                    cell &c = my_cells[(pos + i) & my_mask];
+                    items_out[i] = c.value;
+                    // ready for the producer's next lap.
+                    c.sequence.store(pos + i + my_mask + 1, std::memory_order_release);
+                }
+
+                return k;
+            }
+        }
+    }
+};
+
+} // namespace dmtr
+
+#endif /* DMTR_LIBOS_RING_HH_IS_INCLUDED */
@@ -0,0 +1,96 @@
+// -*- mode: c++; c-file-style: "k&r"; c-basic-offset: 4 -*-
+
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+#ifndef DMTR_LIBOS_RING_QUEUE_HH_IS_INCLUDED
+#define DMTR_LIBOS_RING_QUEUE_HH_IS_INCLUDED
+
+#include "io_queue.hh"
+#include "ring.hh"
+
+#include <atomic>
+#include <deque>
+#include <dmtr/types.h>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace dmtr {
+
+// a memory queue backed by a bounded lock-free ring, for handing buffers
+// from one thread to another. the core that creates the queue and any core
+// that attaches to it get their own end of the same ring; each end keeps
+// the operations that it couldn't complete yet and retries them whenever
+// it's serviced. an end that's left waiting on the ring registers its
+// eventfd with the ring and sleeps in its core's poller; every end that
+// moves something through the ring wakes the ends that are waiting.
+class ring_queue : public io_queue
+{
+    // operations are moved through the ring this many at a time.
+#define RING_BATCH static_cast<size_t>(32)
+
+    private: struct ring {
+        std::unique_ptr<spsc_ring<dmtr_sgarray_t>> spsc;
+        std::unique_ptr<mpmc_ring<dmtr_sgarray_t>> mpmc;
+        // the eventfds of the ends that are waiting. the count lets the
+        // ends that aren't skip the lock.
+        std::atomic<size_t> waiter_count;
+        std::mutex waiters_lock;
+        std::vector<int> waiter_fds;
+
+        ring() :
+            waiter_count(0)
+        {}
+        size_t push(const dmtr_sgarray_t sgas[], size_t n);
+        size_t pop(dmtr_sgarray_t sgas_out[], size_t n);
+        void wake(int self_fd);
+    };
+
+    // rings by the descriptor of the queue that created them, so that
+    // other cores can attach to them.
+    private: static std::mutex our_rings_lock;
+    private: static std::unordered_map<int, std::shared_ptr<ring>> our_rings;
+
+    private: std::shared_ptr<ring> my_ring;
+    private: bool my_owner_flag;
+    private: std::deque<dmtr_qtoken_t> my_pushes;
+    private: std::deque<dmtr_qtoken_t> my_pops;
+    private: int my_event_fd;
+    // whether the poller watches `my_event_fd`, and whether it's among the
+    // ring's waiters.
+    private: bool my_watching_flag;
+    private: bool my_waiting_flag;
+    private: bool my_good_flag;
+
+    private: ring_queue(int qd);
+    public: ~ring_queue();
+    // `flags` is `DMTR_QUEUE_SPSC` or `DMTR_QUEUE_MPMC`.
+    public: static int new_object(std::unique_ptr<io_queue> &q_out, int qd, int flags, size_t capacity);
+    // opens another end of the ring created by queue `ring_qd`.
+    public: static int attach(std::unique_ptr<io_queue> &q_out, int qd, int ring_qd);
+
+    public: virtual int push(dmtr_qtoken_t qt, const dmtr_sgarray_t &sga);
+    public: virtual int pop(dmtr_qtoken_t qt);
+    public: virtual int push_batch(const dmtr_qtoken_t qts[], const dmtr_sgarray_t sgas[], int count);
+    public: virtual int pop_batch(const dmtr_qtoken_t qts[], int count);
+    public: virtual int poll(dmtr_qresult_t &qr_out, dmtr_qtoken_t qt);
+    public: virtual int service();
+    public: virtual int close();
+
+    private: bool good() const {
+        return my_good_flag;
+    }
+
+    private: int open_event();
+    private: void start_waiting();
+    private: void stop_waiting();
+    private: int push_waiting();
+    private: int pop_waiting();
+    private: int abort_waiting(std::deque<dmtr_qtoken_t> &qts);
+};
+
+} // namespace dmtr
+
+#endif /* DMTR_LIBOS_RING_QUEUE_HH_IS_INCLUDED */
@@ -0,0 +1,63 @@
+// -*- mode: c++; c-file-style: "k&r"; c-basic-offset: 4 -*-
+
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+#ifndef DMTR_LIBOS_STACK_POOL_HH_IS_INCLUDED
+#define DMTR_LIBOS_STACK_POOL_HH_IS_INCLUDED
+
+#include <boost/context/stack_context.hpp>
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+namespace dmtr {
+
+// coroutine stacks, recycled so that a connection doesn't cost an `mmap()`
+// and `munmap()` per coroutine. stacks are mapped lazily by the kernel, so a
+// stack only occupies as much memory as its coroutine has touched. the
+// pool is shared by every core and is never destroyed, since coroutines may
+// outlive any static object that could own it.
+class stack_pool
+{
+#define DEFAULT_STACK_SIZE (static_cast<size_t>(128) << 10)
+#define DEFAULT_MAX_FREE_STACKS static_cast<size_t>(1024)
+
+    private: std::mutex my_lock;
+    private: std::vector<boost::context::stack_context> my_free_stacks;
+    // the size of a stack, not counting its guard page.
+    private: size_t my_stack_size;
+    private: bool my_guard_page_flag;
+    private: size_t my_max_free_stacks;
+
+    private: stack_pool();
+    private: stack_pool(const stack_pool &) = delete;
+    public: static stack_pool &instance();
+
+    // only affects stacks allocated afterwards.
+    public: int configure(size_t stack_size, bool guard_page, size_t max_free_stacks);
+
+    // the interface of a boost.context stack allocator; `allocate()` throws
+    // `std::bad_alloc` when it runs out of memory.
+    public: boost::context::stack_context allocate();
+    public: void deallocate(boost::context::stack_context &sctx);
+
+    private: size_t mapping_size() const;
+    private: static void unmap(boost::context::stack_context &sctx);
+};
+
+// the stack allocator that coroutines are created with.
+class pooled_stack_allocator
+{
+    public: boost::context::stack_context allocate() {
+        return stack_pool::instance().allocate();
+    }
+
+    public: void deallocate(boost::context::stack_context &sctx) {
+        stack_pool::instance().deallocate(sctx);
+    }
+};
+
+} // namespace dmtr
+
+#endif /* DMTR_LIBOS_STACK_POOL_HH_IS_INCLUDED */
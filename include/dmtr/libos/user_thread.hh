@@ -4,12 +4,17 @@
 #ifndef DMTR_LIBOS_USER_THREAD_HH_IS_INCLUDED
 #define DMTR_LIBOS_USER_THREAD_HH_IS_INCLUDED
 
+#include "stack_pool.hh"
+
 #include <boost/coroutine2/coroutine.hpp>
 #include <functional>
 #include <queue>
 
 namespace dmtr {
 
+// a coroutine fed by a queue of work items. neither the queue nor the
+// coroutine (and its stack) exist until the first item is enqueued, so a
+// queue that never does any work doesn't pay for its threads.
 template <typename Value>
 class user_thread {
     public: typedef std::queue<Value> queue_type;
@@ -18,41 +23,38 @@ class user_thread {
     public: typedef std::function<int (yield_type &, queue_type &)> function_type;
 
     private: int my_error;
+    private: function_type my_function;
     private: std::unique_ptr<queue_type> my_queue;
     private: std::unique_ptr<coroutine_type::pull_type> my_coroutine;
 
     public: user_thread(function_type fun) :
         my_error(EAGAIN),
-        my_queue(new queue_type)
-    {
-        my_coroutine.reset(new coroutine_type::pull_type([=](yield_type &yield) {
-            my_error = fun(yield, *my_queue);
-            if (EAGAIN == my_error) {
-                DMTR_PANIC("User thread function may not return `EAGAIN`.");
-            }
-        }));
-    }
+        my_function(fun)
+    {}
 
     private: user_thread(const user_thread &) = delete;
 
-    public: user_thread(user_thread &&other) :
-        my_error(other.error),
-        my_coroutine(std::move(other.my_coroutine)),
-        my_queue(std::move(other.my_queue))
-    {
-        other.my_error = EAGAIN;
-    }
-
     public: bool done() const {
-        return !(bool)*my_coroutine;
+        return my_coroutine && !(bool)*my_coroutine;
     }
 
     public: void enqueue(const Value &value) {
+        if (!my_queue) {
+            my_queue.reset(new queue_type);
+        }
+
         my_queue->push(value);
     }
 
     public: int service() {
-        if (!done()) {
+        if (!my_coroutine) {
+            if (!my_queue) {
+                // nothing has been asked of this thread yet.
+                return EAGAIN;
+            }
+
+            start();
+        } else if (!done()) {
             (*my_coroutine)();
         }
 
@@ -64,9 +66,18 @@ class user_thread {
         return my_error;
     }
 
+    private: void start() {
+        // the coroutine runs up to its first yield right away, which takes
+        // the place of the first call to `service()`.
+        my_coroutine.reset(new coroutine_type::pull_type(pooled_stack_allocator(), [=](yield_type &yield) {
+            my_error = my_function(yield, *my_queue);
+            if (EAGAIN == my_error) {
+                DMTR_PANIC("User thread function may not return `EAGAIN`.");
+            }
+        }));
+    }
 };
 
 } //namespace dmtr
 
 #endif /* DMTR_LIBOS_USER_THREAD_HH_IS_INCLUDED */
-
@@ -12,7 +12,8 @@
 extern "C" {
 #endif
 
-#define DMTR_SGARRAY_MAXSIZE 1
+// segments are stored inline, so that a `dmtr_qresult_t` is self-contained.
+#define DMTR_SGARRAY_MAXSIZE 8
 #define DMTR_HEADER_MAGIC 0x10102010
 #define QD_OFFSET 32ul
     //#define QD_MASK 0xFFFFFFFFul << QD_OFFSET
@@ -26,8 +27,16 @@ typedef struct dmtr_sgaseg {
     uint32_t sgaseg_len;
 } dmtr_sgaseg_t;
 
+// a pool of buffers owned by a libOS. `dmtr_sgafree()` hands buffers that
+// came from a pool back to it through `sp_free`.
+typedef struct dmtr_sgapool {
+    int (*sp_free)(struct dmtr_sgapool *pool, void *buf);
+} dmtr_sgapool_t;
+
 typedef struct dmtr_sgarray {
     void *sga_buf;
+    // if set, `sga_buf` belongs to this pool and the segments point into it.
+    dmtr_sgapool_t *sga_pool;
     uint32_t sga_numsegs;
     dmtr_sgaseg_t sga_segs[DMTR_SGARRAY_MAXSIZE];
     // todo: to be removed when LWIP libOS is retired in favor of
@@ -35,6 +44,10 @@ typedef struct dmtr_sgarray {
     struct sockaddr_in sga_addr;
 } dmtr_sgarray_t;
 
+// called once a push started by `dmtr_push_detached()` is done with `sga`,
+// whether or not it succeeded.
+typedef void (*dmtr_push_done_fn)(dmtr_sgarray_t *sga, int error, void *arg);
+
 typedef enum dmtr_opcode {
     DMTR_OPC_INVALID = 0,
     DMTR_OPC_PUSH,
@@ -13,6 +13,11 @@ extern "C" {
 
 DMTR_EXPORT int dmtr_wait(dmtr_qresult_t *qr_out, dmtr_qtoken_t qtok);
 DMTR_EXPORT int dmtr_wait_any(dmtr_qresult_t *qr_out, int *ready_offset, dmtr_qtoken_t qtoks[], int num_qtoks);
+// the timed variants give up after `timeout_ms` milliseconds (never, if
+// negative) and return `EAGAIN`, leaving the tokens outstanding.
+DMTR_EXPORT int dmtr_timedwait(dmtr_qresult_t *qr_out, dmtr_qtoken_t qtok, int timeout_ms);
+DMTR_EXPORT int dmtr_timedwait_any(dmtr_qresult_t *qr_out, int *ready_offset, dmtr_qtoken_t qtoks[], int num_qtoks, int timeout_ms);
+DMTR_EXPORT int dmtr_wait_many(dmtr_qresult_t *qrs_out, int *ready_offsets, int *num_ready_out, int max_ready, dmtr_qtoken_t qtoks[], int num_qtoks);
 DMTR_EXPORT int dmtr_wait_all(dmtr_qresult_t *qr_out, dmtr_qtoken_t qtoks[], int num_qtoks);
 
 #ifdef __cplusplus
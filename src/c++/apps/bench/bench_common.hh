@@ -0,0 +1,31 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+#ifndef BENCH_COMMON_H_
+#define BENCH_COMMON_H_
+
+#include <cstdio>
+#include <unistd.h>
+
+// the resident set size of this process, in KB, or zero if it can't be
+// read.
+static size_t rss_kb()
+{
+    long size = 0;
+    long pages = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (NULL == f) {
+        return 0;
+    }
+
+    // the first field is the total program size; the second is what's
+    // resident.
+    if (fscanf(f, "%ld %ld", &size, &pages) != 2) {
+        pages = 0;
+    }
+
+    fclose(f);
+    return pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+#endif
@@ -0,0 +1,207 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+// measures how many loopback connections per second a server can accept,
+// once with the libOS and once with the `epoll()` loop that
+// `posix_tcp_server` runs (one `accept()` per wakeup, then `fcntl()` and
+// `setsockopt()` on every new socket). a child process opens
+// `--iterations` connections in bursts of `--clients`: it connects the
+// whole burst, waits for the server to close every connection and then
+// closes its ends. the server closes every connection as soon as it's
+// accepted, so that `TIME_WAIT` stays on its side. besides the rate, the
+// CPU time that the server spent per connection is reported, which doesn't
+// depend on how much of the machine the client gets.
+
+#include "common.hh"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <boost/chrono.hpp>
+#include <cstring>
+#include <dmtr/annot.h>
+#include <dmtr/libos.h>
+#include <dmtr/wait.h>
+#include <fcntl.h>
+#include <iostream>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+#define LISTEN_BACKLOG 1024
+
+struct result {
+    double rate;
+    // microseconds of CPU time (user and system) per connection.
+    double cpu_us;
+};
+
+static double cpu_secs()
+{
+    struct rusage ru = {};
+    (void)getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+static int run_client(const struct sockaddr_in &saddr)
+{
+    std::vector<int> fds;
+    for (uint32_t done = 0; done < iterations; done += fds.size()) {
+        fds.clear();
+        const uint32_t burst = std::min(clients, iterations - done);
+        for (uint32_t i = 0; i < burst; ++i) {
+            int fd = socket(AF_INET, SOCK_STREAM, 0);
+            DMTR_TRUE(errno, -1 != fd);
+            DMTR_TRUE(errno, 0 == connect(fd, reinterpret_cast<const struct sockaddr *>(&saddr), sizeof(saddr)));
+            fds.push_back(fd);
+        }
+
+        for (int fd : fds) {
+            char c;
+            DMTR_TRUE(EPROTO, 0 == read(fd, &c, sizeof(c)));
+            close(fd);
+        }
+    }
+
+    return 0;
+}
+
+static int start_client(pid_t &pid_out, const struct sockaddr_in &saddr)
+{
+    pid_t pid = fork();
+    DMTR_TRUE(errno, -1 != pid);
+    if (0 == pid) {
+        _exit(0 == run_client(saddr) ? 0 : 1);
+    }
+
+    pid_out = pid;
+    return 0;
+}
+
+static int wait_client(pid_t pid)
+{
+    int status = 0;
+    DMTR_TRUE(errno, pid == waitpid(pid, &status, 0));
+    DMTR_TRUE(ECHILD, WIFEXITED(status) && 0 == WEXITSTATUS(status));
+    return 0;
+}
+
+static int measure_posix(result &result_out, const struct sockaddr_in &saddr)
+{
+    int lfd = socket(AF_INET, SOCK_STREAM, 0);
+    DMTR_TRUE(errno, -1 != lfd);
+    const int n = 1;
+    DMTR_TRUE(errno, 0 == setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &n, sizeof(n)));
+    DMTR_TRUE(errno, 0 == fcntl(lfd, F_SETFL, O_NONBLOCK));
+    DMTR_TRUE(errno, 0 == bind(lfd, reinterpret_cast<const struct sockaddr *>(&saddr), sizeof(saddr)));
+    DMTR_TRUE(errno, 0 == listen(lfd, LISTEN_BACKLOG));
+
+    int epoll_fd = epoll_create1(0);
+    DMTR_TRUE(errno, -1 != epoll_fd);
+    struct epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.fd = lfd;
+    DMTR_TRUE(errno, 0 == epoll_ctl(epoll_fd, EPOLL_CTL_ADD, lfd, &event));
+
+    pid_t pid = 0;
+    DMTR_OK(start_client(pid, saddr));
+    boost::chrono::steady_clock::time_point t0;
+    double cpu0 = 0;
+    for (uint32_t accepted = 0; accepted < iterations;) {
+        struct epoll_event events[10];
+        int count = epoll_wait(epoll_fd, events, 10, -1);
+        if (-1 == count && EINTR == errno) {
+            continue;
+        }
+
+        DMTR_TRUE(errno, -1 != count);
+        for (int i = 0; i < count; ++i) {
+            int fd = accept(lfd, NULL, NULL);
+            if (-1 == fd) {
+                DMTR_TRUE(errno, EAGAIN == errno || EWOULDBLOCK == errno);
+                continue;
+            }
+
+            if (0 == accepted) {
+                t0 = boost::chrono::steady_clock::now();
+                cpu0 = cpu_secs();
+            }
+
+            DMTR_TRUE(errno, 0 == fcntl(fd, F_SETFL, O_NONBLOCK));
+            DMTR_TRUE(errno, 0 == setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &n, sizeof(n)));
+            close(fd);
+            ++accepted;
+        }
+    }
+
+    result_out.rate = iterations / boost::chrono::duration<double>(boost::chrono::steady_clock::now() - t0).count();
+    result_out.cpu_us = (cpu_secs() - cpu0) * 1e6 / iterations;
+    DMTR_OK(wait_client(pid));
+    close(epoll_fd);
+    close(lfd);
+    return 0;
+}
+
+static int measure_dmtr(result &result_out, const struct sockaddr_in &saddr)
+{
+    int lqd = 0;
+    DMTR_OK(dmtr_socket(&lqd, AF_INET, SOCK_STREAM, 0));
+    DMTR_OK(dmtr_bind(lqd, reinterpret_cast<const struct sockaddr *>(&saddr), sizeof(saddr)));
+    DMTR_OK(dmtr_listen(lqd, LISTEN_BACKLOG));
+
+    pid_t pid = 0;
+    DMTR_OK(start_client(pid, saddr));
+    boost::chrono::steady_clock::time_point t0;
+    double cpu0 = 0;
+    for (uint32_t accepted = 0; accepted < iterations; ++accepted) {
+        dmtr_qtoken_t qt = 0;
+        DMTR_OK(dmtr_accept(&qt, lqd));
+        dmtr_qresult_t qr = {};
+        DMTR_OK(dmtr_wait(&qr, qt));
+        if (0 == accepted) {
+            t0 = boost::chrono::steady_clock::now();
+            cpu0 = cpu_secs();
+        }
+
+        DMTR_OK(dmtr_close(qr.qr_value.ares.qd));
+    }
+
+    result_out.rate = iterations / boost::chrono::duration<double>(boost::chrono::steady_clock::now() - t0).count();
+    result_out.cpu_us = (cpu_secs() - cpu0) * 1e6 / iterations;
+    DMTR_OK(wait_client(pid));
+    DMTR_OK(dmtr_close(lqd));
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    parse_args(argc, argv, true);
+    if (0 == clients) {
+        std::cerr << "`--clients` has to be at least 1." << std::endl;
+        return 1;
+    }
+
+    struct sockaddr_in saddr = {};
+    saddr.sin_family = AF_INET;
+    saddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    saddr.sin_port = htons(port);
+
+    // the two servers listen on different ports, so that neither runs into
+    // connections that the other one left in `TIME_WAIT`.
+    result posix = {};
+    DMTR_OK(measure_posix(posix, saddr));
+
+    DMTR_OK(dmtr_init(argc, argv));
+    result dmtr = {};
+    saddr.sin_port = htons(port + 1);
+    DMTR_OK(measure_dmtr(dmtr, saddr));
+
+    std::cerr << iterations << " connections in bursts of " << clients << ":" << std::endl;
+    std::cerr << "server\tconn/s\tCPU/conn (us)" << std::endl;
+    std::cerr << "posix_tcp_server loop\t" << static_cast<uint64_t>(posix.rate) << "\t" << posix.cpu_us << std::endl;
+    std::cerr << "libOS\t" << static_cast<uint64_t>(dmtr.rate) << "\t" << dmtr.cpu_us << std::endl;
+    return 0;
+}
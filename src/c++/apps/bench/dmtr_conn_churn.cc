@@ -0,0 +1,78 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+// opens and closes `--iterations` loopback connections through a single
+// libOS instance, accepting and connecting from the same process. every
+// tenth of the run it reports the connection rate, the highest queue
+// descriptor handed out so far and the resident set size, which should all
+// stay flat if queue descriptors and their resources are being recycled.
+
+#include "bench_common.hh"
+#include "common.hh"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <boost/chrono.hpp>
+#include <cstring>
+#include <dmtr/annot.h>
+#include <dmtr/libos.h>
+#include <dmtr/wait.h>
+#include <iostream>
+#include <netinet/in.h>
+#include <unistd.h>
+
+int main(int argc, char *argv[])
+{
+    parse_args(argc, argv, true);
+
+    struct sockaddr_in saddr = {};
+    saddr.sin_family = AF_INET;
+    saddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    saddr.sin_port = htons(port);
+
+    DMTR_OK(dmtr_init(argc, argv));
+
+    int lqd = 0;
+    DMTR_OK(dmtr_socket(&lqd, AF_INET, SOCK_STREAM, 0));
+    DMTR_OK(dmtr_bind(lqd, reinterpret_cast<struct sockaddr *>(&saddr), sizeof(saddr)));
+    DMTR_OK(dmtr_listen(lqd, 1024));
+
+    const uint32_t report_every = iterations < 10 ? 1 : iterations / 10;
+    int max_qd = lqd;
+    auto t_start = boost::chrono::steady_clock::now();
+    auto t_report = t_start;
+    std::cerr << "connections\tconn/s\tmax qd\tRSS (KB)" << std::endl;
+    for (uint32_t i = 1; i <= iterations; ++i) {
+        dmtr_qtoken_t accept_qt = 0;
+        DMTR_OK(dmtr_accept(&accept_qt, lqd));
+
+        int cqd = 0;
+        DMTR_OK(dmtr_socket(&cqd, AF_INET, SOCK_STREAM, 0));
+        dmtr_qtoken_t connect_qt = 0;
+        DMTR_OK(dmtr_connect(&connect_qt, cqd, reinterpret_cast<struct sockaddr *>(&saddr), sizeof(saddr)));
+        DMTR_OK(dmtr_wait(NULL, connect_qt));
+
+        dmtr_qresult_t qr = {};
+        DMTR_OK(dmtr_wait(&qr, accept_qt));
+        int sqd = qr.qr_value.ares.qd;
+
+        // close the accepted end first so that `TIME_WAIT` is held by the
+        // listening side and the client's ephemeral ports stay reusable.
+        DMTR_OK(dmtr_close(sqd));
+        DMTR_OK(dmtr_close(cqd));
+
+        max_qd = std::max(max_qd, std::max(sqd, cqd));
+        if (0 == i % report_every) {
+            auto now = boost::chrono::steady_clock::now();
+            double secs = boost::chrono::duration<double>(now - t_report).count();
+            t_report = now;
+            std::cerr << i << "\t" << static_cast<uint64_t>(report_every / secs)
+                << "\t" << max_qd << "\t" << rss_kb() << std::endl;
+        }
+    }
+
+    double secs = boost::chrono::duration<double>(boost::chrono::steady_clock::now() - t_start).count();
+    std::cerr << "total: " << iterations << " connections in " << secs << " s ("
+        << static_cast<uint64_t>(iterations / secs) << " conn/s)" << std::endl;
+    DMTR_OK(dmtr_close(lqd));
+    return 0;
+}
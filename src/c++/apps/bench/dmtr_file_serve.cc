@@ -0,0 +1,202 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+// measures how fast a file can be served over a loopback connection, once
+// by popping it from a file queue and pushing the buffers to the socket
+// queue, and once with `dmtr_push_file()`. the file is `FILE_SIZE` bytes
+// and goes out `--iterations` times, in messages of `CHUNK_SIZE` bytes,
+// with up to `PUSH_WINDOW` of them outstanding. a child process reads and
+// drops everything on a plain socket. besides the rate, the CPU time that
+// the server spent per MiB is reported, which doesn't depend on how much of
+// the machine the client gets.
+
+#include "common.hh"
+#include <arpa/inet.h>
+#include <boost/chrono.hpp>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <dmtr/annot.h>
+#include <dmtr/libos.h>
+#include <dmtr/sga.h>
+#include <dmtr/wait.h>
+#include <fcntl.h>
+#include <iostream>
+#include <memory>
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define FILE_SIZE (static_cast<size_t>(64) << 20)
+#define CHUNK_SIZE (static_cast<size_t>(1) << 20)
+#define PUSH_WINDOW 4
+// what the libOS frames every message with: a header and one segment
+// length.
+#define FRAMING_SIZE (sizeof(dmtr_header_t) + sizeof(uint32_t))
+
+struct result {
+    double rate;
+    // microseconds of CPU time (user and system) per MiB.
+    double cpu_us;
+};
+
+static double cpu_secs()
+{
+    struct rusage ru = {};
+    (void)getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+static int run_client(const struct sockaddr_in &saddr, size_t total)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    DMTR_TRUE(errno, -1 != fd);
+    DMTR_TRUE(errno, 0 == connect(fd, reinterpret_cast<const struct sockaddr *>(&saddr), sizeof(saddr)));
+
+    std::unique_ptr<char[]> buf(new char[CHUNK_SIZE]);
+    for (size_t done = 0; done < total;) {
+        ssize_t n = read(fd, buf.get(), CHUNK_SIZE);
+        DMTR_TRUE(EPROTO, n > 0);
+        done += n;
+    }
+
+    close(fd);
+    return 0;
+}
+
+static int start_client(pid_t &pid_out, const struct sockaddr_in &saddr)
+{
+    const size_t chunks = (FILE_SIZE + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    const size_t total = static_cast<size_t>(iterations) * (FILE_SIZE + chunks * FRAMING_SIZE);
+    pid_t pid = fork();
+    DMTR_TRUE(errno, -1 != pid);
+    if (0 == pid) {
+        _exit(0 == run_client(saddr, total) ? 0 : 1);
+    }
+
+    pid_out = pid;
+    return 0;
+}
+
+static int wait_client(pid_t pid)
+{
+    int status = 0;
+    DMTR_TRUE(errno, pid == waitpid(pid, &status, 0));
+    DMTR_TRUE(ECHILD, WIFEXITED(status) && 0 == WEXITSTATUS(status));
+    return 0;
+}
+
+// pushes the next chunk of the file.
+static int push_copy(dmtr_qtoken_t &qt_out, dmtr_sgarray_t &sga_out, int qd, int fqd)
+{
+    dmtr_qtoken_t qt = 0;
+    DMTR_OK(dmtr_pop2(&qt, fqd, CHUNK_SIZE));
+    dmtr_qresult_t qr = {};
+    DMTR_OK(dmtr_wait(&qr, qt));
+    sga_out = qr.qr_value.sga;
+    DMTR_TRUE(EPROTO, 1 == sga_out.sga_numsegs);
+    return dmtr_push(&qt_out, qd, &sga_out);
+}
+
+static int serve(result &result_out, const struct sockaddr_in &saddr, const char *path, bool copy_flag)
+{
+    int lqd = 0;
+    DMTR_OK(dmtr_socket(&lqd, AF_INET, SOCK_STREAM, 0));
+    DMTR_OK(dmtr_bind(lqd, reinterpret_cast<const struct sockaddr *>(&saddr), sizeof(saddr)));
+    DMTR_OK(dmtr_listen(lqd, 1));
+
+    pid_t pid = 0;
+    DMTR_OK(start_client(pid, saddr));
+    dmtr_qtoken_t qt = 0;
+    DMTR_OK(dmtr_accept(&qt, lqd));
+    dmtr_qresult_t qr = {};
+    DMTR_OK(dmtr_wait(&qr, qt));
+    const int qd = qr.qr_value.ares.qd;
+    int fqd = 0;
+    DMTR_OK(dmtr_open(&fqd, path, O_RDONLY));
+
+    const auto t0 = boost::chrono::steady_clock::now();
+    const double cpu0 = cpu_secs();
+    for (uint32_t i = 0; i < iterations; ++i) {
+        DMTR_OK(dmtr_lseek(fqd, 0, SEEK_SET));
+        std::deque<std::pair<dmtr_qtoken_t, dmtr_sgarray_t>> window;
+        for (size_t offset = 0; offset < FILE_SIZE || !window.empty();) {
+            if (offset < FILE_SIZE && window.size() < PUSH_WINDOW) {
+                dmtr_sgarray_t sga = {};
+                if (copy_flag) {
+                    DMTR_OK(push_copy(qt, sga, qd, fqd));
+                } else {
+                    DMTR_OK(dmtr_push_file(&qt, qd, fqd, offset, CHUNK_SIZE));
+                }
+
+                window.push_back(std::make_pair(qt, sga));
+                offset += CHUNK_SIZE;
+                continue;
+            }
+
+            DMTR_OK(dmtr_wait(NULL, window.front().first));
+            if (copy_flag) {
+                DMTR_OK(dmtr_sgafree(&window.front().second));
+            }
+
+            window.pop_front();
+        }
+    }
+
+    DMTR_OK(wait_client(pid));
+    const double mib = static_cast<double>(iterations) * FILE_SIZE / (1 << 20);
+    result_out.rate = mib / boost::chrono::duration<double>(boost::chrono::steady_clock::now() - t0).count();
+    result_out.cpu_us = (cpu_secs() - cpu0) * 1e6 / mib;
+    DMTR_OK(dmtr_close(fqd));
+    DMTR_OK(dmtr_close(qd));
+    DMTR_OK(dmtr_close(lqd));
+    return 0;
+}
+
+static int make_file(const char *path)
+{
+    FILE *f = fopen(path, "wb");
+    DMTR_NOTNULL(errno, f);
+    std::unique_ptr<char[]> buf(new char[CHUNK_SIZE]);
+    memset(buf.get(), FILL_CHAR, CHUNK_SIZE);
+    for (size_t i = 0; i < FILE_SIZE; i += CHUNK_SIZE) {
+        DMTR_TRUE(EIO, CHUNK_SIZE == fwrite(buf.get(), 1, CHUNK_SIZE, f));
+    }
+
+    DMTR_TRUE(errno, 0 == fclose(f));
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    parse_args(argc, argv, true);
+    DMTR_OK(dmtr_init(argc, argv));
+
+    char path[] = "/tmp/dmtr-file-serve-XXXXXX";
+    int fd = mkstemp(path);
+    DMTR_TRUE(errno, -1 != fd);
+    close(fd);
+    DMTR_OK(make_file(path));
+
+    struct sockaddr_in saddr = {};
+    saddr.sin_family = AF_INET;
+    saddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    saddr.sin_port = htons(port);
+
+    // the file is in the page cache for both, since it was just written.
+    result copy = {};
+    DMTR_OK(serve(copy, saddr, path, true));
+    result file = {};
+    saddr.sin_port = htons(port + 1);
+    DMTR_OK(serve(file, saddr, path, false));
+    (void)unlink(path);
+
+    std::cerr << iterations << " x " << (FILE_SIZE >> 20) << " MiB in " << (CHUNK_SIZE >> 10) << " KiB messages:" << std::endl;
+    std::cerr << "server\tMiB/s\tCPU/MiB (us)" << std::endl;
+    std::cerr << "pop and push\t" << static_cast<uint64_t>(copy.rate) << "\t" << copy.cpu_us << std::endl;
+    std::cerr << "dmtr_push_file()\t" << static_cast<uint64_t>(file.rate) << "\t" << file.cpu_us << std::endl;
+    return 0;
+}
@@ -0,0 +1,129 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+// accepts `--iterations` loopback connections through the libOS and keeps
+// them all open and idle. the connecting ends are plain sockets, so the
+// libOS only pays for the accepted queues. every tenth of the run it
+// reports the accept rate and how much the resident set has grown per
+// connection. `-i 100000` needs a file descriptor limit of at least twice
+// that; connections are spread over several loopback source addresses so
+// that they don't run out of ephemeral ports.
+
+#include "bench_common.hh"
+#include "common.hh"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <boost/chrono.hpp>
+#include <cstring>
+#include <dmtr/annot.h>
+#include <dmtr/libos.h>
+#include <dmtr/wait.h>
+#include <iostream>
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+// how many connections are set up before we wait for them to be accepted.
+#define BATCH_SIZE 256
+#define CONNECTIONS_PER_SOURCE_ADDR 20000
+
+static int connect_client(int &fd_out, const struct sockaddr_in &saddr, uint32_t i)
+{
+    fd_out = -1;
+
+    int fd = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    DMTR_TRUE(errno, fd != -1);
+
+    struct sockaddr_in caddr = {};
+    caddr.sin_family = AF_INET;
+    caddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK + i / CONNECTIONS_PER_SOURCE_ADDR);
+    DMTR_TRUE(errno, 0 == ::bind(fd, reinterpret_cast<struct sockaddr *>(&caddr), sizeof(caddr)));
+
+    int ret = ::connect(fd, reinterpret_cast<const struct sockaddr *>(&saddr), sizeof(saddr));
+    DMTR_TRUE(errno, 0 == ret || EINPROGRESS == errno);
+    fd_out = fd;
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    parse_args(argc, argv, true);
+    const uint32_t n = iterations;
+
+    struct sockaddr_in saddr = {};
+    saddr.sin_family = AF_INET;
+    saddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    saddr.sin_port = htons(port);
+
+    // every connection needs two file descriptors.
+    struct rlimit rl = {};
+    DMTR_TRUE(errno, 0 == getrlimit(RLIMIT_NOFILE, &rl));
+    rl.rlim_cur = rl.rlim_max;
+    (void)setrlimit(RLIMIT_NOFILE, &rl);
+    if (2 * static_cast<rlim_t>(n) + 16 > rl.rlim_cur) {
+        std::cerr << "RLIMIT_NOFILE (" << rl.rlim_cur << ") is too low for " << n << " connections." << std::endl;
+        return 1;
+    }
+
+    DMTR_OK(dmtr_init(argc, argv));
+
+    int lqd = 0;
+    DMTR_OK(dmtr_socket(&lqd, AF_INET, SOCK_STREAM, 0));
+    DMTR_OK(dmtr_bind(lqd, reinterpret_cast<struct sockaddr *>(&saddr), sizeof(saddr)));
+    DMTR_OK(dmtr_listen(lqd, 4096));
+
+    std::vector<int> client_fds;
+    std::vector<int> sqds;
+    client_fds.reserve(n);
+    sqds.reserve(n);
+
+    const size_t rss_start = rss_kb();
+    const uint32_t report_every = n < 10 ? 1 : n / 10;
+    uint32_t next_report = report_every;
+    auto t_start = boost::chrono::steady_clock::now();
+    auto t_report = t_start;
+    uint32_t last_reported = 0;
+    std::cerr << "connections\taccepts/s\tRSS (KB)\tRSS/conn (B)" << std::endl;
+    while (sqds.size() < n) {
+        const uint32_t batch = std::min<uint32_t>(BATCH_SIZE, n - sqds.size());
+        dmtr_qtoken_t qts[BATCH_SIZE];
+        for (uint32_t i = 0; i < batch; ++i) {
+            DMTR_OK(dmtr_accept(&qts[i], lqd));
+            int fd = -1;
+            DMTR_OK(connect_client(fd, saddr, client_fds.size()));
+            client_fds.push_back(fd);
+        }
+
+        for (uint32_t i = 0; i < batch; ++i) {
+            dmtr_qresult_t qr = {};
+            DMTR_OK(dmtr_wait(&qr, qts[i]));
+            sqds.push_back(qr.qr_value.ares.qd);
+        }
+
+        if (sqds.size() >= next_report) {
+            auto now = boost::chrono::steady_clock::now();
+            double secs = boost::chrono::duration<double>(now - t_report).count();
+            t_report = now;
+            const size_t rss = rss_kb();
+            std::cerr << sqds.size() << "\t" << static_cast<uint64_t>((sqds.size() - last_reported) / secs)
+                << "\t" << rss << "\t" << (rss - rss_start) * 1024 / sqds.size() << std::endl;
+            last_reported = sqds.size();
+            next_report += report_every;
+        }
+    }
+
+    double secs = boost::chrono::duration<double>(boost::chrono::steady_clock::now() - t_start).count();
+    std::cerr << "total: " << n << " connections in " << secs << " s ("
+        << static_cast<uint64_t>(n / secs) << " accepts/s), RSS grew by "
+        << rss_kb() - rss_start << " KB" << std::endl;
+
+    for (size_t i = 0; i < sqds.size(); ++i) {
+        DMTR_OK(dmtr_close(sqds[i]));
+        ::close(client_fds[i]);
+    }
+
+    DMTR_OK(dmtr_close(lqd));
+    return 0;
+}
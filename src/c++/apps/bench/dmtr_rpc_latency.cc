@@ -0,0 +1,168 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+// measures the round trip time of small requests between two processes on
+// the same host. a child process echoes every message back by pushing the
+// sga that it popped; the parent pushes `--iterations` requests of
+// `--size` bytes, one at a time, from buffers that `dmtr_sgaalloc()` hands
+// out, and reports the latency distribution. built against the shared
+// memory libOS, the processes connect through a Unix domain socket at
+// `RPC_SOCKET_PATH`; otherwise they connect over loopback TCP on `--port`,
+// which makes the two builds comparable.
+
+#include "common.hh"
+#include <arpa/inet.h>
+#include <cstdio>
+#include <cstring>
+#include <dmtr/annot.h>
+#include <dmtr/latency.h>
+#include <dmtr/libos.h>
+#include <dmtr/sga.h>
+#include <dmtr/wait.h>
+#include <iostream>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define RPC_SOCKET_PATH "/tmp/dmtr-rpc-latency.sock"
+#define WARMUP_ITERATIONS 1000
+
+union rpc_address {
+    struct sockaddr sa;
+    struct sockaddr_in in;
+    struct sockaddr_un un;
+};
+
+static socklen_t make_address(rpc_address &addr_out)
+{
+    memset(&addr_out, 0, sizeof(addr_out));
+#ifdef DMTR_RPC_UNIX
+    addr_out.un.sun_family = AF_UNIX;
+    strncpy(addr_out.un.sun_path, RPC_SOCKET_PATH, sizeof(addr_out.un.sun_path) - 1);
+    return sizeof(addr_out.un);
+#else
+    addr_out.in.sin_family = AF_INET;
+    addr_out.in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr_out.in.sin_port = htons(port);
+    return sizeof(addr_out.in);
+#endif
+}
+
+static int run_server(int lqd)
+{
+    dmtr_qtoken_t qt = 0;
+    DMTR_OK(dmtr_accept(&qt, lqd));
+    dmtr_qresult_t qr = {};
+    DMTR_OK(dmtr_wait(&qr, qt));
+    const int qd = qr.qr_value.ares.qd;
+
+    for (;;) {
+        DMTR_OK(dmtr_pop(&qt, qd));
+        int ret = dmtr_wait(&qr, qt);
+        if (ECONNABORTED == ret || ECONNRESET == ret) {
+            break;
+        }
+
+        DMTR_OK(ret);
+        dmtr_sgarray_t sga = qr.qr_value.sga;
+        DMTR_OK(dmtr_push(&qt, qd, &sga));
+        DMTR_OK(dmtr_wait(NULL, qt));
+        DMTR_OK(dmtr_sgafree(&sga));
+    }
+
+    DMTR_OK(dmtr_close(qd));
+    return 0;
+}
+
+static int run_client(int qd, dmtr_latency_t *latency)
+{
+    for (uint32_t i = 0; i < WARMUP_ITERATIONS + iterations; ++i) {
+        dmtr_sgarray_t sga = {};
+        DMTR_OK(dmtr_sgaalloc(&sga, qd, packet_size));
+        memset(sga.sga_segs[0].sgaseg_buf, FILL_CHAR, packet_size);
+
+        const uint64_t t0 = dmtr_now_ns();
+        dmtr_qtoken_t qt = 0;
+        DMTR_OK(dmtr_push(&qt, qd, &sga));
+        DMTR_OK(dmtr_wait(NULL, qt));
+        DMTR_OK(dmtr_pop(&qt, qd));
+        dmtr_qresult_t qr = {};
+        DMTR_OK(dmtr_wait(&qr, qt));
+        const uint64_t t1 = dmtr_now_ns();
+
+        DMTR_TRUE(EPROTO, 1 == qr.qr_value.sga.sga_numsegs);
+        DMTR_TRUE(EPROTO, packet_size == qr.qr_value.sga.sga_segs[0].sgaseg_len);
+        if (i >= WARMUP_ITERATIONS) {
+            DMTR_OK(dmtr_record_latency(latency, t1 - t0));
+        }
+
+        DMTR_OK(dmtr_sgafree(&qr.qr_value.sga));
+        DMTR_OK(dmtr_sgafree(&sga));
+    }
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    parse_args(argc, argv, false);
+    if (0 == packet_size) {
+        std::cerr << "`--size` has to be at least 1." << std::endl;
+        return 1;
+    }
+
+    rpc_address addr = {};
+    const socklen_t addr_len = make_address(addr);
+#ifdef DMTR_RPC_UNIX
+    (void)unlink(RPC_SOCKET_PATH);
+#endif
+
+    // each process sets the libOS up for itself, so the child is forked
+    // first; it listens before the parent gets to connect.
+    int ready[2];
+    DMTR_TRUE(errno, 0 == pipe(ready));
+    pid_t pid = fork();
+    DMTR_TRUE(errno, -1 != pid);
+    if (0 == pid) {
+        close(ready[0]);
+        DMTR_OK(dmtr_init(argc, argv));
+        int lqd = 0;
+        DMTR_OK(dmtr_socket(&lqd, addr.sa.sa_family, SOCK_STREAM, 0));
+        DMTR_OK(dmtr_bind(lqd, &addr.sa, addr_len));
+        DMTR_OK(dmtr_listen(lqd, 1));
+        char c = 0;
+        DMTR_TRUE(errno, sizeof(c) == write(ready[1], &c, sizeof(c)));
+        _exit(0 == run_server(lqd) ? 0 : 1);
+    }
+
+    close(ready[1]);
+    char c = 0;
+    DMTR_TRUE(ECHILD, sizeof(c) == read(ready[0], &c, sizeof(c)));
+    close(ready[0]);
+
+    DMTR_OK(dmtr_init(argc, argv));
+    int qd = 0;
+    DMTR_OK(dmtr_socket(&qd, addr.sa.sa_family, SOCK_STREAM, 0));
+    dmtr_qtoken_t qt = 0;
+    DMTR_OK(dmtr_connect(&qt, qd, &addr.sa, addr_len));
+    DMTR_OK(dmtr_wait(NULL, qt));
+
+    dmtr_latency_t *latency = NULL;
+    DMTR_OK(dmtr_new_latency(&latency, "round trip"));
+    DMTR_OK(run_client(qd, latency));
+    DMTR_OK(dmtr_close(qd));
+
+    int status = 0;
+    DMTR_TRUE(errno, pid == waitpid(pid, &status, 0));
+    DMTR_TRUE(ECHILD, WIFEXITED(status) && 0 == WEXITSTATUS(status));
+#ifdef DMTR_RPC_UNIX
+    (void)unlink(RPC_SOCKET_PATH);
+#endif
+
+    std::cerr << iterations << " round trips of " << packet_size << " bytes:" << std::endl;
+    DMTR_OK(dmtr_dump_latency(stderr, latency));
+    DMTR_OK(dmtr_delete_latency(&latency));
+    return 0;
+}
@@ -0,0 +1,178 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+// measures the aggregate rate of short-lived loopback connections with
+// `--clients` cores, each of which listens on the same port with a socket
+// of its own (which needs `posix.reuseport` in the configuration file).
+// every core is pinned to a CPU, listens in core order (so that
+// `posix.cpu_steering` gives it the connections that arrive on its CPU),
+// and then opens and closes `--iterations` connections while accepting
+// and closing whatever connections the kernel hands its listening socket.
+
+#include "common.hh"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <atomic>
+#include <boost/chrono.hpp>
+#include <cstring>
+#include <dmtr/annot.h>
+#include <dmtr/libos.h>
+#include <dmtr/wait.h>
+#include <iostream>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <sched.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+static std::atomic<uint32_t> listening(0);
+static std::atomic<uint64_t> accepted(0);
+static std::atomic<uint32_t> failures(0);
+static std::atomic<bool> setup_failed(false);
+
+struct core_stats {
+    uint64_t accepted;
+    double secs;
+};
+
+static int run_core(core_stats &stats_out, uint32_t core, const struct sockaddr_in &saddr)
+{
+    stats_out = {};
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(core % sysconf(_SC_NPROCESSORS_ONLN), &cpus);
+    (void)pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+
+    // the cores listen in order, and nobody connects until all of them
+    // are listening.
+    while (listening.load() != core) {
+        sched_yield();
+    }
+
+    int lqd = 0;
+    int ret = dmtr_socket(&lqd, AF_INET, SOCK_STREAM, 0);
+    if (0 == ret) {
+        ret = dmtr_bind(lqd, reinterpret_cast<const struct sockaddr *>(&saddr), sizeof(saddr));
+    }
+    if (0 == ret) {
+        ret = dmtr_listen(lqd, 1024);
+    }
+    if (0 != ret) {
+        setup_failed = true;
+    }
+
+    ++listening;
+    while (listening.load() != clients) {
+        sched_yield();
+    }
+
+    if (0 != ret) {
+        return ret;
+    } else if (setup_failed.load()) {
+        return 0;
+    }
+
+    dmtr_qtoken_t accept_qt = 0;
+    DMTR_OK(dmtr_accept(&accept_qt, lqd));
+    uint32_t connects = 0;
+    const uint64_t total = static_cast<uint64_t>(clients) * iterations;
+    auto t0 = boost::chrono::steady_clock::now();
+    // connections that arrive at other cores still have to be accepted
+    // after this core has opened all of its own.
+    while (accepted.load() < total) {
+        // connecting finishes right away on loopback, so whatever is
+        // waiting to be accepted is taken first; otherwise a core would
+        // never get around to it.
+        dmtr_qresult_t qr = {};
+        ret = dmtr_timedwait(&qr, accept_qt, connects < iterations ? 0 : 10);
+        if (EAGAIN != ret) {
+            if (0 == ret) {
+                DMTR_OK(dmtr_close(qr.qr_value.ares.qd));
+                ++stats_out.accepted;
+                ++accepted;
+            } else {
+                ++failures;
+            }
+
+            DMTR_OK(dmtr_accept(&accept_qt, lqd));
+            continue;
+        }
+
+        if (connects == iterations) {
+            continue;
+        }
+
+        int cqd = 0;
+        DMTR_OK(dmtr_socket(&cqd, AF_INET, SOCK_STREAM, 0));
+        dmtr_qtoken_t connect_qt = 0;
+        DMTR_OK(dmtr_connect(&connect_qt, cqd, reinterpret_cast<const struct sockaddr *>(&saddr), sizeof(saddr)));
+        if (0 != dmtr_wait(NULL, connect_qt)) {
+            ++failures;
+            // it'll never be accepted.
+            ++accepted;
+        }
+
+        DMTR_OK(dmtr_close(cqd));
+        ++connects;
+    }
+
+    stats_out.secs = boost::chrono::duration<double>(boost::chrono::steady_clock::now() - t0).count();
+    DMTR_OK(dmtr_drop(accept_qt));
+    DMTR_OK(dmtr_close(lqd));
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    parse_args(argc, argv, true);
+    if (0 == clients) {
+        std::cerr << "`--clients` has to be at least 1." << std::endl;
+        return 1;
+    }
+
+    struct sockaddr_in saddr = {};
+    saddr.sin_family = AF_INET;
+    saddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    saddr.sin_port = htons(port);
+
+    DMTR_OK(dmtr_init(argc, argv));
+
+    std::vector<core_stats> stats(clients);
+    std::vector<int> rets(clients);
+    std::vector<std::thread> threads;
+    for (uint32_t i = 1; i < clients; ++i) {
+        threads.emplace_back([&, i]() {
+            int core_id = 0;
+            rets[i] = dmtr_init_core(&core_id);
+            if (0 == rets[i]) {
+                rets[i] = run_core(stats[i], i, saddr);
+            }
+        });
+    }
+
+    rets[0] = run_core(stats[0], 0, saddr);
+    for (auto &t : threads) {
+        t.join();
+    }
+
+    for (uint32_t i = 0; i < clients; ++i) {
+        if (0 != rets[i]) {
+            std::cerr << "core " << i << " failed: " << strerror(rets[i])
+                << " (is `posix.reuseport` set?)" << std::endl;
+            return 1;
+        }
+    }
+
+    double secs = 0;
+    std::cerr << "core\taccepted" << std::endl;
+    for (uint32_t i = 0; i < clients; ++i) {
+        std::cerr << i << "\t" << stats[i].accepted << std::endl;
+        secs = std::max(secs, stats[i].secs);
+    }
+
+    std::cerr << "total: " << accepted.load() << " connections on " << clients << " cores in " << secs
+        << " s (" << static_cast<uint64_t>(accepted.load() / secs) << " conn/s, " << failures.load()
+        << " failed)" << std::endl;
+    return 0;
+}
@@ -0,0 +1,139 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+// measures how long `dmtr_wait_any()` takes to return a single completion
+// while 10, 1000 and 10000 pop tokens are outstanding. each token is a pop
+// on one end of a loopback connection; every iteration pushes a message on
+// the other end of a randomly chosen connection and then waits on all of
+// the tokens. the cost per completion should not depend on the number of
+// idle tokens.
+
+#include "common.hh"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <boost/chrono.hpp>
+#include <cstdlib>
+#include <cstring>
+#include <dmtr/annot.h>
+#include <dmtr/libos.h>
+#include <dmtr/sga.h>
+#include <dmtr/wait.h>
+#include <iostream>
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <vector>
+
+static int connect_pairs(std::vector<int> &cqds_out, std::vector<int> &sqds_out, int lqd, const struct sockaddr_in &saddr, size_t n)
+{
+    for (size_t i = 0; i < n; ++i) {
+        dmtr_qtoken_t accept_qt = 0;
+        DMTR_OK(dmtr_accept(&accept_qt, lqd));
+
+        int cqd = 0;
+        DMTR_OK(dmtr_socket(&cqd, AF_INET, SOCK_STREAM, 0));
+        dmtr_qtoken_t connect_qt = 0;
+        DMTR_OK(dmtr_connect(&connect_qt, cqd, reinterpret_cast<const struct sockaddr *>(&saddr), sizeof(saddr)));
+        DMTR_OK(dmtr_wait(NULL, connect_qt));
+
+        dmtr_qresult_t qr = {};
+        DMTR_OK(dmtr_wait(&qr, accept_qt));
+        cqds_out.push_back(cqd);
+        sqds_out.push_back(qr.qr_value.ares.qd);
+    }
+
+    return 0;
+}
+
+static int run(int lqd, const struct sockaddr_in &saddr, size_t n)
+{
+    std::vector<int> cqds, sqds;
+    DMTR_OK(connect_pairs(cqds, sqds, lqd, saddr, n));
+
+    std::vector<dmtr_qtoken_t> tokens(n);
+    for (size_t i = 0; i < n; ++i) {
+        DMTR_OK(dmtr_pop(&tokens[i], sqds[i]));
+    }
+
+    dmtr_sgarray_t sga = {};
+    sga.sga_numsegs = 1;
+    sga.sga_segs[0].sgaseg_buf = generate_packet();
+    sga.sga_segs[0].sgaseg_len = packet_size;
+
+    // the first waits after setting up the connections also have to deal
+    // with their initial readiness, so they don't count.
+    const uint32_t warmup = std::min<uint32_t>(iterations, 1000);
+    std::vector<uint64_t> samples;
+    samples.reserve(iterations);
+    int idx = 0;
+    for (uint32_t i = 0; i < warmup + iterations; ++i) {
+        const size_t j = random() % n;
+        dmtr_qtoken_t push_qt = 0;
+        DMTR_OK(dmtr_push(&push_qt, cqds[j], &sga));
+        DMTR_OK(dmtr_wait(NULL, push_qt));
+
+        dmtr_qresult_t qr = {};
+        auto t0 = boost::chrono::steady_clock::now();
+        DMTR_OK(dmtr_wait_any(&qr, &idx, tokens.data(), n));
+        auto dt = boost::chrono::steady_clock::now() - t0;
+        if (i >= warmup) {
+            samples.push_back(boost::chrono::duration_cast<boost::chrono::nanoseconds>(dt).count());
+        }
+
+        DMTR_TRUE(EINVAL, static_cast<size_t>(idx) == j);
+        DMTR_OK(dmtr_sgafree(&qr.qr_value.sga));
+        DMTR_OK(dmtr_pop(&tokens[idx], sqds[idx]));
+    }
+
+    std::sort(samples.begin(), samples.end());
+    uint64_t total = 0;
+    for (auto s : samples) {
+        total += s;
+    }
+
+    std::cerr << n << "\t" << total / samples.size() << "\t" << samples[samples.size() / 2]
+        << "\t" << samples[samples.size() * 99 / 100] << std::endl;
+
+    free(sga.sga_segs[0].sgaseg_buf);
+    for (size_t i = 0; i < n; ++i) {
+        DMTR_OK(dmtr_drop(tokens[i]));
+        DMTR_OK(dmtr_close(sqds[i]));
+        DMTR_OK(dmtr_close(cqds[i]));
+    }
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    parse_args(argc, argv, true);
+
+    struct sockaddr_in saddr = {};
+    saddr.sin_family = AF_INET;
+    saddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    saddr.sin_port = htons(port);
+
+    DMTR_OK(dmtr_init(argc, argv));
+
+    int lqd = 0;
+    DMTR_OK(dmtr_socket(&lqd, AF_INET, SOCK_STREAM, 0));
+    DMTR_OK(dmtr_bind(lqd, reinterpret_cast<struct sockaddr *>(&saddr), sizeof(saddr)));
+    DMTR_OK(dmtr_listen(lqd, 1024));
+
+    // every outstanding token needs two file descriptors.
+    struct rlimit rl = {};
+    DMTR_TRUE(errno, 0 == getrlimit(RLIMIT_NOFILE, &rl));
+
+    std::cerr << "tokens\tmean (ns)\tp50 (ns)\tp99 (ns)" << std::endl;
+    const size_t sizes[] = {10, 1000, 10000};
+    for (auto n : sizes) {
+        if (2 * n + 16 > rl.rlim_cur) {
+            std::cerr << n << "\tskipped (RLIMIT_NOFILE is " << rl.rlim_cur << ")" << std::endl;
+            continue;
+        }
+
+        DMTR_OK(run(lqd, saddr, n));
+    }
+
+    DMTR_OK(dmtr_close(lqd));
+    return 0;
+}
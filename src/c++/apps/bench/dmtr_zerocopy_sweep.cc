@@ -0,0 +1,210 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+// measures loopback stream throughput with pushes that are copied and with
+// pushes that are sent with `MSG_ZEROCOPY`, for message sizes from 4 KiB
+// to 4 MiB, and reports the smallest size from which zero-copy is faster.
+// every measurement runs in a process of its own, with a configuration file
+// that sets `posix.zerocopy_threshold` to 0 (copy) or 1 (zero-copy). each
+// process pushes from one end of a connection, keeping `PUSH_WINDOW`
+// pushes outstanding, and pops from the other end.
+
+#include "common.hh"
+#include <arpa/inet.h>
+#include <boost/chrono.hpp>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dmtr/annot.h>
+#include <dmtr/libos.h>
+#include <dmtr/sga.h>
+#include <dmtr/wait.h>
+#include <iostream>
+#include <netinet/in.h>
+#include <string>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+#define PUSH_WINDOW 4
+#define WARMUP_MS 200
+#define MEASURE_MS 1000
+
+static int connect_pair(int &cqd_out, int &sqd_out, int lqd, const struct sockaddr_in &saddr)
+{
+    dmtr_qtoken_t accept_qt = 0;
+    DMTR_OK(dmtr_accept(&accept_qt, lqd));
+
+    DMTR_OK(dmtr_socket(&cqd_out, AF_INET, SOCK_STREAM, 0));
+    dmtr_qtoken_t connect_qt = 0;
+    DMTR_OK(dmtr_connect(&connect_qt, cqd_out, reinterpret_cast<const struct sockaddr *>(&saddr), sizeof(saddr)));
+    DMTR_OK(dmtr_wait(NULL, connect_qt));
+
+    dmtr_qresult_t qr = {};
+    DMTR_OK(dmtr_wait(&qr, accept_qt));
+    sqd_out = qr.qr_value.ares.qd;
+    return 0;
+}
+
+// the bytes popped per second, once the connection has warmed up.
+static int measure(double &rate_out, size_t size)
+{
+    struct sockaddr_in saddr = {};
+    saddr.sin_family = AF_INET;
+    saddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    saddr.sin_port = htons(port);
+
+    int lqd = 0;
+    DMTR_OK(dmtr_socket(&lqd, AF_INET, SOCK_STREAM, 0));
+    DMTR_OK(dmtr_bind(lqd, reinterpret_cast<struct sockaddr *>(&saddr), sizeof(saddr)));
+    DMTR_OK(dmtr_listen(lqd, 16));
+    int cqd = 0, sqd = 0;
+    DMTR_OK(connect_pair(cqd, sqd, lqd, saddr));
+
+    // the kernel may read the buffer until a zero-copy push finishes, so
+    // it's never written to after this.
+    void *buf = NULL;
+    DMTR_OK(dmtr_malloc(&buf, size));
+    memset(buf, FILL_CHAR, size);
+    dmtr_sgarray_t sga = {};
+    sga.sga_numsegs = 1;
+    sga.sga_segs[0].sgaseg_buf = buf;
+    sga.sga_segs[0].sgaseg_len = size;
+
+    // the pop comes first, then the pushes.
+    std::vector<dmtr_qtoken_t> tokens(1 + PUSH_WINDOW);
+    DMTR_OK(dmtr_pop(&tokens[0], sqd));
+    for (size_t i = 1; i < tokens.size(); ++i) {
+        DMTR_OK(dmtr_push(&tokens[i], cqd, &sga));
+    }
+
+    const auto t_start = boost::chrono::steady_clock::now();
+    const auto warmup = boost::chrono::milliseconds(WARMUP_MS);
+    const auto duration = warmup + boost::chrono::milliseconds(MEASURE_MS);
+    boost::chrono::steady_clock::time_point t0;
+    size_t bytes = 0;
+    bool warm_flag = false;
+    while (true) {
+        const auto elapsed = boost::chrono::steady_clock::now() - t_start;
+        if (elapsed >= duration) {
+            break;
+        }
+
+        if (!warm_flag && elapsed >= warmup) {
+            warm_flag = true;
+            t0 = boost::chrono::steady_clock::now();
+            bytes = 0;
+        }
+
+        dmtr_qresult_t qr = {};
+        int idx = -1;
+        DMTR_OK(dmtr_wait_any(&qr, &idx, tokens.data(), tokens.size()));
+        if (0 == idx) {
+            DMTR_TRUE(EINVAL, size == qr.qr_value.sga.sga_segs[0].sgaseg_len);
+            bytes += size;
+            DMTR_OK(dmtr_sgafree(&qr.qr_value.sga));
+            DMTR_OK(dmtr_pop(&tokens[0], sqd));
+        } else {
+            DMTR_OK(dmtr_push(&tokens[idx], cqd, &sga));
+        }
+    }
+
+    rate_out = bytes / boost::chrono::duration<double>(boost::chrono::steady_clock::now() - t0).count();
+    for (auto qt : tokens) {
+        DMTR_OK(dmtr_drop(qt));
+    }
+
+    DMTR_OK(dmtr_close(cqd));
+    DMTR_OK(dmtr_close(sqd));
+    DMTR_OK(dmtr_close(lqd));
+    return 0;
+}
+
+// runs `measure()` in a child process whose libOS is configured from
+// `config_path`, since the libOS can only be set up once per process.
+static int run(double &rate_out, const char *argv0, const std::string &config_path, size_t size)
+{
+    rate_out = 0;
+    int fds[2];
+    DMTR_TRUE(errno, 0 == pipe(fds));
+
+    pid_t pid = fork();
+    DMTR_TRUE(errno, -1 != pid);
+    if (0 == pid) {
+        close(fds[0]);
+        char *args[] = {const_cast<char *>(argv0), const_cast<char *>("-r"), const_cast<char *>(config_path.c_str()), NULL};
+        double rate = 0;
+        int ret = dmtr_init(3, args);
+        if (0 == ret) {
+            ret = measure(rate, size);
+        }
+
+        if (0 != ret || sizeof(rate) != write(fds[1], &rate, sizeof(rate))) {
+            _exit(1);
+        }
+
+        _exit(0);
+    }
+
+    close(fds[1]);
+    double rate = 0;
+    const ssize_t n = read(fds[0], &rate, sizeof(rate));
+    close(fds[0]);
+    int status = 0;
+    DMTR_TRUE(errno, pid == waitpid(pid, &status, 0));
+    DMTR_TRUE(ECHILD, WIFEXITED(status) && 0 == WEXITSTATUS(status));
+    DMTR_TRUE(EIO, sizeof(rate) == n);
+    rate_out = rate;
+    return 0;
+}
+
+static int write_config(std::string &path_out, size_t zerocopy_threshold)
+{
+    char path[] = "/tmp/dmtr-zerocopy-XXXXXX";
+    int fd = mkstemp(path);
+    DMTR_TRUE(errno, -1 != fd);
+    FILE *f = fdopen(fd, "w");
+    DMTR_NOTNULL(errno, f);
+    fprintf(f, "posix:\n  zerocopy_threshold: %zu\n", zerocopy_threshold);
+    DMTR_TRUE(EIO, 0 == fclose(f));
+    path_out = path;
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    parse_args(argc, argv, true);
+
+    std::string copy_config, zerocopy_config;
+    DMTR_OK(write_config(copy_config, 0));
+    DMTR_OK(write_config(zerocopy_config, 1));
+
+    std::cerr << "size (B)\tcopy (MB/s)\tzero-copy (MB/s)\tratio" << std::endl;
+    // the smallest size from which zero-copy stays ahead.
+    size_t crossover = 0;
+    for (size_t size = 4 << 10; size <= (4 << 20); size *= 2) {
+        double copy_rate = 0, zerocopy_rate = 0;
+        DMTR_OK(run(copy_rate, argv[0], copy_config, size));
+        DMTR_OK(run(zerocopy_rate, argv[0], zerocopy_config, size));
+        std::cerr << size << "\t" << static_cast<uint64_t>(copy_rate / 1e6) << "\t"
+            << static_cast<uint64_t>(zerocopy_rate / 1e6) << "\t" << zerocopy_rate / copy_rate << std::endl;
+
+        if (zerocopy_rate > copy_rate) {
+            if (0 == crossover) {
+                crossover = size;
+            }
+        } else {
+            crossover = 0;
+        }
+    }
+
+    if (0 == crossover) {
+        std::cerr << "zero-copy wasn't faster at the largest size." << std::endl;
+    } else {
+        std::cerr << "zero-copy is faster from " << crossover << " bytes." << std::endl;
+    }
+
+    unlink(copy_config.c_str());
+    unlink(zerocopy_config.c_str());
+    return 0;
+}
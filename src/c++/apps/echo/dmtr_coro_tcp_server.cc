@@ -0,0 +1,98 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+// the TCP echo server, written with the C++20 coroutine front-end: every
+// connection is a coroutine that pops and pushes back in a plain loop.
+
+#include "common.hh"
+#include <arpa/inet.h>
+#include <boost/optional.hpp>
+#include <dmtr/annot.h>
+#include <dmtr/coroutine.hh>
+#include <dmtr/libos.h>
+#include <dmtr/sga.h>
+#include <iostream>
+#include <netinet/in.h>
+#include <signal.h>
+
+int lqd = 0;
+uint64_t sent = 0;
+uint64_t recved = 0;
+
+void sig_handler(int signo)
+{
+    dmtr_close(lqd);
+    std::cerr << "Sent: " << sent << "  Recved: " << recved << std::endl;
+    exit(0);
+}
+
+static dmtr::coroutine echo(int qd)
+{
+    while (1) {
+        auto popped = co_await dmtr::pop(qd);
+        if (0 != popped.error) {
+            break;
+        }
+
+        recved++;
+        dmtr_sgarray_t &sga = popped.qr.qr_value.sga;
+        auto pushed = co_await dmtr::push(qd, sga);
+        dmtr_sgafree(&sga);
+        if (0 != pushed.error) {
+            break;
+        }
+
+        sent++;
+    }
+
+    std::cerr << "closing connection" << std::endl;
+    dmtr_close(qd);
+}
+
+static dmtr::coroutine accept_loop(int qd)
+{
+    while (1) {
+        auto accepted = co_await dmtr::accept(qd);
+        if (0 != accepted.error) {
+            std::cerr << "accept failed (" << accepted.error << ")." << std::endl;
+            break;
+        }
+
+        std::cerr << "connection accepted (qid = " << accepted.qr.qr_value.ares.qd << ")." << std::endl;
+        echo(accepted.qr.qr_value.ares.qd);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    parse_args(argc, argv, true);
+
+    struct sockaddr_in saddr = {};
+    saddr.sin_family = AF_INET;
+    if (boost::none == server_ip_addr) {
+        std::cerr << "Listening on `*:" << port << "`..." << std::endl;
+        saddr.sin_addr.s_addr = INADDR_ANY;
+    } else {
+        const char *s = boost::get(server_ip_addr).c_str();
+        std::cerr << "Listening on `" << s << ":" << port << "`..." << std::endl;
+        if (inet_pton(AF_INET, s, &saddr.sin_addr) != 1) {
+            std::cerr << "Unable to parse IP address." << std::endl;
+            return -1;
+        }
+    }
+    saddr.sin_port = htons(port);
+
+    DMTR_OK(dmtr_init(argc, argv));
+
+    DMTR_OK(dmtr_socket(&lqd, AF_INET, SOCK_STREAM, 0));
+    std::cout << "listen qd: " << lqd << std::endl;
+    DMTR_OK(dmtr_bind(lqd, reinterpret_cast<struct sockaddr *>(&saddr), sizeof(saddr)));
+    DMTR_OK(dmtr_listen(lqd, 10));
+
+    if (signal(SIGINT, sig_handler) == SIG_ERR)
+        std::cout << "\ncan't catch SIGINT\n";
+
+    accept_loop(lqd);
+    DMTR_OK(dmtr::scheduler::current().run());
+    return 0;
+}
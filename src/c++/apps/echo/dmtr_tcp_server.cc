@@ -2,6 +2,7 @@
 // Licensed under the MIT license.
 
 #include "common.hh"
+#include <algorithm>
 #include <arpa/inet.h>
 #include <boost/chrono.hpp>
 #include <boost/optional.hpp>
@@ -24,6 +25,8 @@
 
 //#define DMTR_PROFILE
 // #define OPEN2
+// the most completions harvested by a single wait.
+#define MAX_READY 32
 // general file descriptors
 int lqd = 0;
 int fqd = 0;
@@ -84,9 +87,6 @@ int main(int argc, char *argv[])
 #endif
 
     std::vector<dmtr_qtoken_t> tokens;
-    dmtr_qtoken_t push_tokens[256];
-    dmtr_sgarray_t popped_buffers[256];
-    memset(push_tokens, 0, 256 * sizeof(dmtr_qtoken_t));
     dmtr_qtoken_t qtemp;
 
     // open listening socket
@@ -111,17 +111,51 @@ int main(int argc, char *argv[])
     // open file if we are a logging server
     if (boost::none != file) {
         // open a log file
-        DMTR_OK(dmtr_open2(&fqd,  boost::get(file).c_str(), O_RDWR | O_CREAT | O_SYNC, S_IRWXU | S_IRGRP));
+        // only the data has to be durable. the libOS commits requests that
+        // arrive together with a single flush.
+        DMTR_OK(dmtr_open2(&fqd,  boost::get(file).c_str(), O_RDWR | O_CREAT | O_DSYNC, S_IRWXU | S_IRGRP));
     }
 #endif
-
-    dmtr_qresult_t wait_out;
-    int idx = 0;
+    // requests that are being logged, by the token of their log push. each
+    // one is echoed back once it's durable, unless its connection was
+    // closed in the meantime (the qd is -1 then); the qd may belong to a
+    // new connection by then.
+    std::unordered_map<dmtr_qtoken_t, int> logging;
+    std::vector<int> done_offsets;
+
+    dmtr_qresult_t ready[MAX_READY];
+    int ready_offsets[MAX_READY];
     while (1) {
-        int status = dmtr_wait_any(&wait_out, &idx, tokens.data(), tokens.size());
+        int num_ready = 0;
+        int status = dmtr_wait_many(ready, ready_offsets, &num_ready, MAX_READY, tokens.data(), tokens.size());
+
+        // a failed operation is always reported on its own, so removing its
+        // token can't shift the offsets of other results.
+        if (status != 0) {
+            dmtr_qresult_t &wait_out = ready[0];
+            int idx = ready_offsets[0];
+            if (0 != fqd && wait_out.qr_qd == fqd) {
+                DMTR_FAIL(status);
+            }
+            assert(status == ECONNRESET || status == ECONNABORTED);
+            fprintf(stderr, "closing connection\n");
+            for (auto &entry : logging) {
+                if (entry.second == wait_out.qr_qd) {
+                    entry.second = -1;
+                }
+            }
+            dmtr_close(wait_out.qr_qd);
+            tokens.erase(tokens.begin()+idx);
+            continue;
+        }
 
-        // if we got an EOK back from wait
-        if (status == 0) {
+        // new connections and log pushes are appended to `tokens` and
+        // finished log pushes are only removed afterwards, so the offsets of
+        // the remaining results stay valid.
+        done_offsets.clear();
+        for (int i = 0; i < num_ready; ++i) {
+            dmtr_qresult_t &wait_out = ready[i];
+            int idx = ready_offsets[i];
             //std::cout << "Found something: qd=" << wait_out.qr_qd;
 
             // check if it's the listening socket
@@ -138,6 +172,25 @@ int main(int argc, char *argv[])
                 // add the token to the token list
                 tokens.push_back(qtemp);
                 DMTR_OK(dmtr_accept(&tokens[0], lqd));
+            } else if (0 != fqd && wait_out.qr_qd == fqd) {
+                // the request is durable, so it can be answered.
+                qtemp = tokens[idx];
+                auto it = logging.find(qtemp);
+                DMTR_TRUE(EINVAL, it != logging.end());
+                const int qd = it->second;
+                logging.erase(it);
+                done_offsets.push_back(idx);
+#ifdef DMTR_PROFILE
+                auto log_dt = boost::chrono::steady_clock::now() - start_times[qtemp];
+                start_times.erase(qtemp);
+                DMTR_OK(dmtr_record_latency(file_log_latency, log_dt.count()));
+#endif
+                // the connection may have gone away in the meantime.
+                if (-1 == qd || 0 != dmtr_push_detached(qd, &wait_out.qr_value.sga, NULL, NULL)) {
+                    DMTR_OK(dmtr_sgafree(&wait_out.qr_value.sga));
+                } else {
+                    sent++;
+                }
             } else {
                 //DMTR_TRUE(EINVAL, DMTR_OPC_POP == wait_out.qr_opcode);
                 //DMTR_TRUE(EINVAL, wait_out.qr_value.sga.sga_numsegs == 1);
@@ -149,52 +202,39 @@ int main(int argc, char *argv[])
                 DMTR_OK(dmtr_record_latency(pop_latency, pop_dt.count()));
 #endif
                 
-#ifdef DMTR_OPEN2
-                if (0 != fqd) {
-                    // log to file
 #ifdef DMTR_PROFILE
-                    auto t0 = boost::chrono::steady_clock::now();
+                auto t0 = boost::chrono::steady_clock::now();
 #endif
+                if (0 != fqd) {
+                    // log to file; the reply waits for the log push to
+                    // complete, but the connection's next request doesn't.
                     DMTR_OK(dmtr_push(&qtemp, fqd, &wait_out.qr_value.sga));
-                    DMTR_OK(dmtr_wait(NULL, qtemp));
+                    logging[qtemp] = wait_out.qr_qd;
+                    tokens.push_back(qtemp);
 #ifdef DMTR_PROFILE
-                    auto log_dt = boost::chrono::steady_clock::now() - t0;
-                    DMTR_OK(dmtr_record_latency(file_log_latency, log_dt.count()));
+                    start_times[qtemp] = t0;
 #endif
-                }
-#endif
-
+                } else {
+                    // push back to client; the buffer is freed once it's sent.
+                    DMTR_OK(dmtr_push_detached(wait_out.qr_qd, &wait_out.qr_value.sga, NULL, NULL));
+                    sent++;
 #ifdef DMTR_PROFILE
-                auto t0 = boost::chrono::steady_clock::now();
+                    auto push_dt = boost::chrono::steady_clock::now() - t0;
+                    DMTR_OK(dmtr_record_latency(push_latency, push_dt.count()));
 #endif
-                // remove last push token
-                if (push_tokens[idx] != 0) {
-                    // should be done by now if we already got a response
-                    DMTR_OK(dmtr_drop(push_tokens[idx]));
-                    DMTR_OK(dmtr_sgafree(&popped_buffers[idx]));
-                    popped_buffers[idx] = wait_out.qr_value.sga;
                 }
-                push_tokens[idx] = 0;
-                // push back to client
-                DMTR_OK(dmtr_push(&push_tokens[idx], wait_out.qr_qd, &wait_out.qr_value.sga));
-                sent++;
-#ifdef DMTR_PROFILE
-                auto push_dt = boost::chrono::steady_clock::now() - t0;
-                DMTR_OK(dmtr_record_latency(push_latency, push_dt.count()));
-#endif
                 // async pop to get next message
                 DMTR_OK(dmtr_pop(&tokens[idx], wait_out.qr_qd));
 #ifdef DMTR_PROFILE
                 start_times[tokens[idx]] = t0;
 #endif
-                //fprintf(stderr, "send complete.\n");
-                //DMTR_OK(dmtr_wait(NULL, push_tokens[idx]));
             }
-        } else {
-            assert(status == ECONNRESET || status == ECONNABORTED);
-            fprintf(stderr, "closing connection");
-            dmtr_close(wait_out.qr_qd);
-            tokens.erase(tokens.begin()+idx);
+        }
+
+        // from the back, so that the offsets still to be removed don't move.
+        std::sort(done_offsets.begin(), done_offsets.end());
+        for (auto it = done_offsets.rbegin(); it != done_offsets.rend(); ++it) {
+            tokens.erase(tokens.begin() + *it);
         }
     }
 }
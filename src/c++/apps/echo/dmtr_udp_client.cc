@@ -2,6 +2,7 @@
 // Licensed under the MIT license.
 
 #include "common.hh"
+#include <algorithm>
 #include <arpa/inet.h>
 #include <boost/chrono.hpp>
 #include <boost/optional.hpp>
@@ -10,17 +11,22 @@
 #include <boost/program_options/variables_map.hpp>
 #include <cassert>
 #include <cstring>
+#include <deque>
 #include <dmtr/annot.h>
 #include <dmtr/latency.h>
 #include <dmtr/libos.h>
+#include <dmtr/sga.h>
 #include <dmtr/wait.h>
 #include <iostream>
 #include <dmtr/libos/mem.h>
 #include <netinet/in.h>
+#include <vector>
 #include <yaml-cpp/yaml.h>
 
 #define USE_CONNECT 1
 #define FILL_CHAR 'a'
+// how many requests are in flight at a time.
+#define WINDOW 32
 
 namespace po = boost::program_options;
 
@@ -28,7 +34,7 @@ int main(int argc, char *argv[])
 {
     parse_args(argc, argv, false);
 
-    DMTR_OK(dmtr_init(dmtr_argc, dmtr_argv));
+    DMTR_OK(dmtr_init(argc, argv));
 
     dmtr_latency_t *latency = NULL;
     DMTR_OK(dmtr_new_latency(&latency, "end-to-end"));
@@ -52,33 +58,73 @@ int main(int argc, char *argv[])
     sga.sga_segs[0].sgaseg_buf = generate_packet();
 
 #if USE_CONNECT
-    std::cerr << "Attempting to connect to `" << server_ip_addr << ":" << port << "`..." << std::endl;
-    DMTR_OK(dmtr_connect(qd, reinterpret_cast<struct sockaddr *>(&saddr), sizeof(saddr)));
+    std::cerr << "Attempting to connect to `" << server_ip << ":" << port << "`..." << std::endl;
+    dmtr_qtoken_t qt = 0;
+    DMTR_OK(dmtr_connect(&qt, qd, reinterpret_cast<struct sockaddr *>(&saddr), sizeof(saddr)));
+    DMTR_OK(dmtr_wait(NULL, qt));
 #else
     sga.sga_addr = saddr;
-    sga.sga_addrlen = sizeof(saddr);
 #endif
 
-    for (size_t i = 0; i < iterations; i++) {
-        dmtr_qtoken_t qt;
-        auto t0 = boost::chrono::steady_clock::now();
-        DMTR_OK(dmtr_push(&qt, qd, &sga));
-        DMTR_OK(dmtr_wait(NULL, qt));
-        //fprintf(stderr, "send complete.\n");
+    // every request sends the same buffer, so there's nothing to release
+    // once a push is done.
+    const dmtr_push_done_fn keep = [](dmtr_sgarray_t *, int, void *) {};
 
-        dmtr_qresult_t qr = {};
+    // requests are answered in order, unless datagrams are lost.
+    std::deque<boost::chrono::steady_clock::time_point> sent_at;
+    std::vector<dmtr_qtoken_t> tokens;
+    size_t sent = 0;
+    size_t received = 0;
+    auto start = boost::chrono::steady_clock::now();
+    while (sent < iterations && sent < WINDOW) {
+        DMTR_OK(dmtr_push_detached(qd, &sga, keep, NULL));
+        sent_at.push_back(boost::chrono::steady_clock::now());
+        ++sent;
+
+        dmtr_qtoken_t qt = 0;
         DMTR_OK(dmtr_pop(&qt, qd));
-        DMTR_OK(dmtr_wait(&qr, qt));
-        auto dt = boost::chrono::steady_clock::now() - t0;
-        DMTR_OK(dmtr_record_latency(latency, dt.count()));
-        assert(DMTR_OPC_POP == qr.qr_opcode);
-        assert(qr.qr_value.sga.sga_numsegs == 1);
-        assert(reinterpret_cast<uint8_t *>(qr.qr_value.sga.sga_segs[0].sgaseg_buf)[0] == FILL_CHAR);
-
-        //fprintf(stderr, "[%lu] client: rcvd\t%s\tbuf size:\t%d\n", i, reinterpret_cast<char *>(qr.qr_value.sga.sga_segs[0].sgaseg_buf), qr.qr_value.sga.sga_segs[0].sgaseg_len);
-        free(qr.qr_value.sga.sga_buf);
+        tokens.push_back(qt);
     }
 
+    dmtr_qresult_t ready[WINDOW];
+    int ready_offsets[WINDOW];
+    while (received < iterations) {
+        int num_ready = 0;
+        DMTR_OK(dmtr_wait_many(ready, ready_offsets, &num_ready, WINDOW, tokens.data(), tokens.size()));
+        for (int i = 0; i < num_ready; ++i) {
+            dmtr_qresult_t &qr = ready[i];
+            auto dt = boost::chrono::steady_clock::now() - sent_at.front();
+            sent_at.pop_front();
+            DMTR_OK(dmtr_record_latency(latency, dt.count()));
+            assert(DMTR_OPC_POP == qr.qr_opcode);
+            assert(qr.qr_value.sga.sga_numsegs == 1);
+            assert(reinterpret_cast<uint8_t *>(qr.qr_value.sga.sga_segs[0].sgaseg_buf)[0] == FILL_CHAR);
+
+            //fprintf(stderr, "client: rcvd\t%s\tbuf size:\t%d\n", reinterpret_cast<char *>(qr.qr_value.sga.sga_segs[0].sgaseg_buf), qr.qr_value.sga.sga_segs[0].sgaseg_len);
+            DMTR_OK(dmtr_sgafree(&qr.qr_value.sga));
+            ++received;
+
+            dmtr_qtoken_t &qt = tokens[ready_offsets[i]];
+            if (sent < iterations) {
+                DMTR_OK(dmtr_push_detached(qd, &sga, keep, NULL));
+                sent_at.push_back(boost::chrono::steady_clock::now());
+                ++sent;
+                DMTR_OK(dmtr_pop(&qt, qd));
+            } else {
+                // no more replies are expected on this token.
+                qt = 0;
+            }
+        }
+
+        // finished tokens are only removed once every result has been
+        // handled, so that the offsets above stay valid.
+        tokens.erase(std::remove(tokens.begin(), tokens.end(), static_cast<dmtr_qtoken_t>(0)), tokens.end());
+    }
+
+    auto elapsed = boost::chrono::duration_cast<boost::chrono::duration<double>>(boost::chrono::steady_clock::now() - start);
+    std::cerr << received << " datagrams echoed in " << elapsed.count() << " s ("
+              << static_cast<uint64_t>(received / elapsed.count()) << "/s)." << std::endl;
+
     DMTR_OK(dmtr_dump_latency(stderr, latency));
     DMTR_OK(dmtr_close(qd));
 
@@ -13,13 +13,19 @@
 #include <dmtr/annot.h>
 #include <dmtr/latency.h>
 #include <dmtr/libos.h>
+#include <dmtr/sga.h>
 #include <dmtr/wait.h>
 #include <iostream>
 #include <dmtr/libos/mem.h>
 #include <netinet/in.h>
 #include <signal.h>
+#include <vector>
 #include <yaml-cpp/yaml.h>
 
+// how many datagrams the server is ready to receive at any time; this is
+// also the most replies that go out together.
+#define MAX_READY 32
+
 int lqd = 0;
 dmtr_latency_t *pop_latency = NULL;
 dmtr_latency_t *push_latency = NULL;
@@ -60,7 +66,7 @@ int main(int argc, char *argv[])
     }
     saddr.sin_port = htons(port);
 
-    DMTR_OK(dmtr_init(dmtr_argc, dmtr_argv));
+    DMTR_OK(dmtr_init(argc, argv));
 
     DMTR_OK(dmtr_new_latency(&pop_latency, "pop"));
     DMTR_OK(dmtr_new_latency(&push_latency, "push"));
@@ -73,26 +79,35 @@ int main(int argc, char *argv[])
     if (signal(SIGINT, sig_handler) == SIG_ERR)
         std::cout << "\ncan't catch SIGINT\n";
 
+    std::vector<dmtr_qtoken_t> tokens(MAX_READY);
+    for (auto &qt : tokens) {
+        DMTR_OK(dmtr_pop(&qt, lqd));
+    }
+
+    dmtr_qresult_t ready[MAX_READY];
+    int ready_offsets[MAX_READY];
     while(1) {
-        dmtr_qresult_t qr = {};
-        dmtr_qtoken_t qt = 0;
+        int num_ready = 0;
         auto t0 = boost::chrono::steady_clock::now();
-        DMTR_OK(dmtr_pop(&qt, lqd));
-        DMTR_OK(dmtr_wait(&qr, qt));
+        DMTR_OK(dmtr_wait_many(ready, ready_offsets, &num_ready, MAX_READY, tokens.data(), tokens.size()));
         auto dt = boost::chrono::steady_clock::now() - t0;
         DMTR_OK(dmtr_record_latency(pop_latency, dt.count()));
-        assert(DMTR_OPC_POP == qr.qr_opcode);
-        assert(qr.qr_value.sga.sga_numsegs == 1);
-
-        //fprintf(stderr, "[%lu] server: rcvd\t%s\tbuf size:\t%d\n", i, reinterpret_cast<char *>(qr.qr_value.sga.sga_segs[0].sgaseg_buf), qr.qr_value.sga.sga_segs[0].sgaseg_len);
-        t0 = boost::chrono::steady_clock::now();
-        DMTR_OK(dmtr_push(&qt, lqd, &qr.qr_value.sga));
-        DMTR_OK(dmtr_wait(NULL, qt));
-        dt = boost::chrono::steady_clock::now() - t0;
-        DMTR_OK(dmtr_record_latency(push_latency, dt.count()));
-
-        //fprintf(stderr, "send complete.\n");
-        free(qr.qr_value.sga.sga_buf);
+
+        for (int i = 0; i < num_ready; ++i) {
+            dmtr_qresult_t &qr = ready[i];
+            assert(DMTR_OPC_POP == qr.qr_opcode);
+            assert(qr.qr_value.sga.sga_numsegs == 1);
+
+            //fprintf(stderr, "server: rcvd\t%s\tbuf size:\t%d\n", reinterpret_cast<char *>(qr.qr_value.sga.sga_segs[0].sgaseg_buf), qr.qr_value.sga.sga_segs[0].sgaseg_len);
+            // the reply goes back to where the datagram came from (`sga_addr`);
+            // the buffer is freed once it's sent.
+            t0 = boost::chrono::steady_clock::now();
+            DMTR_OK(dmtr_push_detached(lqd, &qr.qr_value.sga, NULL, NULL));
+            dt = boost::chrono::steady_clock::now() - t0;
+            DMTR_OK(dmtr_record_latency(push_latency, dt.count()));
+
+            DMTR_OK(dmtr_pop(&tokens[ready_offsets[i]], lqd));
+        }
     }
 
     return 0;
@@ -7,6 +7,7 @@
 #include <cstring>
 #include <dmtr/annot.h>
 #include <dmtr/libos.h>
+#include <dmtr/sga.h>
 #include <dmtr/wait.h>
 #include <iostream>
 #include <dmtr/libos/mem.h>
@@ -65,7 +66,7 @@ int main(int argc, char *argv[])
         assert(reinterpret_cast<uint8_t *>(qr.qr_value.sga.sga_segs[0].sgaseg_buf)[0] == FILL_CHAR);
 
         /*fprintf(stderr, "[%lu] client: rcvd\t%s\tbuf size:\t%d\n", i, reinterpret_cast<char *>(qr.qr_value.sga.sga_segs[0].sgaseg_buf), qr.qr_value.sga.sga_segs[0].sgaseg_len);*/
-        free(qr.qr_value.sga.sga_buf);
+        DMTR_OK(dmtr_sgafree(&qr.qr_value.sga));
     }
 
     DMTR_OK(dmtr_dump_timer(stderr, timer));
@@ -0,0 +1,137 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+#include <dmtr/libos/buffer_pool.hh>
+
+#include <dmtr/annot.h>
+#include <dmtr/libos/mem.h>
+#include <cstdlib>
+
+#define MIN_CLASS_SHIFT static_cast<uint32_t>(6)
+#define MAX_CLASS_SHIFT static_cast<uint32_t>(20)
+// requests larger than the biggest class are allocated and freed directly.
+#define UNPOOLED_CLASS (MAX_CLASS_SHIFT - MIN_CLASS_SHIFT + 1)
+// how many bytes of free blocks each class keeps around.
+#define MAX_FREE_BYTES_PER_CLASS (static_cast<size_t>(4) << 20)
+#define BLOCK_MAGIC 0x706f6f6cu
+
+dmtr::buffer_pool::buffer_pool() :
+    my_free_blocks(UNPOOLED_CLASS)
+{
+    dmtr_sgapool_t::sp_free = &buffer_pool::sp_free;
+}
+
+dmtr::buffer_pool::~buffer_pool()
+{
+    release_free_blocks();
+}
+
+void dmtr::buffer_pool::release_free_blocks() {
+    std::lock_guard<std::mutex> lock(my_lock);
+    for (auto &blocks : my_free_blocks) {
+        for (auto *block : blocks) {
+            delete_block(block);
+        }
+
+        blocks.clear();
+    }
+}
+
+int dmtr::buffer_pool::size_class(uint32_t &class_out, size_t size) {
+    class_out = UNPOOLED_CLASS;
+    for (uint32_t shift = MIN_CLASS_SHIFT; shift <= MAX_CLASS_SHIFT; ++shift) {
+        if (size <= (static_cast<size_t>(1) << shift)) {
+            class_out = shift - MIN_CLASS_SHIFT;
+            return 0;
+        }
+    }
+
+    return 0;
+}
+
+size_t dmtr::buffer_pool::class_size(uint32_t size_class) {
+    return static_cast<size_t>(1) << (size_class + MIN_CLASS_SHIFT);
+}
+
+size_t dmtr::buffer_pool::max_free_blocks(uint32_t size_class) {
+    return MAX_FREE_BYTES_PER_CLASS / class_size(size_class);
+}
+
+int dmtr::buffer_pool::alloc(void *&buf_out, size_t size) {
+    buf_out = NULL;
+    DMTR_NONZERO(EINVAL, size);
+
+    uint32_t sc = 0;
+    DMTR_OK(size_class(sc, size));
+
+    void *block = NULL;
+    if (UNPOOLED_CLASS != sc) {
+        std::lock_guard<std::mutex> lock(my_lock);
+        auto &blocks = my_free_blocks[sc];
+        if (!blocks.empty()) {
+            block = blocks.back();
+            blocks.pop_back();
+        }
+    }
+
+    if (NULL == block) {
+        const size_t len = UNPOOLED_CLASS == sc ? size : class_size(sc);
+        DMTR_OK(new_block(block, sizeof(block_header) + len));
+    }
+
+    auto * const h = reinterpret_cast<block_header *>(block);
+    h->pool = this;
+    h->size_class = sc;
+    h->magic = BLOCK_MAGIC;
+    buf_out = h + 1;
+    return 0;
+}
+
+int dmtr::buffer_pool::free(void *buf) {
+    DMTR_NOTNULL(EINVAL, buf);
+
+    auto * const h = reinterpret_cast<block_header *>(buf) - 1;
+    DMTR_TRUE(EINVAL, BLOCK_MAGIC == h->magic);
+    DMTR_TRUE(EINVAL, this == h->pool);
+
+    const uint32_t sc = h->size_class;
+    if (UNPOOLED_CLASS != sc) {
+        std::lock_guard<std::mutex> lock(my_lock);
+        auto &blocks = my_free_blocks[sc];
+        if (blocks.size() < max_free_blocks(sc)) {
+            blocks.push_back(h);
+            return 0;
+        }
+    }
+
+    h->magic = 0;
+    delete_block(h);
+    return 0;
+}
+
+int dmtr::buffer_pool::alloc_sga(dmtr_sgarray_t &sga_out, size_t size) {
+    sga_out = {};
+    DMTR_TRUE(ERANGE, size <= UINT32_MAX);
+
+    void *buf = NULL;
+    DMTR_OK(alloc(buf, size));
+    sga_out.sga_buf = buf;
+    sga_out.sga_pool = this;
+    sga_out.sga_numsegs = 1;
+    sga_out.sga_segs[0].sgaseg_buf = buf;
+    sga_out.sga_segs[0].sgaseg_len = size;
+    return 0;
+}
+
+int dmtr::buffer_pool::new_block(void *&block_out, size_t size) {
+    return dmtr_malloc(&block_out, size);
+}
+
+void dmtr::buffer_pool::delete_block(void *block) {
+    std::free(block);
+}
+
+int dmtr::buffer_pool::sp_free(dmtr_sgapool_t *pool, void *buf) {
+    DMTR_NOTNULL(EINVAL, pool);
+    return static_cast<buffer_pool *>(pool)->free(buf);
+}
@@ -0,0 +1,223 @@
+// -*- mode: c++; c-file-style: "k&r"; c-basic-offset: 4 -*-
+
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+#include <dmtr/libos/channel_queue.hh>
+
+#include <algorithm>
+#include <dmtr/annot.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+std::mutex dmtr::channel_queue::our_pending_links_lock;
+dmtr::channel_queue::pending_links_type dmtr::channel_queue::our_pending_links;
+
+dmtr::channel_queue::link::~link()
+{
+    for (auto &p : pipes) {
+        if (-1 != p.event_fd) {
+            (void)::close(p.event_fd);
+        }
+    }
+}
+
+int dmtr::channel_queue::link::open_events() {
+    for (auto &p : pipes) {
+        p.event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (-1 == p.event_fd) {
+            return errno;
+        }
+    }
+
+    return 0;
+}
+
+dmtr::channel_queue::channel_queue(int qd) :
+    io_queue(MEMORY_Q, qd),
+    my_inbox(NULL),
+    my_outbox(NULL),
+    my_watching_flag(false),
+    my_good_flag(true)
+{}
+
+dmtr::channel_queue::~channel_queue()
+{
+    if (good()) {
+        (void)close();
+    }
+}
+
+int dmtr::channel_queue::new_object(std::unique_ptr<io_queue> &q_out, int qd, int core_id, int peer_core_id) {
+    q_out = NULL;
+    DMTR_TRUE(EINVAL, core_id >= 0);
+    DMTR_TRUE(EINVAL, peer_core_id >= 0);
+    DMTR_TRUE(EINVAL, core_id != peer_core_id);
+
+    std::unique_ptr<channel_queue> q(new channel_queue(qd));
+    DMTR_NOTNULL(ENOMEM, q);
+    DMTR_OK(q->attach(core_id, peer_core_id));
+    q_out = std::move(q);
+    return 0;
+}
+
+int dmtr::channel_queue::attach(int core_id, int peer_core_id) {
+    const auto key = std::make_pair(std::min(core_id, peer_core_id), std::max(core_id, peer_core_id));
+
+    {
+        std::lock_guard<std::mutex> lock(our_pending_links_lock);
+        auto &pending = our_pending_links[key];
+        // the n-th channel one core opens to another is paired with the
+        // n-th one opened in the other direction.
+        if (!pending.empty() && pending.front()->creator_core_id == peer_core_id) {
+            my_link = pending.front();
+            pending.pop_front();
+            if (pending.empty()) {
+                our_pending_links.erase(key);
+            }
+        } else {
+            std::shared_ptr<link> l = std::make_shared<link>(core_id);
+            DMTR_OK(l->open_events());
+            my_link = l;
+            pending.push_back(my_link);
+        }
+    }
+
+    const int side = core_id < peer_core_id ? 0 : 1;
+    my_inbox = &my_link->pipes[side];
+    my_outbox = &my_link->pipes[1 - side];
+    return 0;
+}
+
+int dmtr::channel_queue::push(dmtr_qtoken_t qt, const dmtr_sgarray_t &sga) {
+    DMTR_TRUE(EINVAL, good());
+    DMTR_TRUE(ECONNABORTED, !my_link->closed_flag);
+
+    DMTR_OK(new_task(qt, DMTR_OPC_PUSH, sga));
+    bool was_empty_flag = false;
+    {
+        std::lock_guard<std::mutex> lock(my_outbox->lock);
+        was_empty_flag = my_outbox->messages.empty();
+        my_outbox->messages.push_back(sga);
+    }
+
+    // the peer has taken everything before this one, so it may be asleep.
+    if (was_empty_flag) {
+        signal_event(my_outbox->event_fd);
+    }
+
+    task *t = NULL;
+    DMTR_OK(get_task(t, qt));
+    DMTR_OK(t->complete(0, sga));
+    return 0;
+}
+
+int dmtr::channel_queue::pop(dmtr_qtoken_t qt) {
+    DMTR_TRUE(EINVAL, good());
+
+    DMTR_OK(new_task(qt, DMTR_OPC_POP));
+    my_pops.push(qt);
+    return 0;
+}
+
+int dmtr::channel_queue::poll(dmtr_qresult_t &qr_out, dmtr_qtoken_t qt) {
+    DMTR_TRUE(EINVAL, good());
+
+    int ret = service();
+    if (0 != ret && EAGAIN != ret) {
+        DMTR_FAIL(ret);
+    }
+
+    task *t = NULL;
+    DMTR_OK(get_task(t, qt));
+    return t->poll(qr_out);
+}
+
+int dmtr::channel_queue::service() {
+    if (!good()) {
+        return 0;
+    }
+
+    // reset before looking, so that a push that comes in after we've
+    // looked wakes us up again.
+    if (my_watching_flag) {
+        reset_event(my_inbox->event_fd);
+    }
+
+    while (!my_pops.empty()) {
+        dmtr_sgarray_t sga = {};
+        {
+            std::lock_guard<std::mutex> lock(my_inbox->lock);
+            if (my_inbox->messages.empty()) {
+                break;
+            }
+
+            sga = my_inbox->messages.front();
+            my_inbox->messages.pop_front();
+        }
+
+        task *t = NULL;
+        DMTR_OK(get_task(t, my_pops.front()));
+        my_pops.pop();
+        DMTR_OK(t->complete(0, sga));
+    }
+
+    if (my_pops.empty()) {
+        return 0;
+    }
+
+    if (my_link->closed_flag) {
+        // messages pushed before the peer closed its end are delivered
+        // first.
+        std::lock_guard<std::mutex> lock(my_inbox->lock);
+        if (my_inbox->messages.empty()) {
+            while (!my_pops.empty()) {
+                task *t = NULL;
+                DMTR_OK(get_task(t, my_pops.front()));
+                my_pops.pop();
+                DMTR_OK(t->complete(ECONNABORTED));
+            }
+
+            return 0;
+        }
+    }
+
+    // the peer runs on another core and can't schedule this queue; it
+    // signals the inbox instead.
+    if (my_watching_flag) {
+        return 0;
+    }
+
+    const int ret = watch(my_inbox->event_fd);
+    if (ENOTSUP == ret) {
+        // nothing would wake us, so a waiting pop keeps the queue runnable.
+        return EAGAIN;
+    }
+
+    DMTR_OK(ret);
+    my_watching_flag = true;
+    // a push may have come in before we were watching.
+    return EAGAIN;
+}
+
+int dmtr::channel_queue::close() {
+    DMTR_TRUE(EINVAL, good());
+
+    my_good_flag = false;
+    my_link->closed_flag = true;
+    // the peer's pops fail once it notices.
+    signal_event(my_outbox->event_fd);
+    if (my_watching_flag) {
+        (void)unwatch(my_inbox->event_fd);
+        my_watching_flag = false;
+    }
+
+    while (!my_pops.empty()) {
+        task *t = NULL;
+        DMTR_OK(get_task(t, my_pops.front()));
+        my_pops.pop();
+        DMTR_OK(t->complete(ECONNABORTED));
+    }
+
+    return 0;
+}
@@ -0,0 +1,38 @@
+// -*- mode: c++; c-file-style: "k&r"; c-basic-offset: 4 -*-
+
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+#include <dmtr/libos/config.hh>
+
+#include <boost/program_options.hpp>
+#include <dmtr/annot.h>
+#include <string>
+#include <unistd.h>
+
+namespace bpo = boost::program_options;
+
+int dmtr::load_config(YAML::Node &config_out, int argc, char *argv[]) {
+    config_out = YAML::Node();
+    DMTR_TRUE(ERANGE, argc >= 0);
+    if (0 == argc) {
+        return 0;
+    }
+    DMTR_NOTNULL(EINVAL, argv);
+
+    std::string config_path;
+    bpo::options_description desc("Allowed options");
+    desc.add_options()
+        ("config-path,r", bpo::value<std::string>(&config_path)->default_value("./config.yaml"), "specify configuration file");
+
+    bpo::variables_map vm;
+    bpo::store(bpo::command_line_parser(argc, argv).options(desc).allow_unregistered().run(), vm);
+    bpo::notify(vm);
+
+    if (access(config_path.c_str(), R_OK) == -1) {
+        return 0;
+    }
+
+    config_out = YAML::LoadFile(config_path);
+    return 0;
+}
@@ -5,34 +5,50 @@
 
 #include <cerrno>
 #include <dmtr/annot.h>
+#include <dmtr/libos/io_queue_api.hh>
+#include <dmtr/sga.h>
 #include <fcntl.h>
 #include <sstream>
+#include <unistd.h>
 
-
+dmtr::buffer_pool dmtr::io_queue::our_buffer_pool;
 
 dmtr::io_queue::task::task() :
-    valid(false),
+    my_state(FREE),
+    my_dropped_flag(false),
+    my_detached_flag(false),
+    my_push_done(NULL),
+    my_push_done_arg(NULL),
+    my_generation(0),
+    my_next_free(TASK_SLAB_NIL),
     my_qr{},
     my_error(EAGAIN),
     my_sga_arg{},
-    my_queue_arg(nullptr)
+    my_queue_arg(nullptr),
+    my_owner(nullptr)
 {}
 
 int dmtr::io_queue::task::initialize(io_queue &q,  dmtr_qtoken_t qt, dmtr_opcode_t opcode) {
     DMTR_NONZERO(EINVAL, qt);
     DMTR_TRUE(EINVAL, DMTR_OPC_INVALID != opcode);
-    DMTR_TRUE(EINVAL, valid == false);
+    DMTR_TRUE(EINVAL, RESERVED == my_state);
+    // nothing from the slot's previous task may show through.
+    my_qr = {};
     DMTR_OK(initialize_result(my_qr, q.qd(), qt));
-    
+
     my_qr.qr_opcode = opcode;
     my_error = EAGAIN;
-    valid = true;
+    my_sga_arg = {};
+    my_queue_arg = nullptr;
+    my_owner = &q;
+    my_state = VALID;
 
     return 0;
 }
 
 int dmtr::io_queue::task::initialize(io_queue &q, dmtr_qtoken_t qt, dmtr_opcode_t opcode, const dmtr_sgarray_t &arg) {
     DMTR_NONZERO(EINVAL, arg.sga_numsegs);
+    DMTR_TRUE(EINVAL, arg.sga_numsegs <= DMTR_SGARRAY_MAXSIZE);
     DMTR_OK(initialize(q, qt, opcode));
     my_sga_arg = arg;
     return 0;
@@ -83,12 +99,14 @@ bool dmtr::io_queue::task::arg(io_queue *&arg_out) const {
 }
 
 dmtr::io_queue::io_queue(enum category_id cid, int qd) :
+    my_task_capacity(0),
+    my_free_task(TASK_SLAB_NIL),
+    my_token_epoch(0),
+    my_api(nullptr),
+    my_scheduled_flag(false),
     my_cid(cid),
-    my_qd(qd),
-    my_qt_counter(0)
-{
-    //my_tasks.reserve(5);
-}
+    my_qd(qd)
+{}
 
 dmtr::io_queue::~io_queue()
 {
@@ -146,6 +164,119 @@ int dmtr::io_queue::drop(dmtr_qtoken_t qt)
     return 0;
 }
 
+int dmtr::io_queue::pop(dmtr_qtoken_t qt, size_t count) {
+    return ENOTSUP;
+}
+
+int dmtr::io_queue::lseek(off_t offset, int whence) {
+    return ENOTSUP;
+}
+
+int dmtr::io_queue::push_file(dmtr_qtoken_t qt, io_queue &file_q, off_t offset, size_t count) {
+    return ENOTSUP;
+}
+
+int dmtr::io_queue::push_batch(const dmtr_qtoken_t qts[], const dmtr_sgarray_t sgas[], int count) {
+    for (int i = 0; i < count; ++i) {
+        DMTR_OK(push(qts[i], sgas[i]));
+    }
+
+    return 0;
+}
+
+int dmtr::io_queue::pop_batch(const dmtr_qtoken_t qts[], int count) {
+    for (int i = 0; i < count; ++i) {
+        DMTR_OK(pop(qts[i]));
+    }
+
+    return 0;
+}
+
+int dmtr::io_queue::push_detached(const dmtr_sgarray_t &sga, dmtr_push_done_fn done, void *arg) {
+    dmtr_qtoken_t qt = 0;
+    DMTR_OK(new_qtoken(qt));
+    int ret = push(qt, sga);
+    if (0 != ret) {
+        (void)drop(qt);
+        DMTR_FAIL(ret);
+    }
+
+    task *t = NULL;
+    DMTR_OK(get_task(t, qt));
+    if (t->done()) {
+        dmtr_sgarray_t done_sga = t->my_sga_arg;
+        const int error = t->my_error;
+        DMTR_OK(drop(qt));
+        finish_detached_push(done_sga, error, done, arg);
+        return 0;
+    }
+
+    t->my_detached_flag = true;
+    t->my_push_done = done;
+    t->my_push_done_arg = arg;
+    return drop(qt);
+}
+
+void dmtr::io_queue::finish_detached_push(dmtr_sgarray_t &sga, int error, dmtr_push_done_fn done, void *arg) {
+    if (NULL == done) {
+        (void)dmtr_sgafree(&sga);
+    } else {
+        done(&sga, error, arg);
+    }
+}
+
+int dmtr::io_queue::sgaalloc(dmtr_sgarray_t &sga_out, size_t size) {
+    return our_buffer_pool.alloc_sga(sga_out, size);
+}
+
+int dmtr::io_queue::service() {
+    return ENOTSUP;
+}
+
+void dmtr::io_queue::schedule() {
+    if (NULL != my_api) {
+        my_api->schedule(*this);
+    }
+}
+
+void dmtr::io_queue::on_complete(dmtr_qtoken_t qt) {
+    if (NULL != my_api) {
+        my_api->on_complete(qt);
+    }
+}
+
+void dmtr::io_queue::discard_queue(io_queue &q) {
+    if (NULL != my_api) {
+        my_api->discard_queue(q.qd());
+    }
+}
+
+int dmtr::io_queue::watch(int fd) {
+    if (NULL == my_api) {
+        return ENOTSUP;
+    }
+
+    return my_api->watch(fd, my_qd);
+}
+
+int dmtr::io_queue::unwatch(int fd) {
+    if (NULL == my_api) {
+        return ENOTSUP;
+    }
+
+    return my_api->watch(fd, 0);
+}
+
+void dmtr::io_queue::signal_event(int fd) {
+    const uint64_t one = 1;
+    (void)::write(fd, &one, sizeof(one));
+}
+
+void dmtr::io_queue::reset_event(int fd) {
+    uint64_t n = 0;
+    (void)::read(fd, &n, sizeof(n));
+}
+
 int dmtr::io_queue::set_non_blocking(int fd) {
     ////printf("Set non blocking\n");
     int ret = fcntl(fd, F_GETFL);
@@ -163,104 +294,213 @@ int dmtr::io_queue::set_non_blocking(int fd) {
 
 
 int dmtr::io_queue::new_qtoken(dmtr_qtoken_t &qt_out) {
+    qt_out = 0;
     DMTR_TRUE(EINVAL, my_qd != 0);
 
-    uint32_t u = ++my_qt_counter;
-    if (u == UINT32_MAX) {
-        DMTR_PANIC("Queue token overflow");
+    if (TASK_SLAB_NIL == my_free_task) {
+        DMTR_OK(grow_task_slab());
     }
 
-    while (has_task(u)) {
-        //printf("finding another task slot and token\n");
-        u = ++my_qt_counter;
-        if (u == UINT32_MAX) {
-            DMTR_PANIC("Queue token overflow");
-        }
-    }
+    uint32_t slot = my_free_task;
+    task * const t = task_at(slot);
+    DMTR_TRUE(ENOTSUP, task::FREE == t->my_state);
+    my_free_task = t->my_next_free;
+    t->my_next_free = TASK_SLAB_NIL;
+    t->my_state = task::RESERVED;
+    t->my_dropped_flag = false;
+
+    uint32_t u = slot | (t->my_generation << QT_SLOT_BITS);
     qt_out = static_cast<uint64_t>(u) | (static_cast<uint64_t>(my_qd) << QD_OFFSET);
-    //printf("Allocating qtoken: %lu\n", qt_out);
     return 0;
-    
+}
+
+int dmtr::io_queue::set_token_epoch(uint32_t epoch) {
+    // a queue descriptor may be reused once its queue is closed; starting
+    // the slot generations of the new queue at a different value makes it
+    // unlikely that a stale token issued by the previous queue resolves to
+    // one of the new queue's tasks.
+    DMTR_TRUE(EPERM, my_task_chunks.empty());
+    my_token_epoch = epoch;
+    return 0;
+}
+
+int dmtr::io_queue::grow_task_slab() {
+    // chunk `n` holds `TASK_CHUNK_BASE << n` tasks.
+    const uint32_t n = my_task_chunks.size();
+    const uint32_t chunk_size = TASK_CHUNK_BASE << n;
+    if (my_task_capacity + chunk_size - 1 > QT_SLOT_MASK) {
+        return ENOMEM;
+    }
+
+    std::unique_ptr<task[]> chunk(new task[chunk_size]);
+    DMTR_NOTNULL(ENOMEM, chunk);
+
+    // thread the new slots onto the free list in ascending order.
+    for (uint32_t i = 0; i < chunk_size; ++i) {
+        chunk[i].my_generation = my_token_epoch & QT_GENERATION_MASK;
+        chunk[i].my_next_free = (i + 1 < chunk_size) ? my_task_capacity + i + 1 : my_free_task;
+    }
+
+    my_free_task = my_task_capacity;
+    my_task_capacity += chunk_size;
+    my_task_chunks.push_back(std::move(chunk));
+    return 0;
+}
+
+dmtr::io_queue::task * dmtr::io_queue::task_at(uint32_t slot) {
+    // slots `[TASK_CHUNK_BASE * (2^n - 1), TASK_CHUNK_BASE * (2^(n + 1) - 1))`
+    // live in chunk `n`.
+    const uint32_t i = slot + TASK_CHUNK_BASE;
+    const uint32_t n = (31 - __builtin_clz(i)) - (31 - __builtin_clz(TASK_CHUNK_BASE));
+    return &my_task_chunks[n][i - (TASK_CHUNK_BASE << n)];
 }
 
 int dmtr::io_queue::new_task(dmtr_qtoken_t qt, dmtr_opcode_t opcode) {
-    DMTR_TRUE(EEXIST, !has_task(qt));
-    insert_task(qt);
-    DMTR_OK(get_task(qt)->initialize(*this, qt, opcode));
+    task *t = NULL;
+    DMTR_OK(reserved_task(t, qt));
+    DMTR_OK(t->initialize(*this, qt, opcode));
+    schedule();
     return 0;
 }
 
 int dmtr::io_queue::new_task(dmtr_qtoken_t qt, dmtr_opcode_t opcode, const dmtr_sgarray_t &arg) {
-    DMTR_TRUE(EEXIST, !has_task(qt));
-    insert_task(qt);
-    DMTR_OK(get_task(qt)->initialize(*this, qt, opcode, arg));
+    task *t = NULL;
+    DMTR_OK(reserved_task(t, qt));
+    DMTR_OK(t->initialize(*this, qt, opcode, arg));
+    schedule();
     return 0;
 }
 
 int dmtr::io_queue::new_task(dmtr_qtoken_t qt, dmtr_opcode_t opcode, io_queue *arg) {
-    DMTR_TRUE(EEXIST, !has_task(qt));
-    insert_task(qt);
-    DMTR_OK(get_task(qt)->initialize(*this, qt, opcode, arg));
+    task *t = NULL;
+    DMTR_OK(reserved_task(t, qt));
+    DMTR_OK(t->initialize(*this, qt, opcode, arg));
+    schedule();
     return 0;
 }
 
-void dmtr::io_queue::insert_task(dmtr_qtoken_t qt) {
-#ifndef MAX_TASKS
-    my_tasks.insert(std::make_pair(qt, task()));
-#endif
+int dmtr::io_queue::reserved_task(task *&t_out, dmtr_qtoken_t qt) {
+    t_out = NULL;
+    DMTR_TRUE(EINVAL, QT2QD(qt) == static_cast<uint64_t>(my_qd));
+
+    const uint32_t slot = qt & QT_SLOT_MASK;
+    DMTR_TRUE(ENOENT, slot < my_task_capacity);
+    task * const t = task_at(slot);
+    const uint32_t generation = (qt >> QT_SLOT_BITS) & QT_GENERATION_MASK;
+    DMTR_TRUE(ENOENT, t->my_generation == generation);
+    DMTR_TRUE(EEXIST, task::RESERVED == t->my_state);
+
+    t_out = t;
+    return 0;
 }
 
 bool dmtr::io_queue::has_task(dmtr_qtoken_t qt) {
-#ifdef MAX_TASKS
-    return get_task(qt)->is_valid();
-#else
-    auto it = my_tasks.find(qt);
-    return it != my_tasks.end();
-#endif
+    if (QT2QD(qt) != static_cast<uint64_t>(my_qd)) {
+        return false;
+    }
+
+    const uint32_t slot = qt & QT_SLOT_MASK;
+    if (slot >= my_task_capacity) {
+        return false;
+    }
+
+    const task * const t = task_at(slot);
+    const uint32_t generation = (qt >> QT_SLOT_BITS) & QT_GENERATION_MASK;
+    return t->my_generation == generation && t->is_valid();
 }
 
 int dmtr::io_queue::get_task(task *&t_out, dmtr_qtoken_t qt) {
+    t_out = NULL;
     DMTR_TRUE(ENOENT, has_task(qt));
-    t_out = get_task(qt);
-    DMTR_NOTNULL(ENOTSUP, t_out);
-    
+    t_out = task_at(qt & QT_SLOT_MASK);
     return 0;
-    // if (my_tasks[qt % MAX_TASKS].valid) {
-    //     t_out = &my_tasks[qt % MAX_TASKS];
-    //     return 0;
-    // } else {
-    //     return -1;
-    // }
 }
 
-dmtr::io_queue::task * dmtr::io_queue::get_task(dmtr_qtoken_t qt) {
-#ifdef MAX_TASKS
-    return &my_tasks[qt % MAX_TASKS];
-#else
-    return &my_tasks.find(qt)->second;
-#endif
+int dmtr::io_queue::result(dmtr_qresult_t &qr_out, dmtr_qtoken_t qt) {
+    task *t;
+    DMTR_OK(get_task(t, qt));
+    return t->poll(qr_out);
 }
+
+void dmtr::io_queue::free_task(uint32_t slot) {
+    task &t = *task_at(slot);
+    // bumping the generation invalidates every outstanding copy of the
+    // token that referred to this slot.
+    t.my_generation = (t.my_generation + 1) & QT_GENERATION_MASK;
+    t.my_state = task::FREE;
+    t.my_dropped_flag = false;
+    t.my_detached_flag = false;
+    t.my_queue_arg = nullptr;
+    t.my_next_free = my_free_task;
+    my_free_task = slot;
+}
+
 int dmtr::io_queue::drop_task(dmtr_qtoken_t qt) {
-    //printf("Dropping task %lx\n", qt);
-    get_task(qt)->clear();
-    return 0;
+    DMTR_TRUE(EINVAL, QT2QD(qt) == static_cast<uint64_t>(my_qd));
+
+    const uint32_t slot = qt & QT_SLOT_MASK;
+    DMTR_TRUE(ENOENT, slot < my_task_capacity);
+    task * const t = task_at(slot);
+    const uint32_t generation = (qt >> QT_SLOT_BITS) & QT_GENERATION_MASK;
+    DMTR_TRUE(ENOENT, t->my_generation == generation);
+    DMTR_TRUE(ENOENT, task::FREE != t->my_state && !t->my_dropped_flag);
+
+    switch (t->my_state) {
+        default:
+            DMTR_UNREACHABLE();
+        case task::RESERVED:
+            // the token was issued but the operation was never started.
+            free_task(slot);
+            return 0;
+        case task::VALID:
+            if (t->done()) {
+                free_task(slot);
+            } else {
+                // a coroutine may still be holding on to this task; it will
+                // be recycled when the operation completes.
+                t->my_dropped_flag = true;
+            }
+            return 0;
+    }
 }
 
 int dmtr::io_queue::task::complete(int error) {
     DMTR_TRUE(EINVAL, error != EAGAIN);
+    DMTR_NOTNULL(EINVAL, my_owner);
     my_error = error;
+    if (my_dropped_flag) {
+        if (my_detached_flag) {
+            finish_detached_push(my_sga_arg, error, my_push_done, my_push_done_arg);
+        }
+
+        // nobody is going to collect what a dropped pop received, so the
+        // buffers it was handed go back to where they came from.
+        if (0 == error && DMTR_OPC_POP == my_qr.qr_opcode) {
+            (void)dmtr_sgafree(&my_qr.qr_value.sga);
+        }
+
+        // the same goes for the queue of a dropped accept, whether or not
+        // a connection made it into it.
+        if (DMTR_OPC_ACCEPT == my_qr.qr_opcode && nullptr != my_queue_arg) {
+            my_owner->discard_queue(*my_queue_arg);
+        }
+
+        my_owner->free_task(my_qr.qr_qt & QT_SLOT_MASK);
+    } else {
+        my_owner->on_complete(my_qr.qr_qt);
+    }
     return 0;
 }
 
 int dmtr::io_queue::task::complete(int error, const dmtr_sgarray_t &sga) {
-    DMTR_OK(complete(error));
     my_qr.qr_value.sga = sga;
+    DMTR_OK(complete(error));
     return 0;
 }
 
 int dmtr::io_queue::task::complete(int error, int new_qd, const sockaddr_in &addr) {
-    DMTR_OK(complete(error));
     my_qr.qr_value.ares.qd = new_qd;
     my_qr.qr_value.ares.addr = addr;
+    DMTR_OK(complete(error));
     return 0;
 }
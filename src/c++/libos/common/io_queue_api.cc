@@ -3,17 +3,31 @@
 
 #include <dmtr/libos/io_queue_api.hh>
 
+#include <algorithm>
 #include <cassert>
 #include <cstdlib>
-#include <dmtr/annot.h>
+#include <cstring>
 #include <dmtr/annot.h>
 #include <dmtr/libos.h>
+#include <dmtr/libos/channel_queue.hh>
+#include <dmtr/libos/config.hh>
 #include <dmtr/libos/memory_queue.hh>
+#include <dmtr/libos/ring_queue.hh>
+#include <dmtr/libos/stack_pool.hh>
 #include <iostream>
 #include <unistd.h>
 
-dmtr::io_queue_api::io_queue_api() :
-    my_qd_counter(0)
+std::atomic<int> dmtr::io_queue_api::our_core_count(0);
+
+dmtr::io_queue_api::io_queue_api(int core_id) :
+    my_core_id(core_id),
+    // descriptor 0 is reserved to mean "no queue".
+    my_queues(1),
+    my_qd_epochs(1, 0),
+    my_completions_limit(MIN_COMPLETIONS_LIMIT),
+    my_poller(NULL),
+    my_watcher(NULL),
+    my_spin_budget(DEFAULT_SPIN_BUDGET_US)
 {}
 
 dmtr::io_queue_api::~io_queue_api()
@@ -22,7 +36,42 @@ dmtr::io_queue_api::~io_queue_api()
 int dmtr::io_queue_api::init(io_queue_api *&newobj_out, int argc, char *argv[]) {
     DMTR_NULL(EINVAL, newobj_out);
 
-    newobj_out = new io_queue_api();
+    int expected = 0;
+    DMTR_TRUE(EPERM, our_core_count.compare_exchange_strong(expected, 1));
+    std::unique_ptr<io_queue_api> api(new io_queue_api(0));
+    DMTR_OK(api->read_config(argc, argv));
+    newobj_out = api.release();
+    return 0;
+}
+
+int dmtr::io_queue_api::init_core(io_queue_api *&newobj_out, const io_queue_api &main) {
+    DMTR_NULL(EINVAL, newobj_out);
+    DMTR_TRUE(EINVAL, 0 == main.my_core_id);
+
+    const int core_id = our_core_count++;
+    DMTR_TRUE(ERANGE, core_id < MAX_CORES);
+    std::unique_ptr<io_queue_api> api(new io_queue_api(core_id));
+    api->my_spin_budget = main.my_spin_budget;
+    newobj_out = api.release();
+    return 0;
+}
+
+int dmtr::io_queue_api::read_config(int argc, char *argv[]) {
+    YAML::Node config;
+    DMTR_OK(load_config(config, argc, argv));
+    YAML::Node node = config["wait"]["spin_budget_us"];
+    if (YAML::NodeType::Scalar == node.Type()) {
+        my_spin_budget = boost::chrono::microseconds(node.as<uint64_t>());
+    }
+
+    YAML::Node stacks = config["coroutine"];
+    if (YAML::NodeType::Map == stacks.Type()) {
+        const size_t stack_size = stacks["stack_size"].as<size_t>(DEFAULT_STACK_SIZE);
+        const bool guard_page = stacks["guard_page"].as<bool>(true);
+        const size_t max_free_stacks = stacks["max_free_stacks"].as<size_t>(DEFAULT_MAX_FREE_STACKS);
+        DMTR_OK(stack_pool::instance().configure(stack_size, guard_page, max_free_stacks));
+    }
+
     return 0;
 }
 
@@ -31,34 +80,91 @@ int dmtr::io_queue_api::register_queue_ctor(enum io_queue::category_id cid, io_q
     return 0;
 }
 
+int dmtr::io_queue_api::register_poller(poller_type poller) {
+    DMTR_NOTNULL(EINVAL, poller);
+    DMTR_NULL(EEXIST, my_poller);
+
+    my_poller = poller;
+    return 0;
+}
+
+int dmtr::io_queue_api::register_watcher(watcher_type watcher) {
+    DMTR_NOTNULL(EINVAL, watcher);
+    DMTR_NULL(EEXIST, my_watcher);
+
+    my_watcher = watcher;
+    return 0;
+}
+
+int dmtr::io_queue_api::qd_index(size_t &index_out, int qd) const {
+    index_out = 0;
+
+    if (qd <= 0 || (qd >> QD_CORE_SHIFT) != my_core_id) {
+        return ENOENT;
+    }
+
+    const size_t i = qd & ((1 << QD_CORE_SHIFT) - 1);
+    if (0 == i || i >= my_queues.size()) {
+        return ENOENT;
+    }
+
+    index_out = i;
+    return 0;
+}
+
 int dmtr::io_queue_api::get_queue(io_queue *&q_out, int qd) const {
-    // q_out = NULL;
+    q_out = NULL;
 
-    // auto it = my_queues.find(qd);
-    // if (my_queues.cend() == it) {
-    //     return ENOENT;
-    // }
+    size_t i = 0;
+    if (0 != qd_index(i, qd)) {
+        return ENOENT;
+    }
+
+    q_out = my_queues[i].get();
+    if (NULL == q_out) {
+        return ENOENT;
+    }
 
-    // q_out = it->second.get();
-    q_out = my_queues[qd].get();
     return 0;
 }
 
-int dmtr::io_queue_api::new_qd() {
-    int qd = ++my_qd_counter;
-    if (qd > 256) {
-        DMTR_PANIC("Queue descriptor overflow");
+int dmtr::io_queue_api::new_qd(int &qd_out) {
+    qd_out = 0;
+
+    if (!my_free_qds.empty()) {
+        qd_out = my_free_qds.back();
+        my_free_qds.pop_back();
+        return 0;
     }
 
-    return qd;
+    // the index has to leave room for the core id.
+    DMTR_TRUE(EMFILE, my_queues.size() < (static_cast<size_t>(1) << QD_CORE_SHIFT));
+    qd_out = (my_core_id << QD_CORE_SHIFT) | static_cast<int>(my_queues.size());
+    my_queues.emplace_back();
+    my_qd_epochs.push_back(0);
+    return 0;
+}
+
+void dmtr::io_queue_api::free_qd(int qd) {
+    size_t i = 0;
+    if (0 == qd_index(i, qd)) {
+        ++my_qd_epochs[i];
+        my_free_qds.push_back(qd);
+    }
 }
 
 int dmtr::io_queue_api::new_queue(io_queue *&q_out, enum io_queue::category_id cid) {
     q_out = NULL;
 
-    int qd = new_qd();
+    int qd = 0;
+    DMTR_OK(new_qd(qd));
     std::unique_ptr<io_queue> qq;
-    DMTR_OK(my_queue_factory.construct(qq, cid, qd));
+    int ret = my_queue_factory.construct(qq, cid, qd);
+    if (0 != ret) {
+        free_qd(qd);
+        DMTR_FAIL(ret);
+    }
+
     io_queue * const q = qq.get();
     DMTR_OK(insert_queue(qq));
 
@@ -69,19 +175,35 @@ int dmtr::io_queue_api::new_queue(io_queue *&q_out, enum io_queue::category_id c
 int dmtr::io_queue_api::insert_queue(std::unique_ptr<io_queue> &q) {
     DMTR_NOTNULL(EINVAL, q);
 
-    int qd = q->qd();
-    my_queues[qd] = std::move(q);
+    size_t i = 0;
+    DMTR_TRUE(EINVAL, 0 == qd_index(i, q->qd()));
+    DMTR_NULL(EEXIST, my_queues[i]);
+    DMTR_OK(q->set_token_epoch(my_qd_epochs[i]));
+    q->my_api = this;
+    my_queues[i] = std::move(q);
     return 0;
 }
 
 int dmtr::io_queue_api::remove_queue(int qd) {
-    DMTR_TRUE(EINVAL, qd != 0);
-    DMTR_NOTNULL(ENOENT, my_queues[qd]);
+    size_t i = 0;
+    DMTR_TRUE(EINVAL, 0 == qd_index(i, qd));
+    DMTR_NOTNULL(ENOENT, my_queues[i]);
 
-    my_queues[qd] = NULL;
+    my_queues[i] = NULL;
+    free_qd(qd);
     return 0;
 }
 
+void dmtr::io_queue_api::discard_queue(int qd) {
+    io_queue *q = NULL;
+    if (0 != get_queue(q, qd)) {
+        return;
+    }
+
+    (void)q->close();
+    (void)remove_queue(qd);
+}
+
 int dmtr::io_queue_api::queue(int &qd_out) {
     qd_out = 0;
 
@@ -92,6 +214,63 @@ int dmtr::io_queue_api::queue(int &qd_out) {
     return 0;
 }
 
+int dmtr::io_queue_api::queue(int &qd_out, int flags, size_t capacity) {
+    qd_out = 0;
+    if (0 == flags) {
+        return queue(qd_out);
+    }
+
+    int qd = 0;
+    DMTR_OK(new_qd(qd));
+    std::unique_ptr<io_queue> q;
+    int ret = ring_queue::new_object(q, qd, flags, capacity);
+    if (0 != ret) {
+        free_qd(qd);
+        DMTR_FAIL(ret);
+    }
+
+    DMTR_OK(insert_queue(q));
+    qd_out = qd;
+    return 0;
+}
+
+int dmtr::io_queue_api::attach_queue(int &qd_out, int ring_qd) {
+    qd_out = 0;
+    DMTR_TRUE(EINVAL, ring_qd != 0);
+
+    int qd = 0;
+    DMTR_OK(new_qd(qd));
+    std::unique_ptr<io_queue> q;
+    int ret = ring_queue::attach(q, qd, ring_qd);
+    if (0 != ret) {
+        free_qd(qd);
+        DMTR_FAIL(ret);
+    }
+
+    DMTR_OK(insert_queue(q));
+    qd_out = qd;
+    return 0;
+}
+
+int dmtr::io_queue_api::channel(int &qd_out, int peer_core_id) {
+    qd_out = 0;
+    DMTR_TRUE(EINVAL, peer_core_id >= 0 && peer_core_id < MAX_CORES);
+    DMTR_TRUE(EINVAL, peer_core_id != my_core_id);
+
+    int qd = 0;
+    DMTR_OK(new_qd(qd));
+    std::unique_ptr<io_queue> q;
+    int ret = channel_queue::new_object(q, qd, my_core_id, peer_core_id);
+    if (0 != ret) {
+        free_qd(qd);
+        DMTR_FAIL(ret);
+    }
+
+    DMTR_OK(insert_queue(q));
+    qd_out = qd;
+    return 0;
+}
+
 int dmtr::io_queue_api::socket(int &qd_out, int domain, int type, int protocol) {
     qd_out = 0;
 
@@ -135,15 +314,24 @@ int dmtr::io_queue_api::accept(dmtr_qtoken_t &qtok_out, int sockqd) {
     io_queue *sockq = NULL;
     DMTR_OK(get_queue(sockq, sockqd));
 
-    int qd = new_qd();
     dmtr_qtoken_t qt = 0;
-
     DMTR_OK(sockq->new_qtoken(qt));
-    //printf("accept: allocate a new q token%lu %lu\n", qt, qt % MAX_TASKS);
-    //printf("accept: done allocating\n");
-    
+
+    int qd = 0;
+    int ret = new_qd(qd);
+    if (0 != ret) {
+        (void)sockq->drop(qt);
+        DMTR_FAIL(ret);
+    }
+
     std::unique_ptr<io_queue> q;
-    DMTR_OK(sockq->accept(q, qt, qd));
+    ret = sockq->accept(q, qt, qd);
+    if (0 != ret) {
+        (void)sockq->drop(qt);
+        free_qd(qd);
+        DMTR_FAIL(ret);
+    }
+
     DMTR_OK(insert_queue(q));
     qtok_out = qt;
     return 0;
@@ -166,12 +354,12 @@ int dmtr::io_queue_api::connect(dmtr_qtoken_t &qtok_out, int qd, const struct so
     DMTR_OK(get_queue(q, qd));
     dmtr_qtoken_t qt = 0;
     DMTR_OK(q->new_qtoken(qt));
-    //printf("connect: allocate a new q token:%lu %lu\n",qt,qt%MAX_TASKS);
-    //printf("connect: done allocating\n");
     qtok_out = qt;
     int ret = q->connect(qt, saddr, size);
     switch (ret) {
         default:
+            (void)q->drop(qt);
+            qtok_out = 0;
             DMTR_FAIL(ret);
         case ECONNREFUSED:
             return ret;
@@ -268,14 +456,24 @@ int dmtr::io_queue_api::push(dmtr_qtoken_t &qtok_out, int qd, const dmtr_sgarray
     DMTR_OK(get_queue(q, qd));
     dmtr_qtoken_t qt;
     DMTR_OK(q->new_qtoken(qt));
-    //printf("push: allocate a new q token: %lu %lu\n",qt, qt%MAX_TASKS);
-     //printf("push: done allocating\n");
-    DMTR_OK(q->push(qt, sga));
+    int ret = q->push(qt, sga);
+    if (0 != ret) {
+        (void)q->drop(qt);
+        DMTR_FAIL(ret);
+    }
 
     qtok_out = qt;
     return 0;
 }
 
+int dmtr::io_queue_api::push_detached(int qd, const dmtr_sgarray_t &sga, dmtr_push_done_fn done, void *arg) {
+    DMTR_TRUE(EINVAL, qd != 0);
+
+    io_queue *q = NULL;
+    DMTR_OK(get_queue(q, qd));
+    return q->push_detached(sga, done, arg);
+}
+
 int dmtr::io_queue_api::pop(dmtr_qtoken_t &qtok_out, int qd) {
     qtok_out = 0;
     DMTR_TRUE(EINVAL, qd != 0);
@@ -284,14 +482,133 @@ int dmtr::io_queue_api::pop(dmtr_qtoken_t &qtok_out, int qd) {
     DMTR_OK(get_queue(q, qd));
     dmtr_qtoken_t qt;
     DMTR_OK(q->new_qtoken(qt));
-    //printf("pop: allocate a new q token: %lu %lu\n",qt, qt % MAX_TASKS);
-    //printf("pop: done allocating\n");
-    DMTR_OK(q->pop(qt));
+    int ret = q->pop(qt);
+    if (0 != ret) {
+        (void)q->drop(qt);
+        DMTR_FAIL(ret);
+    }
+
+    qtok_out = qt;
+    return 0;
+}
+
+int dmtr::io_queue_api::pop(dmtr_qtoken_t &qtok_out, int qd, size_t count) {
+    qtok_out = 0;
+    DMTR_TRUE(EINVAL, qd != 0);
+    DMTR_NONZERO(EINVAL, count);
+
+    io_queue *q = NULL;
+    DMTR_OK(get_queue(q, qd));
+    dmtr_qtoken_t qt;
+    DMTR_OK(q->new_qtoken(qt));
+    int ret = q->pop(qt, count);
+    if (0 != ret) {
+        (void)q->drop(qt);
+        DMTR_FAIL(ret);
+    }
 
     qtok_out = qt;
     return 0;
 }
 
+int dmtr::io_queue_api::lseek(int qd, off_t offset, int whence) {
+    DMTR_TRUE(EINVAL, qd != 0);
+
+    io_queue *q = NULL;
+    DMTR_OK(get_queue(q, qd));
+    return q->lseek(offset, whence);
+}
+
+int dmtr::io_queue_api::push_file(dmtr_qtoken_t &qtok_out, int qd, int file_qd, off_t offset, size_t count) {
+    qtok_out = 0;
+    DMTR_TRUE(EINVAL, qd != 0);
+    DMTR_TRUE(EINVAL, file_qd != 0);
+    DMTR_TRUE(EINVAL, offset >= 0);
+
+    io_queue *q = NULL;
+    DMTR_OK(get_queue(q, qd));
+    io_queue *file_q = NULL;
+    DMTR_OK(get_queue(file_q, file_qd));
+    DMTR_TRUE(EINVAL, io_queue::FILE_Q == file_q->cid());
+    dmtr_qtoken_t qt;
+    DMTR_OK(q->new_qtoken(qt));
+    int ret = q->push_file(qt, *file_q, offset, count);
+    if (0 != ret) {
+        (void)q->drop(qt);
+        DMTR_FAIL(ret);
+    }
+
+    qtok_out = qt;
+    return 0;
+}
+
+int dmtr::io_queue_api::new_qtokens(dmtr_qtoken_t qts_out[], io_queue &q, int count) {
+    for (int i = 0; i < count; ++i) {
+        int ret = q.new_qtoken(qts_out[i]);
+        if (0 != ret) {
+            drop_qtokens(qts_out, q, i);
+            DMTR_FAIL(ret);
+        }
+    }
+
+    return 0;
+}
+
+void dmtr::io_queue_api::drop_qtokens(dmtr_qtoken_t qts[], io_queue &q, int count) {
+    // operations that were already started are recycled once they
+    // complete.
+    for (int i = 0; i < count; ++i) {
+        (void)q.drop(qts[i]);
+        qts[i] = 0;
+    }
+}
+
+int dmtr::io_queue_api::push_batch(dmtr_qtoken_t qtoks_out[], int qd, const dmtr_sgarray_t sgas[], int count) {
+    DMTR_NOTNULL(EINVAL, qtoks_out);
+    DMTR_NOTNULL(EINVAL, sgas);
+    DMTR_TRUE(EINVAL, count > 0);
+    std::fill(qtoks_out, qtoks_out + count, 0);
+    DMTR_TRUE(EINVAL, qd != 0);
+
+    io_queue *q = NULL;
+    DMTR_OK(get_queue(q, qd));
+    DMTR_OK(new_qtokens(qtoks_out, *q, count));
+    int ret = q->push_batch(qtoks_out, sgas, count);
+    if (0 != ret) {
+        drop_qtokens(qtoks_out, *q, count);
+        DMTR_FAIL(ret);
+    }
+
+    return 0;
+}
+
+int dmtr::io_queue_api::pop_batch(dmtr_qtoken_t qtoks_out[], int qd, int count) {
+    DMTR_NOTNULL(EINVAL, qtoks_out);
+    DMTR_TRUE(EINVAL, count > 0);
+    std::fill(qtoks_out, qtoks_out + count, 0);
+    DMTR_TRUE(EINVAL, qd != 0);
+
+    io_queue *q = NULL;
+    DMTR_OK(get_queue(q, qd));
+    DMTR_OK(new_qtokens(qtoks_out, *q, count));
+    int ret = q->pop_batch(qtoks_out, count);
+    if (0 != ret) {
+        drop_qtokens(qtoks_out, *q, count);
+        DMTR_FAIL(ret);
+    }
+
+    return 0;
+}
+
+int dmtr::io_queue_api::sgaalloc(dmtr_sgarray_t &sga_out, int qd, size_t size) {
+    sga_out = {};
+    DMTR_TRUE(EINVAL, qd != 0);
+
+    io_queue *q = NULL;
+    DMTR_OK(get_queue(q, qd));
+    return q->sgaalloc(sga_out, size);
+}
+
 int dmtr::io_queue_api::poll(dmtr_qresult_t *qr_out, dmtr_qtoken_t qt) {
     DMTR_TRUE(EINVAL, qt != 0);
 
@@ -310,7 +627,10 @@ int dmtr::io_queue_api::poll(dmtr_qresult_t *qr_out, dmtr_qtoken_t qt) {
         default:
             on_poll_failure(qr_out, this);
             DMTR_FAIL(ret);
+        // `*qr_out` isn't filled in until the operation completes, so it
+        // may still hold the result of an earlier one.
         case EAGAIN:
+            return ret;
         case ECONNABORTED:
         case ECONNRESET:
         case ETIMEDOUT:
@@ -357,3 +677,327 @@ int dmtr::io_queue_api::drop(dmtr_qtoken_t qt) {
     DMTR_OK(get_queue(q, qd));
     return q->drop(qt);
 }
+
+void dmtr::io_queue_api::schedule(io_queue &q) {
+    // without a poller, queues are only ever driven by polling their
+    // tokens, so there is no point in keeping track of them.
+    if (NULL == my_poller || q.my_scheduled_flag) {
+        return;
+    }
+
+    q.my_scheduled_flag = true;
+    my_runnable_qds.push_back(q.qd());
+}
+
+int dmtr::io_queue_api::watch(int fd, int qd) {
+    // without a watcher, the queue has to stay runnable instead.
+    if (NULL == my_watcher) {
+        return ENOTSUP;
+    }
+
+    return my_watcher(fd, qd);
+}
+
+void dmtr::io_queue_api::on_complete(dmtr_qtoken_t qt) {
+    // applications that only ever wait on individual tokens never consume
+    // the completion queue, so it gets rid of stale entries whenever it
+    // has doubled in size.
+    if (my_completions.size() >= my_completions_limit) {
+        prune_completions();
+        my_completions_limit = std::max(MIN_COMPLETIONS_LIMIT, 2 * my_completions.size());
+    }
+
+    my_completions.push_back(qt);
+}
+
+bool dmtr::io_queue_api::is_complete(dmtr_qtoken_t qt) const {
+    io_queue *q = NULL;
+    if (0 != get_queue(q, qttoqd(qt))) {
+        return false;
+    }
+
+    dmtr_qresult_t unused_qr = {};
+    return q->has_task(qt) && EAGAIN != q->result(unused_qr, qt);
+}
+
+void dmtr::io_queue_api::prune_completions() {
+    auto end = std::remove_if(my_completions.begin(), my_completions.end(), [this](dmtr_qtoken_t qt) {
+        return !is_complete(qt);
+    });
+    my_completions.erase(end, my_completions.end());
+}
+
+void dmtr::io_queue_api::sync_wait_set(dmtr_qtoken_t qts[], int num_qts) {
+    const size_t n = num_qts;
+    const size_t m = std::min(n, my_wait_set.size());
+    // between two waits, usually only a handful of tokens change, so we skip
+    // over unchanged blocks of the array as quickly as we can.
+    for (size_t i = 0; i < m; i += WAIT_SET_BLOCK) {
+        const size_t len = std::min(WAIT_SET_BLOCK, m - i);
+        if (0 == memcmp(&my_wait_set[i], &qts[i], len * sizeof(dmtr_qtoken_t))) {
+            continue;
+        }
+
+        for (size_t j = i; j < i + len; ++j) {
+            if (my_wait_set[j] != qts[j]) {
+                update_wait_set(j, qts[j]);
+            }
+        }
+    }
+
+    for (size_t i = n; i < my_wait_set.size(); ++i) {
+        update_wait_set(i, 0);
+    }
+
+    my_wait_set.resize(n, 0);
+    for (size_t i = m; i < n; ++i) {
+        update_wait_set(i, qts[i]);
+    }
+}
+
+void dmtr::io_queue_api::update_wait_set(size_t i, dmtr_qtoken_t qt) {
+    if (0 != my_wait_set[i]) {
+        auto it = my_wait_offsets.find(my_wait_set[i]);
+        if (my_wait_offsets.end() != it && static_cast<size_t>(it->second) == i) {
+            my_wait_offsets.erase(it);
+        }
+    }
+
+    my_wait_set[i] = qt;
+    if (0 == qt) {
+        return;
+    }
+
+    my_wait_offsets[qt] = i;
+    // the token may have completed while we weren't waiting on it, in
+    // which case its entry in the completion queue has already been passed
+    // over.
+    if (is_complete(qt)) {
+        my_completions.push_back(qt);
+    }
+}
+
+bool dmtr::io_queue_api::next_pass(int &block_ms_out, const boost::chrono::steady_clock::time_point &t0, int timeout_ms) const {
+    block_ms_out = 0;
+
+    const auto elapsed = boost::chrono::steady_clock::now() - t0;
+    const auto timeout = boost::chrono::milliseconds(timeout_ms);
+    if (timeout_ms >= 0 && elapsed >= timeout) {
+        return false;
+    }
+
+    // spin for a while before blocking, so that a busy application
+    // doesn't pay for a wake-up on every completion.
+    if (NULL == my_poller || elapsed < my_spin_budget) {
+        return true;
+    }
+
+    if (timeout_ms < 0) {
+        block_ms_out = -1;
+    } else {
+        auto remaining = boost::chrono::duration_cast<boost::chrono::milliseconds>(timeout - elapsed);
+        block_ms_out = std::max<int>(1, remaining.count());
+    }
+
+    return true;
+}
+
+int dmtr::io_queue_api::advance(dmtr_qtoken_t qts[], int num_qts, int block_ms) {
+    if (NULL == my_poller) {
+        // we can't tell which queues are ready, so we have to drive every
+        // queue that we're waiting on.
+        for (int i = 0; i < num_qts; ++i) {
+            io_queue *q = NULL;
+            if (0 == qts[i] || 0 != get_queue(q, qttoqd(qts[i]))) {
+                continue;
+            }
+
+            dmtr_qresult_t unused_qr = {};
+            (void)q->poll(unused_qr, qts[i]);
+        }
+
+        return 0;
+    }
+
+    // queues that are already runnable have to be serviced before we can
+    // go to sleep.
+    DMTR_OK(my_poller(my_servicing_qds, my_runnable_qds.empty() ? block_ms : 0));
+    for (size_t i = 0; i < my_servicing_qds.size(); ++i) {
+        io_queue *q = NULL;
+        if (0 == get_queue(q, my_servicing_qds[i])) {
+            schedule(*q);
+        }
+    }
+    my_servicing_qds.clear();
+
+    my_servicing_qds.swap(my_runnable_qds);
+    int ret = 0;
+    for (size_t i = 0; i < my_servicing_qds.size(); ++i) {
+        io_queue *q = NULL;
+        // the queue may have been closed (and its descriptor reused) since
+        // it was scheduled.
+        if (0 != get_queue(q, my_servicing_qds[i]) || !q->my_scheduled_flag) {
+            continue;
+        }
+
+        q->my_scheduled_flag = false;
+        int service_ret = q->service();
+        switch (service_ret) {
+            default:
+                if (0 == ret) {
+                    ret = service_ret;
+                }
+                break;
+            case EAGAIN:
+                schedule(*q);
+                break;
+            case 0:
+                break;
+        }
+    }
+    my_servicing_qds.clear();
+
+    DMTR_OK(ret);
+    return 0;
+}
+
+int dmtr::io_queue_api::claim(dmtr_qresult_t &qr_out, dmtr_qtoken_t qt) {
+    io_queue *q = NULL;
+    DMTR_OK(get_queue(q, qttoqd(qt)));
+
+    int ret = q->result(qr_out, qt);
+    DMTR_TRUE(EINVAL, EAGAIN != ret);
+    DMTR_OK(q->drop(qt));
+    switch (ret) {
+        default:
+            on_poll_failure(&qr_out, this);
+            DMTR_FAIL(ret);
+        case ECONNABORTED:
+        case ECONNRESET:
+        case ETIMEDOUT:
+        case EBADF:
+            on_poll_failure(&qr_out, this);
+            return ret;
+        case 0:
+            return 0;
+    }
+}
+
+int dmtr::io_queue_api::reap(dmtr_qresult_t *qrs_out, int *ready_offsets, int &count_out, int max_qrs, bool all_flag) {
+    count_out = 0;
+
+    while (count_out < max_qrs && !my_completions.empty()) {
+        dmtr_qtoken_t qt = my_completions.front();
+        if (!is_complete(qt)) {
+            // the token has been dropped (or was already reported).
+            my_completions.pop_front();
+            continue;
+        }
+
+        int offset = -1;
+        if (!all_flag) {
+            auto it = my_wait_offsets.find(qt);
+            if (my_wait_offsets.end() == it) {
+                // not waited on; `sync_wait_set()` will find the token
+                // again if it shows up in a later wait.
+                my_completions.pop_front();
+                continue;
+            }
+
+            offset = it->second;
+        }
+
+        dmtr_qresult_t qr = {};
+        io_queue *q = NULL;
+        DMTR_OK(get_queue(q, qttoqd(qt)));
+        // a failure is reported on its own, so that the caller can tell
+        // which operation it belongs to.
+        if (0 != q->result(qr, qt) && count_out > 0) {
+            return 0;
+        }
+
+        my_completions.pop_front();
+        int ret = claim(qrs_out[count_out], qt);
+        if (NULL != ready_offsets) {
+            ready_offsets[count_out] = offset;
+        }
+        ++count_out;
+
+        if (0 != ret) {
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+int dmtr::io_queue_api::wait_many(dmtr_qresult_t *qrs_out, int *ready_offsets, int &count_out, int max_qrs, dmtr_qtoken_t qts[], int num_qts, int timeout_ms) {
+    count_out = 0;
+    DMTR_NOTNULL(EINVAL, qrs_out);
+    DMTR_TRUE(EINVAL, max_qrs > 0);
+    DMTR_TRUE(EINVAL, num_qts >= 0);
+    DMTR_TRUE(EINVAL, NULL != qts || 0 == num_qts);
+    // without a poller, there's nothing to drive the queues other than
+    // the tokens we're waiting on.
+    DMTR_TRUE(EINVAL, NULL != qts || NULL != my_poller);
+
+    const bool all_flag = (NULL == qts);
+    if (!all_flag) {
+        sync_wait_set(qts, num_qts);
+    }
+
+    const auto t0 = boost::chrono::steady_clock::now();
+    bool last_pass_flag = false;
+    while (1) {
+        int ret = reap(qrs_out, ready_offsets, count_out, max_qrs, all_flag);
+        if (0 != ret || count_out > 0) {
+            return ret;
+        }
+
+        if (last_pass_flag) {
+            return EAGAIN;
+        }
+
+        int block_ms = 0;
+        last_pass_flag = !next_pass(block_ms, t0, timeout_ms);
+        DMTR_OK(advance(qts, num_qts, block_ms));
+    }
+}
+
+int dmtr::io_queue_api::wait_any(dmtr_qresult_t *qr_out, int *ready_offset, dmtr_qtoken_t qts[], int num_qts, int timeout_ms) {
+    DMTR_NOTNULL(EINVAL, qts);
+
+    dmtr_qresult_t unused_qr = {};
+    if (NULL == qr_out) {
+        qr_out = &unused_qr;
+    }
+
+    int count = 0;
+    return wait_many(qr_out, ready_offset, count, 1, qts, num_qts, timeout_ms);
+}
+
+int dmtr::io_queue_api::wait(dmtr_qresult_t *qr_out, dmtr_qtoken_t qt, int timeout_ms) {
+    DMTR_TRUE(EINVAL, qt != 0);
+
+    const auto t0 = boost::chrono::steady_clock::now();
+    bool last_pass_flag = false;
+    while (1) {
+        int ret = poll(qr_out, qt);
+        if (EAGAIN != ret) {
+            DMTR_OK(drop(qt));
+            return ret;
+        }
+
+        if (last_pass_flag) {
+            return EAGAIN;
+        }
+
+        // polling the token drives its queue, so we only need to get
+        // involved once it's time to block.
+        int block_ms = 0;
+        last_pass_flag = !next_pass(block_ms, t0, timeout_ms);
+        if (0 != block_ms) {
+            DMTR_OK(advance(NULL, 0, block_ms));
+        }
+    }
+}
@@ -12,5 +12,9 @@ int dmtr_malloc(void **ptr_out, size_t bytes) {
     DMTR_NOTNULL(EINVAL, ptr_out);
     *ptr_out = malloc(bytes);
     //printf("allocating dmtr memory: %lx\n", *ptr_out);
+    if (NULL == *ptr_out && 0 != bytes) {
+        return ENOMEM;
+    }
+
     return 0;
 }
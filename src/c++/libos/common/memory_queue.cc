@@ -121,6 +121,30 @@ int dmtr::memory_queue::poll(dmtr_qresult_t &qr_out, dmtr_qtoken_t qt) {
     return t->poll(qr_out);
 }
 
+int dmtr::memory_queue::service() {
+    std::lock_guard<std::recursive_mutex> lock(my_lock);
+    if (!good()) {
+        return 0;
+    }
+
+    // pushes go first, so that a pop waiting on the same queue sees them.
+    int ret = my_push_thread->service();
+    if (EAGAIN == ret) {
+        ret = my_pop_thread->service();
+    }
+
+    switch (ret) {
+        default:
+            DMTR_FAIL(ret);
+        case EAGAIN:
+            // a pop that is still waiting can only be satisfied by a
+            // push, which will schedule the queue again.
+            return 0;
+        case 0:
+            DMTR_UNREACHABLE();
+    }
+}
+
 int dmtr::memory_queue::drop(dmtr_qtoken_t qt) {
     std::lock_guard<std::recursive_mutex> lock(my_lock);
     DMTR_TRUE(EINVAL, good());
@@ -0,0 +1,189 @@
+// -*- mode: c++; c-file-style: "k&r"; c-basic-offset: 4 -*-
+
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+#include <dmtr/libos/recv_buffer.hh>
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cstdlib>
+#include <cstring>
+#include <dmtr/annot.h>
+#include <dmtr/libos/mem.h>
+#include <new>
+
+// a popped message's header isn't needed anymore, so it's overwritten with
+// a pointer to the chunk that the message lives in. that's how
+// `dmtr_sgafree()` finds the chunk again.
+static_assert(sizeof(dmtr_header_t) >= sizeof(void *), "no room for the chunk pointer");
+
+dmtr_sgapool_t dmtr::recv_buffer::our_pool = { &dmtr::recv_buffer::sp_free };
+
+dmtr::recv_buffer::recv_buffer() :
+    my_chunk(NULL),
+    my_begin(0),
+    my_end(0),
+    my_needed(sizeof(dmtr_header_t))
+{}
+
+dmtr::recv_buffer::~recv_buffer()
+{
+    clear();
+}
+
+void dmtr::recv_buffer::clear() {
+    if (NULL != my_chunk) {
+        release(my_chunk);
+        my_chunk = NULL;
+    }
+
+    my_begin = 0;
+    my_end = 0;
+    my_needed = sizeof(dmtr_header_t);
+}
+
+int dmtr::recv_buffer::new_chunk(chunk *&chunk_out, size_t capacity) {
+    chunk_out = NULL;
+
+    void *p = NULL;
+    DMTR_OK(dmtr_malloc(&p, sizeof(chunk) + capacity));
+    chunk * const c = new (p) chunk;
+    c->refs.store(1, std::memory_order_relaxed);
+    c->capacity = capacity;
+    chunk_out = c;
+    return 0;
+}
+
+void dmtr::recv_buffer::release(chunk *c) {
+    // sgas may be freed on any core.
+    if (1 == c->refs.fetch_sub(1, std::memory_order_acq_rel)) {
+        c->~chunk();
+        std::free(c);
+    }
+}
+
+int dmtr::recv_buffer::sp_free(dmtr_sgapool_t *pool, void *buf) {
+    DMTR_TRUE(EINVAL, &our_pool == pool);
+    DMTR_NOTNULL(EINVAL, buf);
+
+    chunk *c = NULL;
+    memcpy(&c, reinterpret_cast<uint8_t *>(buf) - sizeof(dmtr_header_t), sizeof(c));
+    release(c);
+    return 0;
+}
+
+int dmtr::recv_buffer::pop(bool &done_out, dmtr_sgarray_t &sga_out) {
+    done_out = false;
+
+    const size_t pending = my_end - my_begin;
+    if (pending < sizeof(dmtr_header_t)) {
+        my_needed = sizeof(dmtr_header_t);
+        return 0;
+    }
+
+    uint8_t * const msg = my_chunk->data() + my_begin;
+    dmtr_header_t header;
+    memcpy(&header, msg, sizeof(header));
+    header.h_magic = ntohl(header.h_magic);
+    header.h_bytes = ntohl(header.h_bytes);
+    header.h_sgasegs = ntohl(header.h_sgasegs);
+
+    if (DMTR_HEADER_MAGIC != header.h_magic) {
+        return EILSEQ;
+    }
+
+    if (0 == header.h_sgasegs || header.h_sgasegs > DMTR_SGARRAY_MAXSIZE) {
+        return EILSEQ;
+    }
+
+    my_needed = sizeof(header) + header.h_bytes;
+    if (pending < my_needed) {
+        return 0;
+    }
+
+    // the segments point into the message; the lengths come from the peer,
+    // so they're checked against the message size.
+    uint8_t * const body = msg + sizeof(header);
+    uint8_t *p = body;
+    const uint8_t * const end = body + header.h_bytes;
+    dmtr_sgarray_t sga = {};
+    sga.sga_numsegs = header.h_sgasegs;
+    for (size_t i = 0; i < sga.sga_numsegs; ++i) {
+        if (static_cast<size_t>(end - p) < sizeof(uint32_t)) {
+            return EILSEQ;
+        }
+
+        uint32_t seglen = 0;
+        memcpy(&seglen, p, sizeof(seglen));
+        seglen = ntohl(seglen);
+        if (static_cast<size_t>(end - p) - sizeof(uint32_t) < seglen) {
+            return EILSEQ;
+        }
+
+        p += sizeof(uint32_t);
+        sga.sga_segs[i].sgaseg_buf = p;
+        sga.sga_segs[i].sgaseg_len = seglen;
+        p += seglen;
+    }
+
+    memcpy(msg, &my_chunk, sizeof(my_chunk));
+    my_chunk->refs.fetch_add(1, std::memory_order_relaxed);
+    sga.sga_buf = body;
+    sga.sga_pool = &our_pool;
+    sga_out = sga;
+
+    my_begin += my_needed;
+    my_needed = sizeof(dmtr_header_t);
+    done_out = true;
+    return 0;
+}
+
+int dmtr::recv_buffer::reserve(void *&buf_out, size_t &len_out) {
+    buf_out = NULL;
+    len_out = 0;
+
+    const size_t pending = my_end - my_begin;
+    const size_t missing = my_needed > pending ? my_needed - pending : 0;
+    const size_t want = std::max(missing, RECV_MIN_READ);
+
+    if (NULL != my_chunk && 0 == pending) {
+        if (my_chunk->capacity > RECV_CHUNK_SIZE) {
+            // don't hang on to what a big message left behind.
+            clear();
+        } else if (1 == my_chunk->refs.load(std::memory_order_acquire)) {
+            my_begin = 0;
+            my_end = 0;
+        }
+    }
+
+    if (NULL == my_chunk) {
+        DMTR_OK(new_chunk(my_chunk, std::max(RECV_CHUNK_SIZE, want)));
+    } else if (my_chunk->capacity - my_end < want) {
+        uint8_t * const src = my_chunk->data() + my_begin;
+        if (1 == my_chunk->refs.load(std::memory_order_acquire) && pending + want <= my_chunk->capacity) {
+            // nobody else is looking at this chunk, so the unread bytes can
+            // just move to the front.
+            memmove(my_chunk->data(), src, pending);
+        } else {
+            // the messages that were popped out of this chunk stay where
+            // they are; only the unread bytes come along.
+            chunk *c = NULL;
+            DMTR_OK(new_chunk(c, std::max(RECV_CHUNK_SIZE, pending + want)));
+            memcpy(c->data(), src, pending);
+            release(my_chunk);
+            my_chunk = c;
+        }
+
+        my_begin = 0;
+        my_end = pending;
+    }
+
+    buf_out = my_chunk->data() + my_end;
+    len_out = my_chunk->capacity - my_end;
+    return 0;
+}
+
+void dmtr::recv_buffer::commit(size_t len) {
+    my_end += len;
+}
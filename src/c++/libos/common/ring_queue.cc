@@ -0,0 +1,319 @@
+// -*- mode: c++; c-file-style: "k&r"; c-basic-offset: 4 -*-
+
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+#include <dmtr/libos/ring_queue.hh>
+
+#include <algorithm>
+#include <dmtr/annot.h>
+#include <dmtr/libos.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+// a ring's slots are allocated up front.
+#define MAX_RING_CAPACITY (static_cast<size_t>(1) << 24)
+
+std::mutex dmtr::ring_queue::our_rings_lock;
+std::unordered_map<int, std::shared_ptr<dmtr::ring_queue::ring>> dmtr::ring_queue::our_rings;
+
+size_t dmtr::ring_queue::ring::push(const dmtr_sgarray_t sgas[], size_t n) {
+    return NULL == spsc ? mpmc->push(sgas, n) : spsc->push(sgas, n);
+}
+
+size_t dmtr::ring_queue::ring::pop(dmtr_sgarray_t sgas_out[], size_t n) {
+    return NULL == spsc ? mpmc->pop(sgas_out, n) : spsc->pop(sgas_out, n);
+}
+
+void dmtr::ring_queue::ring::wake(int self_fd) {
+    // pairs with the fence in `start_waiting()`: either the waiter sees
+    // what we moved, or we see the waiter.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (0 == waiter_count.load(std::memory_order_relaxed)) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(waiters_lock);
+    for (int fd : waiter_fds) {
+        if (fd != self_fd) {
+            signal_event(fd);
+        }
+    }
+}
+
+dmtr::ring_queue::ring_queue(int qd) :
+    io_queue(MEMORY_Q, qd),
+    my_owner_flag(false),
+    my_event_fd(-1),
+    my_watching_flag(false),
+    my_waiting_flag(false),
+    my_good_flag(true)
+{}
+
+dmtr::ring_queue::~ring_queue()
+{
+    if (good()) {
+        (void)close();
+    }
+}
+
+int dmtr::ring_queue::new_object(std::unique_ptr<io_queue> &q_out, int qd, int flags, size_t capacity) {
+    q_out = NULL;
+    DMTR_TRUE(EINVAL, capacity > 0 && capacity <= MAX_RING_CAPACITY);
+
+    std::shared_ptr<ring> r = std::make_shared<ring>();
+    switch (flags) {
+        default:
+            DMTR_FAIL(EINVAL);
+        case DMTR_QUEUE_SPSC:
+            r->spsc.reset(new spsc_ring<dmtr_sgarray_t>(capacity));
+            break;
+        case DMTR_QUEUE_MPMC:
+            r->mpmc.reset(new mpmc_ring<dmtr_sgarray_t>(capacity));
+            break;
+    }
+
+    std::unique_ptr<ring_queue> q(new ring_queue(qd));
+    DMTR_NOTNULL(ENOMEM, q);
+    DMTR_OK(q->open_event());
+    {
+        std::lock_guard<std::mutex> lock(our_rings_lock);
+        DMTR_TRUE(EEXIST, our_rings.find(qd) == our_rings.end());
+        our_rings[qd] = r;
+    }
+
+    q->my_ring = r;
+    q->my_owner_flag = true;
+    q_out = std::move(q);
+    return 0;
+}
+
+int dmtr::ring_queue::attach(std::unique_ptr<io_queue> &q_out, int qd, int ring_qd) {
+    q_out = NULL;
+
+    std::unique_ptr<ring_queue> q(new ring_queue(qd));
+    DMTR_NOTNULL(ENOMEM, q);
+    DMTR_OK(q->open_event());
+    {
+        std::lock_guard<std::mutex> lock(our_rings_lock);
+        auto it = our_rings.find(ring_qd);
+        DMTR_TRUE(ENOENT, it != our_rings.end());
+        q->my_ring = it->second;
+    }
+
+    q_out = std::move(q);
+    return 0;
+}
+
+int dmtr::ring_queue::open_event() {
+    my_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (-1 == my_event_fd) {
+        return errno;
+    }
+
+    return 0;
+}
+
+void dmtr::ring_queue::start_waiting() {
+    {
+        std::lock_guard<std::mutex> lock(my_ring->waiters_lock);
+        my_ring->waiter_fds.push_back(my_event_fd);
+    }
+
+    my_ring->waiter_count.fetch_add(1);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    my_waiting_flag = true;
+}
+
+void dmtr::ring_queue::stop_waiting() {
+    my_ring->waiter_count.fetch_sub(1);
+    {
+        std::lock_guard<std::mutex> lock(my_ring->waiters_lock);
+        auto &fds = my_ring->waiter_fds;
+        fds.erase(std::remove(fds.begin(), fds.end(), my_event_fd), fds.end());
+    }
+
+    my_waiting_flag = false;
+}
+
+int dmtr::ring_queue::push(dmtr_qtoken_t qt, const dmtr_sgarray_t &sga) {
+    return push_batch(&qt, &sga, 1);
+}
+
+int dmtr::ring_queue::pop(dmtr_qtoken_t qt) {
+    return pop_batch(&qt, 1);
+}
+
+int dmtr::ring_queue::push_batch(const dmtr_qtoken_t qts[], const dmtr_sgarray_t sgas[], int count) {
+    DMTR_TRUE(EINVAL, good());
+
+    for (int i = 0; i < count; ++i) {
+        DMTR_OK(new_task(qts[i], DMTR_OPC_PUSH, sgas[i]));
+        my_pushes.push_back(qts[i]);
+    }
+
+    return push_waiting();
+}
+
+int dmtr::ring_queue::pop_batch(const dmtr_qtoken_t qts[], int count) {
+    DMTR_TRUE(EINVAL, good());
+
+    for (int i = 0; i < count; ++i) {
+        DMTR_OK(new_task(qts[i], DMTR_OPC_POP));
+        my_pops.push_back(qts[i]);
+    }
+
+    return pop_waiting();
+}
+
+int dmtr::ring_queue::push_waiting() {
+    while (!my_pushes.empty()) {
+        task *ts[RING_BATCH];
+        dmtr_sgarray_t sgas[RING_BATCH];
+        const size_t n = std::min(my_pushes.size(), RING_BATCH);
+        for (size_t i = 0; i < n; ++i) {
+            DMTR_OK(get_task(ts[i], my_pushes[i]));
+            const dmtr_sgarray_t *sga = NULL;
+            DMTR_TRUE(EINVAL, ts[i]->arg(sga));
+            sgas[i] = *sga;
+        }
+
+        const size_t pushed = my_ring->push(sgas, n);
+        if (pushed > 0) {
+            my_ring->wake(my_event_fd);
+        }
+
+        for (size_t i = 0; i < pushed; ++i) {
+            my_pushes.pop_front();
+            DMTR_OK(ts[i]->complete(0, sgas[i]));
+        }
+
+        if (pushed < n) {
+            break;
+        }
+    }
+
+    return 0;
+}
+
+int dmtr::ring_queue::pop_waiting() {
+    while (!my_pops.empty()) {
+        dmtr_sgarray_t sgas[RING_BATCH];
+        const size_t n = std::min(my_pops.size(), RING_BATCH);
+        const size_t popped = my_ring->pop(sgas, n);
+        if (popped > 0) {
+            my_ring->wake(my_event_fd);
+        }
+
+        for (size_t i = 0; i < popped; ++i) {
+            task *t = NULL;
+            DMTR_OK(get_task(t, my_pops.front()));
+            my_pops.pop_front();
+            DMTR_OK(t->complete(0, sgas[i]));
+        }
+
+        if (popped < n) {
+            break;
+        }
+    }
+
+    return 0;
+}
+
+int dmtr::ring_queue::poll(dmtr_qresult_t &qr_out, dmtr_qtoken_t qt) {
+    DMTR_TRUE(EINVAL, good());
+
+    int ret = service();
+    if (0 != ret && EAGAIN != ret) {
+        DMTR_FAIL(ret);
+    }
+
+    task *t = NULL;
+    DMTR_OK(get_task(t, qt));
+    return t->poll(qr_out);
+}
+
+int dmtr::ring_queue::service() {
+    if (!good()) {
+        return 0;
+    }
+
+    // reset before looking, so that the ring moving after we've looked
+    // wakes us up again.
+    if (my_watching_flag) {
+        reset_event(my_event_fd);
+    }
+
+    DMTR_OK(push_waiting());
+    DMTR_OK(pop_waiting());
+
+    if (my_pushes.empty() && my_pops.empty()) {
+        if (my_waiting_flag) {
+            stop_waiting();
+        }
+
+        return 0;
+    }
+
+    // the other ends of the ring may be driven by other cores, which can't
+    // schedule this queue; they signal our eventfd instead.
+    if (!my_watching_flag) {
+        const int ret = watch(my_event_fd);
+        if (ENOTSUP == ret) {
+            // nothing would wake us, so anything still waiting keeps the
+            // queue runnable.
+            return EAGAIN;
+        }
+
+        DMTR_OK(ret);
+        my_watching_flag = true;
+    }
+
+    if (!my_waiting_flag) {
+        start_waiting();
+        // the ring may have moved before we were among its waiters.
+        return EAGAIN;
+    }
+
+    return 0;
+}
+
+int dmtr::ring_queue::abort_waiting(std::deque<dmtr_qtoken_t> &qts) {
+    while (!qts.empty()) {
+        task *t = NULL;
+        DMTR_OK(get_task(t, qts.front()));
+        qts.pop_front();
+        DMTR_OK(t->complete(ECONNABORTED));
+    }
+
+    return 0;
+}
+
+int dmtr::ring_queue::close() {
+    DMTR_TRUE(EINVAL, good());
+
+    my_good_flag = false;
+    if (my_owner_flag) {
+        // ends that are already attached keep the ring alive.
+        std::lock_guard<std::mutex> lock(our_rings_lock);
+        our_rings.erase(qd());
+    }
+
+    if (my_waiting_flag) {
+        stop_waiting();
+    }
+
+    if (my_watching_flag) {
+        (void)unwatch(my_event_fd);
+        my_watching_flag = false;
+    }
+
+    if (-1 != my_event_fd) {
+        (void)::close(my_event_fd);
+        my_event_fd = -1;
+    }
+
+    DMTR_OK(abort_waiting(my_pushes));
+    DMTR_OK(abort_waiting(my_pops));
+    return 0;
+}
@@ -31,7 +31,9 @@ int dmtr_sgafree(dmtr_sgarray_t *sga) {
         return 0;
     }
 
-    if (NULL == sga->sga_buf) {
+    if (NULL != sga->sga_pool) {
+        DMTR_OK(sga->sga_pool->sp_free(sga->sga_pool, sga->sga_buf));
+    } else if (NULL == sga->sga_buf) {
         for (size_t i = 0; i < sga->sga_numsegs; ++i) {
             //printf("freeing a scatter-gather array: %lx\n",sga->sga_segs[i].sgaseg_buf);
             free(sga->sga_segs[i].sgaseg_buf);
@@ -0,0 +1,93 @@
+// -*- mode: c++; c-file-style: "k&r"; c-basic-offset: 4 -*-
+
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+#include <dmtr/libos/stack_pool.hh>
+
+#include <boost/context/stack_traits.hpp>
+#include <dmtr/annot.h>
+#include <new>
+#include <sys/mman.h>
+
+dmtr::stack_pool::stack_pool() :
+    my_stack_size(DEFAULT_STACK_SIZE),
+    my_guard_page_flag(true),
+    my_max_free_stacks(DEFAULT_MAX_FREE_STACKS)
+{}
+
+dmtr::stack_pool &dmtr::stack_pool::instance() {
+    static stack_pool * const pool = new stack_pool();
+    return *pool;
+}
+
+int dmtr::stack_pool::configure(size_t stack_size, bool guard_page, size_t max_free_stacks) {
+    DMTR_TRUE(EINVAL, stack_size >= boost::context::stack_traits::minimum_size());
+
+    std::lock_guard<std::mutex> lock(my_lock);
+    my_stack_size = stack_size;
+    my_guard_page_flag = guard_page;
+    my_max_free_stacks = max_free_stacks;
+    // the free stacks may have the wrong size now; the ones that are still
+    // in use are unmapped when they're given back.
+    for (auto &sctx : my_free_stacks) {
+        unmap(sctx);
+    }
+
+    my_free_stacks.clear();
+    return 0;
+}
+
+size_t dmtr::stack_pool::mapping_size() const {
+    const size_t page_size = boost::context::stack_traits::page_size();
+    const size_t pages = (my_stack_size + page_size - 1) / page_size;
+    return (pages + (my_guard_page_flag ? 1 : 0)) * page_size;
+}
+
+boost::context::stack_context dmtr::stack_pool::allocate() {
+    size_t size = 0;
+    bool guard_page = false;
+    {
+        std::lock_guard<std::mutex> lock(my_lock);
+        if (!my_free_stacks.empty()) {
+            auto sctx = my_free_stacks.back();
+            my_free_stacks.pop_back();
+            return sctx;
+        }
+
+        size = mapping_size();
+        guard_page = my_guard_page_flag;
+    }
+
+    void * const p = ::mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if (MAP_FAILED == p) {
+        throw std::bad_alloc();
+    }
+
+    // stacks grow down, so the guard page goes at the bottom.
+    if (guard_page && 0 != ::mprotect(p, boost::context::stack_traits::page_size(), PROT_NONE)) {
+        (void)::munmap(p, size);
+        throw std::bad_alloc();
+    }
+
+    boost::context::stack_context sctx;
+    sctx.size = size;
+    sctx.sp = static_cast<char *>(p) + size;
+    return sctx;
+}
+
+void dmtr::stack_pool::deallocate(boost::context::stack_context &sctx) {
+    {
+        std::lock_guard<std::mutex> lock(my_lock);
+        if (sctx.size == mapping_size() && my_free_stacks.size() < my_max_free_stacks) {
+            my_free_stacks.push_back(sctx);
+            return;
+        }
+    }
+
+    unmap(sctx);
+}
+
+void dmtr::stack_pool::unmap(boost::context::stack_context &sctx) {
+    (void)::munmap(static_cast<char *>(sctx.sp) - sctx.size, sctx.size);
+}
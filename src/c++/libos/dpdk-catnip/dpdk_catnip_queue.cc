@@ -809,6 +809,9 @@ int dmtr::dpdk_catnip_queue::read_message(dmtr_sgarray_t &sga_out, std::deque<ui
         return ret;
     }
 
+    DMTR_NONZERO(EILSEQ, sga.sga_numsegs);
+    DMTR_TRUE(EILSEQ, sga.sga_numsegs <= DMTR_SGARRAY_MAXSIZE);
+
     for (size_t i = 0; i < sga.sga_numsegs; ++i) {
         uint32_t segment_length = 0;
         ret = tcp_read(segment_length, buffer, yield);
@@ -966,7 +966,7 @@ dmtr::lwip_queue::service_incoming_packets() {
 
     for (size_t i = 0; i < count; ++i) {
         struct sockaddr_in src, dst;
-        dmtr_sgarray_t sga;
+        dmtr_sgarray_t sga = {};
         // check the packet header
 
         bool valid_packet = parse_packet(src, dst, sga, pkts[i]);
@@ -1097,6 +1097,9 @@ dmtr::lwip_queue::parse_packet(struct sockaddr_in &src,
             return false;
         }
     }
+    // the segments are allocated with `dmtr_malloc()` below, so they're
+    // released without a pool.
+    sga.sga_pool = NULL;
     // segment count
     sga.sga_numsegs = ntohl(*reinterpret_cast<uint32_t *>(p));
     p += sizeof(uint32_t);
@@ -1105,6 +1108,13 @@ dmtr::lwip_queue::parse_packet(struct sockaddr_in &src,
     printf("recv: sga_numsegs: %d\n", sga.sga_numsegs);
 #endif
 
+    if (0 == sga.sga_numsegs || sga.sga_numsegs > DMTR_SGARRAY_MAXSIZE) {
+#if DMTR_DEBUG
+        printf("recv: dropped (bad segment count)!\n");
+#endif
+        return false;
+    }
+
     for (size_t i = 0; i < sga.sga_numsegs; ++i) {
         // segment length
         auto seg_len = ntohl(*reinterpret_cast<uint32_t *>(p));
@@ -5,6 +5,7 @@
 
 #include "posix_queue.hh"
 
+#include <algorithm>
 #include <arpa/inet.h>
 #include <boost/chrono.hpp>
 #include <cassert>
@@ -15,11 +16,22 @@
 #include <dmtr/sga.h>
 #include <fcntl.h>
 #include <iostream>
+#include <limits>
+#include <linux/errqueue.h>
+#include <linux/filter.h>
+#include <dmtr/libos/config.hh>
 #include <dmtr/libos/io_queue_api.hh>
 #include <dmtr/libos/mem.h>
 #include <dmtr/libos/raii_guard.hh>
 #include <netinet/tcp.h>
+#include <netinet/udp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
 #include <sys/uio.h>
+#include <system_error>
+#include <thread>
 #include <unistd.h>
 
 //#define DMTR_DEBUG 1
@@ -31,12 +43,29 @@ static latency_ptr_type read_latency;
 static latency_ptr_type write_latency;
 #endif
 
+thread_local int dmtr::posix_queue::our_epoll_fd = -1;
+thread_local std::list<dmtr::posix_queue::lingering_socket> dmtr::posix_queue::our_lingering_sockets;
+thread_local std::unordered_map<int, dmtr::posix_queue *> dmtr::posix_queue::our_connecting_queues;
+size_t dmtr::posix_queue::our_zerocopy_threshold = 0;
+bool dmtr::posix_queue::our_reuseport_flag = false;
+bool dmtr::posix_queue::our_cpu_steering_flag = false;
+
 dmtr::posix_queue::posix_queue(int qd, io_queue::category_id cid) :
     io_queue(cid, qd),
     my_fd(-1),
     my_listening_flag(false),
     my_tcp_flag(false),
-    my_peer_saddr(NULL)
+    my_connect_done_flag(false),
+    my_peer_saddr(NULL),
+    my_accept_error(0),
+    my_zerocopy_flag(false),
+    my_zerocopy_next_id(0),
+    my_gso_limit(0),
+    my_file_offset(0),
+    my_file_sync_flags(0),
+    my_readahead_buf(NULL),
+    my_readahead_offset(0),
+    my_readahead_len(0)
 {}
 
 #if DMTR_PROFILE
@@ -83,6 +112,111 @@ int dmtr::posix_queue::new_file_object(std::unique_ptr<io_queue> &q_out, int qd)
     return 0;
 }
 
+int dmtr::posix_queue::read_config(int argc, char *argv[]) {
+    YAML::Node config;
+    DMTR_OK(load_config(config, argc, argv));
+    YAML::Node node = config["posix"]["zerocopy_threshold"];
+    if (YAML::NodeType::Scalar == node.Type()) {
+        our_zerocopy_threshold = node.as<size_t>();
+    }
+
+    node = config["posix"]["reuseport"];
+    if (YAML::NodeType::Scalar == node.Type()) {
+        our_reuseport_flag = node.as<bool>();
+    }
+
+    node = config["posix"]["cpu_steering"];
+    if (YAML::NodeType::Scalar == node.Type()) {
+        our_cpu_steering_flag = node.as<bool>();
+    }
+
+    return 0;
+}
+
+int dmtr::posix_queue::init_epoll() {
+    DMTR_TRUE(EPERM, -1 == our_epoll_fd);
+
+    int fd = epoll_create1(EPOLL_CLOEXEC);
+    if (-1 == fd) {
+        return errno;
+    }
+
+    our_epoll_fd = fd;
+    return 0;
+}
+
+int dmtr::posix_queue::poll_events(std::vector<int> &qds_out, int timeout_ms) {
+    DMTR_TRUE(EPERM, -1 != our_epoll_fd);
+
+    struct epoll_event events[256];
+    int n = epoll_wait(our_epoll_fd, events, sizeof(events) / sizeof(events[0]), timeout_ms);
+    if (-1 == n) {
+        // being interrupted by a signal is just an early wake-up.
+        return EINTR == errno ? 0 : errno;
+    }
+
+    bool lingering_flag = false;
+    for (int i = 0; i < n; ++i) {
+        if (LINGERING_SOCKET_QD == events[i].data.u64) {
+            lingering_flag = true;
+            continue;
+        }
+
+        const int qd = static_cast<int>(events[i].data.u64);
+        if (!our_connecting_queues.empty() && 0 != (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+            auto it = our_connecting_queues.find(qd);
+            if (our_connecting_queues.end() != it) {
+                it->second->my_connect_done_flag = true;
+            }
+        }
+
+        qds_out.push_back(qd);
+    }
+
+    if (lingering_flag) {
+        DMTR_OK(reap_lingering());
+    }
+
+    return 0;
+}
+
+int dmtr::posix_queue::watch_fd(int fd, int qd) {
+    DMTR_TRUE(EPERM, -1 != our_epoll_fd);
+
+    if (0 == qd) {
+        if (-1 == epoll_ctl(our_epoll_fd, EPOLL_CTL_DEL, fd, NULL)) {
+            return errno;
+        }
+
+        return 0;
+    }
+
+    // the watched descriptors are eventfds, which are reset by the queue
+    // when it's serviced.
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.u64 = qd;
+    if (-1 == epoll_ctl(our_epoll_fd, EPOLL_CTL_ADD, fd, &ev)) {
+        return errno;
+    }
+
+    return 0;
+}
+
+int dmtr::posix_queue::watch_events() {
+    DMTR_TRUE(EINVAL, good());
+    DMTR_TRUE(EPERM, -1 != our_epoll_fd);
+
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.u64 = qd();
+    if (-1 == epoll_ctl(our_epoll_fd, EPOLL_CTL_ADD, my_fd, &ev)) {
+        return errno;
+    }
+
+    return 0;
+}
+
 int
 dmtr::posix_queue::socket(int domain, int type, int protocol)
 {
@@ -106,9 +240,49 @@ dmtr::posix_queue::socket(int domain, int type, int protocol)
     }
 
     my_fd = fd;
+    if (my_tcp_flag) {
+        enable_zerocopy();
+    } else {
+        setup_datagrams();
+    }
+
     return 0;
 }
 
+void dmtr::posix_queue::enable_zerocopy()
+{
+    if (0 == our_zerocopy_threshold) {
+        return;
+    }
+
+    // kernels before 4.14 don't have it, in which case every push is
+    // copied.
+    const int on = 1;
+    my_zerocopy_flag = (0 == ::setsockopt(my_fd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)));
+}
+
+void dmtr::posix_queue::setup_datagrams()
+{
+    // both are optimizations, so it doesn't matter if the kernel doesn't
+    // have them (GRO 5.0, GSO 4.18).
+    const int on = 1;
+    (void)::setsockopt(my_fd, SOL_UDP, UDP_GRO, &on, sizeof(on));
+
+    // datagrams wait in the socket until the next batch is received, and a
+    // GRO buffer takes up to 64 KiB, so the default buffers overflow (and
+    // drop datagrams) long before the socket is busy. the kernel caps these
+    // at `net.core.{r,w}mem_max`.
+    const int size = DGRAM_SOCKET_BUFFER_SIZE;
+    (void)::setsockopt(my_fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    (void)::setsockopt(my_fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+
+    int gso_size = 0;
+    socklen_t len = sizeof(gso_size);
+    if (0 == ::getsockopt(my_fd, SOL_UDP, UDP_SEGMENT, &gso_size, &len)) {
+        my_gso_limit = DGRAM_MAX_SIZE;
+    }
+}
+
 int
 dmtr::posix_queue::getsockname(struct sockaddr * const saddr, socklen_t * const size)
 {
@@ -146,15 +320,30 @@ dmtr::posix_queue::bind(const struct sockaddr * const saddr, socklen_t size)
             return errno;
     }
 
+    // every socket that's bound to the port has to ask for it.
+    if (my_tcp_flag && our_reuseport_flag) {
+        if (-1 == ::setsockopt(my_fd, SOL_SOCKET, SO_REUSEPORT, &n, sizeof(n))) {
+            return errno;
+        }
+    }
+
     ret = ::bind(my_fd, saddr, size);
     switch (ret) {
         default:
             DMTR_UNREACHABLE();
         case 0:
-            return 0;
+            break;
         case -1:
             return errno;
     }
+
+    // a datagram socket can be used as soon as it has an address.
+    if (!my_tcp_flag) {
+        start_threads();
+        DMTR_OK(watch_events());
+    }
+
+    return 0;
 }
 
 int dmtr::posix_queue::accept(std::unique_ptr<io_queue> &q_out, dmtr_qtoken_t qt, int new_qd) {
@@ -168,7 +357,21 @@ int dmtr::posix_queue::accept(std::unique_ptr<io_queue> &q_out, dmtr_qtoken_t qt
     auto qq = std::unique_ptr<io_queue>(q);
 
     DMTR_OK(new_task(qt, DMTR_OPC_ACCEPT, q));
-    my_accept_thread->enqueue(qt);
+    if (my_accepted.empty() && 0 != my_accept_error) {
+        // the listening socket won't be reported ready for it again.
+        task *t;
+        DMTR_OK(get_task(t, qt));
+        DMTR_OK(t->complete(my_accept_error));
+        my_accept_error = 0;
+    } else if (my_accepted.empty()) {
+        my_accept_thread->enqueue(qt);
+    } else {
+        // `accept_thread()` only leaves connections behind when there are
+        // no accepts waiting for them.
+        const accepted_connection c = my_accepted.front();
+        my_accepted.pop_front();
+        DMTR_OK(finish_accept(qt, c));
+    }
 
     q_out = std::move(qq);
     return 0;
@@ -180,51 +383,90 @@ int dmtr::posix_queue::accept_thread(task::thread_type::yield_type &yield, task:
     DMTR_TRUE(EINVAL, my_tcp_flag);
 
     while (good()) {
-        while (tq.empty()) {
-            yield();
+        int error = 0;
+        DMTR_OK(drain_backlog(error));
+        // the socket won't be reported ready again while there's still
+        // something left on the kernel's backlog.
+        const bool full_flag = ACCEPT_BACKLOG_SIZE == my_accepted.size();
+        while (!tq.empty() && !my_accepted.empty()) {
+            auto qt = tq.front();
+            tq.pop();
+            const accepted_connection c = my_accepted.front();
+            my_accepted.pop_front();
+            DMTR_OK(finish_accept(qt, c));
         }
 
-        auto qt = tq.front();
-        tq.pop();
-        task *t;
-        DMTR_OK(get_task(t, qt));
+        if (0 != error) {
+            my_accept_error = error;
+        }
 
-        io_queue *new_q = NULL;
-        DMTR_TRUE(EINVAL, t->arg(new_q));
-        auto * const new_pq = dynamic_cast<posix_queue *>(new_q);
-        DMTR_NOTNULL(EINVAL, new_pq);
-
-        int new_fd = -1;
-        sockaddr_in addr;
-        socklen_t len = sizeof(addr);
-        int ret;
-        while (1) {
-            ret = accept(new_fd, my_fd, reinterpret_cast<sockaddr *>(&addr), &len);
-            if (EAGAIN != ret) {
-                break;
-            }
+        if (0 != my_accept_error && !tq.empty()) {
+            auto qt = tq.front();
+            tq.pop();
+            task *t;
+            DMTR_OK(get_task(t, qt));
+            DMTR_OK(t->complete(my_accept_error));
+            my_accept_error = 0;
+            // move onto the next task.
+            continue;
+        }
 
-            yield();
+        if (full_flag && !tq.empty()) {
+            continue;
+        }
+
+        yield();
+    }
+
+    return 0;
+}
+
+// takes connections off the kernel's backlog until it's empty or
+// `my_accepted` is full. an error that `accept4()` reports stops the
+// draining and is left for the next accept (see `my_accept_error`).
+int dmtr::posix_queue::drain_backlog(int &error_out) {
+    error_out = 0;
+
+    while (my_accepted.size() < ACCEPT_BACKLOG_SIZE) {
+        accepted_connection c = {};
+        socklen_t len = sizeof(c.addr);
+        int ret = accept(c.fd, my_fd, reinterpret_cast<sockaddr *>(&c.addr), &len);
+        if (EAGAIN == ret) {
+            break;
         }
 
         if (0 != ret) {
-            DMTR_OK(t->complete(ret));
-            // move onto the next task.
-            continue;
+            error_out = ret;
+            break;
         }
 
-        DMTR_OK(set_tcp_nodelay(new_fd));
-        DMTR_OK(set_non_blocking(new_fd));
-        new_pq->my_fd = new_fd;
-        new_pq->my_tcp_flag = true;
-        new_pq->my_listening_flag = false;
-        new_pq->start_threads();
-        DMTR_OK(t->complete(0, new_pq->qd(), addr));
+        my_accepted.push_back(c);
     }
 
     return 0;
 }
 
+int dmtr::posix_queue::finish_accept(dmtr_qtoken_t qt, const accepted_connection &c) {
+    task *t;
+    DMTR_OK(get_task(t, qt));
+
+    io_queue *new_q = NULL;
+    DMTR_TRUE(EINVAL, t->arg(new_q));
+    auto * const new_pq = dynamic_cast<posix_queue *>(new_q);
+    DMTR_NOTNULL(EINVAL, new_pq);
+
+    // the socket is already non-blocking (see `accept()`) and inherited
+    // `TCP_NODELAY` from the listening socket, so it's ready to go.
+    new_pq->my_fd = c.fd;
+    new_pq->my_tcp_flag = true;
+    new_pq->my_listening_flag = false;
+    new_pq->enable_zerocopy();
+    new_pq->start_threads();
+    DMTR_OK(new_pq->watch_events());
+    DMTR_OK(t->complete(0, new_pq->qd(), c.addr));
+    return 0;
+}
+
 int dmtr::posix_queue::accept(int &newfd_out, int fd, struct sockaddr * const saddr, socklen_t * const addrlen)
 {
     DMTR_TRUE(EINVAL, NULL == saddr || (addrlen != NULL && 0 < *addrlen));
@@ -259,9 +501,19 @@ dmtr::posix_queue::listen(int backlog)
         case -1:
             return errno;
         case 0:
+            // the program belongs to all of the port's listening sockets,
+            // which only share it once they're listening.
+            if (our_reuseport_flag && our_cpu_steering_flag) {
+                DMTR_OK(steer_to_cpu(my_fd));
+            }
+
+            // accepted sockets inherit this, which saves a system call per
+            // connection.
+            DMTR_OK(set_tcp_nodelay(my_fd));
             my_listening_flag = true;
             DMTR_OK(set_non_blocking(my_fd));
             start_threads();
+            DMTR_OK(watch_events());
             return 0;
     }
 }
@@ -274,50 +526,220 @@ int dmtr::posix_queue::connect(dmtr_qtoken_t qt, const struct sockaddr * const s
     DMTR_OK(new_task(qt, DMTR_OPC_CONNECT));
     task *t;
     DMTR_OK(get_task(t, qt));
+    // a stream socket's handshake goes on without us; see
+    // `connect_thread()`.
+    DMTR_OK(set_non_blocking(my_fd));
     int res = ::connect(my_fd, saddr, size);
     switch (res) {
         default:
             DMTR_UNREACHABLE();
-        case -1:
-            DMTR_OK(t->complete(errno));
-            return 0;
-        case 0: {
-            DMTR_OK(set_non_blocking(my_fd));
+        case -1: {
+            const int error = errno;
+            if (EINPROGRESS != error) {
+                DMTR_OK(t->complete(error));
+                return 0;
+            }
+            break;
+        }
+        case 0:
+            break;
+    }
 
-            void *p = malloc(size);
-            DMTR_TRUE(ENOMEM, p != NULL);
-            memcpy(p, saddr, size);
-            my_peer_saddr = reinterpret_cast<struct sockaddr *>(p);
+    void *p = malloc(size);
+    DMTR_TRUE(ENOMEM, p != NULL);
+    memcpy(p, saddr, size);
+    my_peer_saddr = reinterpret_cast<struct sockaddr *>(p);
 
-            start_threads();
+    // a datagram socket that was bound first is already set up. pushes
+    // and pops that are started before the handshake is over wait for it.
+    if (NULL == my_pop_thread) {
+        start_threads();
+        DMTR_OK(watch_events());
+    }
+
+    if (0 == res) {
+        DMTR_OK(t->complete(0));
+        return 0;
+    }
+
+    my_connect_done_flag = false;
+    our_connecting_queues[qd()] = this;
+    my_connect_thread.reset(new task::thread_type([=](task::thread_type::yield_type &yield, task::thread_type::queue_type &tq) {
+        return connect_thread(yield, tq);
+    }));
+    my_connect_thread->enqueue(qt);
+    return 0;
+}
+
+int dmtr::posix_queue::connect_thread(task::thread_type::yield_type &yield, task::thread_type::queue_type &tq)
+{
+    DMTR_TRUE(EINVAL, !tq.empty());
+    const dmtr_qtoken_t qt = tq.front();
+    tq.pop();
 
-            DMTR_OK(t->complete(0));
+    // the poller tells us when the handshake is over (see
+    // `my_connect_done_flag`).
+    while (!my_connect_done_flag) {
+        yield();
+        if (!good()) {
+            // the queue was closed first.
             return 0;
         }
     }
+
+    our_connecting_queues.erase(qd());
+    int error = 0;
+    socklen_t len = sizeof(error);
+    if (-1 == ::getsockopt(my_fd, SOL_SOCKET, SO_ERROR, &error, &len)) {
+        error = errno;
+    }
+
+    task *t;
+    DMTR_OK(get_task(t, qt));
+    DMTR_OK(t->complete(error));
+    return 0;
 }
 
 int dmtr::posix_queue::open(const char *pathname, int flags)
 {
-    int fd = ::open(pathname, flags);
+    return open_file(pathname, flags, 0);
+}
+
+int dmtr::posix_queue::open2(const char *pathname, int flags, mode_t mode)
+{
+    return open_file(pathname, flags, mode);
+}
+
+int dmtr::posix_queue::open_file(const char *pathname, int flags, mode_t mode)
+{
+    // with `O_SYNC`, every `write()` would wait for the device by itself.
+    // `file_push()` flushes once for everything it writes instead.
+    const int sync_flags = flags & (O_SYNC | O_DSYNC);
+    int fd = ::open(pathname, flags & ~sync_flags, mode);
     if (fd == -1) {
         return errno;
     }
 
+    // pops read files front to back.
+    (void)posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
     my_fd = fd;
+    my_file_sync_flags = sync_flags;
+    if (0 != sync_flags) {
+        int ret = start_flusher();
+        if (0 != ret) {
+            my_fd = -1;
+            (void)::close(fd);
+            DMTR_FAIL(ret);
+        }
+    }
+
     start_threads();
     return 0;
 }
 
-int dmtr::posix_queue::open2(const char *pathname, int flags, mode_t mode)
+int dmtr::posix_queue::start_flusher()
 {
-    int fd = ::open(pathname, flags, mode);
-    if (fd == -1) {
+    DMTR_TRUE(EPERM, -1 != our_epoll_fd);
+
+    std::shared_ptr<file_flusher> f(new file_flusher);
+    f->fd = fcntl(my_fd, F_DUPFD_CLOEXEC, 0);
+    if (-1 == f->fd) {
         return errno;
     }
 
-    my_fd = fd;
-    start_threads();
+    f->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (-1 == f->event_fd) {
+        const int error = errno;
+        (void)::close(f->fd);
+        return error;
+    }
+
+    f->sync_flags = my_file_sync_flags;
+    f->requested_flag = false;
+    f->done_flag = false;
+    f->stop_flag = false;
+    f->error = 0;
+
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.u64 = qd();
+    if (-1 == epoll_ctl(our_epoll_fd, EPOLL_CTL_ADD, f->event_fd, &ev)) {
+        const int error = errno;
+        (void)::close(f->event_fd);
+        (void)::close(f->fd);
+        return error;
+    }
+
+    try {
+        std::thread(run_flusher, f).detach();
+    } catch (const std::system_error &e) {
+        (void)epoll_ctl(our_epoll_fd, EPOLL_CTL_DEL, f->event_fd, NULL);
+        (void)::close(f->event_fd);
+        (void)::close(f->fd);
+        return e.code().value();
+    }
+
+    my_flusher = f;
+    return 0;
+}
+
+void dmtr::posix_queue::run_flusher(std::shared_ptr<file_flusher> f)
+{
+    std::unique_lock<std::mutex> lock(f->lock);
+    while (true) {
+        f->cond.wait(lock, [&] { return f->requested_flag || f->stop_flag; });
+        if (!f->requested_flag) {
+            break;
+        }
+
+        f->requested_flag = false;
+        lock.unlock();
+        const int r = O_SYNC == f->sync_flags ? ::fsync(f->fd) : ::fdatasync(f->fd);
+        const int error = -1 == r ? errno : 0;
+        lock.lock();
+        f->error = error;
+        f->done_flag = true;
+        const uint64_t one = 1;
+        (void)::write(f->event_fd, &one, sizeof(one));
+    }
+
+    (void)::close(f->event_fd);
+    (void)::close(f->fd);
+}
+
+int dmtr::posix_queue::flush_file(int &error_out, task::thread_type::yield_type &yield)
+{
+    error_out = 0;
+    DMTR_NOTNULL(EINVAL, my_flusher);
+
+    {
+        std::lock_guard<std::mutex> lock(my_flusher->lock);
+        my_flusher->requested_flag = true;
+    }
+    my_flusher->cond.notify_one();
+
+    while (true) {
+        {
+            std::lock_guard<std::mutex> lock(my_flusher->lock);
+            if (my_flusher->done_flag) {
+                my_flusher->done_flag = false;
+                error_out = my_flusher->error;
+                break;
+            }
+        }
+
+        yield();
+        if (!good()) {
+            // `close()` has let go of the flusher, which finishes by
+            // itself.
+            return ECANCELED;
+        }
+    }
+
+    // the counter only has to be reset, so that the next flush wakes the
+    // queue up again.
+    uint64_t n = 0;
+    (void)::read(my_flusher->event_fd, &n, sizeof(n));
     return 0;
 }
 
@@ -335,6 +757,69 @@ int dmtr::posix_queue::creat(const char *pathname, mode_t mode)
 
 int dmtr::posix_queue::close()
 {
+    // pushes wait for the queue to be serviced, so whatever can still be
+    // sent without blocking goes out now.
+    if (good() && NULL != my_push_thread) {
+        (void)my_push_thread->service();
+    }
+
+    if (good()) {
+        DMTR_OK(drain_zerocopy());
+    }
+
+    free(my_peer_saddr);
+    my_peer_saddr = NULL;
+    if (NULL != my_connect_thread) {
+        our_connecting_queues.erase(qd());
+    }
+
+    // detached pushes have no token to report through, so they're handed
+    // back here.
+    while (!my_detached_pushes.empty()) {
+        detached_push dp = my_detached_pushes.front();
+        my_detached_pushes.pop_front();
+        finish_detached_push(dp.sga, ECONNABORTED, dp.done, dp.arg);
+    }
+
+    while (!my_file_sends.empty()) {
+        if (-1 != my_file_sends.front().fd) {
+            (void)::close(my_file_sends.front().fd);
+        }
+
+        my_file_sends.pop_front();
+    }
+
+    // nobody ever accepted these.
+    while (!my_accepted.empty()) {
+        (void)::close(my_accepted.front().fd);
+        my_accepted.pop_front();
+    }
+
+    my_recv_buffer.clear();
+    while (!my_datagrams.empty()) {
+        (void)dmtr_sgafree(&my_datagrams.front());
+        my_datagrams.pop_front();
+    }
+
+    if (NULL != my_flusher) {
+        // a flush that's under way finishes on its own; nobody is waiting
+        // for it anymore.
+        (void)epoll_ctl(our_epoll_fd, EPOLL_CTL_DEL, my_flusher->event_fd, NULL);
+        {
+            std::lock_guard<std::mutex> lock(my_flusher->lock);
+            my_flusher->stop_flag = true;
+        }
+        my_flusher->cond.notify_one();
+        my_flusher.reset();
+    }
+
+    my_file_reads.clear();
+    if (NULL != my_readahead_buf) {
+        (void)our_buffer_pool.free(my_readahead_buf);
+        my_readahead_buf = NULL;
+    }
+    my_readahead_len = 0;
+
     if (-1 == my_fd) {
         return 0;
     }
@@ -353,105 +838,605 @@ int dmtr::posix_queue::close()
     }
 }
 
-int dmtr::posix_queue::net_push(const dmtr_sgarray_t *sga, task::thread_type::yield_type &yield)
+int dmtr::posix_queue::net_push(task::thread_type::yield_type &yield, task::thread_type::queue_type &tq)
 {
-    size_t iov_len = 2 * sga->sga_numsegs + 1;
-    struct iovec iov[iov_len];
-    size_t data_size = 0;
+    // everything that was pushed since the last time around goes out in a
+    // single `writev()`, as far as `IOV_MAX` allows. the vectors are only
+    // ever filled up to their reserved size, so the iovecs that point into
+    // them stay valid.
+    my_push_batch.clear();
+    my_push_iov.clear();
+    my_push_headers.clear();
+    my_push_headers.reserve(IOV_MAX / 3);
+    my_push_seg_lens.clear();
+    my_push_seg_lens.reserve(IOV_MAX / 2);
+
     size_t message_bytes = 0;
-    uint32_t seg_lens[sga->sga_numsegs];
+    size_t detached_count = 0;
+    while (!tq.empty()) {
+        const dmtr_qtoken_t qt = tq.front();
+        if (0 != qt && !my_file_sends.empty() && qt == my_file_sends.front().qt) {
+            // a file goes out on its own, after what's ahead of it.
+            if (my_push_batch.empty()) {
+                return send_file(yield, tq);
+            }
 
-    // calculate size and fill in iov
-    for (size_t i = 0; i < sga->sga_numsegs; i++) {
-        static_assert(sizeof(*seg_lens) == sizeof(sga->sga_segs[i].sgaseg_len), "type mismatch");
-        const auto j = 2 * i + 1;
-        seg_lens[i] = htonl(sga->sga_segs[i].sgaseg_len);
-        iov[j].iov_base = &seg_lens[i];
-        iov[j].iov_len = sizeof(sga->sga_segs[i].sgaseg_len);
+            break;
+        }
+
+        const dmtr_sgarray_t *sga = NULL;
+        if (0 == qt) {
+            DMTR_TRUE(EINVAL, detached_count < my_detached_pushes.size());
+            sga = &my_detached_pushes[detached_count].sga;
+        } else {
+            task *t;
+            DMTR_OK(get_task(t, qt));
+            DMTR_TRUE(EINVAL, t->arg(sga));
+        }
 
-        const auto k = j + 1;
-        iov[k].iov_base = sga->sga_segs[i].sgaseg_buf;
-        iov[k].iov_len = sga->sga_segs[i].sgaseg_len;
+        const size_t iov_len = 2 * sga->sga_numsegs + 1;
+        if (!my_push_batch.empty() && my_push_iov.size() + iov_len > IOV_MAX) {
+            break;
+        }
 
-        // add up actual data size
-        data_size += sga->sga_segs[i].sgaseg_len;
+        tq.pop();
+        if (0 == qt) {
+            ++detached_count;
+        }
 
-        // add up expected packet size (not yet including header)
-        message_bytes += sga->sga_segs[i].sgaseg_len;
-        message_bytes += sizeof(sga->sga_segs[i].sgaseg_len);
-    }
+        size_t sgalen = 0;
+        DMTR_OK(dmtr_sgalen(&sgalen, sga));
+        if (0 == sgalen) {
+            my_push_batch.push_back(outgoing_message{qt, message_bytes, ENOMSG});
+            continue;
+        }
 
-    // fill in header
-    dmtr_header_t header = {};
-    header.h_magic = htonl(DMTR_HEADER_MAGIC);
-    header.h_bytes = htonl(message_bytes);
-    header.h_sgasegs = htonl(sga->sga_numsegs);
+        size_t data_bytes = 0;
+        my_push_headers.push_back(dmtr_header_t{});
+        dmtr_header_t &header = my_push_headers.back();
+        my_push_iov.push_back(iovec{&header, sizeof(header)});
+        for (size_t i = 0; i < sga->sga_numsegs; i++) {
+            static_assert(sizeof(uint32_t) == sizeof(sga->sga_segs[i].sgaseg_len), "type mismatch");
+            my_push_seg_lens.push_back(htonl(sga->sga_segs[i].sgaseg_len));
+            my_push_iov.push_back(iovec{&my_push_seg_lens.back(), sizeof(uint32_t)});
+            my_push_iov.push_back(iovec{sga->sga_segs[i].sgaseg_buf, sga->sga_segs[i].sgaseg_len});
+            data_bytes += sizeof(uint32_t) + sga->sga_segs[i].sgaseg_len;
+        }
 
-    // set up header at beginning of packet
-    iov[0].iov_base = &header;
-    iov[0].iov_len = sizeof(header);
-    message_bytes += sizeof(header);
+        header.h_magic = htonl(DMTR_HEADER_MAGIC);
+        header.h_bytes = htonl(data_bytes);
+        header.h_sgasegs = htonl(sga->sga_numsegs);
+        message_bytes += sizeof(header) + data_bytes;
+        my_push_batch.push_back(outgoing_message{qt, message_bytes, 0});
+    }
 
 #if DMTR_DEBUG
-    std::cerr << "push: sending message (" << message_bytes << " bytes)." << std::endl;
+    std::cerr << "push: sending " << my_push_batch.size() << " messages (" << message_bytes << " bytes)." << std::endl;
 #endif
 
-    size_t bytes_written = 0;
 #if DMTR_PROFILE
     auto t0 = boost::chrono::steady_clock::now();
     boost::chrono::duration<uint64_t, boost::nano> dt(0);
 #endif
-    int ret = writev(bytes_written, my_fd, iov, iov_len);
-    while (EAGAIN == ret) {
-#if DMTR_PROFILE
-        dt += boost::chrono::steady_clock::now() - t0;
-#endif
-        yield();
-#if DMTR_PROFILE
-        t0 = boost::chrono::steady_clock::now();
-#endif
-        ret = writev(bytes_written, my_fd, iov, iov_len);
+    // a zero-copy batch (and any batch behind one) is finished once the
+    // kernel is done with it; see `reap_zerocopy()`.
+    const bool zerocopy_flag = my_zerocopy_flag && message_bytes >= our_zerocopy_threshold;
+    zerocopy_send *z = NULL;
+    if (zerocopy_flag || !my_zerocopy_sends.empty()) {
+        my_zerocopy_sends.push_back(zerocopy_send{});
+        z = &my_zerocopy_sends.back();
+        z->messages.swap(my_push_batch);
+        z->headers.swap(my_push_headers);
+        z->seg_lens.swap(my_push_seg_lens);
+        z->first_id = my_zerocopy_next_id;
+        z->sending_flag = true;
     }
 
+    // otherwise, messages are finished in order, as soon as their last
+    // byte is written.
+    size_t bytes_written = 0;
+    size_t iov_next = 0;
+    size_t done_count = 0;
+    int ret = 0;
+    while (true) {
+        while (NULL == z && done_count < my_push_batch.size() && (0 != ret || my_push_batch[done_count].end <= bytes_written)) {
+            const outgoing_message &m = my_push_batch[done_count++];
+            DMTR_OK(finish_push(m.qt, 0 == m.error ? ret : m.error));
+        }
+
+        if (0 != ret || bytes_written == message_bytes) {
+            break;
+        }
+
+        size_t count = 0;
+        if (zerocopy_flag) {
+            ret = sendmsg(count, my_fd, &my_push_iov[iov_next], my_push_iov.size() - iov_next, MSG_ZEROCOPY);
+            if (0 == ret) {
+                ++z->id_count;
+                ++my_zerocopy_next_id;
+            } else if (ENOBUFS == ret) {
+                // the kernel won't keep track of any more zero-copy sends
+                // on this socket until it's done with some of them, so
+                // this piece is copied.
+                ret = writev(count, my_fd, &my_push_iov[iov_next], my_push_iov.size() - iov_next);
+            }
+        } else {
+            ret = writev(count, my_fd, &my_push_iov[iov_next], my_push_iov.size() - iov_next);
+        }
+
+        if (EAGAIN == ret) {
 #if DMTR_PROFILE
-    dt += (boost::chrono::steady_clock::now() - t0);
-    DMTR_OK(dmtr_record_latency(write_latency.get(), dt.count()));
+            dt += boost::chrono::steady_clock::now() - t0;
 #endif
-
-#if DMTR_DEBUG
-    std::cerr << "push: sent message (" << bytes_written << " bytes)." << std::endl;
+            ret = 0;
+            yield();
+            if (!good()) {
+                // `close()` has dealt with what's left.
+                return 0;
+            }
+#if DMTR_PROFILE
+            t0 = boost::chrono::steady_clock::now();
 #endif
+            // earlier batches may have been let go of in the meantime.
+            DMTR_OK(reap_zerocopy());
+            continue;
+        }
 
-    DMTR_TRUE(ENOTSUP, bytes_written == message_bytes);
+        // a short write picks up where it left off.
+        bytes_written += count;
+        if (NULL != z) {
+            // `close()` may take over the batch before it's all written.
+            z->bytes_sent = bytes_written;
+        }
 
-    return ret;
-}
+        while (count > 0) {
+            struct iovec &v = my_push_iov[iov_next];
+            if (count < v.iov_len) {
+                v.iov_base = reinterpret_cast<uint8_t *>(v.iov_base) + count;
+                v.iov_len -= count;
+                break;
+            }
 
-int dmtr::posix_queue::file_push(const dmtr_sgarray_t *sga, task::thread_type::yield_type &yield)
-{
-    size_t iov_len = sga->sga_numsegs;
-    struct iovec iov[iov_len];
-    size_t data_size = 0;
+            count -= v.iov_len;
+            ++iov_next;
+        }
+    }
+
+    if (NULL != z) {
+        z->bytes_sent = bytes_written;
+        z->error = ret;
+        z->sending_flag = false;
+        DMTR_OK(reap_zerocopy());
+    }
+
+#if DMTR_PROFILE
+    dt += (boost::chrono::steady_clock::now() - t0);
+    DMTR_OK(dmtr_record_latency(write_latency.get(), dt.count()));
+#endif
 
-    for (size_t i = 0; i < sga->sga_numsegs; i++) {
-        iov[i].iov_base = sga->sga_segs[i].sgaseg_buf;
-        iov[i].iov_len = sga->sga_segs[i].sgaseg_len;
-        data_size += sga->sga_segs[i].sgaseg_len;
 #if DMTR_DEBUG
-        std::cerr << "push: segs[" << i << "] addr=" << iov[i].iov_base << std::endl;
+    std::cerr << "push: sent " << bytes_written << " bytes." << std::endl;
 #endif
+
+    return 0;
+}
+
+int dmtr::posix_queue::finish_push(dmtr_qtoken_t qt, int error)
+{
+    if (0 == qt) {
+        // detached pushes are finished in the order they were started.
+        DMTR_TRUE(EINVAL, !my_detached_pushes.empty());
+        detached_push dp = my_detached_pushes.front();
+        my_detached_pushes.pop_front();
+        finish_detached_push(dp.sga, error, dp.done, dp.arg);
+        return 0;
+    }
+
+    task *t;
+    DMTR_OK(get_task(t, qt));
+    if (0 != error) {
+        return t->complete(error);
+    }
+
+    const dmtr_sgarray_t *sga = NULL;
+    DMTR_TRUE(EINVAL, t->arg(sga));
+    return t->complete(0, *sga);
+}
+
+int dmtr::posix_queue::send_file(task::thread_type::yield_type &yield, task::thread_type::queue_type &tq)
+{
+    const dmtr_qtoken_t qt = tq.front();
+    tq.pop();
+    DMTR_TRUE(EINVAL, !my_file_sends.empty() && qt == my_file_sends.front().qt);
+
+    // pushes are finished in order, so the batches that the kernel is
+    // still reading go first.
+    while (!my_zerocopy_sends.empty()) {
+        yield();
+        if (!good()) {
+            return 0;
+        }
+
+        DMTR_OK(reap_zerocopy());
+    }
+
+    // the file is framed as a message with a single segment. `MSG_MORE`
+    // holds the framing back until the start of the file goes with it.
+    struct {
+        dmtr_header_t header;
+        uint32_t seg_len;
+    } framing = {};
+    const size_t len = my_file_sends.front().count;
+    framing.header.h_magic = htonl(DMTR_HEADER_MAGIC);
+    framing.header.h_bytes = htonl(sizeof(framing.seg_len) + len);
+    framing.header.h_sgasegs = htonl(1);
+    framing.seg_len = htonl(len);
+
+    size_t framing_sent = 0;
+    int ret = 0 == len ? ENOMSG : 0;
+    while (0 == ret && framing_sent < sizeof(framing)) {
+        struct iovec v = {reinterpret_cast<uint8_t *>(&framing) + framing_sent, sizeof(framing) - framing_sent};
+        size_t count = 0;
+        ret = sendmsg(count, my_fd, &v, 1, MSG_MORE);
+        if (EAGAIN == ret) {
+            ret = 0;
+            yield();
+            if (!good()) {
+                // `close()` has dealt with what's left.
+                return 0;
+            }
+
+            continue;
+        }
+
+        framing_sent += count;
+    }
+
+    // the kernel reads the file straight out of the page cache.
+    while (0 == ret && my_file_sends.front().count > 0) {
+        file_send &fs = my_file_sends.front();
+        const ssize_t n = ::sendfile(my_fd, fs.fd, &fs.offset, fs.count);
+        if (-1 == n) {
+            if (EAGAIN == errno || EWOULDBLOCK == errno) {
+                yield();
+                if (!good()) {
+                    return 0;
+                }
+
+                continue;
+            }
+
+            ret = errno;
+            break;
+        }
+
+        if (0 == n) {
+            // the file got shorter after the push was started.
+            ret = EIO;
+            break;
+        }
+
+        fs.count -= n;
+    }
+
+    if (0 != ret && framing_sent > 0) {
+        // the message can't be finished, and nothing that followed it
+        // could be made sense of, so the peer sees the stream end instead.
+        (void)::shutdown(my_fd, SHUT_WR);
+    }
+
+    const file_send fs = my_file_sends.front();
+    my_file_sends.pop_front();
+    if (-1 != fs.fd) {
+        (void)::close(fs.fd);
+    }
+
+    task *t;
+    DMTR_OK(get_task(t, qt));
+    return t->complete(ret);
+}
+
+int dmtr::posix_queue::read_zerocopy_done(int fd, std::deque<zerocopy_send> &sends)
+{
+    // the kernel reports the sends that it's done with as ranges of their
+    // numbers, and merges ranges that are waiting to be read.
+    while (true) {
+        uint64_t control[8];
+        struct msghdr msg = {};
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (-1 == ::recvmsg(fd, &msg, MSG_ERRQUEUE)) {
+            if (EAGAIN == errno || EWOULDBLOCK == errno) {
+                break;
+            }
+
+            return errno;
+        }
+
+        for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); NULL != c; c = CMSG_NXTHDR(&msg, c)) {
+            if (!(SOL_IP == c->cmsg_level && IP_RECVERR == c->cmsg_type)
+                && !(SOL_IPV6 == c->cmsg_level && IPV6_RECVERR == c->cmsg_type)) {
+                continue;
+            }
+
+            struct sock_extended_err err;
+            memcpy(&err, CMSG_DATA(c), sizeof(err));
+            if (SO_EE_ORIGIN_ZEROCOPY != err.ee_origin || 0 != err.ee_errno) {
+                continue;
+            }
+
+            // the numbers wrap around, so they're compared by how far they
+            // are from the batch's first one.
+            for (auto &z : sends) {
+                const int64_t begin = std::max<int64_t>(static_cast<int32_t>(err.ee_info - z.first_id), 0);
+                const int64_t end = std::min<int64_t>(static_cast<int64_t>(static_cast<int32_t>(err.ee_data - z.first_id)) + 1, z.id_count);
+                if (begin < end) {
+                    z.ids_done += end - begin;
+                }
+            }
+        }
+    }
+
+    return 0;
+}
+
+int dmtr::posix_queue::reap_zerocopy()
+{
+    if (my_zerocopy_sends.empty()) {
+        return 0;
+    }
+
+    DMTR_OK(read_zerocopy_done(my_fd, my_zerocopy_sends));
+    while (!my_zerocopy_sends.empty()) {
+        const zerocopy_send &front = my_zerocopy_sends.front();
+        if (front.sending_flag || front.ids_done < front.id_count) {
+            break;
+        }
+
+        // finishing a push may call back into the application, which may
+        // close the queue.
+        const zerocopy_send z = std::move(my_zerocopy_sends.front());
+        my_zerocopy_sends.pop_front();
+        DMTR_OK(finish_zerocopy(z));
+    }
+
+    return 0;
+}
+
+int dmtr::posix_queue::finish_zerocopy(const zerocopy_send &z)
+{
+    for (const auto &m : z.messages) {
+        int error = m.error;
+        if (0 == error && m.end > z.bytes_sent) {
+            error = z.error;
+        }
+
+        DMTR_OK(finish_push(m.qt, error));
+    }
+
+    return 0;
+}
+
+int dmtr::posix_queue::drain_zerocopy()
+{
+    for (auto &z : my_zerocopy_sends) {
+        // `net_push()` won't be coming back for it, so what it hasn't sent
+        // yet never will be.
+        if (z.sending_flag && 0 == z.error) {
+            z.error = ECONNABORTED;
+        }
+
+        z.sending_flag = false;
+    }
+
+    DMTR_OK(reap_zerocopy());
+    if (my_zerocopy_sends.empty()) {
+        return 0;
+    }
+
+    // the kernel reads what was pushed from the pushed buffers until the
+    // peer has acknowledged it, and `close()` doesn't wait for that. the
+    // socket is shut down for writing, so that everything that was pushed
+    // is still delivered, and handed over to the core together with the
+    // buffers; see `reap_lingering()`. pushes with tokens are aborted along
+    // with the rest of the queue's operations, but detached pushes are
+    // handed back once the kernel is done with them.
+    lingering_socket ls;
+    ls.fd = my_fd;
+    size_t detached_count = 0;
+    for (const auto &z : my_zerocopy_sends) {
+        for (const auto &m : z.messages) {
+            if (0 == m.qt) {
+                ++detached_count;
+            } else {
+                DMTR_OK(finish_push(m.qt, ECONNABORTED));
+            }
+        }
+    }
+
+    DMTR_TRUE(EINVAL, detached_count <= my_detached_pushes.size());
+    for (size_t i = 0; i < detached_count; ++i) {
+        ls.detached_pushes.push_back(my_detached_pushes.front());
+        my_detached_pushes.pop_front();
+    }
+
+    ls.sends.swap(my_zerocopy_sends);
+    (void)::shutdown(my_fd, SHUT_WR);
+    // the error queue is reported as `EPOLLERR`, which needn't be asked
+    // for.
+    struct epoll_event ev = {};
+    ev.events = EPOLLET;
+    ev.data.u64 = LINGERING_SOCKET_QD;
+    if (-1 == epoll_ctl(our_epoll_fd, EPOLL_CTL_MOD, my_fd, &ev)) {
+        DMTR_TRUE(errno, ENOENT == errno);
+        DMTR_TRUE(errno, 0 == epoll_ctl(our_epoll_fd, EPOLL_CTL_ADD, my_fd, &ev));
+    }
+
+    our_lingering_sockets.push_back(std::move(ls));
+    // the descriptor isn't ours to close anymore.
+    my_fd = -1;
+    return 0;
+}
+
+int dmtr::posix_queue::reap_lingering()
+{
+    for (auto it = our_lingering_sockets.begin(); it != our_lingering_sockets.end();) {
+        lingering_socket &ls = *it;
+        DMTR_OK(read_zerocopy_done(ls.fd, ls.sends));
+        while (!ls.sends.empty() && ls.sends.front().ids_done == ls.sends.front().id_count) {
+            const zerocopy_send &z = ls.sends.front();
+            for (const auto &m : z.messages) {
+                if (0 != m.qt) {
+                    continue;
+                }
+
+                int error = m.error;
+                if (0 == error && m.end > z.bytes_sent) {
+                    error = z.error;
+                }
+
+                DMTR_TRUE(EINVAL, !ls.detached_pushes.empty());
+                detached_push dp = ls.detached_pushes.front();
+                ls.detached_pushes.pop_front();
+                finish_detached_push(dp.sga, error, dp.done, dp.arg);
+            }
+
+            ls.sends.pop_front();
+        }
+
+        if (!ls.sends.empty()) {
+            ++it;
+            continue;
+        }
+
+        (void)::close(ls.fd);
+        it = our_lingering_sockets.erase(it);
+    }
+
+    return 0;
+}
+
+int dmtr::posix_queue::file_push(task::thread_type::yield_type &yield, task::thread_type::queue_type &tq)
+{
+    // the writes may change what has been read ahead.
+    my_readahead_len = 0;
+
+    // everything that was pushed since the last time around is appended
+    // with a single `writev()` and, for a synchronous file, made durable
+    // with a single flush. that's the group commit: the flush runs on the
+    // flusher's thread, and pushes that arrive while it's under way are
+    // picked up together by the next one.
+    my_push_batch.clear();
+    my_push_iov.clear();
+
+    size_t data_bytes = 0;
+    size_t detached_count = 0;
+    while (!tq.empty()) {
+        const dmtr_qtoken_t qt = tq.front();
+        const dmtr_sgarray_t *sga = NULL;
+        if (0 == qt) {
+            DMTR_TRUE(EINVAL, detached_count < my_detached_pushes.size());
+            sga = &my_detached_pushes[detached_count].sga;
+        } else {
+            task *t;
+            DMTR_OK(get_task(t, qt));
+            DMTR_TRUE(EINVAL, t->arg(sga));
+        }
+
+        if (!my_push_batch.empty() && my_push_iov.size() + sga->sga_numsegs > IOV_MAX) {
+            break;
+        }
+
+        tq.pop();
+        if (0 == qt) {
+            ++detached_count;
+        }
+
+        size_t sgalen = 0;
+        DMTR_OK(dmtr_sgalen(&sgalen, sga));
+        if (0 == sgalen) {
+            my_push_batch.push_back(outgoing_message{qt, data_bytes, ENOMSG});
+            continue;
+        }
+
+        for (size_t i = 0; i < sga->sga_numsegs; i++) {
+            my_push_iov.push_back(iovec{sga->sga_segs[i].sgaseg_buf, sga->sga_segs[i].sgaseg_len});
+        }
+
+        data_bytes += sgalen;
+        my_push_batch.push_back(outgoing_message{qt, data_bytes, 0});
     }
+
 #if DMTR_DEBUG
-    std::cerr << "push: segs=" << iov_len << " totallen=" << data_size << std::endl;
+    std::cerr << "push: appending " << my_push_batch.size() << " messages (" << data_bytes << " bytes)." << std::endl;
+#endif
+
+#if DMTR_PROFILE
+    auto t0 = boost::chrono::steady_clock::now();
 #endif
     size_t bytes_written = 0;
-    int ret = writev(bytes_written, my_fd, iov, iov_len);
-    while (EAGAIN == ret) {
-        yield();
-        ret = writev(bytes_written, my_fd, iov, iov_len);
+    size_t iov_next = 0;
+    int ret = 0;
+    while (bytes_written < data_bytes) {
+        size_t count = 0;
+        ret = writev(count, my_fd, &my_push_iov[iov_next], my_push_iov.size() - iov_next);
+        if (EAGAIN == ret) {
+            ret = 0;
+            yield();
+            if (!good()) {
+                // `close()` has dealt with what's left.
+                return 0;
+            }
+            continue;
+        }
+
+        if (0 != ret) {
+            break;
+        }
+
+        // a short write picks up where it left off.
+        bytes_written += count;
+        while (count > 0) {
+            struct iovec &v = my_push_iov[iov_next];
+            if (count < v.iov_len) {
+                v.iov_base = reinterpret_cast<uint8_t *>(v.iov_base) + count;
+                v.iov_len -= count;
+                break;
+            }
+
+            count -= v.iov_len;
+            ++iov_next;
+        }
+    }
+
+    // a push only succeeds once all of it is written and, if the file is
+    // synchronous, flushed.
+    int sync_ret = 0;
+    if (NULL != my_flusher && bytes_written > 0) {
+        const int flush_ret = flush_file(sync_ret, yield);
+        if (ECANCELED == flush_ret) {
+            // `close()` has dealt with what's left.
+            return 0;
+        }
+
+        DMTR_OK(flush_ret);
+    }
+
+#if DMTR_PROFILE
+    DMTR_OK(dmtr_record_latency(write_latency.get(), (boost::chrono::steady_clock::now() - t0).count()));
+#endif
+
+    for (size_t i = 0; i < my_push_batch.size(); ++i) {
+        const outgoing_message &m = my_push_batch[i];
+        int error = m.error;
+        if (0 == error) {
+            error = m.end <= bytes_written ? sync_ret : ret;
+        }
+
+        DMTR_OK(finish_push(m.qt, error));
     }
-    //ret = fsync(my_fd);
-    return ret;
+
+    return 0;
 }
 
 int dmtr::posix_queue::push(dmtr_qtoken_t qt, const dmtr_sgarray_t &sga)
@@ -460,187 +1445,586 @@ int dmtr::posix_queue::push(dmtr_qtoken_t qt, const dmtr_sgarray_t &sga)
     DMTR_TRUE(ENOTSUP, !my_listening_flag);
     DMTR_NOTNULL(EINVAL, my_push_thread);
 
+    // the push goes out with whatever else is pushed before the queue is
+    // next serviced.
     DMTR_OK(new_task(qt, DMTR_OPC_PUSH, sga));
     my_push_thread->enqueue(qt);
-    my_push_thread->service();
+    return 0;
+}
+
+int dmtr::posix_queue::push_batch(const dmtr_qtoken_t qts[], const dmtr_sgarray_t sgas[], int count)
+{
+    DMTR_TRUE(EINVAL, my_fd != -1);
+    DMTR_TRUE(ENOTSUP, !my_listening_flag);
+    DMTR_NOTNULL(EINVAL, my_push_thread);
+
+    for (int i = 0; i < count; ++i) {
+        DMTR_OK(new_task(qts[i], DMTR_OPC_PUSH, sgas[i]));
+        my_push_thread->enqueue(qts[i]);
+    }
+
+    return 0;
+}
+
+int dmtr::posix_queue::push_detached(const dmtr_sgarray_t &sga, dmtr_push_done_fn done, void *arg)
+{
+    DMTR_TRUE(EINVAL, my_fd != -1);
+    DMTR_TRUE(ENOTSUP, !my_listening_flag);
+    DMTR_NOTNULL(EINVAL, my_push_thread);
+
+    // no task is needed; a zero token tells the push thread to take the
+    // next detached push instead.
+    my_detached_pushes.push_back(detached_push{sga, done, arg});
+    my_push_thread->enqueue(0);
+    schedule();
+    return 0;
+}
+
+int dmtr::posix_queue::push_file(dmtr_qtoken_t qt, io_queue &file_q, off_t offset, size_t count)
+{
+    DMTR_TRUE(EINVAL, my_fd != -1);
+    DMTR_TRUE(ENOTSUP, NETWORK_Q == my_cid && my_tcp_flag && !my_listening_flag);
+    DMTR_NOTNULL(EINVAL, my_push_thread);
+    auto * const fq = dynamic_cast<posix_queue *>(&file_q);
+    DMTR_NOTNULL(EINVAL, fq);
+    DMTR_TRUE(EINVAL, FILE_Q == fq->my_cid && fq->good());
+
+    const int flags = fcntl(fq->my_fd, F_GETFL);
+    if (-1 == flags) {
+        return errno;
+    }
+
+    DMTR_TRUE(EBADF, O_WRONLY != (flags & O_ACCMODE));
+
+    // the length goes out ahead of the data, so the range is settled now.
+    struct stat st = {};
+    if (-1 == fstat(fq->my_fd, &st)) {
+        return errno;
+    }
+
+    // `sendfile()` needs a file that it can read out of the page cache.
+    DMTR_TRUE(ENOTSUP, S_ISREG(st.st_mode));
+    size_t len = 0;
+    if (offset < st.st_size) {
+        len = std::min<uint64_t>(count, st.st_size - offset);
+    }
+
+    DMTR_TRUE(EMSGSIZE, len <= UINT32_MAX - sizeof(uint32_t));
+    int fd = -1;
+    if (len > 0) {
+        fd = fcntl(fq->my_fd, F_DUPFD_CLOEXEC, 0);
+        if (-1 == fd) {
+            return errno;
+        }
+    }
+
+    int ret = new_task(qt, DMTR_OPC_PUSH);
+    if (0 != ret) {
+        if (-1 != fd) {
+            (void)::close(fd);
+        }
+
+        DMTR_FAIL(ret);
+    }
+
+    my_file_sends.push_back(file_send{qt, fd, offset, len});
+    my_push_thread->enqueue(qt);
     return 0;
 }
 
 int dmtr::posix_queue::push_thread(task::thread_type::yield_type &yield, task::thread_type::queue_type &tq) {
     while (good()) {
-        while (tq.empty()) {
+        while (tq.empty() && my_zerocopy_sends.empty()) {
+            yield();
+        }
+
+        switch (my_cid) {
+            default:
+                DMTR_UNREACHABLE();
+            case NETWORK_Q:
+                if (my_tcp_flag) {
+                    DMTR_OK(reap_zerocopy());
+                    if (tq.empty()) {
+                        // the kernel still has zero-copy sends to let go
+                        // of.
+                        yield();
+                    } else {
+                        DMTR_OK(net_push(yield, tq));
+                    }
+                } else {
+                    DMTR_OK(dgram_push(yield, tq));
+                }
+                break;
+            case FILE_Q:
+                DMTR_OK(file_push(yield, tq));
+                break;
+        }
+    }
+
+    return 0;
+}
+
+int dmtr::posix_queue::net_pop(dmtr_sgarray_t *sga, task::thread_type::yield_type &yield)
+{
+#if DMTR_PROFILE
+    boost::chrono::steady_clock::time_point t0;
+    boost::chrono::duration<uint64_t, boost::nano> dt(0);
+#endif
+    // a single read usually brings in several messages, so there's only
+    // a system call if the buffer doesn't already hold the next one.
+    while (true) {
+        bool done = false;
+        int ret = my_recv_buffer.pop(done, *sga);
+        if (0 != ret) {
+            return ret;
+        }
+
+        if (done) {
+#if DMTR_PROFILE
+            DMTR_OK(dmtr_record_latency(read_latency.get(), dt.count()));
+#endif
+#if DMTR_DEBUG
+            std::cerr << "pop: sgarray has " << sga->sga_numsegs << " segments." << std::endl;
+#endif
+            return 0;
+        }
+
+        void *p = NULL;
+        size_t len = 0;
+        DMTR_OK(my_recv_buffer.reserve(p, len));
+#if DMTR_DEBUG
+        std::cerr << "pop: attempting to read " << len << " bytes..." << std::endl;
+#endif
+#if DMTR_PROFILE
+        t0 = boost::chrono::steady_clock::now();
+#endif
+        size_t bytes_read = 0;
+        ret = read(bytes_read, my_fd, p, len);
+#if DMTR_PROFILE
+        dt += (boost::chrono::steady_clock::now() - t0);
+#endif
+        if (EAGAIN == ret) {
             yield();
+            continue;
         }
 
-        auto qt = tq.front();
-        tq.pop();
-        task *t;
-        DMTR_OK(get_task(t, qt));
+        if (0 == bytes_read) {
+            return ECONNABORTED;
+        }
+
+        my_recv_buffer.commit(bytes_read);
+    }
+}
 
+int dmtr::posix_queue::dgram_push(task::thread_type::yield_type &yield, task::thread_type::queue_type &tq)
+{
+    // the vectors are only ever filled up to their reserved size, so the
+    // iovecs and messages that point into them stay valid.
+    my_dgram_batch.clear();
+    my_push_iov.clear();
+    my_push_iov.reserve(DGRAM_SEND_BATCH * (1 + 2 * DMTR_SGARRAY_MAXSIZE));
+    my_push_headers.clear();
+    my_push_headers.reserve(DGRAM_SEND_BATCH);
+    my_push_seg_lens.clear();
+    my_push_seg_lens.reserve(DGRAM_SEND_BATCH * DMTR_SGARRAY_MAXSIZE);
+
+    size_t detached_count = 0;
+    while (!tq.empty() && my_dgram_batch.size() < DGRAM_SEND_BATCH) {
+        const dmtr_qtoken_t qt = tq.front();
         const dmtr_sgarray_t *sga = NULL;
-        DMTR_TRUE(EINVAL, t->arg(sga));
+        if (0 == qt) {
+            DMTR_TRUE(EINVAL, detached_count < my_detached_pushes.size());
+            sga = &my_detached_pushes[detached_count].sga;
+            ++detached_count;
+        } else {
+            task *t;
+            DMTR_OK(get_task(t, qt));
+            DMTR_TRUE(EINVAL, t->arg(sga));
+        }
 
-#if DMTR_DEBUG
-        std::cerr << "push(" << qt << "): preparing message." << std::endl;
-#endif
+        tq.pop();
+        my_dgram_batch.push_back(outgoing_datagram{qt, 0, my_push_iov.size(), 0, 0, NULL, 0});
+        outgoing_datagram &d = my_dgram_batch.back();
 
         size_t sgalen = 0;
         DMTR_OK(dmtr_sgalen(&sgalen, sga));
         if (0 == sgalen) {
-            DMTR_OK(t->complete(ENOMSG));
-            // move onto the next task.
+            d.error = ENOMSG;
             continue;
         }
 
-        int ret = 0;
-        switch (my_cid) {
-        case NETWORK_Q:
-            ret = net_push(sga, yield);
-            break;
-        case FILE_Q:
-            ret = file_push(sga, yield);
-            break;
-        default:
-            ret = ENOTSUP;
+        // an unconnected socket sends each datagram where its sga says.
+        if (NULL == my_peer_saddr) {
+            if (AF_INET != sga->sga_addr.sin_family) {
+                d.error = EDESTADDRREQ;
+                continue;
+            }
+
+            d.dest = const_cast<struct sockaddr_in *>(&sga->sga_addr);
+        }
+
+        size_t data_bytes = 0;
+        my_push_headers.push_back(dmtr_header_t{});
+        dmtr_header_t &header = my_push_headers.back();
+        my_push_iov.push_back(iovec{&header, sizeof(header)});
+        for (size_t i = 0; i < sga->sga_numsegs; i++) {
+            my_push_seg_lens.push_back(htonl(sga->sga_segs[i].sgaseg_len));
+            my_push_iov.push_back(iovec{&my_push_seg_lens.back(), sizeof(uint32_t)});
+            my_push_iov.push_back(iovec{sga->sga_segs[i].sgaseg_buf, sga->sga_segs[i].sgaseg_len});
+            data_bytes += sizeof(uint32_t) + sga->sga_segs[i].sgaseg_len;
+        }
+
+        header.h_magic = htonl(DMTR_HEADER_MAGIC);
+        header.h_bytes = htonl(data_bytes);
+        header.h_sgasegs = htonl(sga->sga_numsegs);
+        d.size = sizeof(header) + data_bytes;
+        if (d.size > DGRAM_MAX_SIZE) {
+            d.error = EMSGSIZE;
+            my_push_iov.resize(d.iov_begin);
+            continue;
+        }
+
+        d.iov_count = my_push_iov.size() - d.iov_begin;
+    }
+
+    (void)layout_datagrams(0, 0);
+
+#if DMTR_DEBUG
+    std::cerr << "push: sending " << my_dgram_batch.size() << " datagrams in " << my_send_msgs.size() << " messages." << std::endl;
+#endif
+
+    // pushes are finished in order, as soon as the message that carries
+    // them is sent.
+    size_t msgs_sent = 0;
+    size_t done_count = 0;
+    while (true) {
+        while (done_count < my_dgram_batch.size()) {
+            const outgoing_datagram &d = my_dgram_batch[done_count];
+            if (0 == d.error && d.msg >= msgs_sent) {
+                break;
+            }
+
+            ++done_count;
+            DMTR_OK(finish_push(d.qt, d.error));
+        }
+
+        if (done_count == my_dgram_batch.size()) {
             break;
         }
 
-        if (0 != ret) {
-            DMTR_OK(t->complete(ret));
-            // move onto the next task.
+        const int n = ::sendmmsg(my_fd, &my_send_msgs[msgs_sent], my_send_msgs.size() - msgs_sent, MSG_DONTWAIT);
+        if (n > 0) {
+            msgs_sent += n;
             continue;
         }
-        DMTR_OK(t->complete(0, *sga));
+
+        const int error = errno;
+        switch (error) {
+            case EINTR:
+                continue;
+            case EAGAIN:
+#if EAGAIN != EWOULDBLOCK
+            case EWOULDBLOCK:
+#endif
+            case ENOBUFS:
+                yield();
+                if (!good()) {
+                    // `close()` has dealt with what's left.
+                    return 0;
+                }
+                continue;
+            default:
+                break;
+        }
+
+        // the first push that this message carries.
+        const size_t first = done_count;
+
+        if (0 != my_send_msgs[msgs_sent].msg_hdr.msg_controllen && (EINVAL == error || EIO == error)) {
+            // the kernel won't segment datagrams this big (e.g. because
+            // they don't fit the path MTU), so they're sent one by one from
+            // now on.
+            my_gso_limit = my_dgram_batch[first].size - 1;
+            (void)layout_datagrams(first, msgs_sent);
+            continue;
+        }
+
+        for (size_t i = first; i < my_dgram_batch.size() && my_dgram_batch[i].msg <= msgs_sent; ++i) {
+            if (0 == my_dgram_batch[i].error) {
+                my_dgram_batch[i].error = error;
+            }
+        }
+
+        ++msgs_sent;
     }
 
     return 0;
 }
 
-int dmtr::posix_queue::net_pop(dmtr_sgarray_t *sga, task::thread_type::yield_type &yield)
+// groups the pushes from `first` on into messages for `sendmmsg()`,
+// starting with message `msg`.
+size_t dmtr::posix_queue::layout_datagrams(size_t first, size_t msg)
 {
+    const size_t cmsg_words = (CMSG_SPACE(sizeof(uint16_t)) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+    my_send_cmsgs.resize(DGRAM_SEND_BATCH * cmsg_words);
+    my_send_msgs.reserve(DGRAM_SEND_BATCH);
+    my_send_msgs.resize(msg);
+
+    size_t seg_size = 0;
+    size_t seg_count = 0;
+    const struct sockaddr_in *dest = NULL;
+    auto set_gso = [&]() {
+        if (seg_count < 2) {
+            return;
+        }
 
-    // if we don't have a full header yet, get one.
-    size_t header_bytes = 0;
-    dmtr_header_t header;
-    int ret = -1;
-#if DMTR_PROFILE
-    boost::chrono::steady_clock::time_point t0;
-    boost::chrono::duration<uint64_t, boost::nano> dt(0);
-#endif
-    while (header_bytes < sizeof(header)) {
-        uint8_t *p = reinterpret_cast<uint8_t *>(&header) + header_bytes;
-        size_t remaining_bytes = sizeof(header) - header_bytes;
-        size_t bytes_read = 0;
-#if DMTR_DEBUG
-        std::cerr << "pop: attempting to read " << remaining_bytes << " bytes..." << std::endl;
-#endif
-#if DMTR_PROFILE
-        t0 = boost::chrono::steady_clock::now();
-#endif
-        ret = read(bytes_read, my_fd, p, remaining_bytes);
+        struct msghdr &h = my_send_msgs.back().msg_hdr;
+        h.msg_control = &my_send_cmsgs[(my_send_msgs.size() - 1) * cmsg_words];
+        h.msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+        struct cmsghdr *c = CMSG_FIRSTHDR(&h);
+        c->cmsg_level = SOL_UDP;
+        c->cmsg_type = UDP_SEGMENT;
+        c->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+        const uint16_t gso_size = seg_size;
+        memcpy(CMSG_DATA(c), &gso_size, sizeof(gso_size));
+    };
+
+    for (size_t i = first; i < my_dgram_batch.size(); ++i) {
+        outgoing_datagram &d = my_dgram_batch[i];
+        if (0 != d.error) {
+            continue;
+        }
+
+        // GSO cuts a message into datagrams of the same size, all going to
+        // the same place.
+        if (seg_count > 0 && d.size == seg_size && d.size <= my_gso_limit &&
+            seg_count < DGRAM_GSO_MAX_SEGMENTS && (seg_count + 1) * seg_size <= DGRAM_MAX_SIZE) {
+            struct msghdr &h = my_send_msgs.back().msg_hdr;
+            const bool same_dest = (NULL == dest && NULL == d.dest) ||
+                (NULL != dest && NULL != d.dest && dest->sin_addr.s_addr == d.dest->sin_addr.s_addr && dest->sin_port == d.dest->sin_port);
+            if (same_dest && h.msg_iov + h.msg_iovlen == &my_push_iov[d.iov_begin] &&
+                h.msg_iovlen + d.iov_count <= IOV_MAX) {
+                h.msg_iovlen += d.iov_count;
+                ++seg_count;
+                d.msg = my_send_msgs.size() - 1;
+                continue;
+            }
+        }
+
+        set_gso();
+        my_send_msgs.push_back(mmsghdr{});
+        struct msghdr &h = my_send_msgs.back().msg_hdr;
+        h.msg_name = d.dest;
+        h.msg_namelen = NULL == d.dest ? 0 : sizeof(*d.dest);
+        h.msg_iov = &my_push_iov[d.iov_begin];
+        h.msg_iovlen = d.iov_count;
+        d.msg = my_send_msgs.size() - 1;
+        seg_size = d.size;
+        seg_count = 1;
+        dest = d.dest;
+    }
+
+    set_gso();
+    return my_send_msgs.size();
+}
+
+int dmtr::posix_queue::dgram_pop(dmtr_sgarray_t *sga, task::thread_type::yield_type &yield)
+{
+    while (my_datagrams.empty()) {
+        int ret = recv_datagrams();
         if (EAGAIN == ret) {
-#if DMTR_PROFILE
-            dt += (boost::chrono::steady_clock::now() - t0);
-#endif
             yield();
             continue;
+        }
 
+        if (0 != ret) {
+            return ret;
         }
+    }
 
-        if (0 == bytes_read) {
-            return ECONNABORTED;
+    *sga = my_datagrams.front();
+    my_datagrams.pop_front();
+#if DMTR_DEBUG
+    std::cerr << "pop: datagram has " << sga->sga_numsegs << " segments." << std::endl;
+#endif
+    return 0;
+}
+
+int dmtr::posix_queue::recv_datagrams()
+{
+    const size_t cmsg_words = (CMSG_SPACE(sizeof(int)) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+    if (NULL == my_recv_slots) {
+        my_recv_slots.reset(new uint8_t[DGRAM_RECV_BATCH * DGRAM_SLOT_SIZE]);
+        my_recv_msgs.resize(DGRAM_RECV_BATCH);
+        my_recv_iov.resize(DGRAM_RECV_BATCH);
+        my_recv_addrs.resize(DGRAM_RECV_BATCH);
+        my_recv_cmsgs.resize(DGRAM_RECV_BATCH * cmsg_words);
+    }
+
+    for (size_t i = 0; i < DGRAM_RECV_BATCH; ++i) {
+        my_recv_iov[i] = iovec{&my_recv_slots[i * DGRAM_SLOT_SIZE], DGRAM_SLOT_SIZE};
+        my_recv_msgs[i] = mmsghdr{};
+        struct msghdr &h = my_recv_msgs[i].msg_hdr;
+        h.msg_name = &my_recv_addrs[i];
+        h.msg_namelen = sizeof(my_recv_addrs[i]);
+        h.msg_iov = &my_recv_iov[i];
+        h.msg_iovlen = 1;
+        h.msg_control = &my_recv_cmsgs[i * cmsg_words];
+        h.msg_controllen = cmsg_words * sizeof(uint64_t);
+    }
+
+    const int n = ::recvmmsg(my_fd, my_recv_msgs.data(), DGRAM_RECV_BATCH, MSG_DONTWAIT, NULL);
+    if (-1 == n) {
+        if (EAGAIN == errno || EWOULDBLOCK == errno || EINTR == errno) {
+            return EAGAIN;
         }
 
-        header_bytes += bytes_read;
+        return errno;
+    }
 
-#if DMTR_PROFILE
-	    dt += (boost::chrono::steady_clock::now() - t0);
-#endif
-	}
+    for (int i = 0; i < n; ++i) {
+        struct msghdr &h = my_recv_msgs[i].msg_hdr;
+        const size_t len = my_recv_msgs[i].msg_len;
+        if (0 != (h.msg_flags & MSG_TRUNC)) {
+            continue;
+        }
 
+        // with GRO, one buffer may hold several datagrams from the same
+        // sender, all but the last of them `seg_size` bytes long.
+        size_t seg_size = len;
+        for (struct cmsghdr *c = CMSG_FIRSTHDR(&h); NULL != c; c = CMSG_NXTHDR(&h, c)) {
+            if (SOL_UDP == c->cmsg_level && UDP_GRO == c->cmsg_type) {
+                int gso_size = 0;
+                memcpy(&gso_size, CMSG_DATA(c), sizeof(gso_size));
+                if (gso_size > 0) {
+                    seg_size = gso_size;
+                }
+            }
+        }
 
-#if DMTR_DEBUG
-    std::cerr << "pop: read " << header_bytes << " bytes for header." << std::endl;
-#endif
+        const uint8_t * const p = &my_recv_slots[i * DGRAM_SLOT_SIZE];
+        for (size_t offset = 0; offset < len; offset += seg_size) {
+            dmtr_sgarray_t sga = {};
+            int ret = parse_datagram(sga, p + offset, std::min(seg_size, len - offset), my_recv_addrs[i]);
+            switch (ret) {
+                default:
+                    return ret;
+                case 0:
+                    my_datagrams.push_back(sga);
+                    break;
+                // a datagram that isn't framed properly is dropped.
+                case EILSEQ:
+                    break;
+            }
+        }
+    }
+
+    return 0;
+}
+
+int dmtr::posix_queue::parse_datagram(dmtr_sgarray_t &sga_out, const uint8_t *p, size_t len, const struct sockaddr_in &addr)
+{
+    dmtr_header_t header;
+    if (len < sizeof(header)) {
+        return EILSEQ;
+    }
 
+    memcpy(&header, p, sizeof(header));
     header.h_magic = ntohl(header.h_magic);
     header.h_bytes = ntohl(header.h_bytes);
     header.h_sgasegs = ntohl(header.h_sgasegs);
-
-    if (DMTR_HEADER_MAGIC != header.h_magic) {
+    if (DMTR_HEADER_MAGIC != header.h_magic || len - sizeof(header) != header.h_bytes) {
         return EILSEQ;
     }
 
-#if DMTR_DEBUG
-    std::cerr << "pop: header magic number is correct." << std::endl;
-#endif
+    if (0 == header.h_sgasegs || header.h_sgasegs > DMTR_SGARRAY_MAXSIZE) {
+        return EILSEQ;
+    }
 
-    // grab the rest of the message
-    DMTR_OK(dmtr_malloc(&sga->sga_buf, header.h_bytes));
-   std::unique_ptr<uint8_t> buf(reinterpret_cast<uint8_t *>(sga->sga_buf));
-    size_t data_bytes = 0;
-    ret = -1;
-    while (data_bytes < header.h_bytes) {
-        uint8_t *p = reinterpret_cast<uint8_t *>(sga->sga_buf) + data_bytes;
-        size_t remaining_bytes = header.h_bytes - data_bytes;
-        size_t bytes_read = 0;
-#if DMTR_DEBUG
-        std::cerr << "pop: attempting to read " << remaining_bytes << " bytes..." << std::endl;
-#endif
-#if DMTR_PROFILE
-        t0 = boost::chrono::steady_clock::now();
-#endif
-        ret = read(bytes_read, my_fd, p, remaining_bytes);
-        if (EAGAIN == ret) {
-#if DMTR_PROFILE
-            dt += (boost::chrono::steady_clock::now() - t0);
-#endif
-            yield();
-            continue;
+    dmtr_sgarray_t sga = {};
+    DMTR_OK(our_buffer_pool.alloc(sga.sga_buf, header.h_bytes));
+    sga.sga_pool = &our_buffer_pool;
+    raii_guard buf_guard([&]() {
+        (void)our_buffer_pool.free(sga.sga_buf);
+    });
+    memcpy(sga.sga_buf, p + sizeof(header), header.h_bytes);
+
+    // the lengths come from the peer, so they're checked against the
+    // datagram's size.
+    uint8_t *q = reinterpret_cast<uint8_t *>(sga.sga_buf);
+    const uint8_t * const end = q + header.h_bytes;
+    sga.sga_numsegs = header.h_sgasegs;
+    for (size_t i = 0; i < sga.sga_numsegs; ++i) {
+        if (static_cast<size_t>(end - q) < sizeof(uint32_t)) {
+            return EILSEQ;
         }
 
-        if (0 == bytes_read) {
-            return ECONNABORTED;
+        uint32_t seglen = 0;
+        memcpy(&seglen, q, sizeof(seglen));
+        seglen = ntohl(seglen);
+        if (static_cast<size_t>(end - q) - sizeof(uint32_t) < seglen) {
+            return EILSEQ;
         }
 
-        data_bytes += bytes_read;
+        q += sizeof(uint32_t);
+        sga.sga_segs[i].sgaseg_buf = q;
+        sga.sga_segs[i].sgaseg_len = seglen;
+        q += seglen;
+    }
 
-#if DMTR_PROFILE
-        dt += (boost::chrono::steady_clock::now() - t0);
-#endif
+    sga.sga_addr = addr;
+    buf_guard.cancel();
+    sga_out = sga;
+    return 0;
+}
 
-    }
-#if DMTR_PROFILE
-    DMTR_OK(dmtr_record_latency(read_latency.get(), dt.count()));
-#endif
+int dmtr::posix_queue::file_pop(dmtr_sgarray_t *sga, off_t offset, size_t count)
+{
+    if (count >= FILE_READAHEAD_SIZE) {
+        // big reads go straight into the buffer that's handed out.
+        DMTR_OK(our_buffer_pool.alloc_sga(*sga, count));
+        size_t bytes_read = 0;
+        int ret = pread(bytes_read, my_fd, sga->sga_buf, count, offset);
+        if (0 != ret || 0 == bytes_read) {
+            (void)dmtr_sgafree(sga);
+            *sga = {};
+            return ret;
+        }
 
-    if (0 != ret) return ret;
+        sga->sga_segs[0].sgaseg_len = bytes_read;
+        return 0;
+    }
 
-#if DMTR_DEBUG
-    std::cerr << "pop(" << qt << "): read " << data_bytes << " bytes for content." << std::endl;
-    std::cerr << "pop(" << qt << "): sgarray has " << header.h_sgasegs << " segments." << std::endl;
-#endif
+    // small reads are served from the readahead buffer, which is refilled
+    // from where they start whenever it doesn't hold all of what they ask
+    // for.
+    const bool hit = my_readahead_len > 0 && offset >= my_readahead_offset &&
+        static_cast<size_t>(offset - my_readahead_offset) + count <= my_readahead_len;
+    if (!hit) {
+        DMTR_OK(fill_readahead(offset));
+    }
 
-    // now we have the whole buffer, start filling sga
-    uint8_t *p = reinterpret_cast<uint8_t *>(sga->sga_buf);
-    sga->sga_numsegs = header.h_sgasegs;
-    for (size_t i = 0; i < sga->sga_numsegs; ++i) {
-        size_t seglen = ntohl(*reinterpret_cast<uint32_t *>(p));
-        sga->sga_segs[i].sgaseg_len = seglen;
-        //printf("[%x] sga len= %ld\n", qd, t.sga.bufs[i].len);
-        p += sizeof(uint32_t);
-        sga->sga_segs[i].sgaseg_buf = p;
-        p += seglen;
+    const size_t skip = offset - my_readahead_offset;
+    if (skip >= my_readahead_len) {
+        // we're at the end of the file.
+        return 0;
     }
 
-    buf.release();
+    const size_t len = std::min(count, my_readahead_len - skip);
+    DMTR_OK(our_buffer_pool.alloc_sga(*sga, len));
+    memcpy(sga->sga_buf, reinterpret_cast<uint8_t *>(my_readahead_buf) + skip, len);
     return 0;
 }
 
-int dmtr::posix_queue::file_pop(dmtr_sgarray_t *sga, task::thread_type::yield_type &yield)
+int dmtr::posix_queue::fill_readahead(off_t offset)
 {
+    if (NULL == my_readahead_buf) {
+        DMTR_OK(our_buffer_pool.alloc(my_readahead_buf, FILE_READAHEAD_SIZE));
+    }
 
-    return 0;
+    my_readahead_offset = offset;
+    my_readahead_len = 0;
+    return pread(my_readahead_len, my_fd, my_readahead_buf, FILE_READAHEAD_SIZE, offset);
 }
 
 int dmtr::posix_queue::pop(dmtr_qtoken_t qt) {
@@ -648,9 +2032,59 @@ int dmtr::posix_queue::pop(dmtr_qtoken_t qt) {
     DMTR_TRUE(ENOTSUP, !my_listening_flag);
     DMTR_NOTNULL(EINVAL, my_pop_thread);
 
+    if (FILE_Q == my_cid) {
+        return pop(qt, FILE_POP_SIZE);
+    }
+
+    DMTR_OK(new_task(qt, DMTR_OPC_POP));
+    my_pop_thread->enqueue(qt);
+
+    return 0;
+}
+
+int dmtr::posix_queue::pop(dmtr_qtoken_t qt, size_t count) {
+    DMTR_TRUE(EINVAL, my_fd != -1);
+    DMTR_TRUE(ENOTSUP, FILE_Q == my_cid);
+    DMTR_NOTNULL(EINVAL, my_pop_thread);
+    DMTR_TRUE(ERANGE, count <= UINT32_MAX);
+    DMTR_TRUE(EOVERFLOW, static_cast<off_t>(count) <= std::numeric_limits<off_t>::max() - my_file_offset);
+
+    // like `pread()`, every pop knows where it reads from as soon as it's
+    // started.
     DMTR_OK(new_task(qt, DMTR_OPC_POP));
+    my_file_reads.push_back(file_read{my_file_offset, count});
+    my_file_offset += count;
     my_pop_thread->enqueue(qt);
+    return 0;
+}
+
+int dmtr::posix_queue::lseek(off_t offset, int whence) {
+    DMTR_TRUE(EINVAL, my_fd != -1);
+    DMTR_TRUE(ENOTSUP, FILE_Q == my_cid);
+
+    off_t base = 0;
+    switch (whence) {
+        default:
+            return EINVAL;
+        case SEEK_SET:
+            break;
+        case SEEK_CUR:
+            base = my_file_offset;
+            break;
+        case SEEK_END: {
+            struct stat st = {};
+            if (-1 == fstat(my_fd, &st)) {
+                return errno;
+            }
+
+            base = st.st_size;
+            break;
+        }
+    }
 
+    DMTR_TRUE(EINVAL, offset >= -base);
+    DMTR_TRUE(EOVERFLOW, offset <= std::numeric_limits<off_t>::max() - base);
+    my_file_offset = base + offset;
     return 0;
 }
 
@@ -673,11 +2107,15 @@ int dmtr::posix_queue::pop_thread(task::thread_type::yield_type &yield, task::th
         int ret = 0;
         switch(my_cid) {
         case NETWORK_Q:
-            ret = net_pop(&sga, yield);
+            ret = my_tcp_flag ? net_pop(&sga, yield) : dgram_pop(&sga, yield);
             break;
-        case FILE_Q:
-            ret = file_pop(&sga, yield);
+        case FILE_Q: {
+            DMTR_TRUE(EINVAL, !my_file_reads.empty());
+            const file_read r = my_file_reads.front();
+            my_file_reads.pop_front();
+            ret = file_pop(&sga, r.offset, r.count);
             break;
+        }
         default:
             ret = ENOTSUP;
             break;
@@ -724,6 +2162,9 @@ int dmtr::posix_queue::poll(dmtr_qresult_t &qr_out, dmtr_qtoken_t qt)
         break;
     case DMTR_OPC_CONNECT:
         ret = 0;
+        if (NULL != my_connect_thread) {
+            ret = my_connect_thread->service();
+        }
         break;
     }
 
@@ -745,6 +2186,49 @@ int dmtr::posix_queue::poll(dmtr_qresult_t &qr_out, dmtr_qtoken_t qt)
     return t->poll(qr_out);
 }
 
+int dmtr::posix_queue::service()
+{
+    if (!good()) {
+        return 0;
+    }
+
+    int ret = EAGAIN;
+    if (my_listening_flag) {
+        if (NULL != my_accept_thread) {
+            ret = my_accept_thread->service();
+        }
+    } else {
+        if (NULL != my_connect_thread) {
+            ret = my_connect_thread->service();
+            if (EAGAIN != ret) {
+                // the connection is up (or it isn't going to be); the
+                // other threads carry on from here.
+                my_connect_thread.reset();
+                DMTR_OK(ret);
+                ret = EAGAIN;
+            }
+        }
+
+        if (EAGAIN == ret && NULL != my_pop_thread) {
+            ret = my_pop_thread->service();
+        }
+
+        if (EAGAIN == ret && NULL != my_push_thread) {
+            ret = my_push_thread->service();
+        }
+    }
+
+    switch (ret) {
+        default:
+            DMTR_FAIL(ret);
+        case 0:
+        case EAGAIN:
+            // network queues are scheduled again by `poll_events()` once
+            // their socket is ready; file queues never block.
+            return 0;
+    }
+}
+
 int
 dmtr::posix_queue::set_tcp_nodelay(int fd)
 {
@@ -757,6 +2241,25 @@ dmtr::posix_queue::set_tcp_nodelay(int fd)
     return 0;
 }
 
+int dmtr::posix_queue::steer_to_cpu(int fd)
+{
+    // picks the socket whose index is the CPU that's handling the
+    // connection. an index that's out of range makes the kernel fall back
+    // to hashing.
+    struct sock_filter code[] = {
+        { BPF_LD | BPF_W | BPF_ABS, 0, 0, static_cast<uint32_t>(SKF_AD_OFF + SKF_AD_CPU) },
+        { BPF_RET | BPF_A, 0, 0, 0 },
+    };
+    struct sock_fprog prog = {};
+    prog.len = sizeof(code) / sizeof(code[0]);
+    prog.filter = code;
+    if (-1 == ::setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog))) {
+        return errno;
+    }
+
+    return 0;
+}
+
 int dmtr::posix_queue::read(size_t &count_out, int fd, void *buf, size_t len) {
     count_out = 0;
     DMTR_NOTNULL(EINVAL, buf);
@@ -773,6 +2276,32 @@ int dmtr::posix_queue::read(size_t &count_out, int fd, void *buf, size_t len) {
     }
 }
 
+int dmtr::posix_queue::pread(size_t &count_out, int fd, void *buf, size_t len, off_t offset) {
+    count_out = 0;
+    DMTR_NOTNULL(EINVAL, buf);
+    DMTR_TRUE(ERANGE, len <= SSIZE_MAX);
+
+    // regular files only come up short at the end.
+    while (count_out < len) {
+        ssize_t ret = ::pread(fd, reinterpret_cast<uint8_t *>(buf) + count_out, len - count_out, offset + count_out);
+        if (-1 == ret) {
+            if (EINTR == errno) {
+                continue;
+            }
+
+            return errno;
+        }
+
+        if (0 == ret) {
+            break;
+        }
+
+        count_out += ret;
+    }
+
+    return 0;
+}
+
 int dmtr::posix_queue::writev(size_t &count_out, int fd, const struct iovec *iov, int iovcnt) {
     count_out = 0;
     ssize_t ret = ::writev(fd, iov, iovcnt);
@@ -794,6 +2323,30 @@ int dmtr::posix_queue::writev(size_t &count_out, int fd, const struct iovec *iov
     return 0;
 }
 
+int dmtr::posix_queue::sendmsg(size_t &count_out, int fd, const struct iovec *iov, int iovcnt, int flags) {
+    count_out = 0;
+    struct msghdr msg = {};
+    msg.msg_iov = const_cast<struct iovec *>(iov);
+    msg.msg_iovlen = iovcnt;
+    ssize_t ret = ::sendmsg(fd, &msg, flags);
+
+    if (ret == -1) {
+        if (errno == EWOULDBLOCK || errno == EAGAIN) {
+            // we'll try again later.
+            return EAGAIN;
+        }
+
+        return errno;
+    }
+
+    if (ret < -1) {
+        DMTR_UNREACHABLE();
+    }
+
+    count_out = ret;
+    return 0;
+}
+
 void dmtr::posix_queue::start_threads() {
     if (my_listening_flag) {
         my_accept_thread.reset(new task::thread_type([=](task::thread_type::yield_type &yield, task::thread_type::queue_type &tq) {
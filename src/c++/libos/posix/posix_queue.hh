@@ -7,9 +7,17 @@
 #define DMTR_LIBOS_POSIX_QUEUE_HH_IS_INCLUDED
 
 #include <dmtr/libos/io_queue.hh>
+#include <dmtr/libos/recv_buffer.hh>
+#include <condition_variable>
+#include <deque>
+#include <list>
 #include <memory>
+#include <mutex>
 #include <queue>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <unordered_map>
+#include <vector>
 
 namespace dmtr {
 
@@ -19,15 +27,201 @@ class posix_queue : public io_queue {
     private: bool my_listening_flag;
     private: bool my_tcp_flag;
     private: std::unique_ptr<task::thread_type> my_accept_thread;
+    // waits for a stream socket's handshake to finish; it only exists
+    // until then.
+    private: std::unique_ptr<task::thread_type> my_connect_thread;
+    // set by `poll_events()` once the socket of a queue that's connecting
+    // is reported writable, which is when the handshake is over, whichever
+    // way it went. the queues are looked up by descriptor.
+    private: bool my_connect_done_flag;
+    private: static thread_local std::unordered_map<int, posix_queue *> our_connecting_queues;
     private: std::unique_ptr<task::thread_type> my_push_thread;
     private: std::unique_ptr<task::thread_type> my_pop_thread;
     // todo: may not be needed for production code.
     private: struct sockaddr *my_peer_saddr;
+    // every network socket is registered (edge-triggered) with this epoll
+    // instance, so that only queues whose sockets became ready are
+    // serviced while waiting.
+    // every core has its own event set.
+    private: static thread_local int our_epoll_fd;
+    // stream sockets are bound with `SO_REUSEPORT`, so that every core can
+    // listen on the same port with a socket of its own. the kernel spreads
+    // new connections across the listening sockets by hashing them.
+    private: static bool our_reuseport_flag;
+    // connections are given to the n-th socket to start listening on the
+    // port, where n is the CPU that the connection arrived on (or hashed,
+    // if there are fewer sockets than that). core n should listen n-th and
+    // run on CPU n.
+    private: static bool our_cpu_steering_flag;
+    // listening sockets: connections that were taken off the kernel's
+    // backlog but haven't been handed to an accept yet. the listening
+    // socket is drained into this (up to `ACCEPT_BACKLOG_SIZE`
+    // connections) every time it's ready, so that a burst of connections
+    // costs one wakeup instead of one per connection, and an accept that
+    // finds a connection here finishes right away.
+    private: struct accepted_connection {
+        int fd;
+        struct sockaddr_in addr;
+    };
+    private: std::deque<accepted_connection> my_accepted;
+#define ACCEPT_BACKLOG_SIZE 128
+    // an error that `accept4()` reported while no accept was waiting. the
+    // next accept fails with it.
+    private: int my_accept_error;
+    // pushes started by `push_detached()`, in the order they were started.
+    private: struct detached_push {
+        dmtr_sgarray_t sga;
+        dmtr_push_done_fn done;
+        void *arg;
+    };
+    private: std::deque<detached_push> my_detached_pushes;
+    // pushes started by `push_file()`, in the order they were started.
+    // each one has a descriptor of its own for the file, so that the file
+    // queue can be closed while the push is under way.
+    private: struct file_send {
+        dmtr_qtoken_t qt;
+        int fd;
+        off_t offset;
+        // what's left to send, after the framing.
+        size_t count;
+    };
+    private: std::deque<file_send> my_file_sends;
+    // the pushes that `net_push()` or `file_push()` is writing, in order.
+    private: struct outgoing_message {
+        // zero for a detached push.
+        dmtr_qtoken_t qt;
+        // where the message ends in the bytes being sent.
+        size_t end;
+        int error;
+    };
+    private: std::vector<outgoing_message> my_push_batch;
+    private: std::vector<struct iovec> my_push_iov;
+    private: std::vector<dmtr_header_t> my_push_headers;
+    private: std::vector<uint32_t> my_push_seg_lens;
+    // a batch of at least this many bytes is sent with `MSG_ZEROCOPY` on a
+    // stream socket, so that the kernel reads the pushed buffers in place
+    // instead of copying them. zero turns it off.
+    private: static size_t our_zerocopy_threshold;
+    // whether the socket accepted `SO_ZEROCOPY`.
+    private: bool my_zerocopy_flag;
+    // a batch that the kernel may still be reading. its pushes aren't
+    // finished until the kernel reports (on the socket's error queue) that
+    // it's done with every `sendmsg()` that sent it. batches that were
+    // copied while one of these was outstanding wait in line with it, so
+    // that pushes are always finished in order.
+    private: struct zerocopy_send {
+        std::vector<outgoing_message> messages;
+        // the framing points into these, so they have to stay put as well.
+        std::vector<dmtr_header_t> headers;
+        std::vector<uint32_t> seg_lens;
+        // the kernel numbers zero-copy sends on each socket, starting at
+        // zero; these are the numbers of the batch's sends.
+        uint32_t first_id;
+        uint32_t id_count;
+        uint32_t ids_done;
+        size_t bytes_sent;
+        int error;
+        // still being written by `net_push()`.
+        bool sending_flag;
+    };
+    private: std::deque<zerocopy_send> my_zerocopy_sends;
+    private: uint32_t my_zerocopy_next_id;
+    // sockets that were closed while the kernel was still reading the
+    // buffers of zero-copy sends, with the detached pushes that those
+    // buffers belong to. they're closed once the kernel lets go of the last
+    // buffer. the poller reports them with a descriptor that no queue has.
+#define LINGERING_SOCKET_QD 0
+    private: struct lingering_socket {
+        int fd;
+        std::deque<zerocopy_send> sends;
+        std::deque<detached_push> detached_pushes;
+    };
+    private: static thread_local std::list<lingering_socket> our_lingering_sockets;
+    // bytes that have been read from the socket but not popped yet.
+    private: recv_buffer my_recv_buffer;
+    // datagram sockets: every push is a datagram of its own, framed like a
+    // message on a stream, and every pop takes one datagram. datagrams are
+    // received `DGRAM_RECV_BATCH` at a time with `recvmmsg()`, and pending
+    // pushes go out together with `sendmmsg()`.
+#define DGRAM_RECV_BATCH 16
+#define DGRAM_SEND_BATCH 64
+    // the largest UDP payload over IPv4. received buffers are this big so that
+    // nothing is truncated, even when GRO hands us several datagrams at once.
+#define DGRAM_MAX_SIZE static_cast<size_t>(65507)
+#define DGRAM_SLOT_SIZE (static_cast<size_t>(64) << 10)
+#define DGRAM_SOCKET_BUFFER_SIZE (4 << 20)
+    // the kernel's limit on how many datagrams one GSO send may carry.
+#define DGRAM_GSO_MAX_SEGMENTS 64
+    private: std::deque<dmtr_sgarray_t> my_datagrams;
+    private: std::unique_ptr<uint8_t[]> my_recv_slots;
+    private: std::vector<struct mmsghdr> my_recv_msgs;
+    private: std::vector<struct iovec> my_recv_iov;
+    private: std::vector<struct sockaddr_in> my_recv_addrs;
+    private: std::vector<uint64_t> my_recv_cmsgs;
+    // a push that `dgram_push()` is sending.
+    private: struct outgoing_datagram {
+        // zero for a detached push.
+        dmtr_qtoken_t qt;
+        int error;
+        // where the push's iovecs start in `my_push_iov`.
+        size_t iov_begin;
+        size_t iov_count;
+        size_t size;
+        // NULL on a connected socket.
+        struct sockaddr_in *dest;
+        // the message in `my_send_msgs` that carries it.
+        size_t msg;
+    };
+    private: std::vector<outgoing_datagram> my_dgram_batch;
+    private: std::vector<struct mmsghdr> my_send_msgs;
+    private: std::vector<uint64_t> my_send_cmsgs;
+    // consecutive datagrams of the same size to the same destination are
+    // sent as one message with UDP GSO, as long as they aren't bigger than
+    // this. zero if the kernel doesn't support it.
+    private: size_t my_gso_limit;
+    // what each pop on a file queue reads, in the order they were started.
+    private: struct file_read {
+        off_t offset;
+        size_t count;
+    };
+    private: std::deque<file_read> my_file_reads;
+    // where the next pop on a file queue starts.
+    private: off_t my_file_offset;
+    // `O_SYNC` or `O_DSYNC` if the file was opened with either. the file
+    // itself is opened without them; pushes are flushed in groups instead.
+    private: int my_file_sync_flags;
+    // a synchronous file is flushed on a thread of its own, so that the
+    // core carries on while the device catches up. the pushes that arrive
+    // in the meantime are appended and flushed together once it's done.
+    // the thread has its own descriptors, so that it can finish a flush
+    // after the queue is gone, and it wakes the queue up through
+    // `event_fd`, which is watched like a socket.
+    private: struct file_flusher {
+        std::mutex lock;
+        std::condition_variable cond;
+        int fd;
+        int event_fd;
+        int sync_flags;
+        bool requested_flag;
+        bool done_flag;
+        bool stop_flag;
+        int error;
+    };
+    private: std::shared_ptr<file_flusher> my_flusher;
+    // file data read ahead of the pops that will ask for it.
+    private: void *my_readahead_buf;
+    private: off_t my_readahead_offset;
+    private: size_t my_readahead_len;
+#define FILE_READAHEAD_SIZE (static_cast<size_t>(256) << 10)
 
     private: posix_queue(int qd, io_queue::category_id cid);
     private: static int alloc_latency();
     public: static int new_net_object(std::unique_ptr<io_queue> &q_out, int qd);
     public: static int new_file_object(std::unique_ptr<io_queue> &q_out, int qd);
+    public: static int read_config(int argc, char *argv[]);
+    public: static int init_epoll();
+    public: static int poll_events(std::vector<int> &qds_out, int timeout_ms);
+    public: static int watch_fd(int fd, int qd);
 
     // network functions
     public: int socket(int domain, int type, int protocol);
@@ -43,13 +237,21 @@ class posix_queue : public io_queue {
 
     // data path functions
     public: int push(dmtr_qtoken_t qt, const dmtr_sgarray_t &sga);
+    public: int push_batch(const dmtr_qtoken_t qts[], const dmtr_sgarray_t sgas[], int count);
+    public: int push_detached(const dmtr_sgarray_t &sga, dmtr_push_done_fn done, void *arg);
+    public: int push_file(dmtr_qtoken_t qt, io_queue &file_q, off_t offset, size_t count);
     public: int pop(dmtr_qtoken_t qt);
     public: int pop(dmtr_qtoken_t qt, size_t count);
+    public: int lseek(off_t offset, int whence);
     public: int poll(dmtr_qresult_t &qr_out, dmtr_qtoken_t qt);
+    public: int service();
 
     private: static int set_tcp_nodelay(int fd);
+    private: static int steer_to_cpu(int fd);
     private: static int read(size_t &count_out, int fd, void *buf, size_t len);
+    private: static int pread(size_t &count_out, int fd, void *buf, size_t len, off_t offset);
     private: static int writev(size_t &count_out, int fd, const struct iovec *iov, int iovcnt);
+    private: static int sendmsg(size_t &count_out, int fd, const struct iovec *iov, int iovcnt, int flags);
     private: static int accept(int &newfd_out, int fd, struct sockaddr * const saddr, socklen_t * const addrlen);
 
     private: bool good() const {
@@ -57,13 +259,36 @@ class posix_queue : public io_queue {
     }
 
     private: void start_threads();
+    private: int watch_events();
     private: int accept_thread(task::thread_type::yield_type &yield, task::thread_type::queue_type &tq);
+    private: int drain_backlog(int &error_out);
+    private: int finish_accept(dmtr_qtoken_t qt, const accepted_connection &c);
+    private: int connect_thread(task::thread_type::yield_type &yield, task::thread_type::queue_type &tq);
     private: int push_thread(task::thread_type::yield_type &yield, task::thread_type::queue_type &tq);
     private: int pop_thread(task::thread_type::yield_type &yield, task::thread_type::queue_type &tq);
-    private: int net_push(const dmtr_sgarray_t *sga, task::thread_type::yield_type &yield);
+    private: int net_push(task::thread_type::yield_type &yield, task::thread_type::queue_type &tq);
+    private: int finish_push(dmtr_qtoken_t qt, int error);
+    private: int send_file(task::thread_type::yield_type &yield, task::thread_type::queue_type &tq);
+    private: void enable_zerocopy();
+    private: int reap_zerocopy();
+    private: int finish_zerocopy(const zerocopy_send &z);
+    private: int drain_zerocopy();
+    private: static int read_zerocopy_done(int fd, std::deque<zerocopy_send> &sends);
+    private: static int reap_lingering();
     private: int net_pop(dmtr_sgarray_t *sga, task::thread_type::yield_type &yield);
-    private: int file_push(const dmtr_sgarray_t *sga, task::thread_type::yield_type &yield);
-    private: int file_pop(dmtr_sgarray_t *sga, task::thread_type::yield_type &yield);
+    private: int dgram_push(task::thread_type::yield_type &yield, task::thread_type::queue_type &tq);
+    private: size_t layout_datagrams(size_t first, size_t msg);
+    private: int dgram_pop(dmtr_sgarray_t *sga, task::thread_type::yield_type &yield);
+    private: int recv_datagrams();
+    private: int parse_datagram(dmtr_sgarray_t &sga_out, const uint8_t *p, size_t len, const struct sockaddr_in &addr);
+    private: void setup_datagrams();
+    private: int file_push(task::thread_type::yield_type &yield, task::thread_type::queue_type &tq);
+    private: int open_file(const char *pathname, int flags, mode_t mode);
+    private: int start_flusher();
+    private: static void run_flusher(std::shared_ptr<file_flusher> f);
+    private: int flush_file(int &error_out, task::thread_type::yield_type &yield);
+    private: int file_pop(dmtr_sgarray_t *sga, off_t offset, size_t count);
+    private: int fill_readahead(off_t offset);
 };
 
 } // namespace dmtr
@@ -9,6 +9,7 @@
 #include <dmtr/libos.h>
 #include <dmtr/libos/memory_queue.hh>
 #include <dmtr/libos/io_queue_api.hh>
+#include <dmtr/wait.h>
 
 #include <memory>
 
@@ -26,6 +27,15 @@ int dmtr_init(int argc, char *argv[])
     return 0;
 }
 
+int dmtr_init_core(int *core_id_out)
+{
+    DMTR_NOTNULL(EINVAL, core_id_out);
+
+    // this libOS keeps per-process device state and can only be driven
+    // from one thread.
+    return ENOTSUP;
+}
+
 int dmtr_queue(int *qd_out)
 {
     DMTR_NOTNULL(EINVAL, qd_out);
@@ -35,6 +45,30 @@ int dmtr_queue(int *qd_out)
     return 0;
 }
 
+int dmtr_queue2(int *qd_out, int flags, size_t capacity)
+{
+    DMTR_NOTNULL(EINVAL, qd_out);
+    DMTR_NOTNULL(EPERM, ioq_api.get());
+
+    return ioq_api->queue(*qd_out, flags, capacity);
+}
+
+int dmtr_queue_attach(int *qd_out, int ring_qd)
+{
+    DMTR_NOTNULL(EINVAL, qd_out);
+    DMTR_NOTNULL(EPERM, ioq_api.get());
+
+    return ioq_api->attach_queue(*qd_out, ring_qd);
+}
+
+int dmtr_channel(int *qd_out, int peer_core_id)
+{
+    DMTR_NOTNULL(EINVAL, qd_out);
+    DMTR_NOTNULL(EPERM, ioq_api.get());
+
+    return ioq_api->channel(*qd_out, peer_core_id);
+}
+
 int dmtr_socket(int *qd_out, int domain, int type, int protocol)
 {
     DMTR_NOTNULL(EINVAL, qd_out);
@@ -144,6 +178,60 @@ int dmtr_pop(dmtr_qtoken_t *qtok_out, int qd)
     return ioq_api->pop(*qtok_out, qd);
 }
 
+int dmtr_pop2(dmtr_qtoken_t *qtok_out, int qd, size_t count)
+{
+    DMTR_NOTNULL(EINVAL, qtok_out);
+    DMTR_NOTNULL(EPERM, ioq_api.get());
+
+    return ioq_api->pop(*qtok_out, qd, count);
+}
+
+int dmtr_lseek(int qd, off_t offset, int whence)
+{
+    DMTR_NOTNULL(EPERM, ioq_api.get());
+
+    return ioq_api->lseek(qd, offset, whence);
+}
+
+int dmtr_push_file(dmtr_qtoken_t *qtok_out, int qd, int file_qd, off_t offset, size_t count)
+{
+    DMTR_NOTNULL(EINVAL, qtok_out);
+    DMTR_NOTNULL(EPERM, ioq_api.get());
+
+    return ioq_api->push_file(*qtok_out, qd, file_qd, offset, count);
+}
+
+int dmtr_push_detached(int qd, const dmtr_sgarray_t *sga, dmtr_push_done_fn done, void *arg)
+{
+    DMTR_NOTNULL(EINVAL, sga);
+    DMTR_NOTNULL(EPERM, ioq_api.get());
+
+    return ioq_api->push_detached(qd, *sga, done, arg);
+}
+
+int dmtr_push_batch(
+    dmtr_qtoken_t qtoks_out[], int qd, const dmtr_sgarray_t sgas[], int count)
+{
+    DMTR_NOTNULL(EPERM, ioq_api.get());
+
+    return ioq_api->push_batch(qtoks_out, qd, sgas, count);
+}
+
+int dmtr_pop_batch(dmtr_qtoken_t qtoks_out[], int qd, int count)
+{
+    DMTR_NOTNULL(EPERM, ioq_api.get());
+
+    return ioq_api->pop_batch(qtoks_out, qd, count);
+}
+
+int dmtr_sgaalloc(dmtr_sgarray_t *sga_out, int qd, size_t size)
+{
+    DMTR_NOTNULL(EINVAL, sga_out);
+    DMTR_NOTNULL(EPERM, ioq_api.get());
+
+    return ioq_api->sgaalloc(*sga_out, qd, size);
+}
+
 int dmtr_poll(dmtr_qresult_t *qr_out, dmtr_qtoken_t qt)
 {
     DMTR_NOTNULL(EPERM, ioq_api.get());
@@ -157,3 +245,40 @@ int dmtr_drop(dmtr_qtoken_t qt)
 
     return ioq_api->drop(qt);
 }
+
+int dmtr_wait(dmtr_qresult_t *qr_out, dmtr_qtoken_t qt)
+{
+    DMTR_NOTNULL(EPERM, ioq_api.get());
+
+    return ioq_api->wait(qr_out, qt, -1);
+}
+
+int dmtr_timedwait(dmtr_qresult_t *qr_out, dmtr_qtoken_t qt, int timeout_ms)
+{
+    DMTR_NOTNULL(EPERM, ioq_api.get());
+
+    return ioq_api->wait(qr_out, qt, timeout_ms);
+}
+
+int dmtr_wait_any(dmtr_qresult_t *qr_out, int *ready_offset, dmtr_qtoken_t qts[], int num_qts)
+{
+    DMTR_NOTNULL(EPERM, ioq_api.get());
+
+    return ioq_api->wait_any(qr_out, ready_offset, qts, num_qts, -1);
+}
+
+int dmtr_timedwait_any(dmtr_qresult_t *qr_out, int *ready_offset, dmtr_qtoken_t qts[], int num_qts, int timeout_ms)
+{
+    DMTR_NOTNULL(EPERM, ioq_api.get());
+
+    return ioq_api->wait_any(qr_out, ready_offset, qts, num_qts, timeout_ms);
+}
+
+int dmtr_wait_many(dmtr_qresult_t *qrs_out, int *ready_offsets, int *num_ready_out, int max_ready, dmtr_qtoken_t qts[], int num_qts)
+{
+    DMTR_NOTNULL(EINVAL, num_ready_out);
+    *num_ready_out = 0;
+    DMTR_NOTNULL(EPERM, ioq_api.get());
+
+    return ioq_api->wait_many(qrs_out, ready_offsets, *num_ready_out, max_ready, qts, num_qts, -1);
+}
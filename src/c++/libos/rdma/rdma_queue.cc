@@ -736,6 +736,10 @@ int dmtr::rdma_queue::pop_thread(task::thread_type::yield_type &yield, task::thr
             DMTR_FAIL(EILSEQ);
         }
 
+        if (0 == header->h_sgasegs || header->h_sgasegs > DMTR_SGARRAY_MAXSIZE) {
+            DMTR_FAIL(EILSEQ);
+        }
+
         dmtr_sgarray_t sga = {};
         sga.sga_numsegs = md->header.h_sgasegs;
         p += sizeof(struct metadata);
@@ -0,0 +1,511 @@
+// -*- mode: c++; c-file-style: "k&r"; c-basic-offset: 4 -*-
+
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+#include "shm_queue.hh"
+
+#include <cerrno>
+#include <cstring>
+#include <dmtr/annot.h>
+#include <dmtr/libos/config.hh>
+#include <netinet/in.h>
+#include <sched.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+size_t dmtr::shm_queue::our_ring_size = DEFAULT_SHM_RING_SIZE;
+size_t dmtr::shm_queue::our_arena_size = DEFAULT_SHM_ARENA_SIZE;
+
+dmtr::shm_queue::shm_queue(int qd) :
+    io_queue(NETWORK_Q, qd),
+    my_fd(-1),
+    my_listening_flag(false),
+    my_region(NULL),
+    my_idle_polls(0),
+    my_pop_error(0)
+{}
+
+dmtr::shm_queue::~shm_queue()
+{
+    (void)close();
+}
+
+int dmtr::shm_queue::new_object(std::unique_ptr<io_queue> &q_out, int qd) {
+    q_out = std::unique_ptr<io_queue>(new shm_queue(qd));
+    DMTR_NOTNULL(ENOMEM, q_out);
+    return 0;
+}
+
+int dmtr::shm_queue::read_config(int argc, char *argv[]) {
+    YAML::Node config;
+    DMTR_OK(load_config(config, argc, argv));
+    YAML::Node shm = config["shm"];
+    if (YAML::NodeType::Map == shm.Type()) {
+        our_ring_size = shm["ring_size"].as<size_t>(DEFAULT_SHM_RING_SIZE);
+        our_arena_size = shm["arena_size"].as<size_t>(DEFAULT_SHM_ARENA_SIZE);
+    }
+
+    DMTR_TRUE(EINVAL, our_ring_size > 0 && our_ring_size <= UINT32_MAX);
+    DMTR_TRUE(EINVAL, our_arena_size >= SHM_MIN_BLOCK_SIZE);
+    return 0;
+}
+
+int dmtr::shm_queue::socket(int domain, int type, int protocol)
+{
+    // the socket only carries the region; the data goes through the
+    // region.
+    DMTR_TRUE(ENOTSUP, AF_UNIX == domain && SOCK_STREAM == type);
+
+    int fd = ::socket(domain, type | SOCK_CLOEXEC, protocol);
+    if (fd == -1) {
+        return errno;
+    }
+
+    my_fd = fd;
+    return 0;
+}
+
+int dmtr::shm_queue::getsockname(struct sockaddr * const saddr, socklen_t * const size)
+{
+    DMTR_NOTNULL(EINVAL, saddr);
+    DMTR_NOTNULL(EINVAL, size);
+    DMTR_TRUE(ERANGE, *size > 0);
+
+    if (-1 == ::getsockname(my_fd, saddr, size)) {
+        return errno;
+    }
+
+    return 0;
+}
+
+int dmtr::shm_queue::bind(const struct sockaddr * const saddr, socklen_t size)
+{
+    DMTR_TRUE(EINVAL, good());
+
+    if (-1 == ::bind(my_fd, saddr, size)) {
+        return errno;
+    }
+
+    return 0;
+}
+
+int dmtr::shm_queue::listen(int backlog)
+{
+    DMTR_TRUE(EINVAL, good());
+    DMTR_NULL(EINVAL, my_region);
+
+    if (-1 == ::listen(my_fd, backlog)) {
+        return errno;
+    }
+
+    DMTR_OK(set_non_blocking(my_fd));
+    my_listening_flag = true;
+    return 0;
+}
+
+int dmtr::shm_queue::accept(std::unique_ptr<io_queue> &q_out, dmtr_qtoken_t qt, int new_qd)
+{
+    q_out = NULL;
+    DMTR_TRUE(EINVAL, good());
+    DMTR_TRUE(EINVAL, my_listening_flag);
+
+    auto * const q = new shm_queue(new_qd);
+    DMTR_TRUE(ENOMEM, q != NULL);
+    auto qq = std::unique_ptr<io_queue>(q);
+
+    DMTR_OK(new_task(qt, DMTR_OPC_ACCEPT, q));
+    my_accepts.push_back(qt);
+    DMTR_OK(accept_waiting());
+
+    q_out = std::move(qq);
+    return 0;
+}
+
+int dmtr::shm_queue::accept_waiting()
+{
+    while (!my_accepts.empty()) {
+        int fd = ::accept4(my_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (-1 != fd) {
+            my_handshakes.push_back(fd);
+            continue;
+        }
+
+        if (EAGAIN != errno && EWOULDBLOCK != errno) {
+            task *t = NULL;
+            DMTR_OK(get_task(t, my_accepts.front()));
+            my_accepts.pop_front();
+            DMTR_OK(t->complete(errno));
+            continue;
+        }
+
+        break;
+    }
+
+    // the region follows right behind the connection, but it may not be
+    // there yet.
+    for (size_t i = 0; i < my_handshakes.size() && !my_accepts.empty();) {
+        const int fd = my_handshakes[i];
+        int region_fd = -1;
+        int ret = recv_fd(region_fd, fd);
+        if (EAGAIN == ret) {
+            ++i;
+            continue;
+        }
+
+        my_handshakes.erase(my_handshakes.begin() + i);
+        shm_region *region = NULL;
+        if (0 == ret) {
+            ret = shm_region::attach(region, region_fd);
+            ::close(region_fd);
+        }
+
+        if (0 != ret) {
+            // the other end gave up or isn't one of ours; the accept waits
+            // for the next connection.
+            ::close(fd);
+            continue;
+        }
+
+        task *t = NULL;
+        DMTR_OK(get_task(t, my_accepts.front()));
+        my_accepts.pop_front();
+        io_queue *new_q = NULL;
+        DMTR_TRUE(EINVAL, t->arg(new_q));
+        auto * const new_sq = dynamic_cast<shm_queue *>(new_q);
+        DMTR_NOTNULL(EINVAL, new_sq);
+        new_sq->my_fd = fd;
+        new_sq->my_region = region;
+        sockaddr_in addr = {};
+        DMTR_OK(t->complete(0, new_sq->qd(), addr));
+    }
+
+    return 0;
+}
+
+int dmtr::shm_queue::connect(dmtr_qtoken_t qt, const struct sockaddr * const saddr, socklen_t size)
+{
+    DMTR_TRUE(EINVAL, good());
+    DMTR_TRUE(EINVAL, !my_listening_flag);
+    DMTR_NULL(EPERM, my_region);
+
+    DMTR_OK(new_task(qt, DMTR_OPC_CONNECT));
+    task *t = NULL;
+    DMTR_OK(get_task(t, qt));
+
+    // connecting to a Unix domain socket doesn't involve a handshake, so
+    // it's done before `connect()` returns.
+    if (-1 == ::connect(my_fd, saddr, size)) {
+        DMTR_OK(t->complete(errno));
+        return 0;
+    }
+
+    shm_region *region = NULL;
+    int region_fd = -1;
+    int ret = shm_region::create(region, region_fd, our_ring_size, our_arena_size);
+    if (0 == ret) {
+        ret = send_fd(my_fd, region_fd);
+        // the other end has its own descriptor now, and the mapping
+        // doesn't need one.
+        ::close(region_fd);
+        if (0 != ret) {
+            region->unref();
+        }
+    }
+
+    if (0 != ret) {
+        DMTR_OK(t->complete(ret));
+        return 0;
+    }
+
+    my_region = region;
+    DMTR_OK(t->complete(0));
+    return 0;
+}
+
+int dmtr::shm_queue::close()
+{
+    if (!good()) {
+        return 0;
+    }
+
+    if (NULL != my_region) {
+        my_region->close();
+        // messages that were never popped still hold their blocks.
+        shm_region::message m = {};
+        while (my_region->pop(m)) {
+            my_region->discard(m);
+        }
+
+        // sgas that still point into the region keep it mapped.
+        my_region->unref();
+        my_region = NULL;
+    }
+
+    DMTR_OK(abort_waiting(my_pushes));
+    DMTR_OK(abort_waiting(my_pops));
+    DMTR_OK(abort_waiting(my_accepts));
+    while (!my_handshakes.empty()) {
+        ::close(my_handshakes.front());
+        my_handshakes.pop_front();
+    }
+
+    int fd = my_fd;
+    my_fd = -1;
+    if (-1 == ::close(fd)) {
+        return errno;
+    }
+
+    return io_queue::close();
+}
+
+int dmtr::shm_queue::push(dmtr_qtoken_t qt, const dmtr_sgarray_t &sga)
+{
+    DMTR_TRUE(EINVAL, good());
+    DMTR_NOTNULL(ENOTCONN, my_region);
+
+    DMTR_OK(new_task(qt, DMTR_OPC_PUSH, sga));
+    my_pushes.push_back(qt);
+    return push_waiting();
+}
+
+int dmtr::shm_queue::push_waiting()
+{
+    while (!my_pushes.empty()) {
+        task *t = NULL;
+        DMTR_OK(get_task(t, my_pushes.front()));
+        const dmtr_sgarray_t *sga = NULL;
+        DMTR_TRUE(EINVAL, t->arg(sga));
+
+        if (my_region->peer_closed()) {
+            my_pushes.pop_front();
+            DMTR_OK(t->complete(ECONNABORTED));
+            continue;
+        }
+
+        // nothing is taken from the arena unless it can be published right
+        // away; until then, the push waits for the other end to pop or to
+        // free something, unless it's gone.
+        shm_region::message m = {};
+        int ret = my_region->tx_full() ? EAGAIN : my_region->to_message(m, *sga);
+        if (EAGAIN == ret) {
+            if (!peer_gone()) {
+                break;
+            }
+
+            my_pushes.pop_front();
+            DMTR_OK(t->complete(ECONNABORTED));
+            continue;
+        }
+
+        my_pushes.pop_front();
+        if (0 != ret) {
+            DMTR_OK(t->complete(ret));
+            continue;
+        }
+
+        DMTR_TRUE(EPERM, my_region->push(m));
+        my_idle_polls = 0;
+        DMTR_OK(t->complete(0, *sga));
+    }
+
+    return 0;
+}
+
+int dmtr::shm_queue::pop(dmtr_qtoken_t qt)
+{
+    DMTR_TRUE(EINVAL, good());
+    DMTR_NOTNULL(ENOTCONN, my_region);
+
+    DMTR_OK(new_task(qt, DMTR_OPC_POP));
+    my_pops.push_back(qt);
+    return pop_waiting();
+}
+
+int dmtr::shm_queue::pop_waiting()
+{
+    while (!my_pops.empty()) {
+        shm_region::message m = {};
+        if (0 == my_pop_error && !my_region->pop(m)) {
+            if (!peer_gone()) {
+                break;
+            }
+
+            // it may have pushed something right before it went away.
+            if (!my_region->pop(m)) {
+                my_pop_error = ECONNABORTED;
+            }
+        }
+
+        task *t = NULL;
+        DMTR_OK(get_task(t, my_pops.front()));
+        my_pops.pop_front();
+        if (0 != my_pop_error) {
+            DMTR_OK(t->complete(my_pop_error));
+            continue;
+        }
+
+        dmtr_sgarray_t sga = {};
+        int ret = my_region->to_sga(sga, m);
+        if (0 != ret) {
+            // the other end can't be trusted anymore.
+            my_pop_error = ret;
+            DMTR_OK(t->complete(ret));
+            continue;
+        }
+
+        my_idle_polls = 0;
+        DMTR_OK(t->complete(0, sga));
+    }
+
+    return 0;
+}
+
+bool dmtr::shm_queue::peer_gone()
+{
+    if (my_region->peer_closed()) {
+        return true;
+    }
+
+    // a process that died never got to close the region, but the kernel
+    // closed its socket.
+    idle();
+    if (0 != my_idle_polls % SHM_PEER_CHECK_INTERVAL) {
+        return false;
+    }
+
+    char c = 0;
+    ssize_t n = ::recv(my_fd, &c, sizeof(c), MSG_PEEK | MSG_DONTWAIT);
+    return 0 == n || (-1 == n && EAGAIN != errno && EWOULDBLOCK != errno);
+}
+
+void dmtr::shm_queue::idle()
+{
+    // `sched_yield()` returns right away if nothing else wants the core.
+    if (++my_idle_polls > SHM_SPIN_POLLS) {
+        (void)sched_yield();
+    }
+}
+
+int dmtr::shm_queue::poll(dmtr_qresult_t &qr_out, dmtr_qtoken_t qt)
+{
+    DMTR_OK(task::initialize_result(qr_out, qd(), qt));
+    DMTR_TRUE(EINVAL, good());
+
+    int ret = service();
+    if (0 != ret && EAGAIN != ret) {
+        DMTR_FAIL(ret);
+    }
+
+    task *t = NULL;
+    DMTR_OK(get_task(t, qt));
+    return t->poll(qr_out);
+}
+
+int dmtr::shm_queue::service()
+{
+    if (!good()) {
+        return 0;
+    }
+
+    if (my_listening_flag) {
+        DMTR_OK(accept_waiting());
+    } else if (NULL != my_region) {
+        DMTR_OK(push_waiting());
+        DMTR_OK(pop_waiting());
+    }
+
+    // nothing tells us when the other end has done something, so anything
+    // that's still waiting keeps the queue runnable.
+    if (my_pushes.empty() && my_pops.empty() && my_accepts.empty()) {
+        return 0;
+    }
+
+    return EAGAIN;
+}
+
+int dmtr::shm_queue::sgaalloc(dmtr_sgarray_t &sga_out, size_t size)
+{
+    DMTR_TRUE(EINVAL, good());
+    DMTR_NOTNULL(ENOTCONN, my_region);
+
+    return my_region->alloc_sga(sga_out, size);
+}
+
+int dmtr::shm_queue::abort_waiting(std::deque<dmtr_qtoken_t> &qts)
+{
+    while (!qts.empty()) {
+        task *t = NULL;
+        DMTR_OK(get_task(t, qts.front()));
+        qts.pop_front();
+        DMTR_OK(t->complete(ECONNABORTED));
+    }
+
+    return 0;
+}
+
+int dmtr::shm_queue::send_fd(int sock, int fd)
+{
+    char c = 0;
+    struct iovec iov = {};
+    iov.iov_base = &c;
+    iov.iov_len = sizeof(c);
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control = {};
+
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    struct cmsghdr * const cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(fd));
+
+    if (-1 == ::sendmsg(sock, &msg, MSG_NOSIGNAL)) {
+        return errno;
+    }
+
+    return 0;
+}
+
+int dmtr::shm_queue::recv_fd(int &fd_out, int sock)
+{
+    fd_out = -1;
+
+    char c = 0;
+    struct iovec iov = {};
+    iov.iov_base = &c;
+    iov.iov_len = sizeof(c);
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control = {};
+
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    ssize_t n = ::recvmsg(sock, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+    if (-1 == n) {
+        return EWOULDBLOCK == errno ? EAGAIN : errno;
+    }
+
+    if (0 == n) {
+        return ECONNABORTED;
+    }
+
+    struct cmsghdr * const cmsg = CMSG_FIRSTHDR(&msg);
+    if (0 != (msg.msg_flags & MSG_CTRUNC) || NULL == cmsg || SOL_SOCKET != cmsg->cmsg_level || SCM_RIGHTS != cmsg->cmsg_type
+        || CMSG_LEN(sizeof(int)) != cmsg->cmsg_len) {
+        return EILSEQ;
+    }
+
+    memcpy(&fd_out, CMSG_DATA(cmsg), sizeof(fd_out));
+    return 0;
+}
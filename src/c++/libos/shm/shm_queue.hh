@@ -0,0 +1,91 @@
+// -*- mode: c++; c-file-style: "k&r"; c-basic-offset: 4 -*-
+
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+#ifndef DMTR_LIBOS_SHM_QUEUE_HH_IS_INCLUDED
+#define DMTR_LIBOS_SHM_QUEUE_HH_IS_INCLUDED
+
+#include "shm_region.hh"
+
+#include <deque>
+#include <dmtr/libos/io_queue.hh>
+#include <memory>
+#include <sys/socket.h>
+
+namespace dmtr {
+
+// a connection between two processes on the same host. connections are
+// set up through a Unix domain stream socket, over which the connecting
+// end passes the shared memory region (see `shm_region`) to the other end.
+// from then on, pushes and pops only touch the region: a push publishes
+// the offset of its buffer and a pop returns a pointer into the other
+// end's arena. nothing ever blocks, so waits spin, and give the core away
+// once they've spun for a while, in case the other end is waiting for it.
+// the socket is only looked at now and then, to notice if the other
+// process went away without closing the connection.
+class shm_queue : public io_queue {
+    // how often (in polls that found nothing to pop) the socket is checked.
+#define SHM_PEER_CHECK_INTERVAL 1024u
+    // how many polls in a row can find nothing to do before each one
+    // yields.
+#define SHM_SPIN_POLLS 64u
+#define DEFAULT_SHM_RING_SIZE static_cast<size_t>(1024)
+#define DEFAULT_SHM_ARENA_SIZE (static_cast<size_t>(16) << 20)
+
+    private: int my_fd;
+    private: bool my_listening_flag;
+    // NULL until the connection is set up.
+    private: shm_region *my_region;
+    private: std::deque<dmtr_qtoken_t> my_pushes;
+    private: std::deque<dmtr_qtoken_t> my_pops;
+    private: std::deque<dmtr_qtoken_t> my_accepts;
+    // listening queues: accepted sockets whose region hasn't arrived yet.
+    private: std::deque<int> my_handshakes;
+    private: unsigned my_idle_polls;
+    // once the other end is gone, every pop fails the same way.
+    private: int my_pop_error;
+
+    // the size of the rings (in messages) and arenas (in bytes) of the
+    // regions that this process creates.
+    private: static size_t our_ring_size;
+    private: static size_t our_arena_size;
+
+    private: shm_queue(int qd);
+    public: virtual ~shm_queue();
+    public: static int new_object(std::unique_ptr<io_queue> &q_out, int qd);
+    public: static int read_config(int argc, char *argv[]);
+
+    // network functions
+    public: int socket(int domain, int type, int protocol);
+    public: int getsockname(struct sockaddr * const saddr, socklen_t * const size);
+    public: int listen(int backlog);
+    public: int bind(const struct sockaddr * const saddr, socklen_t size);
+    public: int accept(std::unique_ptr<io_queue> &q_out, dmtr_qtoken_t qtok, int new_qd);
+    public: int connect(dmtr_qtoken_t qt, const struct sockaddr * const saddr, socklen_t size);
+    public: int close();
+
+    // data path functions
+    public: int push(dmtr_qtoken_t qt, const dmtr_sgarray_t &sga);
+    public: int pop(dmtr_qtoken_t qt);
+    public: int poll(dmtr_qresult_t &qr_out, dmtr_qtoken_t qt);
+    public: int service();
+    public: int sgaalloc(dmtr_sgarray_t &sga_out, size_t size);
+
+    private: bool good() const {
+        return my_fd > -1;
+    }
+
+    private: int accept_waiting();
+    private: int push_waiting();
+    private: int pop_waiting();
+    private: bool peer_gone();
+    private: void idle();
+    private: int abort_waiting(std::deque<dmtr_qtoken_t> &qts);
+    private: static int send_fd(int sock, int fd);
+    private: static int recv_fd(int &fd_out, int sock);
+};
+
+} // namespace dmtr
+
+#endif /* DMTR_LIBOS_SHM_QUEUE_HH_IS_INCLUDED */
@@ -0,0 +1,502 @@
+// -*- mode: c++; c-file-style: "k&r"; c-basic-offset: 4 -*-
+
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+#include "shm_region.hh"
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <dmtr/annot.h>
+#include <new>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// the other process updates the same counters, which only works if they
+// don't need a lock.
+static_assert(ATOMIC_INT_LOCK_FREE == 2 && ATOMIC_LLONG_LOCK_FREE == 2, "shared atomics have to be lock-free");
+
+static uint64_t round_up(uint64_t n, uint64_t alignment)
+{
+    return (n + alignment - 1) / alignment * alignment;
+}
+
+dmtr::shm_region::shm_region() :
+    my_refs(1),
+    my_base(NULL),
+    my_size(0),
+    my_layout(NULL),
+    my_end(0),
+    my_mask(0),
+    my_arenas{0, 0},
+    my_arena_size(0),
+    my_tx(NULL),
+    my_tx_slots(NULL),
+    my_tx_cached_head(0),
+    my_rx(NULL),
+    my_rx_slots(NULL),
+    my_rx_cached_tail(0),
+    my_max_size_class(0)
+{
+    my_pool.sga_pool.sp_free = &sp_free;
+    my_pool.region = this;
+}
+
+dmtr::shm_region::~shm_region()
+{
+    if (NULL != my_base) {
+        (void)munmap(my_base, my_size);
+    }
+}
+
+int dmtr::shm_region::create(shm_region *&region_out, int &fd_out, size_t ring_capacity, size_t arena_size)
+{
+    region_out = NULL;
+    fd_out = -1;
+    DMTR_TRUE(EINVAL, ring_capacity > 0 && ring_capacity <= UINT32_MAX);
+    DMTR_TRUE(EINVAL, arena_size >= SHM_MIN_BLOCK_SIZE);
+
+    const uint64_t page_size = sysconf(_SC_PAGESIZE);
+    const uint64_t capacity = dmtr::ring_capacity(ring_capacity);
+    const uint64_t ring_size = round_up(sizeof(ring_header) + capacity * sizeof(message), DMTR_CACHE_LINE_SIZE);
+    const uint64_t rings = round_up(sizeof(layout), DMTR_CACHE_LINE_SIZE);
+    const uint64_t arenas = round_up(rings + 2 * ring_size, page_size);
+    arena_size = round_up(arena_size, page_size);
+    const uint64_t size = arenas + 2 * arena_size;
+
+    int fd = memfd_create("dmtr-shm", MFD_CLOEXEC);
+    DMTR_TRUE(errno, -1 != fd);
+    if (-1 == ftruncate(fd, size)) {
+        const int error = errno;
+        ::close(fd);
+        DMTR_FAIL(error);
+    }
+
+    shm_region * const r = new shm_region;
+    int ret = r->map(fd, size);
+    if (0 != ret) {
+        ::close(fd);
+        delete r;
+        DMTR_FAIL(ret);
+    }
+
+    layout * const l = new (r->my_base) layout;
+    l->magic = SHM_MAGIC;
+    l->version = SHM_VERSION;
+    l->size = size;
+    l->ring_capacity = capacity;
+    l->arena_size = arena_size;
+    for (int i = 0; i < 2; ++i) {
+        l->rings[i] = rings + i * ring_size;
+        l->arenas[i] = arenas + i * arena_size;
+        l->closed[i].store(0, std::memory_order_relaxed);
+        ring_header * const h = new (r->my_base + l->rings[i]) ring_header;
+        h->head.store(0, std::memory_order_relaxed);
+        h->tail.store(0, std::memory_order_relaxed);
+    }
+
+    r->set_end(0);
+    region_out = r;
+    fd_out = fd;
+    return 0;
+}
+
+int dmtr::shm_region::attach(shm_region *&region_out, int fd)
+{
+    region_out = NULL;
+
+    struct stat st = {};
+    DMTR_TRUE(errno, 0 == fstat(fd, &st));
+    DMTR_TRUE(EILSEQ, st.st_size >= static_cast<off_t>(sizeof(layout)));
+
+    shm_region * const r = new shm_region;
+    int ret = r->map(fd, st.st_size);
+    if (0 == ret) {
+        ret = r->validate();
+    }
+
+    if (0 != ret) {
+        delete r;
+        return ret;
+    }
+
+    r->set_end(1);
+    region_out = r;
+    return 0;
+}
+
+int dmtr::shm_region::map(int fd, size_t size)
+{
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (MAP_FAILED == p) {
+        return errno;
+    }
+
+    my_base = reinterpret_cast<uint8_t *>(p);
+    my_size = size;
+    my_layout = reinterpret_cast<layout *>(p);
+    return 0;
+}
+
+int dmtr::shm_region::validate()
+{
+    const layout &l = *my_layout;
+    DMTR_TRUE(EILSEQ, SHM_MAGIC == l.magic && SHM_VERSION == l.version);
+    DMTR_TRUE(EILSEQ, my_size == l.size);
+
+    const uint64_t capacity = l.ring_capacity;
+    DMTR_TRUE(EILSEQ, capacity > 0 && 0 == (capacity & (capacity - 1)));
+    DMTR_TRUE(EILSEQ, capacity <= my_size / sizeof(message));
+    const uint64_t ring_size = sizeof(ring_header) + capacity * sizeof(message);
+    const uint64_t arena_size = l.arena_size;
+    DMTR_TRUE(EILSEQ, arena_size >= SHM_MIN_BLOCK_SIZE && arena_size <= my_size);
+    for (int i = 0; i < 2; ++i) {
+        DMTR_TRUE(EILSEQ, l.rings[i] >= sizeof(layout) && l.rings[i] <= my_size - ring_size);
+        DMTR_TRUE(EILSEQ, 0 == l.rings[i] % DMTR_CACHE_LINE_SIZE);
+        DMTR_TRUE(EILSEQ, l.arenas[i] >= sizeof(layout) && l.arenas[i] <= my_size - arena_size);
+        DMTR_TRUE(EILSEQ, 0 == l.arenas[i] % SHM_MIN_BLOCK_SIZE);
+    }
+
+    return 0;
+}
+
+void dmtr::shm_region::set_end(int end)
+{
+    my_end = end;
+    my_mask = my_layout->ring_capacity - 1;
+    my_arena_size = my_layout->arena_size;
+    for (int i = 0; i < 2; ++i) {
+        my_arenas[i] = my_layout->arenas[i];
+    }
+
+    my_tx = reinterpret_cast<ring_header *>(my_base + my_layout->rings[end]);
+    my_tx_slots = reinterpret_cast<message *>(my_tx + 1);
+    my_rx = reinterpret_cast<ring_header *>(my_base + my_layout->rings[1 - end]);
+    my_rx_slots = reinterpret_cast<message *>(my_rx + 1);
+
+    // the arena starts out as the largest blocks that fit, each aligned
+    // (within the arena) to its size, which is what lets buddies find each
+    // other.
+    uint64_t start = 0;
+    while (my_arena_size - start >= SHM_MIN_BLOCK_SIZE) {
+        uint32_t size_class = 0;
+        while (size_class + 1 < SHM_MAX_SIZE_CLASSES && 0 == start % block_size(size_class + 1)
+            && block_size(size_class + 1) <= my_arena_size - start) {
+            ++size_class;
+        }
+
+        my_free_blocks[size_class].insert(start);
+        my_max_size_class = std::max(my_max_size_class, size_class);
+        start += block_size(size_class);
+    }
+}
+
+void dmtr::shm_region::unref()
+{
+    if (1 == my_refs.fetch_sub(1, std::memory_order_acq_rel)) {
+        delete this;
+    }
+}
+
+bool dmtr::shm_region::tx_full()
+{
+    const uint64_t tail = my_tx->tail.load(std::memory_order_relaxed);
+    if (tail - my_tx_cached_head > my_mask) {
+        my_tx_cached_head = my_tx->head.load(std::memory_order_acquire);
+    }
+
+    return tail - my_tx_cached_head > my_mask;
+}
+
+bool dmtr::shm_region::push(const message &m)
+{
+    if (tx_full()) {
+        return false;
+    }
+
+    const uint64_t tail = my_tx->tail.load(std::memory_order_relaxed);
+    my_tx_slots[tail & my_mask] = m;
+    // publishes the message's data along with the message.
+    my_tx->tail.store(tail + 1, std::memory_order_release);
+    return true;
+}
+
+bool dmtr::shm_region::pop(message &m_out)
+{
+    const uint64_t head = my_rx->head.load(std::memory_order_relaxed);
+    if (head == my_rx_cached_tail) {
+        my_rx_cached_tail = my_rx->tail.load(std::memory_order_acquire);
+        if (head == my_rx_cached_tail) {
+            return false;
+        }
+    }
+
+    m_out = my_rx_slots[head & my_mask];
+    my_rx->head.store(head + 1, std::memory_order_release);
+    return true;
+}
+
+void dmtr::shm_region::close()
+{
+    my_layout->closed[my_end].store(1, std::memory_order_release);
+}
+
+bool dmtr::shm_region::peer_closed() const
+{
+    return 0 != my_layout->closed[1 - my_end].load(std::memory_order_acquire);
+}
+
+int dmtr::shm_region::to_message(message &m_out, const dmtr_sgarray_t &sga)
+{
+    DMTR_TRUE(EINVAL, sga.sga_numsegs > 0 && sga.sga_numsegs <= DMTR_SGARRAY_MAXSIZE);
+
+    const uint8_t * const buf = reinterpret_cast<const uint8_t *>(sga.sga_buf);
+    size_t capacity = 0;
+    if (&my_pool.sga_pool == sga.sga_pool && buf >= my_base && buf < my_base + my_size
+        && 0 == check_block(capacity, buf - my_base)) {
+        // a buffer from `alloc_sga()` or a popped message (ours or the
+        // other end's) only needs another reference, as long as the
+        // segments are where they should be.
+        bool inside_flag = true;
+        for (size_t i = 0; i < sga.sga_numsegs && inside_flag; ++i) {
+            const uint8_t * const seg = reinterpret_cast<const uint8_t *>(sga.sga_segs[i].sgaseg_buf);
+            inside_flag = seg >= buf && static_cast<size_t>(seg - buf) <= capacity
+                && sga.sga_segs[i].sgaseg_len <= capacity - (seg - buf);
+        }
+
+        if (inside_flag) {
+            header(buf - my_base)->refs.fetch_add(1, std::memory_order_relaxed);
+            m_out.block = buf - my_base;
+            m_out.numsegs = sga.sga_numsegs;
+            for (size_t i = 0; i < sga.sga_numsegs; ++i) {
+                m_out.seg_offsets[i] = reinterpret_cast<const uint8_t *>(sga.sga_segs[i].sgaseg_buf) - buf;
+                m_out.seg_lens[i] = sga.sga_segs[i].sgaseg_len;
+            }
+
+            return 0;
+        }
+    }
+
+    size_t len = 0;
+    for (size_t i = 0; i < sga.sga_numsegs; ++i) {
+        len += sga.sga_segs[i].sgaseg_len;
+    }
+
+    DMTR_TRUE(EMSGSIZE, len <= UINT32_MAX);
+    uint64_t block = 0;
+    int ret = alloc(block, len);
+    if (0 != ret) {
+        return ret;
+    }
+
+    uint8_t * const p = my_base + block;
+    uint32_t offset = 0;
+    m_out.block = block;
+    m_out.numsegs = sga.sga_numsegs;
+    for (size_t i = 0; i < sga.sga_numsegs; ++i) {
+        const uint32_t seglen = sga.sga_segs[i].sgaseg_len;
+        memcpy(p + offset, sga.sga_segs[i].sgaseg_buf, seglen);
+        m_out.seg_offsets[i] = offset;
+        m_out.seg_lens[i] = seglen;
+        offset += seglen;
+    }
+
+    return 0;
+}
+
+int dmtr::shm_region::to_sga(dmtr_sgarray_t &sga_out, const message &m)
+{
+    // the other end wrote the message, so it's checked before anything in
+    // it is used.
+    DMTR_TRUE(EILSEQ, m.numsegs > 0 && m.numsegs <= DMTR_SGARRAY_MAXSIZE);
+    size_t capacity = 0;
+    DMTR_OK(check_block(capacity, m.block));
+
+    dmtr_sgarray_t sga = {};
+    uint8_t * const buf = my_base + m.block;
+    sga.sga_numsegs = m.numsegs;
+    for (size_t i = 0; i < m.numsegs; ++i) {
+        DMTR_TRUE(EILSEQ, static_cast<uint64_t>(m.seg_offsets[i]) + m.seg_lens[i] <= capacity);
+        sga.sga_segs[i].sgaseg_buf = buf + m.seg_offsets[i];
+        sga.sga_segs[i].sgaseg_len = m.seg_lens[i];
+    }
+
+    sga.sga_buf = buf;
+    sga.sga_pool = &my_pool.sga_pool;
+    my_refs.fetch_add(1, std::memory_order_relaxed);
+    sga_out = sga;
+    return 0;
+}
+
+void dmtr::shm_region::discard(const message &m)
+{
+    size_t capacity = 0;
+    if (0 == check_block(capacity, m.block)) {
+        header(m.block)->refs.fetch_sub(1, std::memory_order_acq_rel);
+    }
+}
+
+int dmtr::shm_region::alloc_sga(dmtr_sgarray_t &sga_out, size_t size)
+{
+    uint64_t block = 0;
+    int ret = alloc(block, size);
+    if (EAGAIN == ret) {
+        return ENOMEM;
+    }
+
+    DMTR_OK(ret);
+    dmtr_sgarray_t sga = {};
+    sga.sga_buf = my_base + block;
+    sga.sga_pool = &my_pool.sga_pool;
+    sga.sga_numsegs = 1;
+    sga.sga_segs[0].sgaseg_buf = sga.sga_buf;
+    sga.sga_segs[0].sgaseg_len = size;
+    my_refs.fetch_add(1, std::memory_order_relaxed);
+    sga_out = sga;
+    return 0;
+}
+
+int dmtr::shm_region::alloc(uint64_t &block_out, size_t size)
+{
+    block_out = 0;
+
+    uint32_t size_class = 0;
+    while (size_class < SHM_MAX_SIZE_CLASSES && block_size(size_class) - sizeof(block_header) < size) {
+        ++size_class;
+    }
+
+    DMTR_TRUE(EMSGSIZE, size_class <= my_max_size_class);
+    reclaim(false);
+    uint32_t from = size_class;
+    while (from <= my_max_size_class && my_free_blocks[from].empty()) {
+        ++from;
+    }
+
+    if (from > my_max_size_class) {
+        // something other than the oldest block may have come back.
+        reclaim(true);
+        from = size_class;
+        while (from <= my_max_size_class && my_free_blocks[from].empty()) {
+            ++from;
+        }
+    }
+
+    if (from > my_max_size_class) {
+        // blocks that are still out make room as they come back; once
+        // they're all back, the arena holds a block of every size again.
+        return my_live_blocks.empty() ? ENOMEM : EAGAIN;
+    }
+
+    uint64_t start = *my_free_blocks[from].begin();
+    my_free_blocks[from].erase(my_free_blocks[from].begin());
+    while (from > size_class) {
+        --from;
+        my_free_blocks[from].insert(start + block_size(from));
+    }
+
+    const uint64_t block = my_arenas[my_end] + start + sizeof(block_header);
+    block_header * const h = new (my_base + block - sizeof(block_header)) block_header;
+    // the new reference is published along with the message (or sga) that
+    // holds it.
+    h->refs.store(1, std::memory_order_relaxed);
+    h->size_class = size_class;
+    live_block lb = {};
+    lb.block = block;
+    lb.size_class = size_class;
+    my_live_blocks.push_back(lb);
+    block_out = block;
+    return 0;
+}
+
+void dmtr::shm_region::reclaim(bool all_flag)
+{
+    if (!all_flag) {
+        while (!my_live_blocks.empty() && 0 == header(my_live_blocks.front().block)->refs.load(std::memory_order_acquire)) {
+            const live_block &lb = my_live_blocks.front();
+            free_block(lb.block, lb.size_class);
+            my_live_blocks.pop_front();
+        }
+
+        return;
+    }
+
+    size_t kept = 0;
+    for (size_t i = 0; i < my_live_blocks.size(); ++i) {
+        const live_block lb = my_live_blocks[i];
+        if (0 == header(lb.block)->refs.load(std::memory_order_acquire)) {
+            free_block(lb.block, lb.size_class);
+        } else {
+            my_live_blocks[kept++] = lb;
+        }
+    }
+
+    my_live_blocks.resize(kept);
+}
+
+void dmtr::shm_region::free_block(uint64_t block, uint32_t size_class)
+{
+    uint64_t start = block - sizeof(block_header) - my_arenas[my_end];
+    while (size_class < my_max_size_class) {
+        const uint64_t buddy = start ^ block_size(size_class);
+        auto it = my_free_blocks[size_class].find(buddy);
+        if (my_free_blocks[size_class].end() == it) {
+            break;
+        }
+
+        my_free_blocks[size_class].erase(it);
+        start = std::min(start, buddy);
+        ++size_class;
+    }
+
+    my_free_blocks[size_class].insert(start);
+}
+
+dmtr::shm_region::block_header *dmtr::shm_region::header(uint64_t block) const
+{
+    return reinterpret_cast<block_header *>(my_base + block - sizeof(block_header));
+}
+
+int dmtr::shm_region::check_block(size_t &capacity_out, uint64_t block) const
+{
+    capacity_out = 0;
+
+    for (int i = 0; i < 2; ++i) {
+        if (block < my_arenas[i] + sizeof(block_header) || block >= my_arenas[i] + my_arena_size) {
+            continue;
+        }
+
+        const uint64_t start = block - sizeof(block_header);
+        const uint32_t size_class = header(block)->size_class;
+        if (0 != (start - my_arenas[i]) % SHM_MIN_BLOCK_SIZE || size_class >= SHM_MAX_SIZE_CLASSES
+            || block_size(size_class) > my_arenas[i] + my_arena_size - start) {
+            return EILSEQ;
+        }
+
+        capacity_out = block_size(size_class) - sizeof(block_header);
+        return 0;
+    }
+
+    return EILSEQ;
+}
+
+size_t dmtr::shm_region::block_size(uint32_t size_class)
+{
+    return SHM_MIN_BLOCK_SIZE << size_class;
+}
+
+int dmtr::shm_region::sp_free(dmtr_sgapool_t *sga_pool, void *buf)
+{
+    DMTR_NOTNULL(EINVAL, sga_pool);
+    DMTR_NOTNULL(EINVAL, buf);
+
+    shm_region * const r = reinterpret_cast<pool *>(sga_pool)->region;
+    DMTR_NOTNULL(EINVAL, r);
+    uint8_t * const p = reinterpret_cast<uint8_t *>(buf);
+    DMTR_TRUE(EINVAL, p >= r->my_base && p < r->my_base + r->my_size);
+    r->header(p - r->my_base)->refs.fetch_sub(1, std::memory_order_acq_rel);
+    r->unref();
+    return 0;
+}
@@ -0,0 +1,157 @@
+// -*- mode: c++; c-file-style: "k&r"; c-basic-offset: 4 -*-
+
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+#ifndef DMTR_LIBOS_SHM_REGION_HH_IS_INCLUDED
+#define DMTR_LIBOS_SHM_REGION_HH_IS_INCLUDED
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <dmtr/libos/ring.hh>
+#include <dmtr/types.h>
+#include <set>
+
+namespace dmtr {
+
+// the memory that the two ends of a connection share: a ring of messages
+// in each direction and an arena of buffers for each end to push from.
+// the end that connects creates the region (a memfd) and the other end
+// maps the same file after accepting the connection.
+//
+// messages aren't copied through the rings; a message is the offset of
+// the block in an arena that holds it, plus where its segments are in the
+// block. every block counts its references (the application's, one per
+// message in flight and one per popped sga), and the end whose arena the
+// block is in takes it back once the count drops to zero. both processes
+// update the counts, so they're lock-free atomics in the shared memory.
+class shm_region
+{
+#define SHM_MAGIC 0x73686d31u
+#define SHM_VERSION 1u
+    // blocks come in power-of-two sizes, starting at this, header included.
+#define SHM_MIN_BLOCK_SIZE static_cast<size_t>(256)
+#define SHM_MAX_SIZE_CLASSES 32
+
+    public: struct message {
+        // where the block's data starts, from the start of the region.
+        uint64_t block;
+        uint32_t numsegs;
+        // relative to the block's data.
+        uint32_t seg_offsets[DMTR_SGARRAY_MAXSIZE];
+        uint32_t seg_lens[DMTR_SGARRAY_MAXSIZE];
+    };
+
+    private: struct block_header {
+        std::atomic<uint32_t> refs;
+        uint32_t size_class;
+        uint64_t reserved;
+    };
+
+    // a ring's indices only ever grow; the slots follow the indices.
+    private: struct ring_header {
+        alignas(DMTR_CACHE_LINE_SIZE) std::atomic<uint64_t> head;
+        alignas(DMTR_CACHE_LINE_SIZE) std::atomic<uint64_t> tail;
+    };
+
+    // at the start of the region. the offsets are from the start of the
+    // region, and ring (or arena) `n` is written (or allocated from) by end
+    // `n`; the connecting end is end 0.
+    private: struct layout {
+        uint32_t magic;
+        uint32_t version;
+        uint64_t size;
+        uint64_t ring_capacity;
+        uint64_t arena_size;
+        uint64_t rings[2];
+        uint64_t arenas[2];
+        std::atomic<uint32_t> closed[2];
+    };
+
+    // `dmtr_sgafree()` only hands the pool back, so the pool is embedded
+    // in something that leads back to the region.
+    private: struct pool {
+        dmtr_sgapool_t sga_pool;
+        shm_region *region;
+    };
+
+    private: pool my_pool;
+    // the queue's reference plus one for every sga that points into the
+    // region, so that the region stays mapped until the last of them is
+    // freed, on whatever thread that happens.
+    private: std::atomic<uint32_t> my_refs;
+    private: uint8_t *my_base;
+    private: size_t my_size;
+    private: layout *my_layout;
+    private: int my_end;
+    // what the layout said when the region was mapped; the other end
+    // could change the layout afterwards.
+    private: uint64_t my_mask;
+    private: uint64_t my_arenas[2];
+    private: uint64_t my_arena_size;
+    private: ring_header *my_tx;
+    private: message *my_tx_slots;
+    private: uint64_t my_tx_cached_head;
+    private: ring_header *my_rx;
+    private: message *my_rx_slots;
+    private: uint64_t my_rx_cached_tail;
+    // our arena is handed out by a buddy allocator: a free block is split
+    // in halves until it's the size that's needed, and a block that comes
+    // back is merged with its buddy for as long as the buddy is free too,
+    // so that memory freed in one size class can be used for any other.
+    // free blocks are kept by where they start in the arena. blocks that
+    // have been handed out are kept in the order they were allocated in,
+    // since they tend to come back in that order.
+    private: struct live_block {
+        uint64_t block;
+        uint32_t size_class;
+    };
+    private: std::set<uint64_t> my_free_blocks[SHM_MAX_SIZE_CLASSES];
+    // the largest block that the arena holds.
+    private: uint32_t my_max_size_class;
+    private: std::deque<live_block> my_live_blocks;
+
+    private: shm_region();
+    private: ~shm_region();
+    private: shm_region(const shm_region &) = delete;
+
+    // maps a new region and returns the file that the other end has to
+    // map (see `attach()`).
+    public: static int create(shm_region *&region_out, int &fd_out, size_t ring_capacity, size_t arena_size);
+    public: static int attach(shm_region *&region_out, int fd);
+    public: void unref();
+
+    public: bool tx_full();
+    public: bool push(const message &m);
+    public: bool pop(message &m_out);
+    public: void close();
+    public: bool peer_closed() const;
+
+    // turns `sga` into a message. it's only copied into our arena if its
+    // buffer isn't a block of this region already; `EAGAIN` means that the
+    // arena is full for now.
+    public: int to_message(message &m_out, const dmtr_sgarray_t &sga);
+    // hands the message's reference to the sga.
+    public: int to_sga(dmtr_sgarray_t &sga_out, const message &m);
+    // drops the reference of a message that won't be popped.
+    public: void discard(const message &m);
+    // allocates a single segment of `size` bytes in our arena.
+    public: int alloc_sga(dmtr_sgarray_t &sga_out, size_t size);
+
+    private: int map(int fd, size_t size);
+    private: int validate();
+    private: void set_end(int end);
+    private: int alloc(uint64_t &block_out, size_t size);
+    private: void reclaim(bool all_flag);
+    private: void free_block(uint64_t block, uint32_t size_class);
+    private: block_header *header(uint64_t block) const;
+    private: int check_block(size_t &capacity_out, uint64_t block) const;
+    private: static size_t block_size(uint32_t size_class);
+    private: static int sp_free(dmtr_sgapool_t *pool, void *buf);
+};
+
+} // namespace dmtr
+
+#endif /* DMTR_LIBOS_SHM_REGION_HH_IS_INCLUDED */
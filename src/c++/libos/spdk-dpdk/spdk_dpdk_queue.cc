@@ -225,6 +225,18 @@ int dmtr::spdk_dpdk_queue::pop(dmtr_qtoken_t qt) {
     else return file_queue->pop(qt);    
 }
 
+int dmtr::spdk_dpdk_queue::pop(dmtr_qtoken_t qt, size_t count) {
+    DMTR_TRUE(EPERM, our_init_flag);
+    DMTR_TRUE(ENOTSUP, my_cid == FILE_Q);
+    return file_queue->pop(qt, count);
+}
+
+int dmtr::spdk_dpdk_queue::lseek(off_t offset, int whence) {
+    DMTR_TRUE(EPERM, our_init_flag);
+    DMTR_TRUE(ENOTSUP, my_cid == FILE_Q);
+    return file_queue->lseek(offset, whence);
+}
+
 int dmtr::spdk_dpdk_queue::poll(dmtr_qresult_t &qr_out, dmtr_qtoken_t qt)
 { 
     DMTR_TRUE(EPERM, our_init_flag);
@@ -43,6 +43,8 @@ class spdk_rdma_queue : public io_queue {
     // data path functions
     public: int push(dmtr_qtoken_t qt, const dmtr_sgarray_t &sga);
     public: int pop(dmtr_qtoken_t qt);
+    public: int pop(dmtr_qtoken_t qt, size_t count);
+    public: int lseek(off_t offset, int whence);
     public: int poll(dmtr_qresult_t &qr_out, dmtr_qtoken_t qt);
 
     // init functions
@@ -3,6 +3,7 @@
 
 #include "spdk_queue.hh"
 
+#include <algorithm>
 #include <boost/chrono.hpp>
 #include <boost/program_options/options_description.hpp>
 #include <boost/program_options/parsers.hpp>
@@ -20,6 +21,7 @@
 #include <iostream>
 #include <dmtr/libos/mem.h>
 #include <dmtr/libos/raii_guard.hh>
+#include <fcntl.h>
 #include <spdk/env.h>
 #include <spdk/log.h>
 #include <spdk/nvme.h>
@@ -30,6 +32,32 @@ namespace bpo = boost::program_options;
 namespace {
     static constexpr char kTrTypeString[] = "trtype=";
     static constexpr char kTrAddrString[] = "traddr=";
+
+    // Reads and writes may be outstanding on the qpair at the same time, so
+    // each command gets its own completion.
+    struct io_wait {
+        bool done;
+        int error;
+    };
+
+    void onIoDone(void *arg, const struct spdk_nvme_cpl *cpl) {
+        io_wait *w = reinterpret_cast<io_wait *>(arg);
+        w->done = true;
+        w->error = spdk_nvme_cpl_is_error(cpl) ? EIO : 0;
+    }
+
+    int waitForIo(io_wait &w, dmtr::user_thread<dmtr_qtoken_t>::yield_type &yield) {
+        while (!w.done) {
+            const int rc = spdk_nvme_qpair_process_completions(dmtr::spdk_queue::qpair, 0);
+            if (rc < 0) {
+                return -rc;
+            }
+            if (!w.done) {
+                yield();
+            }
+        }
+        return w.error;
+    }
 }
 
 #if DMTR_PROFILE
@@ -266,6 +294,7 @@ int dmtr::spdk_queue::open(const char *pathname, int flags)
     // we choose to support multiple files we will need to so some sort of
     // lookup or something here.
     // TODO(ashmrtnz): O_TRUNC?
+    syncFlag = 0 != (flags & (O_SYNC | O_DSYNC));
     start_threads();
     return 0;
 }
@@ -277,6 +306,7 @@ int dmtr::spdk_queue::open2(const char *pathname, int flags, mode_t mode)
     // we choose to support multiple files we will need to so some sort of
     // lookup or something here. We can't support O_EXCL right now.
     // TODO(ashmrtnz): O_TRUNC?
+    syncFlag = 0 != (flags & (O_SYNC | O_DSYNC));
     start_threads();
     return 0;
 }
@@ -298,6 +328,9 @@ int dmtr::spdk_queue::push(dmtr_qtoken_t qt, const dmtr_sgarray_t &sga)
     DMTR_NOTNULL(EINVAL, my_push_thread);
 
     DMTR_OK(new_task(qt, DMTR_OPC_PUSH, sga));
+    size_t sgalen = 0;
+    DMTR_OK(dmtr_sgalen(&sgalen, &sga));
+    logEnd += sgalen;
     my_push_thread->enqueue(qt);
     my_push_thread->service();
     return 0;
@@ -305,14 +338,20 @@ int dmtr::spdk_queue::push(dmtr_qtoken_t qt, const dmtr_sgarray_t &sga)
 
 // TODO(ashmrtnz): Update to use spdk scatter gather arrays if the sga parameter
 // has DMA-able memory.
-int dmtr::spdk_queue::file_push(const dmtr_sgarray_t *sga, task::thread_type::yield_type &yield)
+// All of the sgas are appended with a single write and, if the file is
+// synchronous, made durable with a single flush. Pushes that arrive while
+// that's under way queue up for the next call, so the cost of the flush is
+// shared by everything that's waiting for it (group commit).
+int dmtr::spdk_queue::file_push(const std::vector<const dmtr_sgarray_t *> &sgas, task::thread_type::yield_type &yield)
 {
     DMTR_TRUE(EPERM, our_spdk_init_flag);
-    uint32_t total_len = 0;
+    uint64_t total_len = 0;
 
     // find size
-    for (size_t i = 0; i < sga->sga_numsegs; i++) {
-        total_len += sga->sga_segs[i].sgaseg_len;
+    for (const dmtr_sgarray_t *sga : sgas) {
+        for (size_t i = 0; i < sga->sga_numsegs; i++) {
+            total_len += sga->sga_segs[i].sgaseg_len;
+        }
     }
     // Allocate a DMA-able buffer that is rounded up to the nearest sector size
     // and includes space for the sga metadata like the number of segments, each
@@ -320,9 +359,17 @@ int dmtr::spdk_queue::file_push(const dmtr_sgarray_t *sga, task::thread_type::yi
     // Randomly pick 4k alignment.
     const size_t partial_block_size = (partialBlockUsage + total_len) % sectorSize;
     const size_t num_blocks = (total_len + partialBlockUsage - partial_block_size) / sectorSize +
-        (partial_block_size > 0) ? 1 : 0;
+        ((partial_block_size > 0) ? 1 : 0);
+
+    // Not sure if this is strictly required or if the device will throw and
+    // error all by itself, but just to be safe.
+    if (static_cast<uint64_t>(logOffset) * sectorSize + partialBlockUsage + total_len > namespaceSize) {
+        return ENOSPC;
+    }
+
     uint8_t *buf = (uint8_t *) spdk_malloc(num_blocks * sectorSize, 0x200, NULL,
         0, SPDK_MALLOC_DMA);
+    DMTR_NOTNULL(ENOMEM, buf);
     uint8_t *p = buf; 
 
     // See if we have a partial block left over from the last write. If we do,
@@ -332,16 +379,12 @@ int dmtr::spdk_queue::file_push(const dmtr_sgarray_t *sga, task::thread_type::yi
         p += partialBlockUsage;
     }
     
-    for (size_t i = 0; i < sga->sga_numsegs; i++) {\
-        const auto len = sga->sga_segs[i].sgaseg_len;    
-        memcpy(p, sga->sga_segs[i].sgaseg_buf, len);
-        p += len;
-    }
-
-    // Not sure if this is strictly required or if the device will throw and
-    // error all by itself, but just to be safe.
-    if (logOffset * sectorSize + total_len > namespaceSize) {
-        return -ENOSPC;
+    for (const dmtr_sgarray_t *sga : sgas) {
+        for (size_t i = 0; i < sga->sga_numsegs; i++) {
+            const auto len = sga->sga_segs[i].sgaseg_len;
+            memcpy(p, sga->sga_segs[i].sgaseg_buf, len);
+            p += len;
+        }
     }
 
     // Save any partial blocks we may have so we don't have to do a
@@ -352,11 +395,13 @@ int dmtr::spdk_queue::file_push(const dmtr_sgarray_t *sga, task::thread_type::yi
             partialBlockUsage);
     }
 
+    io_wait w = {};
     int rc = spdk_nvme_ns_cmd_write(ns, qpair, buf, logOffset, num_blocks,
-        nullptr, nullptr, 0);
+        onIoDone, &w, 0);
     
     if (rc != 0) {
-        return rc;
+        spdk_free(buf);
+        return -rc;
     }
 
     logOffset += num_blocks;
@@ -369,24 +414,22 @@ int dmtr::spdk_queue::file_push(const dmtr_sgarray_t *sga, task::thread_type::yi
     // Wait for completion.
 #if DMTR_PROFILE
     auto t0 = boost::chrono::steady_clock::now();
-    boost::chrono::duration<uint64_t, boost::nano> dt(0);
 #endif
-    do {
-        // TODO(ashmrtnz): Assumes that there is only 1 outstanding request at a
-        // time, since we're retrieving what we just queued above...
-        rc = spdk_nvme_qpair_process_completions(qpair, 1);
-        if (rc == 0) {
-#if DMTR_PROFILE
-            dt += boost::chrono::steady_clock::now() - t0;
-#endif
-            yield();
+    rc = waitForIo(w, yield);
+    spdk_free(buf);
+    if (rc == 0) {
+        logWritten += total_len;
+    }
+    if (rc == 0 && syncFlag) {
+        // Nothing is durable until the device's write cache is flushed.
+        w = {};
+        rc = spdk_nvme_ns_cmd_flush(ns, qpair, onIoDone, &w);
+        rc = rc != 0 ? -rc : waitForIo(w, yield);
+    }
 #if DMTR_PROFILE
-            t0 = boost::chrono::steady_clock::now();
+    DMTR_OK(dmtr_record_latency(write_latency.get(), (boost::chrono::steady_clock::now() - t0).count()));
 #endif
-        }
-    } while (rc == 0);
-    spdk_free(buf);
-    return 0;
+    return rc;
 }
 
 int dmtr::spdk_queue::push_thread(task::thread_type::yield_type &yield, task::thread_type::queue_type &tq) 
@@ -396,55 +439,162 @@ int dmtr::spdk_queue::push_thread(task::thread_type::yield_type &yield, task::th
             yield();
         }
 
-        auto qt = tq.front();
-        tq.pop();
-        task *t;
-        DMTR_OK(get_task(t, qt));
-            
-        const dmtr_sgarray_t *sga = NULL;
-        DMTR_TRUE(EINVAL, t->arg(sga));
+        // Everything that was pushed while the last write was in progress
+        // goes out together.
+        my_push_batch.clear();
+        my_push_sgas.clear();
+        while (!tq.empty()) {
+            auto qt = tq.front();
+            tq.pop();
+            task *t;
+            DMTR_OK(get_task(t, qt));
+
+            const dmtr_sgarray_t *sga = NULL;
+            DMTR_TRUE(EINVAL, t->arg(sga));
+
+            size_t sgalen = 0;
+            DMTR_OK(dmtr_sgalen(&sgalen, sga));
+            if (0 == sgalen) {
+                DMTR_OK(t->complete(ENOMSG));
+                // move onto the next task.
+                continue;
+            }
+
+            my_push_batch.push_back(qt);
+            my_push_sgas.push_back(sga);
+        }
+
+        if (my_push_batch.empty()) {
+            continue;
+        }
 
 #if DMTR_DEBUG
-        std::cerr << "push(" << qt << "): preparing message." << std::endl;
+        std::cerr << "push: writing " << my_push_batch.size() << " messages." << std::endl;
 #endif
 
-        size_t sgalen = 0;
-        DMTR_OK(dmtr_sgalen(&sgalen, sga));
-        if (0 == sgalen) {
-            DMTR_OK(t->complete(ENOMSG));
-            // move onto the next task.
-            continue;
+        const uint64_t written = logWritten;
+        int ret = file_push(my_push_sgas, yield);
+        if (0 != ret && logWritten == written) {
+            // None of the batch made it into the log.
+            for (const dmtr_sgarray_t *sga : my_push_sgas) {
+                size_t sgalen = 0;
+                DMTR_OK(dmtr_sgalen(&sgalen, sga));
+                logEnd -= sgalen;
+            }
         }
 
-        int ret = 0;
-        ret = file_push(sga, yield);
-
-        if (0 != ret) {
-            DMTR_OK(t->complete(ret));
-            // move onto the next task.
-            continue;
+        for (size_t i = 0; i < my_push_batch.size(); ++i) {
+            task *t;
+            DMTR_OK(get_task(t, my_push_batch[i]));
+            if (0 != ret) {
+                DMTR_OK(t->complete(ret));
+            } else {
+                DMTR_OK(t->complete(0, *my_push_sgas[i]));
+            }
         }
-        DMTR_OK(t->complete(0, *sga));
     }
     return 0;
 }
 
 int dmtr::spdk_queue::pop(dmtr_qtoken_t qt) {
+    return pop(qt, FILE_POP_SIZE);
+}
+
+int dmtr::spdk_queue::pop(dmtr_qtoken_t qt, size_t count) {
     DMTR_TRUE(EPERM, our_spdk_init_flag);
     DMTR_NOTNULL(EINVAL, my_pop_thread);
+    DMTR_TRUE(ERANGE, count <= UINT32_MAX);
+    DMTR_TRUE(EOVERFLOW, count <= UINT64_MAX - readOffset);
 
+    // Every pop knows where it reads from as soon as it's started, like
+    // `pread()`.
     DMTR_OK(new_task(qt, DMTR_OPC_POP));
+    my_file_reads.push_back(file_read{readOffset, count});
+    readOffset += count;
     my_pop_thread->enqueue(qt);
 
     return 0;
 }
 
-int dmtr::spdk_queue::file_pop(dmtr_sgarray_t *sga, task::thread_type::yield_type &yield)
-{
-    //TODO?
+int dmtr::spdk_queue::lseek(off_t offset, int whence) {
+    DMTR_TRUE(EPERM, our_spdk_init_flag);
+
+    // There's only the one file, and it ends where the log does.
+    int64_t base = 0;
+    switch (whence) {
+        default:
+            return EINVAL;
+        case SEEK_SET:
+            break;
+        case SEEK_CUR:
+            base = readOffset;
+            break;
+        case SEEK_END:
+            base = logEnd;
+            break;
+    }
+
+    DMTR_TRUE(EINVAL, offset >= -base);
+    readOffset = base + offset;
     return 0;
 }
 
+// Reads the blocks that cover the requested bytes and copies the bytes out.
+// Reads are clipped to the end of the log; a read at or past it comes back
+// without any segments, like a read at the end of a file.
+int dmtr::spdk_queue::file_pop(dmtr_sgarray_t *sga, uint64_t offset, size_t count, task::thread_type::yield_type &yield)
+{
+    DMTR_TRUE(EPERM, our_spdk_init_flag);
+
+    size_t len = 0;
+    while (true) {
+        if (offset >= logEnd) {
+            return 0;
+        }
+
+        len = std::min<uint64_t>(count, logEnd - offset);
+        if (offset + len <= logWritten) {
+            break;
+        }
+
+        // Some of it is still waiting for the push thread, which may also
+        // fail to write it, so the end of the log is looked at again.
+        yield();
+    }
+
+    const uint64_t first_block = offset / sectorSize;
+    const uint64_t end_block = (offset + len + sectorSize - 1) / sectorSize;
+    const uint32_t num_blocks = end_block - first_block;
+    uint8_t *buf = (uint8_t *) spdk_malloc(num_blocks * sectorSize, 0x200, NULL,
+        0, SPDK_MALLOC_DMA);
+    DMTR_NOTNULL(ENOMEM, buf);
+
+#if DMTR_PROFILE
+    auto t0 = boost::chrono::steady_clock::now();
+#endif
+    io_wait w = {};
+    int rc = spdk_nvme_ns_cmd_read(ns, qpair, buf, first_block, num_blocks,
+        onIoDone, &w, 0);
+    if (rc != 0) {
+        spdk_free(buf);
+        return -rc;
+    }
+
+    rc = waitForIo(w, yield);
+#if DMTR_PROFILE
+    DMTR_OK(dmtr_record_latency(read_latency.get(), (boost::chrono::steady_clock::now() - t0).count()));
+#endif
+    if (rc == 0) {
+        rc = our_buffer_pool.alloc_sga(*sga, len);
+    }
+    if (rc == 0) {
+        memcpy(sga->sga_buf, buf + (offset - first_block * sectorSize), len);
+    }
+
+    spdk_free(buf);
+    return rc;
+}
+
 int dmtr::spdk_queue::pop_thread(task::thread_type::yield_type &yield, task::thread_type::queue_type &tq) {
 #if DMTR_DEBUG
     std::cerr << "[" << qd() << "] pop thread started." << std::endl;
@@ -459,9 +609,13 @@ int dmtr::spdk_queue::pop_thread(task::thread_type::yield_type &yield, task::thr
         task *t;
         DMTR_OK(get_task(t, qt));
 
+        DMTR_TRUE(EINVAL, !my_file_reads.empty());
+        const file_read r = my_file_reads.front();
+        my_file_reads.pop_front();
+
         dmtr_sgarray_t sga = {};
         int ret = 0;
-        ret = file_pop(&sga, yield);
+        ret = file_pop(&sga, r.offset, r.count, yield);
         if (EAGAIN == ret) {
             yield();
             continue;
@@ -5,10 +5,12 @@
 #define DMTR_LIBOS_SPDK_QUEUE_HH_IS_INCLUDED
 
 #include <boost/optional.hpp>
+#include <deque>
 #include <dmtr/libos/io_queue.hh>
 #include <memory>
 #include <spdk/env.h>
 #include <spdk/nvme.h>
+#include <vector>
 #include <yaml-cpp/yaml.h>
 
 namespace dmtr {
@@ -28,6 +30,25 @@ class spdk_queue: public io_queue {
     public: static char *partialBlock;
     // How many bytes of data are in partialBlock.
     private: unsigned int partialBlockUsage = 0;
+    // Whether pushes have to be durable before they complete (the file was
+    // opened with O_SYNC or O_DSYNC).
+    private: bool syncFlag = false;
+    // The pushes that the push thread is writing.
+    private: std::vector<dmtr_qtoken_t> my_push_batch;
+    private: std::vector<const dmtr_sgarray_t *> my_push_sgas;
+    // Byte offset that the next pop reads from. The log starts at LBA 0.
+    private: uint64_t readOffset = 0;
+    // Where the log ends, counting the pushes that are still waiting to be
+    // written, and how much of it is on the device. Pops and `SEEK_END` go
+    // by the former; a pop waits for what it covers to be written.
+    private: uint64_t logEnd = 0;
+    private: uint64_t logWritten = 0;
+    // Where each pop that hasn't been serviced yet reads from.
+    private: struct file_read {
+        uint64_t offset;
+        size_t count;
+    };
+    private: std::deque<file_read> my_file_reads;
     // processing threads
     protected: std::unique_ptr<task::thread_type> my_push_thread;
     protected: std::unique_ptr<task::thread_type> my_pop_thread;
@@ -40,14 +61,16 @@ class spdk_queue: public io_queue {
     // data path functions
     public: int push(dmtr_qtoken_t qt, const dmtr_sgarray_t &sga);
     public: int pop(dmtr_qtoken_t qt);
+    public: int pop(dmtr_qtoken_t qt, size_t count);
+    public: int lseek(off_t offset, int whence);
     public: int poll(dmtr_qresult_t &qr_out, dmtr_qtoken_t qt);
 
     public: void start_threads();
     private: int push_thread(task::thread_type::yield_type &yield, task::thread_type::queue_type &tq);
     private: int pop_thread(task::thread_type::yield_type &yield, task::thread_type::queue_type &tq);
 
-    protected: int file_push(const dmtr_sgarray_t *sga, task::thread_type::yield_type &yield);
-    protected: int file_pop(dmtr_sgarray_t *sga, task::thread_type::yield_type &yield);
+    protected: int file_push(const std::vector<const dmtr_sgarray_t *> &sgas, task::thread_type::yield_type &yield);
+    protected: int file_pop(dmtr_sgarray_t *sga, uint64_t offset, size_t count, task::thread_type::yield_type &yield);
     // spdk functions
     public: static int init_spdk(int argc, char *argv[]);
     public: static int init_spdk(YAML::Node &config, spdk_env_opts *opts);
@@ -0,0 +1,275 @@
+// -*- mode: c++; c-file-style: "k&r"; c-basic-offset: 4 -*-
+
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+#include "io_ring.hh"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <dmtr/annot.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static int io_uring_setup(unsigned entries, struct io_uring_params &p)
+{
+    int fd = syscall(__NR_io_uring_setup, entries, &p);
+    return -1 == fd ? -errno : fd;
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, const void *arg, size_t argsz)
+{
+    int ret = syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+    return -1 == ret ? errno : 0;
+}
+
+static int io_uring_register(int fd, unsigned opcode, const void *arg, unsigned nr_args)
+{
+    int ret = syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+    return -1 == ret ? errno : 0;
+}
+
+template <typename T>
+static T * ring_field(void *ring, uint32_t offset)
+{
+    return reinterpret_cast<T *>(reinterpret_cast<uint8_t *>(ring) + offset);
+}
+
+dmtr::io_ring::io_ring() :
+    my_fd(-1),
+    my_features(0),
+    my_sq_ring(MAP_FAILED),
+    my_sq_ring_size(0),
+    my_cq_ring(MAP_FAILED),
+    my_cq_ring_size(0),
+    my_sqes(NULL),
+    my_sqes_size(0),
+    my_sq_head(NULL),
+    my_sq_tail(NULL),
+    my_sq_flags(NULL),
+    my_sq_array(NULL),
+    my_sq_mask(0),
+    my_sq_entries(0),
+    my_sqe_tail(0),
+    my_cq_head(NULL),
+    my_cq_tail(NULL),
+    my_cq_mask(0),
+    my_cqes(NULL)
+{}
+
+dmtr::io_ring::~io_ring()
+{
+    if (NULL != my_sqes) {
+        munmap(my_sqes, my_sqes_size);
+    }
+
+    if (MAP_FAILED != my_cq_ring && my_cq_ring != my_sq_ring) {
+        munmap(my_cq_ring, my_cq_ring_size);
+    }
+
+    if (MAP_FAILED != my_sq_ring) {
+        munmap(my_sq_ring, my_sq_ring_size);
+    }
+
+    if (-1 != my_fd) {
+        ::close(my_fd);
+    }
+}
+
+int dmtr::io_ring::init(unsigned entries, unsigned fixed_files)
+{
+    DMTR_TRUE(EPERM, -1 == my_fd);
+    DMTR_TRUE(EINVAL, entries > 0);
+
+    struct io_uring_params p = {};
+    // completions don't need to interrupt us, since we're either polling
+    // or about to enter the kernel anyway. the kernel raises a flag when it
+    // has some to post.
+    p.flags = IORING_SETUP_COOP_TASKRUN | IORING_SETUP_TASKRUN_FLAG;
+    int fd = io_uring_setup(entries, p);
+    if (-EINVAL == fd) {
+        // kernels before 5.19 don't know these flags.
+        p = {};
+        fd = io_uring_setup(entries, p);
+    }
+
+    if (fd < 0) {
+        return -fd;
+    }
+
+    my_fd = fd;
+    my_features = p.features;
+    // we rely on waiting with a timeout and on completions never being
+    // dropped (5.11).
+    DMTR_TRUE(ENOTSUP, my_features & IORING_FEAT_EXT_ARG);
+    DMTR_TRUE(ENOTSUP, my_features & IORING_FEAT_NODROP);
+    DMTR_TRUE(ENOTSUP, my_features & IORING_FEAT_SINGLE_MMAP);
+
+    my_sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    my_cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    // both rings live in the same mapping.
+    my_sq_ring_size = std::max(my_sq_ring_size, my_cq_ring_size);
+    my_sq_ring = mmap(NULL, my_sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (MAP_FAILED == my_sq_ring) {
+        return errno;
+    }
+    my_cq_ring = my_sq_ring;
+    my_cq_ring_size = my_sq_ring_size;
+
+    my_sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    void *sqes = mmap(NULL, my_sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (MAP_FAILED == sqes) {
+        return errno;
+    }
+    my_sqes = reinterpret_cast<struct io_uring_sqe *>(sqes);
+
+    my_sq_head = ring_field<unsigned>(my_sq_ring, p.sq_off.head);
+    my_sq_tail = ring_field<unsigned>(my_sq_ring, p.sq_off.tail);
+    my_sq_flags = ring_field<unsigned>(my_sq_ring, p.sq_off.flags);
+    my_sq_array = ring_field<unsigned>(my_sq_ring, p.sq_off.array);
+    my_sq_mask = *ring_field<unsigned>(my_sq_ring, p.sq_off.ring_mask);
+    my_sq_entries = *ring_field<unsigned>(my_sq_ring, p.sq_off.ring_entries);
+    my_sqe_tail = *my_sq_tail;
+    // entries are always used in ring order.
+    for (unsigned i = 0; i < my_sq_entries; ++i) {
+        my_sq_array[i] = i;
+    }
+
+    my_cq_head = ring_field<unsigned>(my_cq_ring, p.cq_off.head);
+    my_cq_tail = ring_field<unsigned>(my_cq_ring, p.cq_off.tail);
+    my_cq_mask = *ring_field<unsigned>(my_cq_ring, p.cq_off.ring_mask);
+    my_cqes = ring_field<struct io_uring_cqe>(my_cq_ring, p.cq_off.cqes);
+
+    if (fixed_files > 0) {
+        struct io_uring_rsrc_register r = {};
+        r.nr = fixed_files;
+        r.flags = IORING_RSRC_REGISTER_SPARSE;
+        DMTR_OK(io_uring_register(my_fd, IORING_REGISTER_FILES2, &r, sizeof(r)));
+        // hand out the lowest slots first.
+        my_free_files.reserve(fixed_files);
+        for (unsigned i = fixed_files; i > 0; --i) {
+            my_free_files.push_back(i - 1);
+        }
+    }
+
+    return 0;
+}
+
+int dmtr::io_ring::get_sqe(struct io_uring_sqe *&sqe_out)
+{
+    sqe_out = NULL;
+    DMTR_TRUE(EPERM, -1 != my_fd);
+
+    if (my_sqe_tail - __atomic_load_n(my_sq_head, __ATOMIC_ACQUIRE) >= my_sq_entries) {
+        DMTR_OK(enter(false, 0));
+        DMTR_TRUE(EBUSY, my_sqe_tail - __atomic_load_n(my_sq_head, __ATOMIC_ACQUIRE) < my_sq_entries);
+    }
+
+    struct io_uring_sqe * const sqe = &my_sqes[my_sqe_tail & my_sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    ++my_sqe_tail;
+    sqe_out = sqe;
+    return 0;
+}
+
+bool dmtr::io_ring::needs_enter() const
+{
+    if (my_sqe_tail != __atomic_load_n(my_sq_head, __ATOMIC_ACQUIRE)) {
+        return true;
+    }
+
+    const unsigned flags = __atomic_load_n(my_sq_flags, __ATOMIC_RELAXED);
+    return 0 != (flags & (IORING_SQ_TASKRUN | IORING_SQ_CQ_OVERFLOW));
+}
+
+int dmtr::io_ring::enter(bool wait_flag, int timeout_ms)
+{
+    DMTR_TRUE(EPERM, -1 != my_fd);
+
+    if (!wait_flag && !needs_enter()) {
+        return 0;
+    }
+
+    __atomic_store_n(my_sq_tail, my_sqe_tail, __ATOMIC_RELEASE);
+    const unsigned to_submit = my_sqe_tail - __atomic_load_n(my_sq_head, __ATOMIC_ACQUIRE);
+
+    // `IORING_ENTER_GETEVENTS` also makes the kernel post the completions
+    // that it has been holding back.
+    const unsigned flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+    unsigned min_complete = 0;
+    struct __kernel_timespec ts = {};
+    struct io_uring_getevents_arg arg = {};
+    if (wait_flag) {
+        min_complete = 1;
+        if (timeout_ms >= 0) {
+            ts.tv_sec = timeout_ms / 1000;
+            ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+            arg.ts = reinterpret_cast<uint64_t>(&ts);
+        }
+    }
+
+    int ret = io_uring_enter(my_fd, to_submit, min_complete, flags, &arg, sizeof(arg));
+    switch (ret) {
+        default:
+            return ret;
+        case 0:
+        // timing out or being interrupted by a signal is just an early
+        // wake-up.
+        case ETIME:
+        case EINTR:
+        // the completion queue is full; the caller has to make room.
+        case EBUSY:
+        case EAGAIN:
+            return 0;
+    }
+}
+
+bool dmtr::io_ring::peek_cqe(struct io_uring_cqe &cqe_out)
+{
+    const unsigned head = *my_cq_head;
+    if (head == __atomic_load_n(my_cq_tail, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+
+    cqe_out = my_cqes[head & my_cq_mask];
+    return true;
+}
+
+void dmtr::io_ring::cqe_seen()
+{
+    __atomic_store_n(my_cq_head, *my_cq_head + 1, __ATOMIC_RELEASE);
+}
+
+int dmtr::io_ring::register_file(int &index_out, int fd)
+{
+    index_out = -1;
+    DMTR_TRUE(EINVAL, fd >= 0);
+
+    if (my_free_files.empty()) {
+        return 0;
+    }
+
+    const int index = my_free_files.back();
+    struct io_uring_files_update u = {};
+    u.offset = index;
+    u.fds = reinterpret_cast<uint64_t>(&fd);
+    DMTR_OK(io_uring_register(my_fd, IORING_REGISTER_FILES_UPDATE, &u, 1));
+    my_free_files.pop_back();
+    index_out = index;
+    return 0;
+}
+
+int dmtr::io_ring::unregister_file(int index)
+{
+    DMTR_TRUE(EINVAL, index >= 0);
+
+    int fd = -1;
+    struct io_uring_files_update u = {};
+    u.offset = index;
+    u.fds = reinterpret_cast<uint64_t>(&fd);
+    DMTR_OK(io_uring_register(my_fd, IORING_REGISTER_FILES_UPDATE, &u, 1));
+    my_free_files.push_back(index);
+    return 0;
+}
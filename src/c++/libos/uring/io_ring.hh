@@ -0,0 +1,76 @@
+// -*- mode: c++; c-file-style: "k&r"; c-basic-offset: 4 -*-
+
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+#ifndef DMTR_LIBOS_IO_RING_HH_IS_INCLUDED
+#define DMTR_LIBOS_IO_RING_HH_IS_INCLUDED
+
+#include <cstddef>
+#include <cstdint>
+#include <linux/io_uring.h>
+#include <vector>
+
+namespace dmtr {
+
+// a bare-bones io_uring instance, driven through the raw system calls so
+// that the libOS doesn't depend on liburing. submission queue entries are
+// only handed to the kernel by `enter()`, so that everything prepared in
+// between goes in with a single system call.
+class io_ring {
+    private: int my_fd;
+    private: uint32_t my_features;
+    private: void *my_sq_ring;
+    private: size_t my_sq_ring_size;
+    private: void *my_cq_ring;
+    private: size_t my_cq_ring_size;
+    private: struct io_uring_sqe *my_sqes;
+    private: size_t my_sqes_size;
+
+    private: unsigned *my_sq_head;
+    private: unsigned *my_sq_tail;
+    private: unsigned *my_sq_flags;
+    private: unsigned *my_sq_array;
+    private: unsigned my_sq_mask;
+    private: unsigned my_sq_entries;
+    // entries are prepared past the tail that the kernel sees, and
+    // published all at once by `enter()`.
+    private: unsigned my_sqe_tail;
+
+    private: unsigned *my_cq_head;
+    private: unsigned *my_cq_tail;
+    private: unsigned my_cq_mask;
+    private: struct io_uring_cqe *my_cqes;
+
+    // free slots in the registered file table; empty if there's no table.
+    private: std::vector<int> my_free_files;
+
+    public: io_ring();
+    public: ~io_ring();
+    private: io_ring(const io_ring &) = delete;
+
+    public: int init(unsigned entries, unsigned fixed_files);
+
+    // returns a zeroed entry to fill in. if the submission queue is full,
+    // what's in it is submitted first.
+    public: int get_sqe(struct io_uring_sqe *&sqe_out);
+    // submits everything that has been prepared and, if `wait_flag` is
+    // set, waits up to `timeout_ms` (forever if negative) for a
+    // completion.
+    public: int enter(bool wait_flag, int timeout_ms);
+    // whether `enter()` has anything to do even if we aren't waiting.
+    public: bool needs_enter() const;
+    // the next completion, if there is one. it's consumed by `cqe_seen()`.
+    public: bool peek_cqe(struct io_uring_cqe &cqe_out);
+    public: void cqe_seen();
+
+    // registered files save the kernel from looking the descriptor up on
+    // every operation. `index_out` is -1 if the table is full (or there is
+    // none), in which case `fd` has to be used as is.
+    public: int register_file(int &index_out, int fd);
+    public: int unregister_file(int index);
+};
+
+} // namespace dmtr
+
+#endif /* DMTR_LIBOS_IO_RING_HH_IS_INCLUDED */
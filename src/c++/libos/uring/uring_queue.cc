@@ -0,0 +1,918 @@
+// -*- mode: c++; c-file-style: "k&r"; c-basic-offset: 4 -*-
+
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+#include "uring_queue.hh"
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <dmtr/annot.h>
+#include <dmtr/sga.h>
+#include <dmtr/libos/config.hh>
+#include <dmtr/libos/raii_guard.hh>
+#include <fcntl.h>
+#include <netinet/tcp.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+thread_local std::shared_ptr<dmtr::io_ring> dmtr::uring_queue::our_ring;
+unsigned dmtr::uring_queue::our_ring_entries = DEFAULT_RING_ENTRIES;
+unsigned dmtr::uring_queue::our_fixed_files = 0;
+
+dmtr::uring_queue::uring_queue(int qd, io_queue::category_id cid) :
+    io_queue(cid, qd),
+    my_ring(our_ring),
+    my_fd(-1),
+    my_file_index(-1),
+    my_listening_flag(false),
+    my_tcp_flag(false),
+    my_recv_error(0)
+{}
+
+dmtr::uring_queue::~uring_queue()
+{
+    // the kernel mustn't be left holding on to our requests.
+    (void)close();
+}
+
+int dmtr::uring_queue::new_net_object(std::unique_ptr<io_queue> &q_out, int qd) {
+    q_out = std::unique_ptr<io_queue>(new uring_queue(qd, NETWORK_Q));
+    DMTR_NOTNULL(ENOMEM, q_out);
+    return 0;
+}
+
+int dmtr::uring_queue::new_file_object(std::unique_ptr<io_queue> &q_out, int qd) {
+    q_out = std::unique_ptr<io_queue>(new uring_queue(qd, FILE_Q));
+    DMTR_NOTNULL(ENOMEM, q_out);
+    return 0;
+}
+
+int dmtr::uring_queue::read_config(int argc, char *argv[]) {
+    YAML::Node config;
+    DMTR_OK(load_config(config, argc, argv));
+    YAML::Node uring = config["uring"];
+    if (YAML::NodeType::Map == uring.Type()) {
+        our_ring_entries = uring["entries"].as<unsigned>(DEFAULT_RING_ENTRIES);
+        our_fixed_files = uring["fixed_files"].as<unsigned>(0);
+    }
+
+    return 0;
+}
+
+int dmtr::uring_queue::init_ring() {
+    DMTR_NULL(EPERM, our_ring.get());
+
+    std::shared_ptr<io_ring> ring(new io_ring);
+    DMTR_NOTNULL(ENOMEM, ring);
+    DMTR_OK(ring->init(our_ring_entries, our_fixed_files));
+    our_ring = std::move(ring);
+    return 0;
+}
+
+int dmtr::uring_queue::poll_events(std::vector<int> &qds_out, int timeout_ms) {
+    // completions are handed straight to the tasks they belong to, so there
+    // are never any queues left to service.
+    return run_ring(0 != timeout_ms, timeout_ms);
+}
+
+int dmtr::uring_queue::run_ring(bool wait_flag, int timeout_ms) {
+    DMTR_NOTNULL(EPERM, our_ring.get());
+    io_ring &ring = *our_ring;
+
+    struct io_uring_cqe cqe = {};
+    if (ring.peek_cqe(cqe)) {
+        // there's no point in waiting for what's already there.
+        wait_flag = false;
+    }
+
+    DMTR_OK(ring.enter(wait_flag, timeout_ms));
+    while (ring.peek_cqe(cqe)) {
+        ring.cqe_seen();
+        request * const r = reinterpret_cast<request *>(cqe.user_data);
+        // cancelations don't carry a request.
+        if (NULL == r) {
+            continue;
+        }
+
+        r->in_flight = false;
+        if (NULL == r->owner) {
+            on_orphan_completion(*r, cqe.res);
+        } else {
+            DMTR_OK(r->owner->on_completion(*r, cqe.res));
+        }
+    }
+
+    return 0;
+}
+
+void dmtr::uring_queue::on_orphan_completion(request &r, int res) {
+    switch (r.kind) {
+        default:
+            break;
+        case request::ACCEPT:
+            // nobody is left to take the connection.
+            if (res >= 0) {
+                ::close(res);
+            }
+            break;
+        case request::SEND: {
+            // detached pushes are still owed their sga.
+            auto &s = static_cast<send_request &>(r);
+            for (size_t i = s.pushes_done; i < s.pushes.size(); ++i) {
+                pending_push &p = s.pushes[i];
+                if (0 == p.qt) {
+                    finish_detached_push(p.sga, ECONNABORTED, p.done, p.arg);
+                }
+            }
+            break;
+        }
+    }
+
+    delete &r;
+}
+
+int dmtr::uring_queue::set_fd(int fd) {
+    DMTR_TRUE(EINVAL, fd > -1);
+    DMTR_NOTNULL(EPERM, my_ring.get());
+
+    my_fd = fd;
+    return my_ring->register_file(my_file_index, fd);
+}
+
+void dmtr::uring_queue::prepare_fd(struct io_uring_sqe &sqe) const {
+    if (-1 == my_file_index) {
+        sqe.fd = my_fd;
+    } else {
+        sqe.fd = my_file_index;
+        sqe.flags |= IOSQE_FIXED_FILE;
+    }
+}
+
+int dmtr::uring_queue::submit(request &r, struct io_uring_sqe *&sqe_out) {
+    DMTR_TRUE(EINVAL, good());
+    DMTR_NOTNULL(EPERM, my_ring.get());
+    DMTR_TRUE(EINVAL, !r.in_flight);
+
+    DMTR_OK(my_ring->get_sqe(sqe_out));
+    prepare_fd(*sqe_out);
+    sqe_out->user_data = reinterpret_cast<uint64_t>(&r);
+    r.in_flight = true;
+    return 0;
+}
+
+void dmtr::uring_queue::cancel(request &r) {
+    struct io_uring_sqe *sqe = NULL;
+    if (0 != my_ring->get_sqe(sqe)) {
+        // the request will still complete eventually.
+        return;
+    }
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = reinterpret_cast<uint64_t>(&r);
+}
+
+int dmtr::uring_queue::socket(int domain, int type, int protocol)
+{
+    // the kernel waits for sockets on our behalf, so they're left blocking.
+    int fd = ::socket(domain, type, protocol);
+    if (fd == -1) {
+        return errno;
+    }
+
+    switch (type) {
+        default:
+            ::close(fd);
+            return ENOTSUP;
+        case SOCK_STREAM:
+            DMTR_OK(set_tcp_nodelay(fd));
+            my_tcp_flag = true;
+            break;
+        case SOCK_DGRAM:
+            my_tcp_flag = false;
+            break;
+    }
+
+    return set_fd(fd);
+}
+
+int dmtr::uring_queue::getsockname(struct sockaddr * const saddr, socklen_t * const size)
+{
+    DMTR_NOTNULL(EINVAL, saddr);
+    DMTR_NOTNULL(EINVAL, size);
+    DMTR_TRUE(ERANGE, *size > 0);
+
+    if (-1 == ::getsockname(my_fd, saddr, size)) {
+        return errno;
+    }
+
+    return 0;
+}
+
+int dmtr::uring_queue::bind(const struct sockaddr * const saddr, socklen_t size)
+{
+    DMTR_TRUE(EINVAL, good());
+
+    const int n = 1;
+    if (-1 == ::setsockopt(my_fd, SOL_SOCKET, SO_REUSEADDR, &n, sizeof(n))) {
+        return errno;
+    }
+
+    if (-1 == ::bind(my_fd, saddr, size)) {
+        return errno;
+    }
+
+    return 0;
+}
+
+int dmtr::uring_queue::listen(int backlog)
+{
+    DMTR_TRUE(EINVAL, good());
+
+    if (-1 == ::listen(my_fd, backlog)) {
+        return errno;
+    }
+
+    my_listening_flag = true;
+    return 0;
+}
+
+int dmtr::uring_queue::accept(std::unique_ptr<io_queue> &q_out, dmtr_qtoken_t qt, int new_qd)
+{
+    q_out = NULL;
+    DMTR_TRUE(EINVAL, good());
+    DMTR_TRUE(EINVAL, my_listening_flag);
+    DMTR_TRUE(EINVAL, my_tcp_flag);
+
+    auto * const q = new uring_queue(new_qd, NETWORK_Q);
+    DMTR_TRUE(ENOMEM, q != NULL);
+    auto qq = std::unique_ptr<io_queue>(q);
+    std::unique_ptr<accept_request> r(new accept_request(this, qt));
+    DMTR_NOTNULL(ENOMEM, r);
+
+    DMTR_OK(new_task(qt, DMTR_OPC_ACCEPT, q));
+    struct io_uring_sqe *sqe = NULL;
+    DMTR_OK(submit(*r, sqe));
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->addr = reinterpret_cast<uint64_t>(&r->addr);
+    sqe->addr2 = reinterpret_cast<uint64_t>(&r->addrlen);
+    sqe->accept_flags = SOCK_CLOEXEC;
+    my_requests.push_back(r.release());
+
+    q_out = std::move(qq);
+    return 0;
+}
+
+int dmtr::uring_queue::on_accept(accept_request &r, int res)
+{
+    task *t = NULL;
+    int ret = get_task(t, r.qt);
+    if (0 != ret) {
+        if (res >= 0) {
+            ::close(res);
+        }
+
+        DMTR_FAIL(ret);
+    }
+
+    if (res < 0) {
+        return t->complete(-res);
+    }
+
+    io_queue *new_q = NULL;
+    DMTR_TRUE(EINVAL, t->arg(new_q));
+    auto * const new_uq = dynamic_cast<uring_queue *>(new_q);
+    DMTR_NOTNULL(EINVAL, new_uq);
+
+    DMTR_OK(set_tcp_nodelay(res));
+    DMTR_OK(new_uq->set_fd(res));
+    new_uq->my_tcp_flag = true;
+    return t->complete(0, new_uq->qd(), r.addr);
+}
+
+int dmtr::uring_queue::connect(dmtr_qtoken_t qt, const struct sockaddr * const saddr, socklen_t size)
+{
+    DMTR_TRUE(EINVAL, good());
+    DMTR_NOTNULL(EINVAL, saddr);
+    DMTR_TRUE(ERANGE, size <= sizeof(sockaddr_storage));
+
+    std::unique_ptr<connect_request> r(new connect_request(this, qt));
+    DMTR_NOTNULL(ENOMEM, r);
+    memcpy(&r->addr, saddr, size);
+    r->addrlen = size;
+
+    DMTR_OK(new_task(qt, DMTR_OPC_CONNECT));
+    struct io_uring_sqe *sqe = NULL;
+    DMTR_OK(submit(*r, sqe));
+    sqe->opcode = IORING_OP_CONNECT;
+    sqe->addr = reinterpret_cast<uint64_t>(&r->addr);
+    sqe->off = r->addrlen;
+    my_requests.push_back(r.release());
+    return 0;
+}
+
+int dmtr::uring_queue::on_connect(connect_request &r, int res)
+{
+    task *t = NULL;
+    DMTR_OK(get_task(t, r.qt));
+    return t->complete(res < 0 ? -res : 0);
+}
+
+int dmtr::uring_queue::open(const char *pathname, int flags)
+{
+    int fd = ::open(pathname, flags);
+    if (fd == -1) {
+        return errno;
+    }
+
+    return set_fd(fd);
+}
+
+int dmtr::uring_queue::open2(const char *pathname, int flags, mode_t mode)
+{
+    int fd = ::open(pathname, flags, mode);
+    if (fd == -1) {
+        return errno;
+    }
+
+    return set_fd(fd);
+}
+
+int dmtr::uring_queue::creat(const char *pathname, mode_t mode)
+{
+    int fd = ::creat(pathname, mode);
+    if (fd == -1) {
+        return errno;
+    }
+
+    return set_fd(fd);
+}
+
+int dmtr::uring_queue::close()
+{
+    if (!good()) {
+        return 0;
+    }
+
+    // requests that are still in flight are handed over to the ring. if
+    // there never was a ring, there's nothing in flight.
+    io_ring * const ring = my_ring.get();
+    for (size_t i = 0; i < my_requests.size(); ++i) {
+        request * const r = my_requests[i];
+        // nobody would complete their tokens once the queue is gone.
+        dmtr_qtoken_t qt = 0;
+        if (request::ACCEPT == r->kind) {
+            qt = static_cast<accept_request *>(r)->qt;
+        } else if (request::CONNECT == r->kind) {
+            qt = static_cast<connect_request *>(r)->qt;
+        }
+        if (0 != qt) {
+            task *t = NULL;
+            DMTR_OK(get_task(t, qt));
+            DMTR_OK(t->complete(ECONNABORTED));
+        }
+
+        if (NULL == ring) {
+            delete r;
+        } else {
+            r->owner = NULL;
+            cancel(*r);
+        }
+    }
+    my_requests.clear();
+
+    if (my_send) {
+        // the pushes of a send that's still in flight fail with it;
+        // detached ones are handed back when it completes.
+        for (size_t i = my_send->pushes_done; i < my_send->pushes.size(); ++i) {
+            pending_push &p = my_send->pushes[i];
+            if (0 != p.qt) {
+                task *t = NULL;
+                DMTR_OK(get_task(t, p.qt));
+                DMTR_OK(t->complete(ECONNABORTED));
+            }
+        }
+    }
+
+    if (NULL != ring && my_send && my_send->in_flight) {
+        my_send->owner = NULL;
+        cancel(*my_send);
+        (void)my_send.release();
+    }
+    my_send.reset();
+
+    if (NULL != ring && my_recv && my_recv->in_flight) {
+        my_recv->owner = NULL;
+        cancel(*my_recv);
+        (void)my_recv.release();
+    }
+    my_recv.reset();
+
+    // pushes that haven't been sent yet fail now; detached ones are handed
+    // back.
+    for (size_t i = 0; i < my_pushes.size(); ++i) {
+        pending_push &p = my_pushes[i];
+        if (0 == p.qt) {
+            finish_detached_push(p.sga, ECONNABORTED, p.done, p.arg);
+        } else {
+            task *t = NULL;
+            DMTR_OK(get_task(t, p.qt));
+            DMTR_OK(t->complete(ECONNABORTED));
+        }
+    }
+    my_pushes.clear();
+
+    while (!my_pops.empty()) {
+        task *t = NULL;
+        DMTR_OK(get_task(t, my_pops.front()));
+        my_pops.pop_front();
+        DMTR_OK(t->complete(ECONNABORTED));
+    }
+
+    int fd = my_fd;
+    my_fd = -1;
+
+    int ret = 0;
+    if (NULL != ring) {
+        // whatever refers to the descriptor has to reach the kernel before
+        // the descriptor can be reused.
+        ret = ring->enter(false, 0);
+        if (-1 != my_file_index) {
+            (void)ring->unregister_file(my_file_index);
+        }
+    }
+    my_file_index = -1;
+
+    if (-1 == ::close(fd)) {
+        return errno;
+    }
+
+    return ret;
+}
+
+int dmtr::uring_queue::push(dmtr_qtoken_t qt, const dmtr_sgarray_t &sga)
+{
+    DMTR_TRUE(EINVAL, good());
+    DMTR_TRUE(ENOTSUP, !my_listening_flag);
+
+    DMTR_OK(new_task(qt, DMTR_OPC_PUSH, sga));
+    size_t sgalen = 0;
+    DMTR_OK(dmtr_sgalen(&sgalen, &sga));
+    if (0 == sgalen) {
+        task *t = NULL;
+        DMTR_OK(get_task(t, qt));
+        return t->complete(ENOMSG);
+    }
+
+    // the push goes out with whatever else is pushed before the queue is
+    // next serviced.
+    my_pushes.push_back(pending_push{qt, sga, NULL, NULL});
+    return 0;
+}
+
+int dmtr::uring_queue::push_detached(const dmtr_sgarray_t &sga, dmtr_push_done_fn done, void *arg)
+{
+    DMTR_TRUE(EINVAL, good());
+    DMTR_TRUE(ENOTSUP, !my_listening_flag);
+
+    size_t sgalen = 0;
+    DMTR_OK(dmtr_sgalen(&sgalen, &sga));
+    if (0 == sgalen) {
+        dmtr_sgarray_t done_sga = sga;
+        finish_detached_push(done_sga, ENOMSG, done, arg);
+        return 0;
+    }
+
+    my_pushes.push_back(pending_push{0, sga, done, arg});
+    // there's no task to do this for us.
+    schedule();
+    return 0;
+}
+
+int dmtr::uring_queue::start_send()
+{
+    if (my_pushes.empty() || (my_send && my_send->in_flight)) {
+        return 0;
+    }
+
+    if (!my_send) {
+        my_send.reset(new send_request(this));
+        DMTR_NOTNULL(ENOMEM, my_send);
+    }
+
+    send_request &s = *my_send;
+    const bool framed_flag = NETWORK_Q == my_cid;
+    // every push is a datagram of its own.
+    const size_t max_batch = (framed_flag && !my_tcp_flag) ? 1 : MAX_SEND_BATCH;
+
+    // the vectors are sized up front, since the iovecs point into them.
+    size_t n = 0;
+    size_t iov_count = 0;
+    size_t seg_count = 0;
+    while (n < my_pushes.size() && n < max_batch) {
+        const dmtr_sgarray_t &sga = my_pushes[n].sga;
+        const size_t k = framed_flag ? 1 + 2 * sga.sga_numsegs : sga.sga_numsegs;
+        if (n > 0 && iov_count + k > IOV_MAX) {
+            break;
+        }
+
+        iov_count += k;
+        seg_count += sga.sga_numsegs;
+        ++n;
+    }
+
+    s.pushes.assign(my_pushes.begin(), my_pushes.begin() + n);
+    my_pushes.erase(my_pushes.begin(), my_pushes.begin() + n);
+    s.push_ends.resize(n);
+    s.headers.resize(framed_flag ? n : 0);
+    s.seg_lens.resize(framed_flag ? seg_count : 0);
+    s.iov.resize(iov_count);
+    s.iov_next = 0;
+    s.bytes_sent = 0;
+    s.pushes_done = 0;
+
+    size_t bytes = 0;
+    size_t j = 0;
+    size_t l = 0;
+    for (size_t i = 0; i < n; ++i) {
+        const dmtr_sgarray_t &sga = s.pushes[i].sga;
+        if (!framed_flag) {
+            for (size_t k = 0; k < sga.sga_numsegs; ++k) {
+                s.iov[j].iov_base = sga.sga_segs[k].sgaseg_buf;
+                s.iov[j].iov_len = sga.sga_segs[k].sgaseg_len;
+                bytes += sga.sga_segs[k].sgaseg_len;
+                ++j;
+            }
+
+            s.push_ends[i] = bytes;
+            continue;
+        }
+
+        // the same framing as the posix libOS: a header, then every
+        // segment preceded by its length.
+        struct iovec &header_iov = s.iov[j++];
+        size_t message_bytes = 0;
+        for (size_t k = 0; k < sga.sga_numsegs; ++k) {
+            static_assert(sizeof(s.seg_lens[l]) == sizeof(sga.sga_segs[k].sgaseg_len), "type mismatch");
+            s.seg_lens[l] = htonl(sga.sga_segs[k].sgaseg_len);
+            s.iov[j].iov_base = &s.seg_lens[l];
+            s.iov[j].iov_len = sizeof(s.seg_lens[l]);
+            ++j;
+            ++l;
+
+            s.iov[j].iov_base = sga.sga_segs[k].sgaseg_buf;
+            s.iov[j].iov_len = sga.sga_segs[k].sgaseg_len;
+            ++j;
+
+            message_bytes += sizeof(uint32_t) + sga.sga_segs[k].sgaseg_len;
+        }
+
+        dmtr_header_t &header = s.headers[i];
+        header.h_magic = htonl(DMTR_HEADER_MAGIC);
+        header.h_bytes = htonl(message_bytes);
+        header.h_sgasegs = htonl(sga.sga_numsegs);
+        header_iov.iov_base = &header;
+        header_iov.iov_len = sizeof(header);
+
+        bytes += sizeof(header) + message_bytes;
+        s.push_ends[i] = bytes;
+    }
+
+    return submit_send();
+}
+
+int dmtr::uring_queue::submit_send()
+{
+    send_request &s = *my_send;
+    struct io_uring_sqe *sqe = NULL;
+    int ret = submit(s, sqe);
+    if (0 != ret) {
+        DMTR_OK(finish_pushes(s.pushes.size(), ret));
+        DMTR_FAIL(ret);
+    }
+
+    struct iovec * const iov = &s.iov[s.iov_next];
+    const size_t iov_count = s.iov.size() - s.iov_next;
+    if (NETWORK_Q == my_cid) {
+        s.msg = {};
+        s.msg.msg_iov = iov;
+        s.msg.msg_iovlen = iov_count;
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->addr = reinterpret_cast<uint64_t>(&s.msg);
+        sqe->len = 1;
+        // a peer that went away is reported through the result.
+        sqe->msg_flags = MSG_NOSIGNAL;
+    } else {
+        sqe->opcode = IORING_OP_WRITEV;
+        sqe->addr = reinterpret_cast<uint64_t>(iov);
+        sqe->len = iov_count;
+        // write at the file's current position.
+        sqe->off = static_cast<uint64_t>(-1);
+    }
+
+    return 0;
+}
+
+int dmtr::uring_queue::on_send(int res)
+{
+    send_request &s = *my_send;
+    const size_t n = s.pushes.size();
+    if (res <= 0) {
+        // nothing is written without an error only if the disk is full.
+        DMTR_OK(finish_pushes(n, 0 == res ? ENOSPC : -res));
+        return start_send();
+    }
+
+    s.bytes_sent += res;
+    size_t done = s.pushes_done;
+    while (done < n && s.push_ends[done] <= s.bytes_sent) {
+        ++done;
+    }
+
+    DMTR_OK(finish_pushes(done, 0));
+    if (n == done) {
+        return start_send();
+    }
+
+    // a short write; the rest goes out from where it stopped.
+    size_t left = res;
+    while (left > 0) {
+        struct iovec &v = s.iov[s.iov_next];
+        if (left < v.iov_len) {
+            v.iov_base = reinterpret_cast<uint8_t *>(v.iov_base) + left;
+            v.iov_len -= left;
+            break;
+        }
+
+        left -= v.iov_len;
+        ++s.iov_next;
+    }
+
+    return submit_send();
+}
+
+int dmtr::uring_queue::finish_pushes(size_t count, int error)
+{
+    send_request &s = *my_send;
+    while (s.pushes_done < count) {
+        pending_push &p = s.pushes[s.pushes_done++];
+        if (0 == p.qt) {
+            finish_detached_push(p.sga, error, p.done, p.arg);
+            continue;
+        }
+
+        task *t = NULL;
+        DMTR_OK(get_task(t, p.qt));
+        if (0 == error) {
+            DMTR_OK(t->complete(0, p.sga));
+        } else {
+            DMTR_OK(t->complete(error));
+        }
+    }
+
+    return 0;
+}
+
+int dmtr::uring_queue::pop(dmtr_qtoken_t qt)
+{
+    DMTR_TRUE(EINVAL, good());
+    DMTR_TRUE(ENOTSUP, !my_listening_flag);
+    // files are only written to.
+    DMTR_TRUE(ENOTSUP, NETWORK_Q == my_cid);
+
+    DMTR_OK(new_task(qt, DMTR_OPC_POP));
+    my_pops.push_back(qt);
+    return complete_pops();
+}
+
+int dmtr::uring_queue::complete_pops()
+{
+    while (!my_pops.empty()) {
+        task *t = NULL;
+        DMTR_OK(get_task(t, my_pops.front()));
+        if (0 != my_recv_error) {
+            my_pops.pop_front();
+            DMTR_OK(t->complete(my_recv_error));
+            continue;
+        }
+
+        bool done = false;
+        dmtr_sgarray_t sga = {};
+        int ret = parse_message(done, sga);
+        if (0 != ret) {
+            // the stream can't be trusted past a malformed message.
+            my_recv_error = ret;
+            continue;
+        }
+
+        if (!done) {
+            return start_recv();
+        }
+
+        my_pops.pop_front();
+        DMTR_OK(t->complete(0, sga));
+    }
+
+    return 0;
+}
+
+int dmtr::uring_queue::parse_message(bool &done_out, dmtr_sgarray_t &sga_out)
+{
+    done_out = false;
+    if (!my_recv) {
+        return 0;
+    }
+
+    recv_request &r = *my_recv;
+    const size_t avail = r.end - r.begin;
+    dmtr_header_t header;
+    if (avail < sizeof(header)) {
+        return 0;
+    }
+
+    memcpy(&header, &r.buf[r.begin], sizeof(header));
+    header.h_magic = ntohl(header.h_magic);
+    header.h_bytes = ntohl(header.h_bytes);
+    header.h_sgasegs = ntohl(header.h_sgasegs);
+    if (DMTR_HEADER_MAGIC != header.h_magic) {
+        return EILSEQ;
+    }
+
+    if (0 == header.h_sgasegs || header.h_sgasegs > DMTR_SGARRAY_MAXSIZE) {
+        return EILSEQ;
+    }
+
+    if (avail - sizeof(header) < header.h_bytes) {
+        return 0;
+    }
+
+    DMTR_OK(our_buffer_pool.alloc(sga_out.sga_buf, header.h_bytes));
+    sga_out.sga_pool = &our_buffer_pool;
+    raii_guard buf_guard([&]() {
+        (void)our_buffer_pool.free(sga_out.sga_buf);
+        sga_out.sga_buf = NULL;
+        sga_out.sga_pool = NULL;
+    });
+    memcpy(sga_out.sga_buf, &r.buf[r.begin + sizeof(header)], header.h_bytes);
+
+    // the segments point into the buffer; the lengths come from the peer,
+    // so they're checked against the message size.
+    uint8_t *p = reinterpret_cast<uint8_t *>(sga_out.sga_buf);
+    const uint8_t * const end = p + header.h_bytes;
+    sga_out.sga_numsegs = header.h_sgasegs;
+    for (size_t i = 0; i < sga_out.sga_numsegs; ++i) {
+        if (static_cast<size_t>(end - p) < sizeof(uint32_t)) {
+            return EILSEQ;
+        }
+
+        size_t seglen = ntohl(*reinterpret_cast<uint32_t *>(p));
+        if (static_cast<size_t>(end - p) - sizeof(uint32_t) < seglen) {
+            return EILSEQ;
+        }
+
+        sga_out.sga_segs[i].sgaseg_len = seglen;
+        p += sizeof(uint32_t);
+        sga_out.sga_segs[i].sgaseg_buf = p;
+        p += seglen;
+    }
+
+    r.begin += sizeof(header) + header.h_bytes;
+    if (r.begin == r.end) {
+        r.begin = 0;
+        r.end = 0;
+    }
+
+    buf_guard.cancel();
+    done_out = true;
+    return 0;
+}
+
+int dmtr::uring_queue::start_recv()
+{
+    if (my_recv && my_recv->in_flight) {
+        return 0;
+    }
+
+    if (!my_recv) {
+        my_recv.reset(new recv_request(this));
+        DMTR_NOTNULL(ENOMEM, my_recv);
+    }
+
+    recv_request &r = *my_recv;
+    const size_t avail = r.end - r.begin;
+    // there has to be room for the rest of the message that's underway.
+    size_t want = sizeof(dmtr_header_t);
+    if (avail >= sizeof(dmtr_header_t)) {
+        dmtr_header_t header;
+        memcpy(&header, &r.buf[r.begin], sizeof(header));
+        want += ntohl(header.h_bytes);
+    }
+
+    const size_t capacity = std::max(RECV_BUFFER_SIZE, want);
+    if (capacity > r.capacity) {
+        std::unique_ptr<uint8_t[]> buf(new uint8_t[capacity]);
+        DMTR_NOTNULL(ENOMEM, buf);
+        if (avail > 0) {
+            memcpy(buf.get(), &r.buf[r.begin], avail);
+        }
+
+        r.buf = std::move(buf);
+        r.capacity = capacity;
+        r.begin = 0;
+        r.end = avail;
+    } else if (r.begin > 0) {
+        memmove(&r.buf[0], &r.buf[r.begin], avail);
+        r.begin = 0;
+        r.end = avail;
+    }
+
+    struct io_uring_sqe *sqe = NULL;
+    DMTR_OK(submit(r, sqe));
+    sqe->opcode = IORING_OP_RECV;
+    sqe->addr = reinterpret_cast<uint64_t>(&r.buf[r.end]);
+    sqe->len = r.capacity - r.end;
+    return 0;
+}
+
+int dmtr::uring_queue::on_recv(int res)
+{
+    if (res > 0) {
+        my_recv->end += res;
+    } else {
+        my_recv_error = 0 == res ? ECONNABORTED : -res;
+    }
+
+    return complete_pops();
+}
+
+int dmtr::uring_queue::on_completion(request &r, int res)
+{
+    int ret = 0;
+    switch (r.kind) {
+        default:
+            DMTR_UNREACHABLE();
+        case request::ACCEPT:
+            ret = on_accept(static_cast<accept_request &>(r), res);
+            forget_request(r);
+            return ret;
+        case request::CONNECT:
+            ret = on_connect(static_cast<connect_request &>(r), res);
+            forget_request(r);
+            return ret;
+        case request::SEND:
+            return on_send(res);
+        case request::RECV:
+            return on_recv(res);
+    }
+}
+
+void dmtr::uring_queue::forget_request(request &r)
+{
+    auto it = std::find(my_requests.begin(), my_requests.end(), &r);
+    if (my_requests.end() != it) {
+        *it = my_requests.back();
+        my_requests.pop_back();
+    }
+
+    delete &r;
+}
+
+int dmtr::uring_queue::poll(dmtr_qresult_t &qr_out, dmtr_qtoken_t qt)
+{
+    DMTR_OK(task::initialize_result(qr_out, qd(), qt));
+    DMTR_TRUE(EINVAL, good());
+
+    task *t = NULL;
+    DMTR_OK(get_task(t, qt));
+    if (!t->done()) {
+        DMTR_OK(service());
+        DMTR_OK(run_ring(false, 0));
+    }
+
+    return t->poll(qr_out);
+}
+
+int dmtr::uring_queue::service()
+{
+    if (!good()) {
+        return 0;
+    }
+
+    // pushes are batched up until now.
+    DMTR_OK(start_send());
+    return 0;
+}
+
+int dmtr::uring_queue::set_tcp_nodelay(int fd)
+{
+    const int n = 1;
+    if (-1 == ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &n, sizeof(n))) {
+        return errno;
+    }
+
+    return 0;
+}
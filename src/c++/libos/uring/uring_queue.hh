@@ -0,0 +1,203 @@
+// -*- mode: c++; c-file-style: "k&r"; c-basic-offset: 4 -*-
+
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+#ifndef DMTR_LIBOS_URING_QUEUE_HH_IS_INCLUDED
+#define DMTR_LIBOS_URING_QUEUE_HH_IS_INCLUDED
+
+#include "io_ring.hh"
+
+#include <deque>
+#include <dmtr/libos/io_queue.hh>
+#include <memory>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <vector>
+
+namespace dmtr {
+
+// a queue whose operations are carried out by the kernel through io_uring.
+// operations are prepared as submission queue entries and handed to the
+// kernel in one go whenever the application polls or waits; their
+// completions are turned into task results as they're harvested, so the
+// queue has no coroutines of its own.
+class uring_queue : public io_queue {
+    // the memory of an operation that the kernel is working on has to stay
+    // put until the kernel reports back. if the queue is closed before
+    // then, the request is orphaned (`owner` becomes NULL) and freed when
+    // its completion arrives.
+    private: struct request {
+        enum kind_id {
+            ACCEPT,
+            CONNECT,
+            RECV,
+            SEND,
+        };
+        const kind_id kind;
+        uring_queue *owner;
+        bool in_flight;
+
+        request(kind_id k, uring_queue *q) :
+            kind(k),
+            owner(q),
+            in_flight(false)
+        {}
+        virtual ~request() {}
+    };
+
+    private: struct accept_request : request {
+        dmtr_qtoken_t qt;
+        sockaddr_in addr;
+        socklen_t addrlen;
+
+        accept_request(uring_queue *q, dmtr_qtoken_t t) :
+            request(ACCEPT, q),
+            qt(t),
+            addr{},
+            addrlen(sizeof(addr))
+        {}
+    };
+
+    private: struct connect_request : request {
+        dmtr_qtoken_t qt;
+        sockaddr_storage addr;
+        socklen_t addrlen;
+
+        connect_request(uring_queue *q, dmtr_qtoken_t t) :
+            request(CONNECT, q),
+            qt(t),
+            addr{},
+            addrlen(0)
+        {}
+    };
+
+    // a push waiting to be sent. pushes without a token are detached.
+    private: struct pending_push {
+        dmtr_qtoken_t qt;
+        dmtr_sgarray_t sga;
+        dmtr_push_done_fn done;
+        void *arg;
+    };
+
+    // all pushes that were waiting when the previous send finished go out
+    // in a single `sendmsg()` (`writev()` for files).
+    private: struct send_request : request {
+        std::vector<pending_push> pushes;
+        // where each push ends in the stream of bytes being sent.
+        std::vector<size_t> push_ends;
+        std::vector<dmtr_header_t> headers;
+        std::vector<uint32_t> seg_lens;
+        std::vector<struct iovec> iov;
+        // what's been sent so far; `iov` is trimmed to match.
+        size_t iov_next;
+        size_t bytes_sent;
+        size_t pushes_done;
+        struct msghdr msg;
+
+        send_request(uring_queue *q) :
+            request(SEND, q),
+            iov_next(0),
+            bytes_sent(0),
+            pushes_done(0),
+            msg{}
+        {}
+    };
+
+    // bytes received ahead of the pops that will consume them.
+    private: struct recv_request : request {
+        std::unique_ptr<uint8_t[]> buf;
+        size_t capacity;
+        size_t begin;
+        size_t end;
+
+        recv_request(uring_queue *q) :
+            request(RECV, q),
+            capacity(0),
+            begin(0),
+            end(0)
+        {}
+    };
+
+#define DEFAULT_RING_ENTRIES 1024u
+    // receive buffers grow past this to fit a whole message.
+#define RECV_BUFFER_SIZE static_cast<size_t>(4096)
+    // how many pushes may be coalesced into one send.
+#define MAX_SEND_BATCH static_cast<size_t>(64)
+
+    private: std::shared_ptr<io_ring> my_ring;
+    private: int my_fd;
+    // the slot of `my_fd` in the ring's file table, or -1.
+    private: int my_file_index;
+    private: bool my_listening_flag;
+    private: bool my_tcp_flag;
+    // accepts and connects in flight.
+    private: std::vector<request *> my_requests;
+    private: std::deque<pending_push> my_pushes;
+    private: std::unique_ptr<send_request> my_send;
+    private: std::deque<dmtr_qtoken_t> my_pops;
+    private: std::unique_ptr<recv_request> my_recv;
+    // once receiving fails, every pop fails the same way.
+    private: int my_recv_error;
+
+    // every core has its own ring. queues hold on to it so that it outlives
+    // them, whichever order thread-local storage is torn down in.
+    private: static thread_local std::shared_ptr<io_ring> our_ring;
+    private: static unsigned our_ring_entries;
+    private: static unsigned our_fixed_files;
+
+    private: uring_queue(int qd, io_queue::category_id cid);
+    public: virtual ~uring_queue();
+    public: static int new_net_object(std::unique_ptr<io_queue> &q_out, int qd);
+    public: static int new_file_object(std::unique_ptr<io_queue> &q_out, int qd);
+    public: static int read_config(int argc, char *argv[]);
+    public: static int init_ring();
+    public: static int poll_events(std::vector<int> &qds_out, int timeout_ms);
+
+    // network functions
+    public: int socket(int domain, int type, int protocol);
+    public: int getsockname(struct sockaddr * const saddr, socklen_t * const size);
+    public: int listen(int backlog);
+    public: int bind(const struct sockaddr * const saddr, socklen_t size);
+    public: int accept(std::unique_ptr<io_queue> &q_out, dmtr_qtoken_t qtok, int new_qd);
+    public: int connect(dmtr_qtoken_t qt, const struct sockaddr * const saddr, socklen_t size);
+    public: int open(const char *pathname, int flags);
+    public: int open2(const char *pathname, int flags, mode_t mode);
+    public: int creat(const char *pathname, mode_t mode);
+    public: int close();
+
+    // data path functions
+    public: int push(dmtr_qtoken_t qt, const dmtr_sgarray_t &sga);
+    public: int push_detached(const dmtr_sgarray_t &sga, dmtr_push_done_fn done, void *arg);
+    public: int pop(dmtr_qtoken_t qt);
+    public: int poll(dmtr_qresult_t &qr_out, dmtr_qtoken_t qt);
+    public: int service();
+
+    private: bool good() const {
+        return my_fd > -1;
+    }
+
+    private: static int set_tcp_nodelay(int fd);
+    private: static int run_ring(bool wait_flag, int timeout_ms);
+    private: static void on_orphan_completion(request &r, int res);
+    private: int set_fd(int fd);
+    private: void prepare_fd(struct io_uring_sqe &sqe) const;
+    private: int submit(request &r, struct io_uring_sqe *&sqe_out);
+    private: void cancel(request &r);
+    private: int on_completion(request &r, int res);
+    private: int on_accept(accept_request &r, int res);
+    private: int on_connect(connect_request &r, int res);
+    private: int start_send();
+    private: int submit_send();
+    private: int on_send(int res);
+    private: int finish_pushes(size_t count, int error);
+    private: int start_recv();
+    private: int on_recv(int res);
+    private: int complete_pops();
+    private: int parse_message(bool &done_out, dmtr_sgarray_t &sga_out);
+    private: void forget_request(request &r);
+};
+
+} // namespace dmtr
+
+#endif /* DMTR_LIBOS_URING_QUEUE_HH_IS_INCLUDED */